@@ -122,6 +122,12 @@
 /* minumum number of elements for sorting with quicksort instead of insertion */
 #define SIMCLIST_MINQUICKSORTELS        24
 
+/* initial capacity of vector lists, doubled when exhausted */
+#define SIMCLIST_VECTOR_MINCAP          8
+
+/* minimum number of hash buckets for seeking in vector lists */
+#define SIMCLIST_SEEK_MINBUCKETS        16
+
 
 /* list dump declarations */
 #define SIMCLIST_DUMPFORMAT_VERSION     1   /* (short integer) version of fileformat managed by _dump* and _restore* functions */
@@ -169,6 +175,11 @@ static void *list_get_minmax(const list_t *simclist_restrict l, int versus);
 
 static simclist_inline struct list_entry_s *list_findpos(const list_t *simclist_restrict l, int posstart);
 
+/* vector mode */
+static int list_vec_reserve(list_t *simclist_restrict l, unsigned int numels);
+static void list_vec_sort(list_t *simclist_restrict l, int versus, unsigned int first, unsigned int last);
+static void *list_vec_seek(list_t *simclist_restrict l, const void *indicator);
+
 #ifdef SIMCLIST_DUMPRESTORE
 /* write() decorated with error checking logic */
 #define WRITE_ERRCHECK(fd, msgbuf, msglen)      do {                                                    \
@@ -286,6 +297,9 @@ void list_destroy(list_t *simclist_restrict l) {
     free(l->spareels);
     free(l->head_sentinel);
     free(l->tail_sentinel);
+    free(l->vec);
+    free(l->seek_buckets);
+    free(l->seek_next);
 }
 
 int list_attributes_setdefaults(list_t *simclist_restrict l) {
@@ -302,6 +316,9 @@ int list_attributes_setdefaults(list_t *simclist_restrict l) {
     l->attrs.serializer = NULL;
     l->attrs.unserializer = NULL;
 
+    l->attrs.seek_hasher = NULL;
+    l->attrs.seek_indicator_hasher = NULL;
+
     assert(list_attrOk(l));
 
     return 0;
@@ -327,6 +344,33 @@ int list_attributes_seeker(list_t *simclist_restrict l, element_seeker seeker_fu
     return 0;
 }
 
+int list_attributes_seeker_hash(list_t *simclist_restrict l, element_hash_computer element_hasher,
+        element_hash_computer indicator_hasher) {
+    if (l == NULL) return -1;
+
+    l->attrs.seek_hasher = element_hasher;
+    l->attrs.seek_indicator_hasher = indicator_hasher;
+    l->seek_valid = 0;
+
+    return 0;
+}
+
+int list_attributes_vector(list_t *simclist_restrict l, int enable) {
+    if (l == NULL || l->iter_active || l->numels > 0) return -1;
+
+    l->vector = (enable != 0);
+    if (!l->vector) {
+        free(l->vec);
+        l->vec = NULL;
+        l->veccap = 0;
+    }
+    l->seek_valid = 0;
+
+    assert(list_repOk(l));
+
+    return 0;
+}
+
 int list_attributes_copy(list_t *simclist_restrict l, element_meter metric_fun, int copy_data) {
     if (l == NULL || (metric_fun == NULL && copy_data != 0)) return -1;
 
@@ -377,6 +421,9 @@ void *list_fetch(list_t *simclist_restrict l) {
 void *list_get_at(const list_t *simclist_restrict l, unsigned int pos) {
     struct list_entry_s *tmp;
 
+    if (l->vector)
+        return (pos < l->numels ? l->vec[pos] : NULL);
+
     tmp = list_findpos(l, pos);
 
     return (tmp != NULL ? tmp->data : NULL);
@@ -399,6 +446,17 @@ static void *list_get_minmax(const list_t *simclist_restrict l, int versus) {
     if (l->attrs.comparator == NULL || l->numels == 0)
         return NULL;
 
+    if (l->vector) {
+        unsigned int i;
+
+        curminmax = l->vec[0];
+        for (i = 1; i < l->numels; i++) {
+            if (l->attrs.comparator(curminmax, l->vec[i]) * versus > 0)
+                curminmax = l->vec[i];
+        }
+        return curminmax;
+    }
+
     curminmax = l->head_sentinel->next->data;
     for (s = l->head_sentinel->next->next; s != l->tail_sentinel; s = s->next) {
         if (l->attrs.comparator(curminmax, s->data) * versus > 0)
@@ -443,6 +501,14 @@ void *list_extract_at(list_t *simclist_restrict l, unsigned int pos) {
 
     if (l->iter_active || pos >= l->numels) return NULL;
 
+    if (l->vector) {
+        data = l->vec[pos];
+        memmove(l->vec + pos, l->vec + pos + 1, (l->numels - pos - 1) * sizeof(void *));
+        l->numels--;
+        l->seek_valid = 0;
+        return data;
+    }
+
     tmp = list_findpos(l, pos);
     if (tmp == NULL) {
         return NULL;
@@ -463,6 +529,31 @@ int list_insert_at(list_t *simclist_restrict l, const void *data, unsigned int p
 
     if (l->iter_active || pos > l->numels) return -1;
 
+    if (l->vector) {
+        void *el;
+
+        if (list_vec_reserve(l, l->numels + 1) != 0)
+            return -1;
+        if (l->attrs.copy_data) {
+            size_t datalen = l->attrs.meter(data);
+            el = malloc(datalen);
+            if (el == NULL) {
+                return -1;
+            }
+            memcpy(el, data, datalen);
+        } else {
+            el = (void *)data;
+        }
+        memmove(l->vec + pos + 1, l->vec + pos, (l->numels - pos) * sizeof(void *));
+        l->vec[pos] = el;
+        l->numels++;
+        l->seek_valid = 0;
+
+        assert(list_repOk(l));
+
+        return 1;
+    }
+
     /* this code optimizes malloc() with a free-list */
     if (l->spareelsnum > 0) {
         lent = l->spareels[l->spareelsnum-1];
@@ -536,6 +627,14 @@ int list_delete_at(list_t *simclist_restrict l, unsigned int pos) {
 
     if (l->iter_active || pos >= l->numels) return -1;
 
+    if (l->vector) {
+        void *data = list_extract_at(l, pos);
+
+        if (l->attrs.copy_data && data != NULL)
+            free(data);
+        return 0;
+    }
+
     delendo = list_findpos(l, pos);
 
     list_drop_elem(l, delendo, pos);
@@ -556,6 +655,18 @@ int list_delete_range(list_t *simclist_restrict l, unsigned int posstart, unsign
 
     if (l->iter_active || posend < posstart || posend >= l->numels) return -1;
 
+    if (l->vector) {
+        if (l->attrs.copy_data) {
+            for (i = posstart; i <= posend; i++) {
+                if (l->vec[i] != NULL) free(l->vec[i]);
+            }
+        }
+        memmove(l->vec + posstart, l->vec + posend + 1, (l->numels - posend - 1) * sizeof(void *));
+        l->numels -= posend - posstart + 1;
+        l->seek_valid = 0;
+        return 0;
+    }
+
     tmp = list_findpos(l, posstart);    /* first el to be deleted */
     if (tmp == NULL) {
         return -1;
@@ -618,6 +729,19 @@ int list_clear(list_t *simclist_restrict l) {
 
     if (l->iter_active) return -1;
 
+    if (l->vector) {
+        unsigned int i;
+
+        if (l->attrs.copy_data) {
+            for (i = 0; i < l->numels; i++) {
+                if (l->vec[i] != NULL) free(l->vec[i]);
+            }
+        }
+        l->numels = 0;
+        l->seek_valid = 0;
+        return 0;
+    }
+
     if (l->head_sentinel && l->tail_sentinel) {
         if (l->attrs.copy_data) {        /* also free user data */
             /* spare a loop conditional with two loops: spareing elems and freeing elems */
@@ -671,6 +795,16 @@ int list_locate(const list_t *simclist_restrict l, const void *data) {
 
     if (l->head_sentinel == NULL || l->tail_sentinel == NULL) return -1;
 
+    if (l->vector) {
+        unsigned int i;
+
+        for (i = 0; i < l->numels; i++) {
+            if (l->attrs.comparator != NULL ? l->attrs.comparator(data, l->vec[i]) == 0 : l->vec[i] == data)
+                return (int)i;
+        }
+        return -1;
+    }
+
     if (l->attrs.comparator != NULL) {
         /* use comparator */
         for (el = l->head_sentinel->next; el != l->tail_sentinel; el = el->next, pos++) {
@@ -694,6 +828,9 @@ void *list_seek(list_t *simclist_restrict l, const void *indicator) {
 
     if (l->head_sentinel == NULL || l->tail_sentinel == NULL) return NULL;
 
+    if (l->vector)
+        return list_vec_seek(l, indicator);
+
     for (iter = l->head_sentinel->next; iter != l->tail_sentinel; iter = iter->next) {
         if (l->attrs.seeker(iter->data, indicator) != 0) return iter->data;
     }
@@ -705,6 +842,23 @@ int list_contains(const list_t *simclist_restrict l, const void *data) {
     return (list_locate(l, data) >= 0);
 }
 
+/* append the element references of src to dest */
+static int list_append_all(list_t *simclist_restrict dest, const list_t *src) {
+    struct list_entry_s *el;
+    unsigned int i;
+
+    if (src->vector) {
+        for (i = 0; i < src->numels; i++) {
+            if (list_append(dest, src->vec[i]) < 0) return -1;
+        }
+    } else {
+        for (el = src->head_sentinel->next; el != src->tail_sentinel; el = el->next) {
+            if (list_append(dest, el->data) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
 int list_concat(const list_t *l1, const list_t *l2, list_t *simclist_restrict dest) {
     struct list_entry_s *el, *srcel;
     unsigned int cnt;
@@ -720,6 +874,12 @@ int list_concat(const list_t *l1, const list_t *l2, list_t *simclist_restrict de
         return -1;
     }
 
+    if (l1->vector || l2->vector) {
+        if (list_append_all(dest, l1) != 0 || list_append_all(dest, l2) != 0)
+            return -1;
+        return 0;
+    }
+
     dest->numels = l1->numels + l2->numels;
     if (dest->numels == 0)
         return 0;
@@ -777,6 +937,12 @@ int list_sort(list_t *simclist_restrict l, int versus) {
 
     if (l->head_sentinel == NULL || l->tail_sentinel == NULL) return -1;
 
+    if (l->vector) {
+        list_vec_sort(l, versus, 0, l->numels-1);
+        l->seek_valid = 0;
+        return 0;
+    }
+
     list_sort_quicksort(l, versus, 0, l->head_sentinel->next, l->numels-1, l->tail_sentinel->prev);
     assert(list_repOk(l));
     return 0;
@@ -960,6 +1126,11 @@ void *list_iterator_next(list_t *simclist_restrict l) {
 
     if (! l->iter_active) return NULL;
 
+    if (l->vector) {
+        if (l->iter_pos >= l->numels) return NULL;
+        return l->vec[l->iter_pos++];
+    }
+
     toret = l->iter_curentry->data;
     l->iter_curentry = l->iter_curentry->next;
     l->iter_pos++;
@@ -986,7 +1157,15 @@ int list_hash(const list_t *simclist_restrict l, list_hash_t *simclist_restrict
     assert(hash != NULL);
 
     tmphash = l->numels * 2 + 100;
-    if (l->attrs.hasher == NULL) {
+    if (l->vector) {
+        unsigned int i;
+
+        if (l->attrs.hasher == NULL) return -1;
+        for (i = 0; i < l->numels; i++) {
+            tmphash += tmphash ^ l->attrs.hasher(l->vec[i]);
+            tmphash +=* hash % l->numels;
+        }
+    } else if (l->attrs.hasher == NULL) {
 #ifdef SIMCLIST_ALLOW_LOCATIONBASED_HASHES
         /* ENABLE WITH CARE !! */
 #warning "Memlocation-based hash is consistent only for testing modification in the same program run."
@@ -1112,6 +1291,12 @@ int list_dump_filedescriptor(const list_t *simclist_restrict l, int fd, size_t *
         return -1;
     }
 
+    /* dumps are only implemented for linked lists */
+    if (l->vector) {
+        errno = EINVAL;
+        return -1;
+    }
+
     /****       DUMP FORMAT      ****
 
     [ ver   timestamp   |  totlen   numels  elemlen     hash    |   DATA ]
@@ -1439,6 +1624,130 @@ static int list_drop_elem(list_t *simclist_restrict l, struct list_entry_s *tmp,
     return 0;
 }
 
+/* make room for numels element references in a vector list */
+static int list_vec_reserve(list_t *simclist_restrict l, unsigned int numels) {
+    void **vec;
+    unsigned int cap;
+
+    if (numels <= l->veccap) return 0;
+
+    cap = l->veccap > 0 ? l->veccap : SIMCLIST_VECTOR_MINCAP;
+    while (cap < numels) cap *= 2;
+    vec = (void **)realloc(l->vec, cap * sizeof(void *));
+    if (vec == NULL) return -1;
+    l->vec = vec;
+    l->veccap = cap;
+
+    return 0;
+}
+
+/* sort l->vec[first..last]; quicksort, insertion sort for short ranges */
+static void list_vec_sort(list_t *simclist_restrict l, int versus, unsigned int first, unsigned int last) {
+    void **v = l->vec;
+    void *pivot, *tmp;
+    unsigned int i, j, store;
+
+    while (last > first) {
+        if (last - first + 1 <= SIMCLIST_MINQUICKSORTELS) {
+            for (i = first + 1; i <= last; i++) {
+                tmp = v[i];
+                for (j = i; j > first && l->attrs.comparator(v[j-1], tmp) * -versus > 0; j--)
+                    v[j] = v[j-1];
+                v[j] = tmp;
+            }
+            return;
+        }
+
+        /* middle element as pivot, moved to the end meanwhile */
+        i = first + (last - first) / 2;
+        pivot = v[i];
+        v[i] = v[last];
+        v[last] = pivot;
+        for (store = first, i = first; i < last; i++) {
+            if (l->attrs.comparator(v[i], pivot) * -versus < 0) {
+                tmp = v[i];
+                v[i] = v[store];
+                v[store] = tmp;
+                store++;
+            }
+        }
+        v[last] = v[store];
+        v[store] = pivot;
+
+        /* recurse into the shorter part, iterate on the longer one */
+        if (store - first < last - store) {
+            if (store > first) list_vec_sort(l, versus, first, store - 1);
+            first = store + 1;
+        } else {
+            if (store < last) list_vec_sort(l, versus, store + 1, last);
+            if (store == first) return;
+            last = store - 1;
+        }
+    }
+}
+
+/* spread user hashes (often small integers or pointers) over the buckets */
+static simclist_inline unsigned int list_seek_bucket(const list_t *simclist_restrict l, list_hash_t hash) {
+    uint32_t h = (uint32_t)hash;
+
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h & (l->seek_nbuckets - 1);
+}
+
+static int list_vec_build_seek_index(list_t *simclist_restrict l) {
+    unsigned int nbuckets, i, b;
+
+    nbuckets = SIMCLIST_SEEK_MINBUCKETS;
+    while (nbuckets < 2 * l->numels) nbuckets *= 2;
+    if (nbuckets != l->seek_nbuckets) {
+        unsigned int *buckets = (unsigned int *)realloc(l->seek_buckets, nbuckets * sizeof(unsigned int));
+        if (buckets == NULL) return -1;
+        l->seek_buckets = buckets;
+        l->seek_nbuckets = nbuckets;
+    }
+    if (l->numels > l->seek_nextcap) {
+        unsigned int *next = (unsigned int *)realloc(l->seek_next, l->veccap * sizeof(unsigned int));
+        if (next == NULL) return -1;
+        l->seek_next = next;
+        l->seek_nextcap = l->veccap;
+    }
+
+    /* insert backwards, so chains are in list order */
+    memset(l->seek_buckets, 0, nbuckets * sizeof(unsigned int));
+    for (i = l->numels; i > 0; i--) {
+        b = list_seek_bucket(l, l->attrs.seek_hasher(l->vec[i-1]));
+        l->seek_next[i-1] = l->seek_buckets[b];
+        l->seek_buckets[b] = i;
+    }
+    l->seek_valid = 1;
+
+    return 0;
+}
+
+static void *list_vec_seek(list_t *simclist_restrict l, const void *indicator) {
+    unsigned int i;
+
+    if (l->numels == 0) return NULL;
+
+    if (l->attrs.seek_hasher != NULL && l->attrs.seek_indicator_hasher != NULL
+            && (l->seek_valid || list_vec_build_seek_index(l) == 0)) {
+        i = l->seek_buckets[list_seek_bucket(l, l->attrs.seek_indicator_hasher(indicator))];
+        for (; i != 0; i = l->seek_next[i-1]) {
+            if (l->attrs.seeker(l->vec[i-1], indicator) != 0) return l->vec[i-1];
+        }
+        return NULL;
+    }
+
+    /* no hash index (or no memory for one): linear scan */
+    for (i = 0; i < l->numels; i++) {
+        if (l->attrs.seeker(l->vec[i], indicator) != 0) return l->vec[i];
+    }
+
+    return NULL;
+}
+
 /* ready-made comparators and meters */
 #define SIMCLIST_NUMBER_COMPARATOR(type)     int list_comparator_##type(const void *a, const void *b) { return( *(type *)a < *(type *)b) - (*(type *)a > *(type *)b); }
 
@@ -1512,6 +1821,9 @@ static int list_repOk(const list_t *simclist_restrict l) {
     int ok, i;
     struct list_entry_s *s;
 
+    if (l != NULL && l->vector)
+        return (l->numels <= l->veccap && (l->veccap == 0 || l->vec != NULL));
+
     ok = (l != NULL) && (
             /* head/tail checks */
             (l->head_sentinel != NULL && l->tail_sentinel != NULL) &&
@@ -206,6 +206,9 @@ struct list_attributes_s {
     element_serializer serializer;
     /* user-set routine for unserializing an element */
     element_unserializer unserializer;
+    /* user-set routines for hashing elements and seek indicators */
+    element_hash_computer seek_hasher;
+    element_hash_computer seek_indicator_hasher;
 };
 
 /** list object */
@@ -232,6 +235,19 @@ typedef struct {
 
     /* list attributes */
     struct list_attributes_s attrs;
+
+    /* vector mode: element references in a contiguous array */
+    int vector;
+    void **vec;
+    unsigned int veccap;
+
+    /* vector mode: hash index for list_seek(), rebuilt when stale.
+     * Chains hold element positions + 1, 0 terminates a chain */
+    unsigned int *seek_buckets;
+    unsigned int seek_nbuckets;
+    unsigned int *seek_next;
+    unsigned int seek_nextcap;
+    int seek_valid;
 } list_t;
 
 /**
@@ -281,6 +297,47 @@ int list_attributes_comparator(list_t *simclist_restrict l, element_comparator c
  */
 int list_attributes_seeker(list_t *simclist_restrict l, element_seeker seeker_fun);
 
+/**
+ * set hash functions to speed up list_seek() (vector lists only).
+ *
+ * [ advanced preference ]
+ *
+ * element_hasher computes the hash of an element, indicator_hasher the hash
+ * of a seek indicator; both must agree for elements the seeker matches.
+ * With both set, list_seek() builds a hash index over the list and only calls
+ * the seeker for elements whose hash matches the one of the indicator. The
+ * index is rebuilt on the first list_seek() after the list has been modified,
+ * so the hashed part of an element must not change while it is in the list
+ * unless the list is modified afterwards. Linked lists ignore the hashers.
+ *
+ * @param l                 list to operate
+ * @param element_hasher    hash of an element, or NULL to disable
+ * @param indicator_hasher  hash of a seek indicator, or NULL to disable
+ * @return                  0 if the attribute was successfully set; -1 otherwise
+ *
+ * @see list_attributes_vector()
+ * @see list_seek()
+ */
+int list_attributes_seeker_hash(list_t *simclist_restrict l, element_hash_computer element_hasher,
+        element_hash_computer indicator_hasher);
+
+/**
+ * store the list in a contiguous array instead of a doubly linked list.
+ *
+ * [ advanced preference ]
+ *
+ * Vector lists keep the whole list API. list_get_at() is O(1), iterating
+ * does not chase pointers and appending is amortized O(1); inserting or
+ * deleting in the middle moves the following element references. Lists that
+ * are mostly appended to and then scanned by position benefit from this.
+ * The mode can only be changed while the list is empty.
+ *
+ * @param l         list to operate
+ * @param enable    non-0 for a vector list, 0 for a linked list (default)
+ * @return          0 if the mode was successfully set; -1 otherwise
+ */
+int list_attributes_vector(list_t *simclist_restrict l, int enable);
+
 /**
  * require to free element data when list entry is removed (default: don't free).
  *
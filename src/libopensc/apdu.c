@@ -344,7 +344,7 @@ error:
  *  APDU if one of the SC_APDU_CASE_? types is used.
  *  @param  apdu  APDU object
  */
-static void
+void
 sc_detect_apdu_cse(const sc_card_t *card, sc_apdu_t *apdu)
 {
 	if (apdu->cse == SC_APDU_CASE_2 || apdu->cse == SC_APDU_CASE_3 ||
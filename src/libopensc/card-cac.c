@@ -153,15 +153,28 @@ typedef struct cac_object {
 #define CAC_OBJECT_TYPE_CERT		1
 #define CAC_OBJECT_TYPE_TLV_FILE	4
 
+/*
+ * Objects already read from the card, in the form read_binary returns them
+ * (reintegrated TLV or decompressed certificate). CAC objects can't be
+ * changed through this driver, so they stay valid for the card's lifetime.
+ */
+typedef struct cac_cached_object {
+	sc_path_t path;
+	u8 *buf;
+	size_t buf_len;
+} cac_cached_object_t;
+
 /*
  * CAC private data per card state
  */
 typedef struct cac_private_data {
 	int object_type;		/* select set this so we know how to read the file */
 	int cert_next;			/* index number for the next certificate found in the list */
-	u8 *cache_buf;			/* cached version of the currently selected file */
+	u8 *cache_buf;			/* cached version of the currently selected file, owned by obj_cache */
 	size_t cache_buf_len;		/* length of the cached selected file */
 	int cached;			/* is the cached selected file valid */
+	sc_path_t current_path;		/* path of the currently selected file */
+	list_t obj_cache;		/* list of cac_cached_object_t read so far */
 	cac_cuid_t cuid;                /* card unique ID from the CCC */
 	u8 *cac_id;                     /* card serial number */
 	size_t cac_id_len;              /* card serial number len */
@@ -186,6 +199,24 @@ size_t cac_list_meter(const void *el) {
 	return sizeof(cac_object_t);
 }
 
+static int cac_path_equal(const sc_path_t *a, const sc_path_t *b)
+{
+	return a->type == b->type
+		&& a->len == b->len && memcmp(a->value, b->value, a->len) == 0
+		&& a->aid.len == b->aid.len && memcmp(a->aid.value, b->aid.value, a->aid.len) == 0;
+}
+
+static int cac_cache_seeker(const void *el, const void *key)
+{
+	if (el == NULL || key == NULL)
+		return 0;
+	return cac_path_equal(&((const cac_cached_object_t *) el)->path, (const sc_path_t *) key);
+}
+
+static size_t cac_cache_meter(const void *el) {
+	return sizeof(cac_cached_object_t);
+}
+
 static cac_private_data_t *cac_new_private_data(void)
 {
 	cac_private_data_t *priv;
@@ -198,6 +229,9 @@ static cac_private_data_t *cac_new_private_data(void)
 	list_init(&priv->general_list);
 	list_attributes_comparator(&priv->general_list, cac_list_compare_path);
 	list_attributes_copy(&priv->general_list, cac_list_meter, 1);
+	list_init(&priv->obj_cache);
+	list_attributes_seeker(&priv->obj_cache, cac_cache_seeker);
+	list_attributes_copy(&priv->obj_cache, cac_cache_meter, 1);
 	/* set other fields as appropriate */
 
 	return priv;
@@ -205,8 +239,14 @@ static cac_private_data_t *cac_new_private_data(void)
 
 static void cac_free_private_data(cac_private_data_t *priv)
 {
+	cac_cached_object_t *entry;
+
 	free(priv->cac_id);
-	free(priv->cache_buf);
+	list_iterator_start(&priv->obj_cache);
+	while ((entry = list_iterator_next(&priv->obj_cache)) != NULL)
+		free(entry->buf);
+	list_iterator_stop(&priv->obj_cache);
+	list_destroy(&priv->obj_cache);
 	list_destroy(&priv->pki_list);
 	list_destroy(&priv->general_list);
 	free(priv);
@@ -555,6 +595,68 @@ failure:
 	return rv;
 }
 
+static int cac_get_serial_nr_from_CUID(sc_card_t* card, sc_serial_number_t* serial);
+
+/*
+ * Build the name of the on-disk cache file for the currently selected
+ * object from the card's CUID and the object path.
+ */
+static int cac_cache_filename(sc_card_t *card, char *buf, size_t buf_len)
+{
+	cac_private_data_t * priv = CAC_DATA(card);
+	sc_serial_number_t serial;
+	char serial_hex[SC_MAX_SERIALNR*2+1];
+	char aid_hex[SC_MAX_AID_SIZE*2+1];
+	char path_hex[SC_MAX_PATH_SIZE*2+1];
+	int r;
+
+	r = cac_get_serial_nr_from_CUID(card, &serial);
+	if (r != SC_SUCCESS || serial.len == 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	sc_bin_to_hex(serial.value, serial.len, serial_hex, sizeof(serial_hex), 0);
+	sc_bin_to_hex(priv->current_path.aid.value, priv->current_path.aid.len,
+		aid_hex, sizeof(aid_hex), 0);
+	sc_bin_to_hex(priv->current_path.value, priv->current_path.len,
+		path_hex, sizeof(path_hex), 0);
+	if (snprintf(buf, buf_len, "cac_%s_%s_%s", serial_hex, aid_hex, path_hex) >= (int)buf_len)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/*
+ * Look up the currently selected object in the object cache, and make it
+ * the current read_binary buffer if it's there.
+ */
+static int cac_cache_lookup(cac_private_data_t *priv)
+{
+	cac_cached_object_t *entry;
+
+	entry = list_seek(&priv->obj_cache, &priv->current_path);
+	if (entry == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	priv->cache_buf = entry->buf;
+	priv->cache_buf_len = entry->buf_len;
+	priv->cached = 1;
+	return SC_SUCCESS;
+}
+
+/*
+ * Hand the current read_binary buffer over to the object cache.
+ */
+static int cac_cache_add(cac_private_data_t *priv)
+{
+	cac_cached_object_t entry;
+
+	entry.path = priv->current_path;
+	entry.buf = priv->cache_buf;
+	entry.buf_len = priv->cache_buf_len;
+	if (list_append(&priv->obj_cache, &entry) < 0)
+		return SC_ERROR_OUT_OF_MEMORY;
+	priv->cached = 1;
+	return SC_SUCCESS;
+}
+
 /*
  * Callers of this may be expecting a certificate,
  * select file will have saved the object type for us
@@ -571,6 +673,8 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 	size_t tl_len, val_len, tlv_len;
 	size_t len, tl_head_len, cert_len;
 	u8 cert_type, tag;
+	char cache_name[PATH_MAX];
+	int use_file_cache = 0;
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
@@ -588,18 +692,24 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
-		 "clearing cache idx=%d count=%"SC_FORMAT_LEN_SIZE_T"u",
+		 "reading object idx=%d count=%"SC_FORMAT_LEN_SIZE_T"u",
 		 idx, count);
-	if (priv->cache_buf) {
-		free(priv->cache_buf);
-		priv->cache_buf = NULL;
-		priv->cache_buf_len = 0;
-	}
-
+	priv->cache_buf = NULL;
+	priv->cache_buf_len = 0;
 
 	if (priv->object_type <= 0)
 		 SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_INTERNAL);
 
+	/* certificates are the expensive objects to read and inflate, keep them on disk too */
+	if (priv->object_type == CAC_OBJECT_TYPE_CERT && _sc_use_file_cache(card->ctx)
+			&& cac_cache_filename(card, cache_name, sizeof(cache_name)) == SC_SUCCESS) {
+		use_file_cache = 1;
+		r = _sc_read_cache_file(card->ctx, cache_name, &priv->cache_buf, &priv->cache_buf_len);
+		if (r == SC_SUCCESS)
+			goto cache;
+		r = 0;
+	}
+
 	if ((card->type == SC_CARD_TYPE_CAC_I) && (priv->object_type == CAC_OBJECT_TYPE_CERT)) {
 		/* SPICE smart card emulator only presents CAC-1 cards with the old CAC-1 interface as
 		 * certs. If we are a cac 1 card, use the old interface */
@@ -717,12 +827,27 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 		goto done;
 	}
 
-	/* OK we've read the data, now copy the required portion out to the callers buffer */
-	priv->cached = 1;
+	if (use_file_cache)
+		_sc_write_cache_file(card->ctx, cache_name, priv->cache_buf, priv->cache_buf_len);
+
+cache:
+	/* OK we've read the data, remember it and copy the required portion out to the callers buffer */
+	r = cac_cache_add(priv);
+	if (r < 0)
+		goto done;
+	if (idx > priv->cache_buf_len) {
+		r = SC_ERROR_FILE_END_REACHED;
+		goto done;
+	}
 	len = MIN(count, priv->cache_buf_len-idx);
 	memcpy(buf, &priv->cache_buf[idx], len);
 	r = len;
 done:
+	if (!priv->cached) {
+		free(priv->cache_buf);
+		priv->cache_buf = NULL;
+		priv->cache_buf_len = 0;
+	}
 	if (tl)
 		free(tl);
 	if (val)
@@ -982,6 +1107,34 @@ static int cac_decipher(sc_card_t *card,
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, cac_rsa_op(card, data, datalen, out, outlen));
 }
 
+/*
+ * Make the object at in_path the current one, once the card selected it.
+ * If the SELECT failed, the card still has the old object selected, and
+ * reads have to keep going to it.
+ */
+static void cac_set_current_object(cac_private_data_t *priv, const sc_path_t *in_path)
+{
+	if (!priv) /* don't record anything if we haven't been initialized yet */
+		return;
+
+	/* CAC has multiple different type of objects that aren't PKCS #15. When we read
+	 * them we need convert them to something PKCS #15 would understand. Find the object
+	 * and object type here:
+	 */
+	priv->object_type = CAC_OBJECT_TYPE_TLV_FILE;
+	if (cac_is_cert(priv, in_path)) {
+		priv->object_type = CAC_OBJECT_TYPE_CERT;
+	}
+	/* switch to the cached copy of the new object, if we have read it before */
+	priv->cache_buf = NULL;
+	priv->cache_buf_len = 0;
+	priv->cached = 0;
+	priv->current_path = *in_path;
+	priv->current_path.index = 0;
+	priv->current_path.count = 0;
+	cac_cache_lookup(priv);
+}
+
 /*
  * CAC cards use SC_PATH_SELECT_OBJECT_ID rather than SC_PATH_SELECT_FILE_ID. In order to use more
  * of the PKCS #15 structure, we call the selection SC_PATH_SELECT_FILE_ID, but we set p1 to 2 instead
@@ -1031,24 +1184,6 @@ static int cac_select_file_by_type(sc_card_t *card, const sc_path_t *in_path, sc
 	}
 
 
-	/* CAC has multiple different type of objects that aren't PKCS #15. When we read
-	 * them we need convert them to something PKCS #15 would understand. Find the object
-	 * and object type here:
-	 */
-	if (priv) { /* don't record anything if we haven't been initialized yet */
-		priv->object_type = CAC_OBJECT_TYPE_TLV_FILE;
-		if (cac_is_cert(priv, in_path)) {
-			priv->object_type = CAC_OBJECT_TYPE_CERT;
-		}
-		/* forget any old cacheed values */
-		if (priv->cache_buf) {
-			free(priv->cache_buf);
-			priv->cache_buf = NULL;
-		}
-		priv->cache_buf_len = 0;
-		priv->cached = 0;
-	}
-
 	if (in_path->aid.len) {
 		if (!pathlen) {
 			memcpy(path, in_path->aid.value, in_path->aid.len);
@@ -1114,13 +1249,16 @@ static int cac_select_file_by_type(sc_card_t *card, const sc_path_t *in_path, sc
 				r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 		}
 		if (apdu.sw1 == 0x61)
-			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+			r = SC_SUCCESS;
+		if (r == SC_SUCCESS)
+			cac_set_current_object(priv, in_path);
 		LOG_FUNC_RETURN(ctx, r);
 	}
 
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 	if (r)
 		LOG_FUNC_RETURN(ctx, r);
+	cac_set_current_object(priv, in_path);
 
 		/* CAC cards enver return FCI, fake one */
 	file = sc_file_new();
@@ -744,6 +744,22 @@ coolkey_v1_get_object_length(u8 *obj, size_t buf_len)
 	return len;
 }
 
+/*
+ * Hashed directory of the objects on the token. Entries point to the objects
+ * on objects_list, which is only appended to while the card is bound, so the
+ * pointers stay valid until the private data is freed.
+ */
+#define COOLKEY_HASH_SIZE 64
+
+typedef struct coolkey_hash_entry {
+	sc_cardctl_coolkey_object_t *obj;
+	unsigned long obj_class;		/* CKA_CLASS, template index only */
+	const u8 *cka_id;			/* CKA_ID, points into obj->data */
+	size_t cka_id_len;
+	u8 cka_id_type;
+	struct coolkey_hash_entry *next;
+} coolkey_hash_entry_t;
+
 /*
  * COOLKEY private data per card state
  */
@@ -762,6 +778,11 @@ typedef struct coolkey_private_data {
 	coolkey_cuid_t cuid;			/* card unique ID from the CCC */
 	sc_cardctl_coolkey_object_t *obj;	/* pointer to the current selected object */
 	list_t objects_list;			/* list of objects on the token */
+	coolkey_hash_entry_t *id_hash[COOLKEY_HASH_SIZE];	/* objects by object ID */
+	coolkey_hash_entry_t *template_hash[COOLKEY_HASH_SIZE];	/* objects by CKA_CLASS and CKA_ID */
+	int template_hash_next;			/* objects_list position of the next object to index */
+	unsigned long object_list_hash;		/* hash of the object list, identifies the token contents */
+	char cache_prefix[64];			/* file cache name prefix, empty if not caching */
 	unsigned short key_id;			/* key id set by select */
 	int	algorithm;			/* saved from set_security_env */
 	int operation;				/* saved from set_security_env */
@@ -775,7 +796,7 @@ coolkey_compare_id(const void * a, const void *b)
 	if (a == NULL || b == NULL)
 		return 1;
 	return ((sc_cardctl_coolkey_object_t *)a)->id
-	    == ((sc_cardctl_coolkey_object_t *)b)->id;
+	    != ((sc_cardctl_coolkey_object_t *)b)->id;
 }
 
 /* For SimCList autocopy, we need to know the size of the data elements */
@@ -799,11 +820,28 @@ static coolkey_private_data_t *coolkey_new_private_data(void)
 	return priv;
 }
 
+static void coolkey_free_hash(coolkey_hash_entry_t **hash)
+{
+	coolkey_hash_entry_t *entry, *next;
+	int i;
+
+	for (i=0; i < COOLKEY_HASH_SIZE; i++) {
+		for (entry = hash[i]; entry; entry = next) {
+			next = entry->next;
+			free(entry);
+		}
+		hash[i] = NULL;
+	}
+}
+
 static void coolkey_free_private_data(coolkey_private_data_t *priv)
 {
 	list_t *l = &priv->objects_list;
 	sc_cardctl_coolkey_object_t *o;
 
+	coolkey_free_hash(priv->id_hash);
+	coolkey_free_hash(priv->template_hash);
+
 	/* Clean up the allocated memory in the items */
 	list_iterator_start(l);
 	while (list_iterator_hasnext(l)) {
@@ -821,31 +859,80 @@ static void coolkey_free_private_data(coolkey_private_data_t *priv)
 	return;
 }
 
+/* FNV-1a, good enough to spread object IDs and CKA_IDs over the buckets */
+static unsigned long coolkey_hash_bytes(unsigned long hash, const u8 *buf, size_t len)
+{
+	size_t i;
+
+	for (i=0; i < len; i++) {
+		hash ^= buf[i];
+		hash = (hash * 16777619UL) & 0xffffffffUL;
+	}
+	return hash;
+}
+#define COOLKEY_HASH_INIT 2166136261UL
+
+static unsigned int coolkey_id_bucket(unsigned long object_id)
+{
+	u8 buf[4];
+
+	ulong2bebytes(buf, object_id);
+	return coolkey_hash_bytes(COOLKEY_HASH_INIT, buf, sizeof(buf)) & (COOLKEY_HASH_SIZE-1);
+}
+
+static unsigned int coolkey_template_bucket(unsigned long obj_class, const u8 *cka_id, size_t cka_id_len)
+{
+	u8 buf[4];
+	unsigned long hash;
+
+	ulong2bebytes(buf, obj_class);
+	hash = coolkey_hash_bytes(COOLKEY_HASH_INIT, buf, sizeof(buf));
+	return coolkey_hash_bytes(hash, cka_id, cka_id_len) & (COOLKEY_HASH_SIZE-1);
+}
+
 /*
  * Object list operations
  */
-static int coolkey_add_object_to_list(list_t *list, const sc_cardctl_coolkey_object_t *object)
+static int coolkey_add_object_to_list(coolkey_private_data_t *priv, const sc_cardctl_coolkey_object_t *object)
 {
-	if (list_append(list, object) < 0)
+	list_t *list = &priv->objects_list;
+	coolkey_hash_entry_t *entry;
+	unsigned int bucket;
+
+	entry = calloc(1, sizeof(coolkey_hash_entry_t));
+	if (entry == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (list_append(list, object) < 0) {
+		free(entry);
 		return SC_ERROR_UNKNOWN;
+	}
+	/* the list keeps its own copy of the object, index that one */
+	entry->obj = list_get_at(list, list_size(list)-1);
+	bucket = coolkey_id_bucket(object->id);
+	entry->next = priv->id_hash[bucket];
+	priv->id_hash[bucket] = entry;
 	return SC_SUCCESS;
 }
 
+static coolkey_hash_entry_t *
+coolkey_find_entry_by_id(coolkey_private_data_t *priv, unsigned long object_id)
+{
+	coolkey_hash_entry_t *entry;
+
+	for (entry = priv->id_hash[coolkey_id_bucket(object_id)]; entry; entry = entry->next) {
+		if (entry->obj->id == object_id)
+			return entry;
+	}
+	return NULL;
+}
+
 #define COOLKEY_AID "\xA0\x00\x00\x01\x16"
 static sc_cardctl_coolkey_object_t *
-coolkey_find_object_by_id(list_t *list, unsigned long object_id)
+coolkey_find_object_by_id(coolkey_private_data_t *priv, unsigned long object_id)
 {
-	int pos;
-	static sc_cardctl_coolkey_object_t cmp = {{
-		"", 0, 0, 0, SC_PATH_TYPE_DF_NAME,
-		{ COOLKEY_AID, sizeof(COOLKEY_AID)-1 }
-	}, 0, 0, NULL};
+	coolkey_hash_entry_t *entry = coolkey_find_entry_by_id(priv, object_id);
 
-	cmp.id = object_id;
-	if ((pos = list_locate(list, &cmp)) < 0)
-		return NULL;
-
-	return list_get_at(list, pos);
+	return entry ? entry->obj : NULL;
 }
 
 
@@ -1184,6 +1271,50 @@ fail:
 	return r;
 }
 
+/*
+ * Read a complete coolkey object, through the file cache if file_cacheable.
+ * Cache entries are named after the CUID, the object list and the combined
+ * object version (see coolkey_set_cache_prefix), and only match if the length
+ * is unchanged. Nothing checks the content itself, so only the combined object
+ * is cached: TPS bumps its version on every update.
+ */
+static int coolkey_load_object(sc_card_t *card, coolkey_private_data_t *priv, unsigned long object_id,
+			size_t length, int file_cacheable, u8 **out_buf)
+{
+	char cache_name[PATH_MAX];
+	u8 *data = NULL;
+	size_t data_len = 0;
+	int r;
+
+	file_cacheable = file_cacheable && priv->cache_prefix[0];
+	if (file_cacheable) {
+		snprintf(cache_name, sizeof(cache_name), "%s_%08lx", priv->cache_prefix, object_id);
+		r = _sc_read_cache_file(card->ctx, cache_name, &data, &data_len);
+		if (r == SC_SUCCESS) {
+			if (data_len == length) {
+				*out_buf = data;
+				return (int)data_len;
+			}
+			free(data);
+		}
+	}
+
+	data = malloc(length);
+	if (data == NULL) {
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	r = coolkey_read_object(card, object_id, 0, data, length, priv->nonce, sizeof(priv->nonce));
+	if (r < 0) {
+		free(data);
+		return r;
+	}
+	if (file_cacheable && r > 0) {
+		_sc_write_cache_file(card->ctx, cache_name, data, r);
+	}
+	*out_buf = data;
+	return r;
+}
+
 /*
  * coolkey_read_binary will read a coolkey object off the card. That object is selected
  * by select file. If we've already read the object, we'll return the data from the cache.
@@ -1195,7 +1326,7 @@ static int coolkey_read_binary(sc_card_t *card, unsigned int idx,
 {
 	coolkey_private_data_t * priv = COOLKEY_DATA(card);
 	int r = 0, len;
-	u8 *data = NULL;;
+	u8 *data = NULL;
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 	if (idx > priv->obj->length) {
@@ -1216,15 +1347,7 @@ static int coolkey_read_binary(sc_card_t *card, unsigned int idx,
 		 "clearing cache idx=%u count=%"SC_FORMAT_LEN_SIZE_T"u",
 		 idx, count);
 
-	data = malloc(priv->obj->length);
-	if (data == NULL) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto done;
-	}
-
-
-	r = coolkey_read_object(card, priv->obj->id, 0, data, priv->obj->length,
-												priv->nonce, sizeof(priv->nonce));
+	r = coolkey_load_object(card, priv, priv->obj->id, priv->obj->length, 0, &data);
 	if (r < 0)
 		goto done;
 
@@ -1381,26 +1504,25 @@ coolkey_fill_object(sc_card_t *card, sc_cardctl_coolkey_object_t *obj)
 	size_t buf_len = obj->length;
 	u8 *new_obj_data = NULL;
 	sc_cardctl_coolkey_object_t *obj_entry;
+	coolkey_hash_entry_t *entry;
 	coolkey_private_data_t * priv = COOLKEY_DATA(card);
 
 	if (obj->data != NULL) {
 		return SC_SUCCESS;
 	}
-	new_obj_data = malloc(buf_len);
-	if (new_obj_data == NULL) {
-		return SC_ERROR_OUT_OF_MEMORY;
+	entry = coolkey_find_entry_by_id(priv, obj->id);
+	if (entry == NULL) {
+		return SC_ERROR_INTERNAL; /* shouldn't happen */
+	}
+	obj_entry = entry->obj;
+	r = coolkey_load_object(card, priv, obj->id, buf_len, 0, &new_obj_data);
+	if (r < 0) {
+		return r;
 	}
-	r = coolkey_read_object(card, obj->id, 0, new_obj_data, buf_len,
-				priv->nonce, sizeof(priv->nonce));
 	if (r != (int)buf_len) {
 		free(new_obj_data);
 		return SC_ERROR_CORRUPTED_DATA;
 	}
-	obj_entry = coolkey_find_object_by_id(&priv->objects_list, obj->id);
-	if (obj_entry == NULL) {
-		free(new_obj_data);
-		return SC_ERROR_INTERNAL; /* shouldn't happen */
-	}
 	if (obj_entry->data != NULL) {
 		free(new_obj_data);
 		return SC_ERROR_INTERNAL; /* shouldn't happen */
@@ -1487,6 +1609,136 @@ coolkey_find_attribute(sc_card_t *card, sc_cardctl_coolkey_attribute_t *attribut
 	return SC_ERROR_DATA_OBJECT_NOT_FOUND;
 }
 
+/*
+ * Index the next object of the list by CKA_CLASS and CKA_ID. Objects are
+ * indexed in list order and added to the tail of the bucket chains, so a
+ * lookup returns the same object as the linear template search would.
+ * Returns the new entry, NULL if the object has no class or ID, or an error
+ * in *r if the object could not be read.
+ */
+static coolkey_hash_entry_t *
+coolkey_index_next_object(sc_card_t *card, coolkey_private_data_t *priv, int *r)
+{
+	sc_cardctl_coolkey_object_t *current;
+	coolkey_hash_entry_t *entry, **tail;
+	sc_cardctl_coolkey_attribute_t attribute;
+	unsigned long obj_class;
+
+	*r = SC_SUCCESS;
+	current = list_get_at(&priv->objects_list, priv->template_hash_next);
+	if (current == NULL) {
+		*r = SC_ERROR_INTERNAL;
+		return NULL;
+	}
+	attribute.object = current;
+
+	/* reading the object may fail before login, leave it for the linear search */
+	attribute.attribute_type = CKA_CLASS;
+	*r = coolkey_find_attribute(card, &attribute);
+	if (*r < 0 && *r != SC_ERROR_DATA_OBJECT_NOT_FOUND) {
+		return NULL;
+	}
+	priv->template_hash_next++;
+	if (*r < 0 || attribute.attribute_data_type != SC_CARDCTL_COOLKEY_ATTR_TYPE_ULONG
+			|| attribute.attribute_length != 4) {
+		*r = SC_SUCCESS;
+		return NULL;
+	}
+	obj_class = bebytes2ulong(attribute.attribute_value);
+
+	attribute.attribute_type = CKA_ID;
+	if (coolkey_find_attribute(card, &attribute) < 0) {
+		*r = SC_SUCCESS;
+		return NULL;
+	}
+
+	entry = calloc(1, sizeof(coolkey_hash_entry_t));
+	if (entry == NULL) {
+		priv->template_hash_next--;
+		*r = SC_ERROR_OUT_OF_MEMORY;
+		return NULL;
+	}
+	entry->obj = current;
+	entry->obj_class = obj_class;
+	entry->cka_id = attribute.attribute_value;
+	entry->cka_id_len = attribute.attribute_length;
+	entry->cka_id_type = attribute.attribute_data_type;
+	tail = &priv->template_hash[coolkey_template_bucket(obj_class,
+			entry->cka_id, entry->cka_id_len)];
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = entry;
+	return entry;
+}
+
+static int
+coolkey_template_entry_matches(const coolkey_hash_entry_t *entry, unsigned long obj_class,
+		const sc_cardctl_coolkey_attribute_t *id_attr)
+{
+	return entry->obj_class == obj_class
+		&& entry->cka_id_type == id_attr->attribute_data_type
+		&& entry->cka_id_len == id_attr->attribute_length
+		&& memcmp(entry->cka_id, id_attr->attribute_value, entry->cka_id_len) == 0;
+}
+
+/*
+ * Look up a { CKA_CLASS, CKA_ID } template in the template index. The index is
+ * built lazily: objects not indexed yet are read and indexed one by one, only
+ * until the first match. Returns 1 if the lookup was answered (*obj_out is NULL
+ * if no object matches), 0 if the template has some other shape or an object
+ * could not be read, and the linear search has to be used.
+ */
+static int
+coolkey_find_object_by_class_and_id(sc_card_t *card, sc_cardctl_coolkey_attribute_t *template, int count,
+		sc_cardctl_coolkey_object_t **obj_out)
+{
+	coolkey_private_data_t * priv = COOLKEY_DATA(card);
+	sc_cardctl_coolkey_attribute_t *class_attr, *id_attr;
+	coolkey_hash_entry_t *entry;
+	unsigned long obj_class;
+	int r;
+
+	*obj_out = NULL;
+	if (count != 2) {
+		return 0;
+	}
+	if (template[0].attribute_type == CKA_CLASS && template[1].attribute_type == CKA_ID) {
+		class_attr = &template[0];
+		id_attr = &template[1];
+	} else if (template[0].attribute_type == CKA_ID && template[1].attribute_type == CKA_CLASS) {
+		class_attr = &template[1];
+		id_attr = &template[0];
+	} else {
+		return 0;
+	}
+	if (class_attr->attribute_data_type != SC_CARDCTL_COOLKEY_ATTR_TYPE_ULONG
+			|| class_attr->attribute_length != 4) {
+		return 0;
+	}
+
+	obj_class = bebytes2ulong(class_attr->attribute_value);
+	entry = priv->template_hash[coolkey_template_bucket(obj_class,
+			id_attr->attribute_value, id_attr->attribute_length)];
+	for (; entry; entry = entry->next) {
+		if (coolkey_template_entry_matches(entry, obj_class, id_attr)) {
+			*obj_out = entry->obj;
+			return 1;
+		}
+	}
+
+	while (priv->template_hash_next < (int)list_size(&priv->objects_list)) {
+		entry = coolkey_index_next_object(card, priv, &r);
+		if (r < 0) {
+			return 0;
+		}
+		if (entry && coolkey_template_entry_matches(entry, obj_class, id_attr)) {
+			*obj_out = entry->obj;
+			return 1;
+		}
+	}
+	return 1;
+}
+
 /*
  * pkcs 15 needs to find the cert matching the keys to fill in some of the fields that wasn't stored
  * with the key. To do this we need to look for the cert matching the key's CKA_ID. For flexibility,
@@ -1500,6 +1752,11 @@ coolkey_find_object_by_template(sc_card_t *card, sc_cardctl_coolkey_attribute_t
 	int i, r;
 	unsigned int tmp_pos = (unsigned int) -1;
 
+	/* the common { CKA_CLASS, CKA_ID } lookup goes through the index */
+	if (coolkey_find_object_by_class_and_id(card, template, count, &rv)) {
+		return rv;
+	}
+
 	list = &priv->objects_list;
 	if (list->iter_active) {
 		/* workaround missing functionality of second iterator */
@@ -1556,7 +1813,7 @@ coolkey_find_object(sc_card_t *card, sc_cardctl_coolkey_find_object_t *fobj)
 
 	switch (fobj->type) {
 	case SC_CARDCTL_COOLKEY_FIND_BY_ID:
-		obj = coolkey_find_object_by_id(&priv->objects_list, fobj->find_id);
+		obj = coolkey_find_object_by_id(priv, fobj->find_id);
 		break;
 	case SC_CARDCTL_COOLKEY_FIND_BY_TEMPLATE:
 		obj = coolkey_find_object_by_template(card, fobj->coolkey_template, fobj->template_count);
@@ -1929,7 +2186,7 @@ static int coolkey_select_file(sc_card_t *card, const sc_path_t *in_path, sc_fil
 		return r;
 	}
 	object_id = bebytes2ulong(in_path->value);
-	priv->obj = coolkey_find_object_by_id(&priv->objects_list, object_id);
+	priv->obj = coolkey_find_object_by_id(priv, object_id);
 	if (priv->obj == NULL) {
 		return SC_ERROR_OBJECT_NOT_FOUND;
 	}
@@ -1966,7 +2223,8 @@ static int coolkey_finish(sc_card_t *card)
 }
 
 static int
-coolkey_add_object(coolkey_private_data_t *priv, unsigned long object_id, const u8 *object_data, size_t object_length, int add_v1_record)
+coolkey_add_object(coolkey_private_data_t *priv, unsigned long object_id, const u8 *object_data, size_t object_length,
+		int add_v1_record)
 {
 	sc_cardctl_coolkey_object_t new_object;
 	int r;
@@ -1990,7 +2248,7 @@ coolkey_add_object(coolkey_private_data_t *priv, unsigned long object_id, const
 		memcpy(&new_object.data[add_v1_record], object_data, object_length);
 	}
 
-	r = coolkey_add_object_to_list(&priv->objects_list, &new_object);
+	r = coolkey_add_object_to_list(priv, &new_object);
 	if (r != SC_SUCCESS) {
 		/* if we didn't successfully put the object on the list,
 		 * the data space didn't get adopted. free it before we return */
@@ -2129,6 +2387,30 @@ coolkey_list_object(sc_card_t *card, u8 seq, coolkey_object_info_t *object_info)
 
 }
 
+/*
+ * Set up the file cache name prefix for this token: the CUID and the hash over
+ * the object list and the combined object version. Only called for tokens
+ * with a combined object, without a version there is nothing to tell a
+ * rewritten object from a cached one of the same length.
+ */
+static void
+coolkey_set_cache_prefix(sc_card_t *card, coolkey_private_data_t *priv)
+{
+	char *cuid;
+
+	priv->cache_prefix[0] = 0;
+	if (!_sc_use_file_cache(card->ctx)) {
+		return;
+	}
+	cuid = coolkey_cuid_to_string(&priv->cuid);
+	if (cuid == NULL) {
+		return;
+	}
+	snprintf(priv->cache_prefix, sizeof(priv->cache_prefix), "coolkey_%s_%08lx",
+			cuid, priv->object_list_hash);
+	free(cuid);
+}
+
 /*
  * Initialize the Coolkey data structures.
  */
@@ -2138,6 +2420,9 @@ static int coolkey_initialize(sc_card_t *card)
 	coolkey_private_data_t *priv = NULL;
 	coolkey_life_cycle_t life_cycle;
 	coolkey_object_info_t object_info;
+	coolkey_object_info_t *objects = NULL, *tmp;
+	size_t object_count = 0, objects_allocated = 0, i;
+	unsigned long combined_len = 0;
 	int combined_processed = 0;
 
 	/* already found? */
@@ -2166,12 +2451,56 @@ static int coolkey_initialize(sc_card_t *card)
 	priv->pin_count = life_cycle.pin_count;
 	priv->life_cycle = life_cycle.life_cycle;
 
-	/* walk down the list of objects and read them off the token */
+	/* walk down the list of objects and remember what is on the token */
+	priv->object_list_hash = COOLKEY_HASH_INIT;
 	for(r=coolkey_list_object(card, COOLKEY_LIST_RESET, &object_info); r >= 0;
 		r= coolkey_list_object(card, COOLKEY_LIST_NEXT, &object_info)) {
-		unsigned long object_id = bebytes2ulong(object_info.object_id);
-		unsigned short object_len = bebytes2ulong(object_info.object_length);
-	    /* also look at the ACL... */
+		if (object_count == objects_allocated) {
+			objects_allocated = objects_allocated ? objects_allocated*2 : 16;
+			tmp = realloc(objects, objects_allocated * sizeof(coolkey_object_info_t));
+			if (tmp == NULL) {
+				r = SC_ERROR_OUT_OF_MEMORY;
+				break;
+			}
+			objects = tmp;
+		}
+		objects[object_count++] = object_info;
+		priv->object_list_hash = coolkey_hash_bytes(priv->object_list_hash,
+				object_info.object_id, sizeof(object_info.object_id) + sizeof(object_info.object_length));
+		if (bebytes2ulong(object_info.object_id) == COOLKEY_COMBINED_OBJECT_ID) {
+			combined_len = bebytes2ulong(object_info.object_length);
+		}
+	}
+	if (r != SC_ERROR_FILE_END_REACHED) {
+		goto cleanup;
+	}
+
+	/* we need the cuid before reading any objects, so we know where to find them in the cache.
+	 * It's either in the combined object header or we construct it from the cplc data */
+	if (combined_len >= sizeof(coolkey_combined_header_t)) {
+		coolkey_combined_header_t header;
+
+		r = coolkey_read_object(card, COOLKEY_COMBINED_OBJECT_ID, 0, (u8 *)&header, sizeof(header),
+										priv->nonce, sizeof(priv->nonce));
+		if (r < 0) {
+			goto cleanup;
+		}
+		memcpy(&priv->cuid, &header.cuid, sizeof(priv->cuid));
+		priv->object_list_hash = coolkey_hash_bytes(priv->object_list_hash,
+				header.object_version, sizeof(header.object_version));
+		coolkey_set_cache_prefix(card, priv);
+	} else {
+		global_platform_cplc_data_t cplc_data;
+		r = coolkey_get_cplc_data(card, &cplc_data);
+		if (r < 0) {
+			goto cleanup;
+		}
+		coolkey_make_cuid_from_cplc(&priv->cuid, &cplc_data);
+	}
+
+	for (i=0; i < object_count; i++) {
+		unsigned long object_id = bebytes2ulong(objects[i].object_id);
+		unsigned short object_len = bebytes2ulong(objects[i].object_length);
 
 
 		/* the combined object is a single object that can store the other objects.
@@ -2181,15 +2510,13 @@ static int coolkey_initialize(sc_card_t *card)
 		 * process it separately so that we can have both combined objects managed
 		 * by TPS and user managed certs on the same token */
 		if (object_id == COOLKEY_COMBINED_OBJECT_ID) {
-			u8 *object = malloc(object_len);
-			if (object == NULL) {
-				r = SC_ERROR_OUT_OF_MEMORY;
-				break;
-			}
-			r = coolkey_read_object(card, COOLKEY_COMBINED_OBJECT_ID, 0, object, object_len,
-											priv->nonce, sizeof(priv->nonce));
+			u8 *object = NULL;
+			/* only objects everybody can read may end up in the file cache */
+			int file_cacheable = bebytes2ushort(objects[i].read_acl) == 0;
+
+			r = coolkey_load_object(card, priv, COOLKEY_COMBINED_OBJECT_ID, object_len,
+					file_cacheable, &object);
 			if (r < 0) {
-				free(object);
 				break;
 			}
 			r = coolkey_process_combined_object(card, priv, object, r);
@@ -2203,19 +2530,12 @@ static int coolkey_initialize(sc_card_t *card)
 		r = coolkey_add_object(priv, object_id, NULL, object_len, 0);
 		if (r != SC_SUCCESS)
 			sc_log(card->ctx, "coolkey_add_object() returned %d", r);
-
+		r = SC_SUCCESS;
 	}
-	if (r != SC_ERROR_FILE_END_REACHED) {
+	if (r < 0) {
 		goto cleanup;
 	}
-	/* if we didn't pull the cuid from the combined object, then grab it now */
 	if (!combined_processed) {
-		global_platform_cplc_data_t cplc_data;
-		r = coolkey_get_cplc_data(card, &cplc_data);
-		if (r < 0) {
-			goto cleanup;
-		}
-		coolkey_make_cuid_from_cplc(&priv->cuid, &cplc_data);
 		priv->token_name = (u8 *)strdup("COOLKEY");
 		if (priv->token_name == NULL) {
 			r= SC_ERROR_OUT_OF_MEMORY;
@@ -2223,10 +2543,12 @@ static int coolkey_initialize(sc_card_t *card)
 		}
 		priv->token_name_length = sizeof("COOLKEY")-1;
 	}
+	free(objects);
 	card->drv_data = priv;
 	return SC_SUCCESS;
 
 cleanup:
+	free(objects);
 	if (priv) {
 		coolkey_free_private_data(priv);
 	}
@@ -743,6 +743,140 @@ int dnie_match_card(struct sc_card *card)
 	LOG_FUNC_RETURN(card->ctx, result);
 }
 
+/************************** secure channel reuse **************************/
+
+/**
+ * Read whether the secure channel may be shared with other processes,
+ * and how long a stored channel stays valid.
+ *
+ * @param card pointer to card info data
+ */
+static void dnie_get_sm_reuse(sc_card_t * card)
+{
+	dnie_private_data_t *priv = GET_DNIE_PRIV_DATA(card);
+	int i;
+	int reuse = 0;
+	int lifetime = 600;
+	scconf_block **blocks, *blk;
+	sc_context_t *ctx = card->ctx;
+
+	for (i = 0; ctx->conf_blocks[i]; i++) {
+		blocks = scconf_find_blocks(ctx->conf, ctx->conf_blocks[i],
+				"card_driver", "dnie");
+		if (!blocks)
+			continue;
+		blk = blocks[0];
+		free(blocks);
+		if (blk == NULL)
+			continue;
+		reuse = scconf_get_bool(blk, "secure_channel_reuse", reuse);
+		lifetime = scconf_get_int(blk, "secure_channel_lifetime", lifetime);
+	}
+	priv->sm_reuse = reuse;
+	priv->sm_lifetime = lifetime;
+}
+
+/**
+ * Compose the name the secure channel of this card is stored under.
+ *
+ * @param card pointer to card info data
+ * @return SC_SUCCESS if ok, else error code
+ */
+static int dnie_sm_session_name(sc_card_t * card)
+{
+	dnie_private_data_t *priv = GET_DNIE_PRIV_DATA(card);
+	sc_serial_number_t serial;
+	size_t n;
+	int res;
+
+	if (priv->sm_session[0])
+		return SC_SUCCESS;
+	res = dnie_get_serialnr(card, &serial);
+	if (res != SC_SUCCESS)
+		return res;
+	strcpy(priv->sm_session, "dnie_sm_");
+	for (n = 0; n < serial.len && 8 + 2 * n + 2 < sizeof(priv->sm_session); n++)
+		sprintf(priv->sm_session + 8 + 2 * n, "%02x", serial.value[n]);
+	return SC_SUCCESS;
+}
+
+/**
+ * Store the current secure channel for other processes.
+ *
+ * Called when a channel was established, and when the reader lock is
+ * released after the SSC moved on.
+ *
+ * @param card pointer to card info data
+ */
+static void dnie_sm_save(sc_card_t * card)
+{
+	dnie_private_data_t *priv = GET_DNIE_PRIV_DATA(card);
+
+	if (!priv || !priv->sm_reuse || card->sm_ctx.sm_mode != SM_MODE_TRANSMIT)
+		return;
+	priv->sm_dirty = 0;
+	if (dnie_sm_session_name(card) != SC_SUCCESS
+	    || cwa_store_session(card, priv->sm_session) != SC_SUCCESS)
+		sc_log(card->ctx, "Cannot store secure channel; it won't be shared");
+}
+
+/**
+ * Drop the stored secure channel, as the card does not know it anymore.
+ *
+ * @param card pointer to card info data
+ */
+static void dnie_sm_forget(sc_card_t * card)
+{
+	dnie_private_data_t *priv = GET_DNIE_PRIV_DATA(card);
+
+	if (!priv || !priv->sm_reuse || !priv->sm_session[0])
+		return;
+	priv->sm_dirty = 0;
+	cwa_remove_session(card, priv->sm_session);
+}
+
+/**
+ * Take over the secure channel stored by this or another process.
+ *
+ * A stored channel seen for the first time (or after a card reset) may
+ * belong to an earlier card session, so it is checked with GET CHALLENGE.
+ * Later on the stored state is just loaded, as other processes may have
+ * moved the SSC on in the meantime.
+ *
+ * @param card pointer to card info data
+ * @return SC_SUCCESS; a missing or stale channel is not an error
+ */
+static int dnie_sm_resume(sc_card_t * card)
+{
+	dnie_private_data_t *priv = GET_DNIE_PRIV_DATA(card);
+	u8 rnd[8];
+	int res;
+
+	if (!priv || !priv->sm_reuse)
+		return SC_SUCCESS;
+	LOG_FUNC_CALLED(card->ctx);
+	res = dnie_sm_session_name(card);
+	if (res != SC_SUCCESS) {
+		sc_log(card->ctx, "No serial number; secure channel not shared");
+		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+	}
+	res = cwa_load_session(card, priv->sm_session, priv->sm_lifetime);
+	if (res != SC_SUCCESS || priv->sm_checked) {
+		priv->sm_checked = 1;
+		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+	}
+	priv->sm_checked = 1;
+	res = card->ops->get_challenge(card, rnd, sizeof(rnd));
+	if (res != SC_SUCCESS) {
+		sc_log(card->ctx, "Stored secure channel is not valid anymore");
+		dnie_sm_forget(card);
+		cwa_create_secure_channel(card, priv->cwa_provider, CWA_SM_OFF);
+	} else {
+		sc_log(card->ctx, "Resumed stored secure channel");
+	}
+	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+}
+
 static int dnie_sm_free_wrapped_apdu(struct sc_card *card,
 		struct sc_apdu *plain, struct sc_apdu **sm_apdu)
 {
@@ -759,6 +893,12 @@ static int dnie_sm_free_wrapped_apdu(struct sc_card *card,
 
 	if ((*sm_apdu) != plain) {
 		rv = cwa_decode_response(card, provider, *sm_apdu);
+		/* the SSC moved on, it is stored when the reader lock is
+		 * released; a broken channel is gone for everyone */
+		if (rv == SC_SUCCESS)
+			GET_DNIE_PRIV_DATA(card)->sm_dirty = 1;
+		else
+			dnie_sm_forget(card);
 		if (plain) {
 			plain->resplen = (*sm_apdu)->resplen;
 			plain->sw1 = (*sm_apdu)->sw1;
@@ -868,6 +1008,7 @@ static int dnie_init(struct sc_card *card)
 #endif
 
 	GET_DNIE_PRIV_DATA(card)->cwa_provider = provider;
+	dnie_get_sm_reuse(card);
 
 	LOG_FUNC_RETURN(card->ctx, res);
 }
@@ -886,6 +1027,10 @@ static int dnie_finish(struct sc_card *card)
 	int result = SC_SUCCESS;
 	LOG_FUNC_CALLED(card->ctx);
 	dnie_clear_cache(GET_DNIE_PRIV_DATA(card));
+	/* the stored channel is left for the next process: it is removed
+	 * when it expires, on logout, card reset or when it fails */
+	if (GET_DNIE_PRIV_DATA(card)->sm_dirty)
+		dnie_sm_save(card);
 	/* disable sm channel if established */
 	result = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_OFF);
 	free(GET_DNIE_PRIV_DATA(card)->cwa_provider);
@@ -893,6 +1038,49 @@ static int dnie_finish(struct sc_card *card)
 	LOG_FUNC_RETURN(card->ctx, result);
 }
 
+/**
+ * Pick up the shared secure channel when the reader lock is obtained.
+ *
+ * Other processes may have used the channel (and its SSC) since this
+ * process had the card.
+ *
+ * @param card Pointer to card driver data structure
+ * @param was_reset card was reset since the lock was released
+ * @return SC_SUCCESS if ok; else error code
+ */
+static int dnie_card_reader_lock_obtained(struct sc_card *card, int was_reset)
+{
+	dnie_private_data_t *priv = GET_DNIE_PRIV_DATA(card);
+
+	if (!priv || !priv->sm_reuse)
+		return SC_SUCCESS;
+	LOG_FUNC_CALLED(card->ctx);
+	if (was_reset) {
+		/* the card forgot every channel, so does everybody else */
+		if (dnie_sm_session_name(card) == SC_SUCCESS)
+			dnie_sm_forget(card);
+		cwa_create_secure_channel(card, priv->cwa_provider, CWA_SM_OFF);
+		priv->sm_checked = 0;
+	}
+	LOG_FUNC_RETURN(card->ctx, dnie_sm_resume(card));
+}
+
+/**
+ * Store the shared secure channel before the reader lock is released,
+ * if the SSC moved on meanwhile.
+ *
+ * @param card Pointer to card driver data structure
+ * @return SC_SUCCESS
+ */
+static int dnie_card_reader_lock_released(struct sc_card *card)
+{
+	dnie_private_data_t *priv = GET_DNIE_PRIV_DATA(card);
+
+	if (priv && priv->sm_dirty)
+		dnie_sm_save(card);
+	return SC_SUCCESS;
+}
+
 /* ISO 7816-4 functions */
 
 /**
@@ -1413,6 +1601,7 @@ static int dnie_logout(struct sc_card *card)
 
 	LOG_FUNC_CALLED(card->ctx);
 	if (card->sm_ctx.sm_mode != SM_MODE_NONE) {
+		dnie_sm_forget(card);
 		/* mark the channel as closed */
 		result = cwa_create_secure_channel(card, 
 			GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_OFF);
@@ -2148,6 +2337,7 @@ static int dnie_pin_change(struct sc_card *card, struct sc_pin_cmd_data * data)
 	/* Ensure that secure channel is established from reset */
 	res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_ON);
 	LOG_TEST_RET(card->ctx, res, "Establish SM failed");
+	dnie_sm_save(card);
 	LOG_FUNC_RETURN(card->ctx,SC_ERROR_NOT_SUPPORTED);
 }
 
@@ -2170,6 +2360,7 @@ static int dnie_pin_verify(struct sc_card *card,
 	u8 pinbuffer[SC_MAX_APDU_BUFFER_SIZE];
 	int pinlen = 0;
 	int padding = 0;
+	int reused = 0;
 
 	LOG_FUNC_CALLED(card->ctx);
 	/* ensure that secure channel is established from reset */
@@ -2177,9 +2368,20 @@ static int dnie_pin_verify(struct sc_card *card,
 		/* the provider should be prepared for using PIN information */
 		sc_log(card->ctx, "DNIe 3.0 detected doing PIN initialization");
 		dnie_change_cwa_provider_to_pin(card);
+	} else if (GET_DNIE_PRIV_DATA(card)->sm_reuse) {
+		/* readers without lock operation never resumed the channel */
+		if (!GET_DNIE_PRIV_DATA(card)->sm_checked)
+			dnie_sm_resume(card);
+		reused = card->sm_ctx.sm_mode == SM_MODE_TRANSMIT;
+	}
+	if (reused) {
+		sc_log(card->ctx, "Using already established secure channel");
+	} else {
+		res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_ON);
+		LOG_TEST_RET(card->ctx, res, "Establish SM failed");
+		if (card->atr.value[15] < DNIE_30_VERSION)
+			dnie_sm_save(card);
 	}
-	res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_ON);
-	LOG_TEST_RET(card->ctx, res, "Establish SM failed");
 
 	data->apdu = &apdu;	/* prepare apdu struct */
 	/* compose pin data to be inserted in apdu */
@@ -2197,6 +2399,16 @@ static int dnie_pin_verify(struct sc_card *card,
 
 	/* and send to card throught virtual channel */
 	res = sc_transmit_apdu(card, &apdu);
+	if (res != SC_SUCCESS && reused) {
+		/* the shared channel was closed meanwhile: negotiate a new one */
+		sc_log(card->ctx, "Shared secure channel failed, establishing a new one");
+		dnie_sm_forget(card);
+		res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_ON);
+		LOG_TEST_RET(card->ctx, res, "Establish SM failed");
+		dnie_sm_save(card);
+		apdu.resplen = 0;
+		res = sc_transmit_apdu(card, &apdu);
+	}
 	if (res != SC_SUCCESS) {
 		LOG_TEST_RET(card->ctx, res, "VERIFY APDU Transmit fail");
 	}
@@ -2215,6 +2427,8 @@ static int dnie_pin_verify(struct sc_card *card,
 		sc_log(card->ctx, "DNIe 3.0 detected => re-establish secure channel");
 		dnie_change_cwa_provider_to_secure(card);
 		res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_ON);
+		if (res == SC_SUCCESS)
+			dnie_sm_save(card);
 	}
 
 	LOG_FUNC_RETURN(card->ctx, res);
@@ -2314,6 +2528,8 @@ static sc_card_driver_t *get_dnie_driver(void)
 	dnie_ops.match_card	= dnie_match_card;
 	dnie_ops.init		= dnie_init;
 	dnie_ops.finish		= dnie_finish;
+	dnie_ops.card_reader_lock_obtained = dnie_card_reader_lock_obtained;
+	dnie_ops.card_reader_lock_released = dnie_card_reader_lock_released;
 
 	/* iso7816-4 functions */
 	dnie_ops.read_binary	= dnie_read_binary;
@@ -98,8 +98,27 @@ typedef struct epass2003_exdata_st {
 	unsigned char sk_enc[16];	/* encrypt session key */
 	unsigned char sk_mac[16];	/* mac session key */
 	unsigned char icv_mac[16];	/* instruction counter vector(for sm) */
+
+	/* cipher contexts keyed with the session keys by gen_init_key() */
+	EVP_CIPHER_CTX *sm_enc;		/* CBC encryption with sk_enc */
+	EVP_CIPHER_CTX *sm_dec;		/* CBC decryption with sk_enc */
+	EVP_CIPHER_CTX *sm_mac;		/* CBC encryption with sk_mac (first half for DES) */
+	EVP_CIPHER_CTX *sm_mac_dec;	/* DES decryption with second half of sk_mac */
+
+	/* SM APDUs and buffers reused for the wrapped commands, two of them
+	 * as a GET RESPONSE may be wrapped while a command is outstanding */
+	struct epass2003_sm_slot {
+		struct sc_apdu apdu;
+		int in_use;
+		unsigned char *data;
+		unsigned char *resp;
+	} sm_slot[2];
+	unsigned char *sm_mac_buf;
 } epass2003_exdata;
 
+#define SM_BUF_SIZE	SC_MAX_EXT_APDU_BUFFER_SIZE
+#define SM_SLOTS	(sizeof(((epass2003_exdata *)0)->sm_slot) / sizeof(struct epass2003_sm_slot))
+
 #define REVERSE_ORDER4(x)	(			  \
 		((unsigned long)x & 0xFF000000)>> 24	| \
 		((unsigned long)x & 0x00FF0000)>>  8 	| \
@@ -237,35 +256,6 @@ out:
 	return r;
 }
 
-static int
-openssl_dec(const EVP_CIPHER * cipher, const unsigned char *key, const unsigned char *iv,
-		const unsigned char *input, size_t length, unsigned char *output)
-{
-	int r = SC_ERROR_INTERNAL;
-	EVP_CIPHER_CTX * ctx = NULL;
-	int outl = 0;
-	int outl_tmp = 0;
-	unsigned char iv_tmp[EVP_MAX_IV_LENGTH] = { 0 };
-
-	memcpy(iv_tmp, iv, EVP_MAX_IV_LENGTH);
-	ctx = EVP_CIPHER_CTX_new();
-	if (ctx == NULL)
-		goto out;
-	EVP_DecryptInit_ex(ctx, cipher, NULL, key, iv_tmp);
-	EVP_CIPHER_CTX_set_padding(ctx, 0);
-
-	if (!EVP_DecryptUpdate(ctx, output, &outl, input, length))
-		goto out;
-
-	if (!EVP_DecryptFinal_ex(ctx, output + outl, &outl_tmp))
-		goto out;
-
-	r = SC_SUCCESS;
-out:
-	if (ctx)
-		EVP_CIPHER_CTX_free(ctx);
-	return r;
-}
 
 
 static int
@@ -285,14 +275,6 @@ aes128_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[16],
 }
 
 
-static int
-aes128_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[16],
-		const unsigned char *input, size_t length, unsigned char *output)
-{
-	return openssl_dec(EVP_aes_128_cbc(), key, iv, input, length, output);
-}
-
-
 static int
 des3_encrypt_ecb(const unsigned char *key, int keysize,
 		const unsigned char *input, int length, unsigned char *output)
@@ -330,39 +312,6 @@ des3_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX
 }
 
 
-static int
-des3_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
-		const unsigned char *input, size_t length, unsigned char *output)
-{
-	unsigned char bKey[24] = { 0 };
-	if (keysize == 16) {
-		memcpy(&bKey[0], key, 16);
-		memcpy(&bKey[16], key, 8);
-	}
-	else {
-		memcpy(&bKey[0], key, 24);
-	}
-
-	return openssl_dec(EVP_des_ede3_cbc(), bKey, iv, input, length, output);
-}
-
-
-static int
-des_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
-		const unsigned char *input, size_t length, unsigned char *output)
-{
-	return openssl_enc(EVP_des_cbc(), key, iv, input, length, output);
-}
-
-
-static int
-des_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[EVP_MAX_IV_LENGTH],
-		const unsigned char *input, size_t length, unsigned char *output)
-{
-	return openssl_dec(EVP_des_cbc(), key, iv, input, length, output);
-}
-
-
 static int
 openssl_dig(const EVP_MD * digest, const unsigned char *input, size_t length,
 		unsigned char *output)
@@ -404,6 +353,83 @@ sha1_digest(const unsigned char *input, size_t length, unsigned char *output)
 }
 
 
+static void
+sm_free_ctx(epass2003_exdata *exdata)
+{
+	EVP_CIPHER_CTX_free(exdata->sm_enc);
+	EVP_CIPHER_CTX_free(exdata->sm_dec);
+	EVP_CIPHER_CTX_free(exdata->sm_mac);
+	EVP_CIPHER_CTX_free(exdata->sm_mac_dec);
+	exdata->sm_enc = exdata->sm_dec = exdata->sm_mac = exdata->sm_mac_dec = NULL;
+}
+
+
+/* key the session cipher contexts, so that wrapping an APDU only needs to
+ * reset the IV */
+static int
+sm_init_ctx(epass2003_exdata *exdata, unsigned char key_type)
+{
+	unsigned char bKey[24];
+	int ok;
+
+	if (!exdata->sm_enc) {
+		exdata->sm_enc = EVP_CIPHER_CTX_new();
+		exdata->sm_dec = EVP_CIPHER_CTX_new();
+		exdata->sm_mac = EVP_CIPHER_CTX_new();
+		exdata->sm_mac_dec = EVP_CIPHER_CTX_new();
+		if (!exdata->sm_enc || !exdata->sm_dec || !exdata->sm_mac || !exdata->sm_mac_dec) {
+			sm_free_ctx(exdata);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+	}
+
+	if (KEY_TYPE_AES == key_type) {
+		ok = EVP_EncryptInit_ex(exdata->sm_enc, EVP_aes_128_cbc(), NULL, exdata->sk_enc, NULL)
+			&& EVP_DecryptInit_ex(exdata->sm_dec, EVP_aes_128_cbc(), NULL, exdata->sk_enc, NULL)
+			&& EVP_EncryptInit_ex(exdata->sm_mac, EVP_aes_128_cbc(), NULL, exdata->sk_mac, NULL);
+	}
+	else {
+		memcpy(&bKey[0], exdata->sk_enc, 16);
+		memcpy(&bKey[16], exdata->sk_enc, 8);
+		ok = EVP_EncryptInit_ex(exdata->sm_enc, EVP_des_ede3_cbc(), NULL, bKey, NULL)
+			&& EVP_DecryptInit_ex(exdata->sm_dec, EVP_des_ede3_cbc(), NULL, bKey, NULL)
+			&& EVP_EncryptInit_ex(exdata->sm_mac, EVP_des_cbc(), NULL, exdata->sk_mac, NULL)
+			&& EVP_DecryptInit_ex(exdata->sm_mac_dec, EVP_des_cbc(), NULL, &exdata->sk_mac[8], NULL);
+		sc_mem_clear(bKey, sizeof(bKey));
+	}
+	if (!ok)
+		return SC_ERROR_INTERNAL;
+
+	EVP_CIPHER_CTX_set_padding(exdata->sm_enc, 0);
+	EVP_CIPHER_CTX_set_padding(exdata->sm_dec, 0);
+	EVP_CIPHER_CTX_set_padding(exdata->sm_mac, 0);
+	EVP_CIPHER_CTX_set_padding(exdata->sm_mac_dec, 0);
+
+	return SC_SUCCESS;
+}
+
+
+/* CBC en-/decryption with one of the session contexts; output may be input */
+static int
+sm_cbc(EVP_CIPHER_CTX *ctx, const unsigned char *iv,
+		const unsigned char *input, size_t length, unsigned char *output)
+{
+	int outl = 0;
+	int outl_tmp = 0;
+
+	if (!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1))
+		return SC_ERROR_INTERNAL;
+
+	if (!EVP_CipherUpdate(ctx, output, &outl, input, length))
+		return SC_ERROR_INTERNAL;
+
+	if (!EVP_CipherFinal_ex(ctx, output + outl, &outl_tmp))
+		return SC_ERROR_INTERNAL;
+
+	return SC_SUCCESS;
+}
+
+
 static int
 gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_mac,
 		unsigned char *result, unsigned char key_type)
@@ -456,6 +482,9 @@ gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_ma
 		des3_encrypt_ecb(key_mac, 16, data, 16, exdata->sk_mac);
 	}
 
+	r = sm_init_ctx(exdata, key_type);
+	LOG_TEST_RET(card->ctx, r, "Failed to set up session key contexts");
+
 	memcpy(data, g_random, 8);
 	memcpy(&data[8], &result[12], 8);
 	data[16] = 0x80;
@@ -598,122 +627,107 @@ epass2003_refresh(struct sc_card *card)
 }
 
 
-/* Data(TLV)=0x87|L|0x01+Cipher */
+/* According to GlobalPlatform Card Specification's SCP01
+ * encode APDU from
+ * CLA INS P1 P2 [Lc] Data [Le]
+ * to
+ * CLA INS P1 P2 Lc' Data' [Le]
+ * where
+ * Data'=Data(TLV)+Le(TLV)+MAC(TLV)
+ * Data(TLV)=0x87|L|0x01+Cipher
+ * Le(TLV)=0x97|L|Le
+ * MAC(TLV)=0x8e|0x08|MAC
+ *
+ * Data' is built directly in sm->data with the cryptogram encrypted in place.
+ * The MAC is computed over the padded header followed by the padded data
+ * objects, which are staged in exdata->sm_mac_buf. */
 static int
-construct_data_tlv(struct sc_card *card, struct sc_apdu *apdu, unsigned char *apdu_buf,
-		unsigned char *data_tlv, size_t * data_tlv_len, const unsigned char key_type)
+encode_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_apdu *sm)
 {
-	size_t block_size = (KEY_TYPE_AES == key_type ? 16 : 8);
-	unsigned char pad[4096] = { 0 };
-	size_t pad_len;
-	size_t tlv_more;	/* increased tlv length */
+	size_t block_size;
+	unsigned char *data = (unsigned char *)sm->data;
+	unsigned char *mac_buf;
 	unsigned char iv[16] = { 0 };
+	unsigned char icv[16] = { 0 };
+	unsigned char tmp[8];
+	size_t pad_len;
+	size_t len = 0;
+	size_t mac_len;
+	int le_ext = 0;
+	int i;
 	epass2003_exdata *exdata = NULL;
 
 	if (!card->drv_data) 
 		return SC_ERROR_INVALID_ARGUMENTS;
+	exdata = (epass2003_exdata*)card->drv_data;
+	block_size = (KEY_TYPE_AES == exdata->smtype ? 16 : 8);
+	mac_buf = exdata->sm_mac_buf;
+	if (!mac_buf || !exdata->sm_enc)
+		return -1;
 
-	exdata = (epass2003_exdata *)card->drv_data;
+	/* Data -> Data' */
+	if (plain->lc != 0) {
+		pad_len = (plain->lc / block_size + 1) * block_size;
+		/* room for the TLV headers of data, Le and MAC */
+		if (5 + pad_len + 4 + 10 > SM_BUF_SIZE)
+			return -1;
 
-	/* padding */
-	apdu_buf[block_size] = 0x87;
-	memcpy(pad, apdu->data, apdu->lc);
-	pad[apdu->lc] = 0x80;
-	if ((apdu->lc + 1) % block_size)
-		pad_len = ((apdu->lc + 1) / block_size + 1) * block_size;
-	else
-		pad_len = apdu->lc + 1;
+		data[len++] = 0x87;
+		if (pad_len > 0x7E) {
+			/* Lc' > 0x7E, use extended APDU */
+			data[len++] = 0x82;
+			data[len++] = (unsigned char)((pad_len + 1) / 0x100);
+			data[len++] = (unsigned char)((pad_len + 1) % 0x100);
+		}
+		else {
+			data[len++] = (unsigned char)pad_len + 1;
+		}
+		data[len++] = 0x01;
 
-	/* encode Lc' */
-	if (pad_len > 0x7E) {
-		/* Lc' > 0x7E, use extended APDU */
-		apdu_buf[block_size + 1] = 0x82;
-		apdu_buf[block_size + 2] = (unsigned char)((pad_len + 1) / 0x100);
-		apdu_buf[block_size + 3] = (unsigned char)((pad_len + 1) % 0x100);
-		apdu_buf[block_size + 4] = 0x01;
-		tlv_more = 5;
-	}
-	else {
-		apdu_buf[block_size + 1] = (unsigned char)pad_len + 1;
-		apdu_buf[block_size + 2] = 0x01;
-		tlv_more = 3;
+		memcpy(data + len, plain->data, plain->lc);
+		data[len + plain->lc] = 0x80;
+		memset(data + len + plain->lc + 1, 0, pad_len - plain->lc - 1);
+		if (0 != sm_cbc(exdata->sm_enc, iv, data + len, pad_len, data + len))
+			return -1;
+		len += pad_len;
 	}
-	memcpy(data_tlv, &apdu_buf[block_size], tlv_more);
-
-	/* encrypt Data */
-	if (KEY_TYPE_AES == key_type)
-		aes128_encrypt_cbc(exdata->sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
-	else
-		des3_encrypt_cbc(exdata->sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
-
-	memcpy(data_tlv + tlv_more, apdu_buf + block_size + tlv_more, pad_len);
-	*data_tlv_len = tlv_more + pad_len;
-	return 0;
-}
 
-
-/* Le(TLV)=0x97|L|Le */
-static int
-construct_le_tlv(struct sc_apdu *apdu, unsigned char *apdu_buf, size_t data_tlv_len,
-		unsigned char *le_tlv, size_t * le_tlv_len, const unsigned char key_type)
-{
-	size_t block_size = (KEY_TYPE_AES == key_type ? 16 : 8);
-
-	*(apdu_buf + block_size + data_tlv_len) = 0x97;
-	if (apdu->le > 0x7F) {
-		/* Le' > 0x7E, use extended APDU */
-		*(apdu_buf + block_size + data_tlv_len + 1) = 2;
-		*(apdu_buf + block_size + data_tlv_len + 2) = (unsigned char)(apdu->le / 0x100);
-		*(apdu_buf + block_size + data_tlv_len + 3) = (unsigned char)(apdu->le % 0x100);
-		memcpy(le_tlv, apdu_buf + block_size + data_tlv_len, 4);
-		*le_tlv_len = 4;
-	}
-	else {
-		*(apdu_buf + block_size + data_tlv_len + 1) = 1;
-		*(apdu_buf + block_size + data_tlv_len + 2) = (unsigned char)apdu->le;
-		memcpy(le_tlv, apdu_buf + block_size + data_tlv_len, 3);
-		*le_tlv_len = 3;
+	if (plain->le != 0 || plain->resplen != 0) {
+		data[len++] = 0x97;
+		if (plain->le > 0x7F) {
+			/* Le' > 0x7E, use extended APDU */
+			data[len++] = 2;
+			data[len++] = (unsigned char)(plain->le / 0x100);
+			data[len++] = (unsigned char)(plain->le % 0x100);
+			le_ext = 1;
+		}
+		else {
+			data[len++] = 1;
+			data[len++] = (unsigned char)plain->le;
+		}
 	}
-	return 0;
-}
 
+	/* padded header */
+	mac_buf[0] = (unsigned char)plain->cla;
+	mac_buf[1] = (unsigned char)plain->ins;
+	mac_buf[2] = (unsigned char)plain->p1;
+	mac_buf[3] = (unsigned char)plain->p2;
+	mac_buf[4] = 0x80;
+	memset(&mac_buf[5], 0x00, block_size - 5);
 
-/* MAC(TLV)=0x8e|0x08|MAC */
-static int
-construct_mac_tlv(struct sc_card *card, unsigned char *apdu_buf, size_t data_tlv_len, size_t le_tlv_len,
-		unsigned char *mac_tlv, size_t * mac_tlv_len, const unsigned char key_type)
-{
-	size_t block_size = (KEY_TYPE_AES == key_type ? 16 : 8);
-	unsigned char mac[4096] = { 0 };
-	size_t mac_len;
-	unsigned char icv[16] = { 0 };
-	int i = (KEY_TYPE_AES == key_type ? 15 : 7);
-	epass2003_exdata *exdata = NULL;
-
-	if (!card->drv_data) 
-		return SC_ERROR_INVALID_ARGUMENTS;
-
-	exdata = (epass2003_exdata *)card->drv_data;
-
-	if (0 == data_tlv_len && 0 == le_tlv_len) {
+	/* padded data objects */
+	if (0 == len) {
 		mac_len = block_size;
 	}
 	else {
-		/* padding */
-		*(apdu_buf + block_size + data_tlv_len + le_tlv_len) = 0x80;
-		if ((data_tlv_len + le_tlv_len + 1) % block_size)
-			mac_len = (((data_tlv_len + le_tlv_len + 1) / block_size) +
-					1) * block_size + block_size;
-
-		else
-			mac_len = data_tlv_len + le_tlv_len + 1 + block_size;
-
-		memset((apdu_buf + block_size + data_tlv_len + le_tlv_len + 1),
-		       0, (mac_len - (data_tlv_len + le_tlv_len + 1)));
+		memcpy(mac_buf + block_size, data, len);
+		mac_buf[block_size + len] = 0x80;
+		mac_len = ((len + block_size) / block_size) * block_size + block_size;
+		memset(mac_buf + block_size + len + 1, 0, mac_len - block_size - len - 1);
 	}
 
 	/* increase icv */
-	for (; i >= 0; i--) {
+	for (i = (int)block_size - 1; i >= 0; i--) {
 		if (exdata->icv_mac[i] == 0xff) {
 			exdata->icv_mac[i] = 0;
 		}
@@ -724,112 +738,28 @@ construct_mac_tlv(struct sc_card *card, unsigned char *apdu_buf, size_t data_tlv
 	}
 
 	/* calculate MAC */
-	memset(icv, 0, sizeof(icv));
 	memcpy(icv, exdata->icv_mac, 16);
-	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_cbc(exdata->sk_mac, 16, icv, apdu_buf, mac_len, mac);
-		memcpy(mac_tlv + 2, &mac[mac_len - 16], 8);
-	}
-	else {
-		unsigned char iv[8] = { 0 };
-		unsigned char tmp[8] = { 0 };
-		des_encrypt_cbc(exdata->sk_mac, 8, icv, apdu_buf, mac_len, mac);
-		des_decrypt_cbc(&exdata->sk_mac[8], 8, iv, &mac[mac_len - 8], 8, tmp);
-		memset(iv, 0x00, 8);
-		des_encrypt_cbc(exdata->sk_mac, 8, iv, tmp, 8, mac_tlv + 2);
-	}
-
-	*mac_tlv_len = 2 + 8;
-	return 0;
-}
-
-
-/* According to GlobalPlatform Card Specification's SCP01
- * encode APDU from
- * CLA INS P1 P2 [Lc] Data [Le]
- * to
- * CLA INS P1 P2 Lc' Data' [Le]
- * where
- * Data'=Data(TLV)+Le(TLV)+MAC(TLV) */
-static int
-encode_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_apdu *sm,
-		unsigned char *apdu_buf, size_t * apdu_buf_len)
-{
-	size_t block_size = 0;
-	unsigned char dataTLV[4096] = { 0 };
-	size_t data_tlv_len = 0;
-	unsigned char le_tlv[256] = { 0 };
-	size_t le_tlv_len = 0;
-	size_t mac_tlv_len = 10;
-	size_t tmp_lc = 0;
-	size_t tmp_le = 0;
-	unsigned char mac_tlv[256] = { 0 };
-	epass2003_exdata *exdata = NULL;
-
-	mac_tlv[0] = 0x8E;
-	mac_tlv[1] = 8;
-	/* size_t plain_le = 0; */
-	if (!card->drv_data) 
-		return SC_ERROR_INVALID_ARGUMENTS;
-	exdata = (epass2003_exdata*)card->drv_data;
-	block_size = (KEY_TYPE_DES == exdata->smtype ? 16 : 8);
-
-	sm->cse = SC_APDU_CASE_4_SHORT;
-	apdu_buf[0] = (unsigned char)plain->cla;
-	apdu_buf[1] = (unsigned char)plain->ins;
-	apdu_buf[2] = (unsigned char)plain->p1;
-	apdu_buf[3] = (unsigned char)plain->p2;
-	/* plain_le = plain->le; */
-	/* padding */
-	apdu_buf[4] = 0x80;
-	memset(&apdu_buf[5], 0x00, block_size - 5);
-
-	/* Data -> Data' */
-	if (plain->lc != 0)
-		if (0 != construct_data_tlv(card, plain, apdu_buf, dataTLV, &data_tlv_len, exdata->smtype))
-			return -1;
-
-	if (plain->le != 0 || (plain->le == 0 && plain->resplen != 0))
-		if (0 != construct_le_tlv(plain, apdu_buf, data_tlv_len, le_tlv,
-				     &le_tlv_len, exdata->smtype))
-			return -1;
-
-	if (0 != construct_mac_tlv(card, apdu_buf, data_tlv_len, le_tlv_len, mac_tlv, &mac_tlv_len, exdata->smtype))
+	data[len] = 0x8E;
+	data[len + 1] = 8;
+	if (0 != sm_cbc(exdata->sm_mac, icv, mac_buf, mac_len, mac_buf))
 		return -1;
-
-	memset(apdu_buf + 4, 0, *apdu_buf_len - 4);
-	sm->lc = sm->datalen = data_tlv_len + le_tlv_len + mac_tlv_len;
-	if (sm->lc > 0xFF) {
-		sm->cse = SC_APDU_CASE_4_EXT;
-		apdu_buf[4] = (unsigned char)((sm->lc) / 0x10000);
-		apdu_buf[5] = (unsigned char)(((sm->lc) / 0x100) % 0x100);
-		apdu_buf[6] = (unsigned char)((sm->lc) % 0x100);
-		tmp_lc = 3;
+	if (KEY_TYPE_AES == exdata->smtype) {
+		memcpy(data + len + 2, &mac_buf[mac_len - 16], 8);
 	}
 	else {
-		apdu_buf[4] = (unsigned char)sm->lc;
-		tmp_lc = 1;
+		/* retail MAC: finish the last block with the second key */
+		if (0 != sm_cbc(exdata->sm_mac_dec, iv, &mac_buf[mac_len - 8], 8, tmp)
+				|| 0 != sm_cbc(exdata->sm_mac, iv, tmp, 8, data + len + 2))
+			return -1;
 	}
+	len += 2 + 8;
 
-	memcpy(apdu_buf + 4 + tmp_lc, dataTLV, data_tlv_len);
-	memcpy(apdu_buf + 4 + tmp_lc + data_tlv_len, le_tlv, le_tlv_len);
-	memcpy(apdu_buf + 4 + tmp_lc + data_tlv_len + le_tlv_len, mac_tlv, mac_tlv_len);
-	memcpy((unsigned char *)sm->data, apdu_buf + 4 + tmp_lc, sm->datalen);
-	*apdu_buf_len = 0;
-
-	if (4 == le_tlv_len) {
+	sm->lc = sm->datalen = len;
+	if (sm->lc > 0xFF || le_ext)
 		sm->cse = SC_APDU_CASE_4_EXT;
-		*(apdu_buf + 4 + tmp_lc + sm->lc) = (unsigned char)(plain->le / 0x100);
-		*(apdu_buf + 4 + tmp_lc + sm->lc + 1) = (unsigned char)(plain->le % 0x100);
-		tmp_le = 2;
-	}
-	else if (3 == le_tlv_len) {
-		*(apdu_buf + 4 + tmp_lc + sm->lc) = (unsigned char)plain->le;
-		tmp_le = 1;
-	}
+	else
+		sm->cse = SC_APDU_CASE_4_SHORT;
 
-	*apdu_buf_len += 4 + tmp_lc + data_tlv_len + le_tlv_len + mac_tlv_len + tmp_le;
-	/* sm->le = calc_le(plain_le); */
 	return 0;
 }
 
@@ -837,8 +767,6 @@ encode_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_apdu *sm,
 static int
 epass2003_sm_wrap_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_apdu *sm)
 {
-	unsigned char buf[4096] = { 0 };	/* APDU buffer */
-	size_t buf_len = sizeof(buf);
 	epass2003_exdata *exdata = NULL;
 	
 	if (!card->drv_data) 
@@ -870,8 +798,7 @@ epass2003_sm_wrap_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_ap
 		memcpy(sm->resp, plain->resp, plain->resplen);
 		break;
 	case 0x0C:
-		memset(buf, 0, sizeof(buf));
-		if (0 != encode_apdu(card, plain, sm, buf, &buf_len))
+		if (0 != encode_apdu(card, plain, sm))
 			return SC_ERROR_CARD_CMD_FAILED;
 		break;
 	default:
@@ -894,12 +821,13 @@ epass2003_sm_wrap_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_ap
  * SW12(TLV)=0x99|0x02|SW1+SW2
  * MAC(TLV)=0x8e|0x08|MAC */
 static int
-decrypt_response(struct sc_card *card, unsigned char *in, unsigned char *out, size_t * out_len)
+decrypt_response(struct sc_card *card, unsigned char *in, size_t inlen,
+		unsigned char *out, size_t * out_len)
 {
 	size_t in_len;
 	size_t i;
 	unsigned char iv[16] = { 0 };
-	unsigned char plaintext[4096] = { 0 };
+	unsigned char *plaintext;
 	epass2003_exdata *exdata = NULL;
 
 	if (!card->drv_data) 
@@ -928,12 +856,13 @@ decrypt_response(struct sc_card *card, unsigned char *in, unsigned char *out, si
 	else {
 		return -1;
 	}
+	if (in_len < 3 || i + in_len - 1 > inlen)
+		return -1;
 
-	/* decrypt */
-	if (KEY_TYPE_AES == exdata->smtype)
-		aes128_decrypt_cbc(exdata->sk_enc, 16, iv, &in[i], in_len - 1, plaintext);
-	else
-		des3_decrypt_cbc(exdata->sk_enc, 16, iv, &in[i], in_len - 1, plaintext);
+	/* decrypt in place */
+	plaintext = &in[i];
+	if (0 != sm_cbc(exdata->sm_dec, iv, plaintext, in_len - 1, plaintext))
+		return -1;
 
 	/* unpadding */
 	while (0x80 != plaintext[in_len - 2] && (in_len - 2 > 0))
@@ -965,7 +894,7 @@ epass2003_sm_unwrap_apdu(struct sc_card *card, struct sc_apdu *sm, struct sc_apd
 	r = sc_check_sw(card, sm->sw1, sm->sw2);
 	if (r == SC_SUCCESS) {
 		if (exdata->sm) {
-			if (0 != decrypt_response(card, sm->resp, plain->resp, &len))
+			if (0 != decrypt_response(card, sm->resp, sm->resplen, plain->resp, &len))
 				return SC_ERROR_CARD_CMD_FAILED;
 		}
 		else {
@@ -990,6 +919,8 @@ epass2003_sm_free_wrapped_apdu(struct sc_card *card,
 		struct sc_apdu *plain, struct sc_apdu **sm_apdu)
 {
 	struct sc_context *ctx = card->ctx;
+	epass2003_exdata *exdata = (epass2003_exdata *)card->drv_data;
+	size_t i;
 	int rv = SC_SUCCESS;
 
 	LOG_FUNC_CALLED(ctx);
@@ -1002,6 +933,15 @@ epass2003_sm_free_wrapped_apdu(struct sc_card *card,
 	if (plain)
 		rv = epass2003_sm_unwrap_apdu(card, *sm_apdu, plain);
 
+	for (i = 0; exdata && i < SM_SLOTS; i++) {
+		if (*sm_apdu == &exdata->sm_slot[i].apdu) {
+			/* buffers are kept for the next command */
+			exdata->sm_slot[i].in_use = 0;
+			*sm_apdu = NULL;
+			LOG_FUNC_RETURN(ctx, rv);
+		}
+	}
+
 	if ((*sm_apdu)->data) {
 		unsigned char * p = (unsigned char *)((*sm_apdu)->data);
 		free(p);
@@ -1023,14 +963,58 @@ epass2003_sm_get_wrapped_apdu(struct sc_card *card,
 {
 	struct sc_context *ctx = card->ctx;
 	struct sc_apdu *apdu = NULL;
+	epass2003_exdata *exdata = (epass2003_exdata *)card->drv_data;
+	struct epass2003_sm_slot *slot;
+	size_t i;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
-	if (!plain || !sm_apdu)
+	if (!plain || !sm_apdu || !exdata)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 
 	*sm_apdu = NULL;
-	//construct new SM apdu from original apdu
+
+	if (!exdata->sm_mac_buf) {
+		/* header block and trailing padding block around the data */
+		exdata->sm_mac_buf = malloc(SM_BUF_SIZE + 32);
+		if (!exdata->sm_mac_buf)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	}
+
+	for (i = 0; i < SM_SLOTS; i++) {
+		slot = &exdata->sm_slot[i];
+		if (slot->in_use)
+			continue;
+		if (!slot->data) {
+			slot->data = malloc(SM_BUF_SIZE);
+			slot->resp = malloc(SM_BUF_SIZE);
+			if (!slot->data || !slot->resp) {
+				free(slot->data);
+				free(slot->resp);
+				slot->data = slot->resp = NULL;
+				LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+			}
+		}
+
+		apdu = &slot->apdu;
+		memset(apdu, 0, sizeof(struct sc_apdu));
+		apdu->data = slot->data;
+		apdu->resp = slot->resp;
+		apdu->datalen = SM_BUF_SIZE;
+		apdu->resplen = SM_BUF_SIZE;
+		slot->in_use = 1;
+
+		rv = epass2003_sm_wrap_apdu(card, plain, apdu);
+		if (rv) {
+			slot->in_use = 0;
+			LOG_FUNC_RETURN(ctx, rv);
+		}
+
+		*sm_apdu = apdu;
+		LOG_FUNC_RETURN(ctx, rv);
+	}
+
+	/* all shared SM APDUs are in flight, construct a new one */
 	apdu = calloc(1, sizeof(struct sc_apdu));
 	if (!apdu) {
 		rv = SC_ERROR_OUT_OF_MEMORY;
@@ -1123,6 +1107,28 @@ get_data(struct sc_card *card, unsigned char type, unsigned char *data, size_t d
 
 /* card driver functions */
 
+/* 'sm_pipeline' in the card_driver epass2003 block */
+static int
+epass2003_get_sm_pipeline(struct sc_card *card)
+{
+	struct sc_context *ctx = card->ctx;
+	scconf_block **blocks, *blk;
+	int i, pipeline = 0;
+
+	for (i = 0; ctx->conf_blocks[i]; i++) {
+		blocks = scconf_find_blocks(ctx->conf, ctx->conf_blocks[i],
+				"card_driver", "epass2003");
+		if (!blocks)
+			continue;
+		blk = blocks[0];
+		free(blocks);
+		if (blk == NULL)
+			continue;
+		pipeline = scconf_get_bool(blk, "sm_pipeline", pipeline);
+	}
+	return pipeline;
+}
+
 static int epass2003_match_card(struct sc_card *card)
 {
 	int r;
@@ -1179,6 +1185,9 @@ epass2003_init(struct sc_card *card)
 	card->sm_ctx.ops.open = epass2003_refresh;
 	card->sm_ctx.ops.get_sm_apdu = epass2003_sm_get_wrapped_apdu;
 	card->sm_ctx.ops.free_sm_apdu = epass2003_sm_free_wrapped_apdu;
+	/* SCP01 chains the MAC over the commands only */
+	if (epass2003_get_sm_pipeline(card))
+		card->sm_ctx.sm_flags |= SM_FLAGS_PIPELINE;
 
 	/* FIXME (VT): rather then set/unset 'g_sm', better to implement filter for APDUs to be wrapped */
 	epass2003_refresh(card);
@@ -1201,9 +1210,17 @@ static int
 epass2003_finish(sc_card_t *card)
 {
 	epass2003_exdata *exdata = (epass2003_exdata *)card->drv_data;
+	size_t i;
 
-	if (exdata)
+	if (exdata) {
+		sm_free_ctx(exdata);
+		for (i = 0; i < SM_SLOTS; i++) {
+			free(exdata->sm_slot[i].data);
+			free(exdata->sm_slot[i].resp);
+		}
+		free(exdata->sm_mac_buf);
 		free(exdata);
+	}
 	return SC_SUCCESS;
 }
 
@@ -143,11 +143,21 @@ typedef struct _CARD_CACHE_FILE_FORMAT
 
 } CARD_CACHE_FILE_FORMAT, *PCARD_CACHE_FILE_FORMAT;
 
+// offsets of the freshness counters in the cardcf file
+#define GIDS_CARDCF_SIZE 6
+#define GIDS_CARDCF_CONTAINERS_FRESHNESS 2
+#define GIDS_CARDCF_FILES_FRESHNESS 4
+
 struct gids_private_data {
 	u8 masterfile[MAX_GIDS_FILE_SIZE];
 	size_t masterfilesize;
 	u8 cmapfile[MAX_GIDS_FILE_SIZE];
 	size_t cmapfilesize;
+	// the cardcf the cached masterfile & cmapfile belong to
+	u8 cardcf[GIDS_CARDCF_SIZE];
+	int cardcfvalid;
+	// cardcf has been compared with the card since the reader lock was obtained
+	int cardcfchecked;
 	unsigned short currentEFID;
 	unsigned short currentDO;
 	int state;
@@ -333,22 +343,157 @@ static int gids_write_gidsfile_without_cache(sc_card_t* card, u8* masterfile, si
 	return r;
 }
 
-// read the masterfile from the card
+// FILE CACHE
+// The cardcf file is bumped by every minidriver when it changes a file or a container.
+// We use it to know if the masterfile, the cmapfile and the certificates we have
+// in memory or in the file cache are still up to date.
+///////////////////////////////////////////
+
+// drop everything we know about the files of the card, including the cardid
+static void gids_invalidate_cache(sc_card_t* card) {
+	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
+	card->serialnr.len = 0;
+	data->masterfilesize = sizeof(data->masterfile);
+	data->cmapfilesize = sizeof(data->cmapfile);
+	data->cardcfvalid = 0;
+	data->cardcfchecked = 0;
+	data->state = GIDS_STATE_NONE;
+}
+
+// compare the cardcf with the one the cached data belongs to, once per reader lock
+static int gids_check_cardcf(sc_card_t* card) {
+	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
+	u8 cardcf[GIDS_CARDCF_SIZE];
+	size_t cardcfsize = sizeof(cardcf);
+	int r;
+
+	if (data->cardcfchecked && card->reader->ops->lock != NULL) {
+		return SC_SUCCESS;
+	}
+	r = gids_get_DO(card, CARDCF_FI, CARDCF_DO, cardcf, &cardcfsize);
+	if (r < 0 || cardcfsize < GIDS_CARDCF_SIZE) {
+		// no usable cardcf (e.g. card not initialized): do not trust any cached data
+		gids_invalidate_cache(card);
+		return SC_SUCCESS;
+	}
+	if (data->cardcfvalid) {
+		if (memcmp(cardcf + GIDS_CARDCF_FILES_FRESHNESS, data->cardcf + GIDS_CARDCF_FILES_FRESHNESS, 2) != 0) {
+			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "files changed on the card, invalidating the cache");
+			data->masterfilesize = sizeof(data->masterfile);
+			data->cmapfilesize = sizeof(data->cmapfile);
+			data->state = GIDS_STATE_NONE;
+		} else if (memcmp(cardcf + GIDS_CARDCF_CONTAINERS_FRESHNESS, data->cardcf + GIDS_CARDCF_CONTAINERS_FRESHNESS, 2) != 0) {
+			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "containers changed on the card, invalidating the cmapfile");
+			data->cmapfilesize = sizeof(data->cmapfile);
+		}
+	}
+	memcpy(data->cardcf, cardcf, sizeof(cardcf));
+	data->cardcfvalid = 1;
+	data->cardcfchecked = 1;
+	return SC_SUCCESS;
+}
+
+// name of the file cache entry for a DO, or SC_ERROR_NOT_SUPPORTED if the file cache can't be used
+static int gids_get_cache_name(sc_card_t* card, int fileIdentifier, int dataObjectIdentifier, char* name, size_t namesize) {
+	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
+	char cardid[SC_MAX_SERIALNR * 2 + 1];
+	int r;
+
+	if (!data->cardcfvalid || !_sc_use_file_cache(card->ctx)) {
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+	if (card->serialnr.len == 0) {
+		u8 buffer[SC_MAX_SERIALNR];
+		size_t buffersize = sizeof(buffer);
+		// the cardid is at a fixed location, no need for the masterfile
+		r = gids_get_DO(card, CARDID_FI, CARDID_DO, buffer, &buffersize);
+		if (r < 0 || buffersize == 0) {
+			return SC_ERROR_NOT_SUPPORTED;
+		}
+		card->serialnr.len = buffersize;
+		memcpy(card->serialnr.value, buffer, buffersize);
+	}
+	sc_bin_to_hex(card->serialnr.value, card->serialnr.len, cardid, sizeof(cardid), 0);
+	snprintf(name, namesize, "gids_%s_%04X%04X", cardid, fileIdentifier, dataObjectIdentifier);
+	return SC_SUCCESS;
+}
+
+// read a DO from the file cache. The cache entry starts with the freshness counters it is valid for
+static int gids_read_cached_DO(sc_card_t* card, int fileIdentifier, int dataObjectIdentifier, int containers, u8* response, size_t *responselen) {
+	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
+	char name[PATH_MAX];
+	u8 *cached = NULL;
+	size_t cachedsize = 0;
+	int r;
+
+	r = gids_get_cache_name(card, fileIdentifier, dataObjectIdentifier, name, sizeof(name));
+	if (r < 0) {
+		return r;
+	}
+	r = _sc_read_cache_file(card->ctx, name, &cached, &cachedsize);
+	if (r < 0) {
+		return r;
+	}
+	r = SC_ERROR_FILE_NOT_FOUND;
+	if (cachedsize >= 4 && cachedsize - 4 <= *responselen
+			&& memcmp(cached, data->cardcf + GIDS_CARDCF_FILES_FRESHNESS, 2) == 0
+			&& (!containers || memcmp(cached + 2, data->cardcf + GIDS_CARDCF_CONTAINERS_FRESHNESS, 2) == 0)) {
+		memcpy(response, cached + 4, cachedsize - 4);
+		*responselen = cachedsize - 4;
+		r = SC_SUCCESS;
+	}
+	free(cached);
+	return r;
+}
+
+static void gids_write_cached_DO(sc_card_t* card, int fileIdentifier, int dataObjectIdentifier, u8* content, size_t contentsize) {
+	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
+	char name[PATH_MAX];
+	u8 *cached;
+
+	if (gids_get_cache_name(card, fileIdentifier, dataObjectIdentifier, name, sizeof(name)) < 0) {
+		return;
+	}
+	cached = malloc(contentsize + 4);
+	if (!cached) {
+		return;
+	}
+	memcpy(cached, data->cardcf + GIDS_CARDCF_FILES_FRESHNESS, 2);
+	memcpy(cached + 2, data->cardcf + GIDS_CARDCF_CONTAINERS_FRESHNESS, 2);
+	memcpy(cached + 4, content, contentsize);
+	_sc_write_cache_file(card->ctx, name, cached, contentsize + 4);
+	free(cached);
+}
+
+// read the masterfile from the card (or from the cache if the card didn't change)
 static int gids_read_masterfile(sc_card_t* card) {
 	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
 	int r = SC_SUCCESS;
 
+	r = gids_check_cardcf(card);
+	LOG_TEST_RET(card->ctx, r, "unable to check the cardcf");
+	if (data->masterfilesize != sizeof(data->masterfile)) {
+		return SC_SUCCESS;
+	}
+
 	data->masterfilesize = sizeof(data->masterfile);
-	r = gids_get_DO(card, MF_FI, MF_DO, data->masterfile, &data->masterfilesize);
-	if (r<0) {
+	r = gids_read_cached_DO(card, MF_FI, MF_DO, 0, data->masterfile, &data->masterfilesize);
+	if (r < 0) {
 		data->masterfilesize = sizeof(data->masterfile);
-		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_INVALID_CARD);
+		r = gids_get_DO(card, MF_FI, MF_DO, data->masterfile, &data->masterfilesize);
+		if (r<0) {
+			data->masterfilesize = sizeof(data->masterfile);
+			SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_INVALID_CARD);
+		}
+		if (data->masterfilesize >= 1 && data->masterfile[0] == 1) {
+			gids_write_cached_DO(card, MF_FI, MF_DO, data->masterfile, data->masterfilesize);
+		}
 	}
 	if (data->masterfilesize < 1 || data->masterfile[0] != 1) {
 		data->masterfilesize = sizeof(data->masterfile);
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_INVALID_CARD);
 	}
-	return r;
+	return SC_SUCCESS;
 }
 
 // signal to the windows minidriver that something changed on the card and that it should refresh its cache
@@ -375,6 +520,10 @@ static int gids_update_cardcf(sc_card_t* card, int file, int container) {
 	}
 	r = gids_write_gidsfile_without_cache(card, data->masterfile, data->masterfilesize, "", "cardcf", cardcf, 6);
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to update the cardcf file");
+	// the caller keeps the in memory data up to date with its own changes
+	if (data->cardcfvalid) {
+		memcpy(data->cardcf, cardcf, sizeof(cardcf));
+	}
 	return r;
 }
 
@@ -383,10 +532,8 @@ static int gids_read_gidsfile(sc_card_t* card, char *directory, char *filename,
 	struct gids_private_data* privatedata = (struct gids_private_data*) card->drv_data;
 	int r;
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
-	if (privatedata->masterfilesize == sizeof(privatedata->masterfile)) {
-		r = gids_read_masterfile(card);
-		SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to get the masterfile");
-	}
+	r = gids_read_masterfile(card);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to get the masterfile");
 	r = gids_read_gidsfile_without_cache(card, privatedata->masterfile, privatedata->masterfilesize,
 		directory, filename, response, responselen);
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to read the file");
@@ -424,12 +571,27 @@ static int gids_write_gidsfile(sc_card_t* card, char *directory, char *filename,
 static int gids_read_cmapfile(sc_card_t* card) {
 	struct gids_private_data* data = (struct gids_private_data*) card->drv_data;
 	int r = SC_SUCCESS;
+	int fileIdentifier, dataObjectIdentifier;
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
+	r = gids_read_masterfile(card);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to get the masterfile");
+	if (data->cmapfilesize != sizeof(data->cmapfile)) {
+		return SC_SUCCESS;
+	}
+
+	r = gids_get_identifiers(card, data->masterfile, data->masterfilesize, "mscp", "cmapfile", &fileIdentifier, &dataObjectIdentifier);
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to get the identifier for the cmapfile");
 	data->cmapfilesize = sizeof(data->cmapfile);
-	r = gids_read_gidsfile(card, "mscp", "cmapfile", data->cmapfile, &data->cmapfilesize);
-	if (r<0) {
+	r = gids_read_cached_DO(card, fileIdentifier, dataObjectIdentifier, 1, data->cmapfile, &data->cmapfilesize);
+	if (r < 0) {
 		data->cmapfilesize = sizeof(data->cmapfile);
+		r = gids_get_DO(card, fileIdentifier, dataObjectIdentifier, data->cmapfile, &data->cmapfilesize);
+		if (r<0) {
+			data->cmapfilesize = sizeof(data->cmapfile);
+		} else {
+			gids_write_cached_DO(card, fileIdentifier, dataObjectIdentifier, data->cmapfile, data->cmapfilesize);
+		}
 	}
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to get the cmapfile");
 	return r;
@@ -601,6 +763,12 @@ static int gids_get_serialnr(sc_card_t * card, sc_serial_number_t * serial)
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 
+	if (card->serialnr.len) {
+		if (serial)
+			memcpy(serial, &card->serialnr, sizeof(*serial));
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_SUCCESS);
+	}
+
 	buffersize = sizeof(buffer);
 	r = gids_read_gidsfile(card, "", "cardid", buffer, &buffersize);
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "unable to read cardid");
@@ -636,8 +804,7 @@ static int gids_init(sc_card_t * card)
 	memset(data, 0, sizeof(struct gids_private_data));
 	card->drv_data = data;
 	// invalidate the master file and cmap file cache
-	data->cmapfilesize = sizeof(data->cmapfile);
-	data->masterfilesize = sizeof(data->masterfile);
+	gids_invalidate_cache(card);
 
 	/* supported RSA keys and how padding is done */
 	flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE | SC_ALGORITHM_ONBOARD_KEY_GEN | SC_ALGORITHM_RSA_RAW;
@@ -659,6 +826,17 @@ static int gids_finish(sc_card_t *card)
 	return 0;
 }
 
+// another application may have changed the card while we didn't hold the lock
+static int gids_card_reader_lock_obtained(sc_card_t *card, int was_reset)
+{
+	struct gids_private_data *data = (struct gids_private_data *) card->drv_data;
+
+	if (data) {
+		data->cardcfchecked = 0;
+	}
+	return SC_SUCCESS;
+}
+
 //see 12.5.3.1 Cryptographic Mechanism Identifier for Key with CRT
 // the cmap file is used to detect the key algorithm / size
 static int gids_get_crypto_identifier_from_key_ref(sc_card_t *card, const unsigned char keyref, unsigned char *cryptoidentifier) {
@@ -990,8 +1168,15 @@ static int gids_read_binary(sc_card_t *card, unsigned int offset,
 		// this function is called to read the certificate only
 		u8 buffer[SC_MAX_EXT_APDU_BUFFER_SIZE];
 		size_t buffersize = sizeof(buffer);
-		r = gids_get_DO(card, data->currentEFID, data->currentDO, buffer, &(buffersize));
-		if (r <0) return r;
+		r = gids_check_cardcf(card);
+		LOG_TEST_RET(card->ctx, r, "unable to check the cardcf");
+		r = gids_read_cached_DO(card, data->currentEFID, data->currentDO, 0, buffer, &(buffersize));
+		if (r < 0) {
+			buffersize = sizeof(buffer);
+			r = gids_get_DO(card, data->currentEFID, data->currentDO, buffer, &(buffersize));
+			if (r <0) return r;
+			gids_write_cached_DO(card, data->currentEFID, data->currentDO, buffer, buffersize);
+		}
 		if (buffersize < 4) {
 			SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_INVALID_DATA);
 		}
@@ -1831,6 +2016,8 @@ static int gids_initialize(sc_card_t *card, sc_cardctl_gids_init_param_t* param)
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids unable to save the cardcf");
 	r = gids_put_DO(card, CMAP_FI, CMAP_DO, NULL, 0);
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids unable to save the cmapfile");
+	// the filesystem has been replaced, forget what we cached about it
+	gids_invalidate_cache(card);
 #ifdef ENABLE_OPENSSL
 	for (i = sizeof(param->cardid) -1; i >= 0; i--) {
 		if (param->cardid[i]) break;
@@ -1844,6 +2031,8 @@ static int gids_initialize(sc_card_t *card, sc_cardctl_gids_init_param_t* param)
 #endif
 	r = gids_put_DO(card, CARDID_FI, CARDID_DO, param->cardid, sizeof(param->cardid));
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "gids unable to save the cardid");
+	// the serial number and the cache file names derive from the cardid
+	card->serialnr.len = 0;
 
 	//select applet
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_3, INS_SELECT, 0x00, 0x0C);
@@ -2088,6 +2277,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	gids_ops.put_data = NULL;
 	gids_ops.delete_record = NULL;
 	gids_ops.read_public_key = gids_read_public_key;
+	gids_ops.card_reader_lock_obtained = gids_card_reader_lock_obtained;
 	return &gids_drv;
 }
 
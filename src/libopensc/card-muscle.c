@@ -142,6 +142,21 @@ static void muscle_parse_acls(const sc_file_t* file, unsigned short* read_perm,
 	*delete_perm =  muscle_parse_singleAcl(sc_file_get_acl_entry(file, SC_AC_OP_DELETE));
 }
 
+/* Record a freshly created object instead of listing all objects again */
+static int muscle_cache_created_object(mscfs_t *fs, msc_id objectId, size_t size,
+		unsigned short read_perm, unsigned short write_perm, unsigned short delete_perm)
+{
+	mscfs_file_t created;
+
+	memset(&created, 0, sizeof(created));
+	created.objectId = objectId;
+	created.size = size;
+	created.read = read_perm;
+	created.write = write_perm;
+	created.delete = delete_perm;
+	return mscfs_cache_add_object(fs, &created);
+}
+
 static int muscle_create_directory(sc_card_t *card, sc_file_t *file)
 {
 	mscfs_t *fs = MUSCLE_FS(card);
@@ -165,9 +180,13 @@ static int muscle_create_directory(sc_card_t *card, sc_file_t *file)
 
 	muscle_parse_acls(file, &read_perm, &write_perm, &delete_perm);
 	r = msc_create_object(card, objectId, objectSize, read_perm, write_perm, delete_perm);
-	mscfs_clear_cache(fs);
-	if(r >= 0) return 0;
-	return r;
+	if(r >= 0)
+		r = muscle_cache_created_object(fs, objectId, objectSize, read_perm, write_perm, delete_perm);
+	if(r < 0) {
+		mscfs_clear_cache(fs);
+		return r;
+	}
+	return 0;
 }
 
 
@@ -189,9 +208,13 @@ static int muscle_create_file(sc_card_t *card, sc_file_t *file)
 
 	mscfs_lookup_local(fs, file->id, &objectId);
 	r = msc_create_object(card, objectId, objectSize, read_perm, write_perm, delete_perm);
-	mscfs_clear_cache(fs);
-	if(r >= 0) return 0;
-	return r;
+	if(r >= 0)
+		r = muscle_cache_created_object(fs, objectId, objectSize, read_perm, write_perm, delete_perm);
+	if(r < 0) {
+		mscfs_clear_cache(fs);
+		return r;
+	}
+	return 0;
 }
 
 static int muscle_read_binary(sc_card_t *card, unsigned int idx, u8* buf, size_t count, unsigned long flags)
@@ -251,6 +274,7 @@ static int muscle_update_binary(sc_card_t *card, unsigned int idx, const u8* buf
 		r = msc_update_object(card, objectId, 0, buffer, newFileSize);
 		if(r < 0) goto update_bin_free_buffer;
 		file->size = newFileSize;
+		file->read = file->write = file->delete = 0;
 update_bin_free_buffer:
 		free(buffer);
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
@@ -278,19 +302,19 @@ static int muscle_delete_mscfs_file(sc_card_t *card, mscfs_file_t *file_data)
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
 			"DELETING Children of: %02X%02X%02X%02X\n",
 			oid[0],oid[1],oid[2],oid[3]);
-		for(x = 0; x < fs->cache.size; x++) {
+		for(x = mscfs_first_in_dir(fs, oid + 2); x >= 0; x = mscfs_next_in_dir(fs, x)) {
 			msc_id objectId;
 			childFile = &fs->cache.array[x];
 			objectId = childFile->objectId;
 
-			if(0 == memcmp(oid + 2, objectId.id, 2)) {
-				sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
-					"DELETING: %02X%02X%02X%02X\n",
-					objectId.id[0],objectId.id[1],
-					objectId.id[2],objectId.id[3]);
-				r = muscle_delete_mscfs_file(card, childFile);
-				if(r < 0) SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE,r);
-			}
+			if(0 == memcmp(objectId.id, oid, 4))
+				continue;
+			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
+				"DELETING: %02X%02X%02X%02X\n",
+				objectId.id[0],objectId.id[1],
+				objectId.id[2],objectId.id[3]);
+			r = muscle_delete_mscfs_file(card, childFile);
+			if(r < 0) SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE,r);
 		}
 		oid[0] = oid[2];
 		oid[1] = oid[3];
@@ -319,13 +343,19 @@ static int muscle_delete_file(sc_card_t *card, const sc_path_t *path_in)
 {
 	mscfs_t *fs = MUSCLE_FS(card);
 	mscfs_file_t *file_data = NULL;
+	msc_id objectId;
 	int r = 0;
 
 	r = mscfs_loadFileInfo(fs, path_in->value, path_in->len, &file_data, NULL);
 	if(r < 0) SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE,r);
+	objectId = file_data->objectId;
 	r = muscle_delete_mscfs_file(card, file_data);
-	mscfs_clear_cache(fs);
-	if(r < 0) SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE,r);
+	if(r < 0) {
+		/* Some objects may be gone already, list them again */
+		mscfs_clear_cache(fs);
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE,r);
+	}
+	mscfs_cache_remove_object(fs, objectId);
 	return 0;
 }
 
@@ -477,7 +507,7 @@ static int muscle_init(sc_card_t *card)
 
 	/* Card type detection */
 	if (_sc_match_atr(card, muscle_atrs, &card->type) < 0)   {
-		free(priv->fs);
+		mscfs_free(priv->fs);
 		free(card->drv_data);
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_NOT_SUPPORTED);
 	}
@@ -516,18 +546,18 @@ static int muscle_list_files(sc_card_t *card, u8 *buf, size_t bufLen)
 
 	mscfs_check_cache(priv->fs);
 
-	for(x = 0; x < fs->cache.size; x++) {
+	for(x = mscfs_first_in_dir(fs, fs->currentPath); x >= 0; x = mscfs_next_in_dir(fs, x)) {
 		u8* oid= fs->cache.array[x].objectId.id;
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
 			"FILE: %02X%02X%02X%02X\n",
 			oid[0],oid[1],oid[2],oid[3]);
-		if(0 == memcmp(fs->currentPath, oid, 2)) {
-			buf[0] = oid[2];
-			buf[1] = oid[3];
-			if(buf[0] == 0x00 && buf[1] == 0x00) continue; /* No directories/null names outside of root */
-			buf += 2;
-			count+=2;
-		}
+		if(oid[2] == 0x00 && oid[3] == 0x00) continue; /* No directories/null names outside of root */
+		if(count + 2 > (int)bufLen)
+			break;
+		buf[0] = oid[2];
+		buf[1] = oid[3];
+		buf += 2;
+		count+=2;
 	}
 	return count;
 }
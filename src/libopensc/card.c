@@ -220,6 +220,8 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 
 	_sc_parse_atr(reader);
 
+	sc_ctx_load_card_drivers(ctx);
+
 	/* See if the ATR matches any ATR specified in the config file */
 	if ((driver = ctx->forced_driver) == NULL) {
 		sc_log(ctx, "matching configured ATRs");
@@ -423,8 +425,12 @@ int sc_lock(sc_card_t *card)
 			if (r == 0)
 				reader_lock_obtained = 1;
 		}
-		if (r == 0)
+		if (r == 0) {
 			card->cache.valid = 1;
+			/* another process may have set up a different security
+			 * environment while the reader was not locked */
+			card->cache.senv_valid = 0;
+		}
 	}
 	if (r == 0)
 		card->lock_count++;
@@ -472,6 +478,9 @@ int sc_unlock(sc_card_t *card)
 		card->cache.valid = 0;
 		sc_log(card->ctx, "cache invalidated");
 #endif
+		/* give card driver a chance to save state others may pick up */
+		if (card->ops->card_reader_lock_released)
+			card->ops->card_reader_lock_released(card);
 		/* release reader lock */
 		if (card->reader->ops->unlock != NULL)
 			r = card->reader->ops->unlock(card->reader);
@@ -552,6 +561,72 @@ int sc_delete_file(sc_card_t *card, const sc_path_t *path)
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+#ifdef ENABLE_SM
+/* Batched READ BINARY (rbuf) or UPDATE BINARY (wbuf) of 'count' bytes in
+ * chunks of 'max' bytes. Only used when the ISO 7816 handlers talk secure
+ * messaging and the card driver enabled SM_FLAGS_PIPELINE.
+ * Returns the number of bytes transferred, the caller does the rest. */
+static int
+sc_binary_pipelined(struct sc_card *card, unsigned int idx,
+		unsigned char *rbuf, const u8 *wbuf, size_t count, size_t max)
+{
+	struct sc_card_driver *iso_drv = sc_get_iso7816_driver();
+	struct sc_apdu *apdus;
+	size_t n, i, chunks = 0, done = 0;
+	int r;
+
+	if (card->sm_ctx.sm_mode != SM_MODE_TRANSMIT
+			|| !(card->sm_ctx.sm_flags & SM_FLAGS_PIPELINE) || !max)
+		return 0;
+	if (rbuf && (card->sm_ctx.ops.read_binary
+				|| card->ops->read_binary != iso_drv->ops->read_binary))
+		return 0;
+	if (wbuf && (card->sm_ctx.ops.update_binary
+				|| card->ops->update_binary != iso_drv->ops->update_binary))
+		return 0;
+
+	/* offsets are limited to 15 bits */
+	for (n = 0; n < count && idx + n <= 0x7FFF; n += max)
+		chunks++;
+	if (chunks < 2)
+		return 0;
+
+	apdus = calloc(chunks, sizeof(struct sc_apdu));
+	if (!apdus)
+		return 0;
+
+	for (i = 0, n = 0; i < chunks; i++, n += max) {
+		unsigned int offs = idx + n;
+		size_t len = count - n > max ? max : count - n;
+
+		if (rbuf) {
+			sc_format_apdu(card, &apdus[i], SC_APDU_CASE_2, 0xB0,
+					(offs >> 8) & 0x7F, offs & 0xFF);
+			apdus[i].le = len;
+			apdus[i].resplen = len;
+			apdus[i].resp = rbuf + n;
+		} else {
+			sc_format_apdu(card, &apdus[i], SC_APDU_CASE_3, 0xD6,
+					(offs >> 8) & 0x7F, offs & 0xFF);
+			apdus[i].lc = len;
+			apdus[i].datalen = len;
+			apdus[i].data = wbuf + n;
+		}
+	}
+
+	r = sc_sm_pipeline_transmit(card, apdus, chunks);
+	for (i = 0; r > 0 && i < (size_t)r; i++)
+		done += rbuf ? apdus[i].resplen : apdus[i].datalen;
+	free(apdus);
+
+	if (r == SC_ERROR_NOT_SUPPORTED)
+		return 0;
+	if (r < 0)
+		return r;
+	return (int)done;
+}
+#endif
+
 int sc_read_binary(sc_card_t *card, unsigned int idx,
 		   unsigned char *buf, size_t count, unsigned long flags)
 {
@@ -582,6 +657,17 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 
 		r = sc_lock(card);
 		LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+#ifdef ENABLE_SM
+		r = sc_binary_pipelined(card, idx, p, NULL, count, max_le);
+		if (r < 0) {
+			sc_unlock(card);
+			LOG_TEST_RET(card->ctx, r, "sc_read_binary() failed");
+		}
+		p += r;
+		idx += r;
+		bytes_read += r;
+		count -= r;
+#endif
 		while (count > 0) {
 			size_t n = count > max_le ? max_le : count;
 			r = sc_read_binary(card, idx, p, n, flags);
@@ -682,6 +768,17 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 
 		r = sc_lock(card);
 		LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+#ifdef ENABLE_SM
+		r = sc_binary_pipelined(card, idx, NULL, p, count, max_lc);
+		if (r < 0) {
+			sc_unlock(card);
+			LOG_TEST_RET(card->ctx, r, "sc_update_binary() failed");
+		}
+		p += r;
+		idx += r;
+		bytes_written += r;
+		count -= r;
+#endif
 		while (count > 0) {
 			size_t n = count > max_lc? max_lc : count;
 			r = sc_update_binary(card, idx, p, n, flags);
@@ -706,6 +803,64 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+/*
+ * Unchanged bytes between two modified ranges are rewritten as long as
+ * there are fewer than this many of them: an extra APDU costs more.
+ */
+#define SC_UPDATE_DIFF_GAP	8
+
+int sc_update_binary_diff(sc_card_t *card, unsigned int idx,
+		const u8 *buf, size_t count, const u8 *old, unsigned long flags)
+{
+	u8 *cur = NULL;
+	size_t start, end, same, written = 0;
+	int r;
+
+	if (card == NULL || buf == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (count == 0)
+		return 0;
+	LOG_FUNC_CALLED(card->ctx);
+
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+
+	if (old == NULL)   {
+		cur = malloc(count);
+		if (cur == NULL)   {
+			sc_unlock(card);
+			LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+		}
+		r = sc_read_binary(card, idx, cur, count, 0);
+		if (r != (int)count)   {
+			sc_log(card->ctx, "cannot read current contents (%i), update all", r);
+			free(cur);
+			r = sc_update_binary(card, idx, buf, count, flags);
+			sc_unlock(card);
+			LOG_FUNC_RETURN(card->ctx, r);
+		}
+		old = cur;
+	}
+
+	for (start = 0, r = 0; r >= 0 && start < count; start = end)   {
+		if (old[start] == buf[start])   {
+			end = start + 1;
+			continue;
+		}
+		for (end = start + 1, same = 0; end < count && same < SC_UPDATE_DIFF_GAP; end++)
+			same = old[end] == buf[end] ? same + 1 : 0;
+		end -= same;
+		r = sc_update_binary(card, idx + start, buf + start, end - start, flags);
+		written += end - start;
+	}
+	sc_log(card->ctx, "%"SC_FORMAT_LEN_SIZE_T"u of %"SC_FORMAT_LEN_SIZE_T"u bytes changed",
+			written, count);
+
+	free(cur);
+	sc_unlock(card);
+	LOG_FUNC_RETURN(card->ctx, r < 0 ? r : (int)count);
+}
+
 
 int sc_erase_binary(struct sc_card *card, unsigned int offs, size_t count,  unsigned long flags)
 {
@@ -766,6 +921,8 @@ int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 	}
 	if (card->ops->select_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	/* the security environment may be bound to the current DF */
+	card->cache.senv_valid = 0;
 	r = card->ops->select_file(card, in_path, file);
 	LOG_TEST_RET(card->ctx, r, "'SELECT' error");
 
@@ -1134,6 +1291,7 @@ scconf_block *_sc_match_atr_block(sc_context_t *ctx, struct sc_card_driver *driv
 	} else {
 		unsigned int i;
 
+		sc_ctx_load_card_drivers(ctx);
 		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
 			drv = ctx->card_drivers[i];
 			table = drv->atr_map;
@@ -29,11 +29,18 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <limits.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #ifdef _WIN32
 #include <windows.h>
 #include <winreg.h>
 #include <direct.h>
+#include <io.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
 #endif
 
 #include "common/libscdl.h"
@@ -256,7 +263,7 @@ static void add_internal_drvs(struct _sc_ctx_options *opts)
 	}
 }
 
-static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
+static void set_defaults(sc_context_t *ctx)
 {
 	ctx->debug = 0;
 	if (ctx->debug_file && (ctx->debug_file != stderr && ctx->debug_file != stdout))
@@ -271,7 +278,6 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
 		ctx->debug_file = fopen("/tmp/opensc-tokend.log", "a");
 #endif
 	ctx->forced_driver = NULL;
-	add_internal_drvs(opts);
 }
 
 /* In Windows, file handles can not be shared between DLL-s,
@@ -312,11 +318,10 @@ int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 
 
 static int
-load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *opts)
+load_parameters(sc_context_t *ctx, scconf_block *block)
 {
 	int err = 0;
-	const scconf_list *list;
-	const char *val, *s_internal = "internal";
+	const char *val;
 	int debug;
 #ifdef _WIN32
 	char expanded_val[PATH_MAX];
@@ -359,6 +364,15 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 				ctx->flags & SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER))
 		ctx->flags |= SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER;
 
+	return err;
+}
+
+static void
+load_driver_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *opts)
+{
+	const scconf_list *list;
+	const char *val, *s_internal = "internal";
+
 	val = scconf_get_str(block, "force_card_driver", NULL);
 	if (val) {
 		if (opts->forced_card_driver)
@@ -376,8 +390,6 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 			add_drv(opts, list->data);
 		list = list->next;
 	}
-
-	return err;
 }
 
 
@@ -617,15 +629,142 @@ static int load_card_atrs(sc_context_t *ctx)
 	return SC_SUCCESS;
 }
 
-static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
+static scconf_context *parse_config_file(sc_context_t *ctx, const char *conf_path)
 {
-	int i, r, count = 0;
+	scconf_context *conf;
+	int r;
+
+	conf = scconf_new(conf_path);
+	if (conf == NULL)
+		return NULL;
+	r = scconf_parse(conf);
+#ifdef OPENSC_CONFIG_STRING
+	/* Parse the string if config file didn't exist */
+	if (r < 0)
+		r = scconf_parse_string(conf, OPENSC_CONFIG_STRING);
+#endif
+	if (r < 1) {
+		/* A negative return value means the config file isn't
+		 * there, which is not an error. Nevertheless log this
+		 * fact. */
+		if (r < 0)
+			sc_log(ctx, "scconf_parse failed: %s", conf->errmsg);
+		else
+			sc_log(ctx, "scconf_parse failed: %s", conf->errmsg);
+		scconf_free(conf);
+		return NULL;
+	}
+	return conf;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * The contexts of a process share one parsed configuration file, as long
+ * as the file doesn't change. The snapshot is read-only: a context must
+ * not modify ctx->conf unless it is the only one in the process.
+ * The latest snapshot of a file is kept when its last user goes away,
+ * so that a new context doesn't have to parse the file again.
+ */
+struct shared_conf {
+	struct shared_conf *next;
+	char *path;
+	time_t mtime;
+	off_t size;
+	int current;
+	unsigned int refs;
+	scconf_context *conf;
+};
+
+static pthread_mutex_t shared_conf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shared_conf *shared_confs = NULL;
+
+static void free_shared_conf(struct shared_conf *sc)
+{
+	struct shared_conf **p;
+
+	for (p = &shared_confs; *p != sc; p = &(*p)->next)
+		;
+	*p = sc->next;
+	scconf_free(sc->conf);
+	free(sc->path);
+	free(sc);
+}
+
+static scconf_context *get_config_file(sc_context_t *ctx, const char *conf_path)
+{
+	struct shared_conf *sc;
+	struct stat st;
+
+	if (stat(conf_path, &st) != 0)
+		return parse_config_file(ctx, conf_path);
+
+	pthread_mutex_lock(&shared_conf_lock);
+	for (sc = shared_confs; sc; sc = sc->next)
+		if (sc->current && !strcmp(sc->path, conf_path))
+			break;
+	if (sc && (sc->mtime != st.st_mtime || sc->size != st.st_size)) {
+		sc->current = 0;
+		if (sc->refs == 0)
+			free_shared_conf(sc);
+		sc = NULL;
+	}
+	if (sc == NULL) {
+		sc = calloc(1, sizeof(*sc));
+		if (sc != NULL) {
+			sc->path = strdup(conf_path);
+			sc->conf = parse_config_file(ctx, conf_path);
+		}
+		if (sc == NULL || sc->path == NULL || sc->conf == NULL) {
+			if (sc != NULL) {
+				free(sc->path);
+				free(sc);
+			}
+			pthread_mutex_unlock(&shared_conf_lock);
+			return NULL;
+		}
+		sc->mtime = st.st_mtime;
+		sc->size = st.st_size;
+		sc->current = 1;
+		sc->next = shared_confs;
+		shared_confs = sc;
+	}
+	else {
+		sc_log(ctx, "using the configuration file parsed by another context");
+	}
+	sc->refs++;
+	pthread_mutex_unlock(&shared_conf_lock);
+	return sc->conf;
+}
+
+static void put_config_file(scconf_context *conf)
+{
+	struct shared_conf *sc;
+
+	pthread_mutex_lock(&shared_conf_lock);
+	for (sc = shared_confs; sc; sc = sc->next)
+		if (sc->conf == conf)
+			break;
+	if (sc == NULL)
+		scconf_free(conf);
+	else if (--sc->refs == 0 && !sc->current)
+		free_shared_conf(sc);
+	pthread_mutex_unlock(&shared_conf_lock);
+}
+#else
+#define get_config_file(ctx, conf_path)	parse_config_file(ctx, conf_path)
+#define put_config_file(conf)		scconf_free(conf)
+#endif
+
+static void process_config_file(sc_context_t *ctx)
+{
+	int i, count = 0;
 	scconf_block **blocks;
 	const char *conf_path = NULL;
 	const char *debug = NULL;
 #ifdef _WIN32
 	char temp_path[PATH_MAX];
 	size_t temp_len;
+	int r;
 #endif
 
 	/* Takes effect even when no config around */
@@ -648,27 +787,9 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	if (!conf_path)
 		conf_path = OPENSC_CONF_PATH;
 #endif
-	ctx->conf = scconf_new(conf_path);
+	ctx->conf = get_config_file(ctx, conf_path);
 	if (ctx->conf == NULL)
 		return;
-	r = scconf_parse(ctx->conf);
-#ifdef OPENSC_CONFIG_STRING
-	/* Parse the string if config file didn't exist */
-	if (r < 0)
-		r = scconf_parse_string(ctx->conf, OPENSC_CONFIG_STRING);
-#endif
-	if (r < 1) {
-		/* A negative return value means the config file isn't
-		 * there, which is not an error. Nevertheless log this
-		 * fact. */
-		if (r < 0)
-			sc_log(ctx, "scconf_parse failed: %s", ctx->conf->errmsg);
-		else
-			sc_log(ctx, "scconf_parse failed: %s", ctx->conf->errmsg);
-		scconf_free(ctx->conf);
-		ctx->conf = NULL;
-		return;
-	}
 	blocks = scconf_find_blocks(ctx->conf, NULL, "app", ctx->app_name);
 	if (blocks && blocks[0])
 		ctx->conf_blocks[count++] = blocks[0];
@@ -682,7 +803,91 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	/* Above we add 2 blocks at most, but conf_blocks has 3 elements,
 	 * so at least one is NULL */
 	for (i = 0; ctx->conf_blocks[i]; i++)
-		load_parameters(ctx, ctx->conf_blocks[i], opts);
+		load_parameters(ctx, ctx->conf_blocks[i]);
+}
+
+/* Card drivers are only instantiated when they are first needed, i.e.
+ * when a card is connected or a caller looks at ctx->card_drivers.
+ * Tools that never touch a card do not pay for the driver table and the
+ * card_atr processing. */
+int sc_ctx_load_card_drivers(sc_context_t *ctx)
+{
+	struct _sc_ctx_options opts;
+	int i;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (ctx->card_drivers_loaded)
+		return SC_SUCCESS;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	if (ctx->card_drivers_loaded) {
+		sc_mutex_unlock(ctx, ctx->mutex);
+		return SC_SUCCESS;
+	}
+
+	memset(&opts, 0, sizeof(opts));
+	add_internal_drvs(&opts);
+	for (i = 0; ctx->conf_blocks[i]; i++)
+		load_driver_parameters(ctx, ctx->conf_blocks[i], &opts);
+
+	load_card_drivers(ctx, &opts);
+	load_card_atrs(ctx);
+
+	if (!opts.forced_card_driver) {
+		char *driver = getenv("OPENSC_DRIVER");
+		if(driver) {
+			opts.forced_card_driver = strdup(driver);
+		}
+	}
+	if (opts.forced_card_driver) {
+		/* sc_set_card_driver() would take the mutex again */
+		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+			if (strcmp(opts.forced_card_driver, ctx->card_drivers[i]->short_name) == 0) {
+				ctx->forced_driver = ctx->card_drivers[i];
+				break;
+			}
+		}
+		if (ctx->card_drivers[i] == NULL)
+			sc_log(ctx, "Warning: Could not load %s.", opts.forced_card_driver);
+		free(opts.forced_card_driver);
+	}
+	del_drvs(&opts);
+	ctx->card_drivers_loaded = 1;
+
+	sc_mutex_unlock(ctx, ctx->mutex);
+	return SC_SUCCESS;
+}
+
+/* The reader driver (and with it PC/SC) is initialised on the first
+ * access to the reader list instead of in sc_context_create(). */
+static int init_reader_driver(sc_context_t *ctx)
+{
+	const struct sc_reader_driver *drv = ctx->reader_driver;
+	int r;
+
+	if (ctx->reader_driver_state != 0)
+		return ctx->reader_driver_state > 0 ? SC_SUCCESS : ctx->reader_driver_state;
+
+	/* Reader drivers look up card_atr blocks while detecting readers */
+	sc_ctx_load_card_drivers(ctx);
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	if (ctx->reader_driver_state == 0) {
+		r = drv->ops->init(ctx);
+		if (r == SC_SUCCESS) {
+			ctx->reader_driver_state = 1;
+			if (drv->ops->detect_readers != NULL)
+				drv->ops->detect_readers(ctx);
+		} else {
+			sc_log(ctx, "Reader driver '%s' failed to initialise: %s",
+					drv->short_name, sc_strerror(r));
+			ctx->reader_driver_state = r;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	return ctx->reader_driver_state > 0 ? SC_SUCCESS : ctx->reader_driver_state;
 }
 
 int sc_ctx_detect_readers(sc_context_t *ctx)
@@ -690,6 +895,11 @@ int sc_ctx_detect_readers(sc_context_t *ctx)
 	int r = 0;
 	const struct sc_reader_driver *drv = ctx->reader_driver;
 
+	if (ctx->reader_driver_state == 0)
+		return init_reader_driver(ctx);
+	if (ctx->reader_driver_state < 0)
+		return ctx->reader_driver_state;
+
 	sc_mutex_lock(ctx, ctx->mutex);
 
 	if (drv->ops->detect_readers != NULL)
@@ -702,21 +912,25 @@ int sc_ctx_detect_readers(sc_context_t *ctx)
 
 sc_reader_t *sc_ctx_get_reader(sc_context_t *ctx, unsigned int i)
 {
+	init_reader_driver(ctx);
 	return list_get_at(&ctx->readers, i);
 }
 
 sc_reader_t *sc_ctx_get_reader_by_id(sc_context_t *ctx, unsigned int id)
 {
+	init_reader_driver(ctx);
 	return list_get_at(&ctx->readers, id);
 }
 
 sc_reader_t *sc_ctx_get_reader_by_name(sc_context_t *ctx, const char * name)
 {
+	init_reader_driver(ctx);
 	return list_seek(&ctx->readers, name);
 }
 
 unsigned int sc_ctx_get_reader_count(sc_context_t *ctx)
 {
+	init_reader_driver(ctx);
 	return list_size(&ctx->readers);
 }
 
@@ -739,9 +953,11 @@ int sc_context_repair(sc_context_t **ctx_out)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	/* The only thing that should be shared across different contexts are the
-	 * card drivers - so rebuild the ATR's
+	 * card drivers - so rebuild the ATR's. If the drivers are not loaded yet,
+	 * the ATR's are built together with them on first use.
 	 */
-	load_card_atrs(*ctx_out);
+	if ((*ctx_out)->card_drivers_loaded)
+		load_card_atrs(*ctx_out);
 
 	/* TODO: May need to re-open any card driver DLL's */
 
@@ -751,7 +967,6 @@ int sc_context_repair(sc_context_t **ctx_out)
 int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 {
 	sc_context_t		*ctx;
-	struct _sc_ctx_options	opts;
 	int			r;
 
 	if (ctx_out == NULL || parm == NULL)
@@ -760,7 +975,6 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	ctx = calloc(1, sizeof(sc_context_t));
 	if (ctx == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
-	memset(&opts, 0, sizeof(opts));
 
 	/* set the application name if set in the parameter options */
 	if (parm->app_name != NULL)
@@ -773,11 +987,12 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	}
 
 	ctx->flags = parm->flags;
-	set_defaults(ctx, &opts);
+	set_defaults(ctx);
 
 	if (0 != list_init(&ctx->readers)) {
 		return SC_ERROR_OUT_OF_MEMORY;
 	}
+	list_attributes_vector(&ctx->readers, 1);
 	list_attributes_seeker(&ctx->readers, reader_list_seeker);
 	/* set thread context and create mutex object (if specified) */
 	if (parm->thread_ctx != NULL)
@@ -788,7 +1003,7 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 		return r;
 	}
 
-	process_config_file(ctx, &opts);
+	process_config_file(ctx);
 	sc_log(ctx, "==================================="); /* first thing in the log */
 	sc_log(ctx, "opensc version: %s", sc_get_version());
 
@@ -802,28 +1017,8 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	ctx->reader_driver = sc_get_openct_driver();
 #endif
 
-	r = ctx->reader_driver->ops->init(ctx);
-	if (r != SC_SUCCESS)   {
-		sc_release_context(ctx);
-		return r;
-	}
-
-	load_card_drivers(ctx, &opts);
-	load_card_atrs(ctx);
-
-	if (!opts.forced_card_driver) {
-		char *driver = getenv("OPENSC_DRIVER");
-		if(driver) {
-			opts.forced_card_driver = strdup(driver);
-		}
-	}
-	if (opts.forced_card_driver) {
-		if (SC_SUCCESS != sc_set_card_driver(ctx, opts.forced_card_driver))
-			sc_log(ctx, "Warning: Could not load %s.", opts.forced_card_driver);
-		free(opts.forced_card_driver);
-	}
-	del_drvs(&opts);
-	sc_ctx_detect_readers(ctx);
+	/* Card drivers and the reader driver are initialised on first use,
+	 * see sc_ctx_load_card_drivers() and init_reader_driver() */
 	*ctx_out = ctx;
 
 	return SC_SUCCESS;
@@ -833,6 +1028,7 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 int sc_ctx_use_reader(sc_context_t *ctx, void *pcsc_context_handle, void *pcsc_card_handle)
 {
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
+	init_reader_driver(ctx);
 	if (ctx->reader_driver->ops->use_reader != NULL)
 		return ctx->reader_driver->ops->use_reader(ctx, pcsc_context_handle, pcsc_card_handle);
 
@@ -843,6 +1039,9 @@ int sc_ctx_use_reader(sc_context_t *ctx, void *pcsc_context_handle, void *pcsc_c
 int sc_cancel(sc_context_t *ctx)
 {
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
+	/* Nobody can be waiting on a reader driver that was never initialised */
+	if (ctx->reader_driver_state <= 0)
+		return SC_SUCCESS;
 	if (ctx->reader_driver->ops->cancel != NULL)
 		return ctx->reader_driver->ops->cancel(ctx);
 
@@ -852,7 +1051,12 @@ int sc_cancel(sc_context_t *ctx)
 
 int sc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_reader_t **event_reader, unsigned int *event, int timeout, void **reader_states)
 {
+	int r;
+
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
+	r = init_reader_driver(ctx);
+	if (r != SC_SUCCESS)
+		return r;
 	if (ctx->reader_driver->ops->wait_for_event != NULL)
 		return ctx->reader_driver->ops->wait_for_event(ctx, event_mask, event_reader, event, timeout, reader_states);
 
@@ -873,7 +1077,7 @@ int sc_release_context(sc_context_t *ctx)
 		_sc_delete_reader(ctx, rdr);
 	}
 
-	if (ctx->reader_driver->ops->finish != NULL)
+	if (ctx->reader_driver_state > 0 && ctx->reader_driver->ops->finish != NULL)
 		ctx->reader_driver->ops->finish(ctx);
 
 	for (i = 0; ctx->card_drivers[i]; i++) {
@@ -894,7 +1098,7 @@ int sc_release_context(sc_context_t *ctx)
 		}
 	}
 	if (ctx->conf != NULL)
-		scconf_free(ctx->conf);
+		put_config_file(ctx->conf);
 	if (ctx->debug_file && (ctx->debug_file != stdout && ctx->debug_file != stderr))
 		fclose(ctx->debug_file);
 	if (ctx->debug_filename != NULL)
@@ -911,6 +1115,7 @@ int sc_set_card_driver(sc_context_t *ctx, const char *short_name)
 {
 	int i = 0, match = 0;
 
+	sc_ctx_load_card_drivers(ctx);
 	sc_mutex_lock(ctx, ctx->mutex);
 	if (short_name == NULL) {
 		ctx->forced_driver = NULL;
@@ -1015,3 +1220,103 @@ failed:
 	sc_log(ctx, "failed to create cache directory");
 	return SC_ERROR_INTERNAL;
 }
+
+int _sc_use_file_cache(sc_context_t *ctx)
+{
+	scconf_block *conf_block;
+
+	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
+	return scconf_get_bool(conf_block, "use_file_caching", 0);
+}
+
+static int generate_driver_cache_filename(sc_context_t *ctx, const char *name,
+		char *buf, size_t bufsize)
+{
+	int r;
+
+	r = sc_get_cache_dir(ctx, buf, bufsize);
+	if (r != SC_SUCCESS)
+		return r;
+	if (strlen(buf) + strlen(name) + 2 > bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	strcat(buf, "/");
+	strcat(buf, name);
+	return SC_SUCCESS;
+}
+
+int _sc_read_cache_file(sc_context_t *ctx, const char *name, u8 **buf, size_t *buflen)
+{
+	char fname[PATH_MAX];
+	struct stat stbuf;
+	FILE *f;
+	u8 *data;
+	int r;
+
+	if (name == NULL || buf == NULL || buflen == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	r = generate_driver_cache_filename(ctx, name, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
+		return r;
+
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fstat(fileno(f), &stbuf) || stbuf.st_size <= 0) {
+		fclose(f);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+
+	data = malloc((size_t)stbuf.st_size);
+	if (data == NULL) {
+		fclose(f);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (fread(data, 1, (size_t)stbuf.st_size, f) != (size_t)stbuf.st_size) {
+		free(data);
+		fclose(f);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	fclose(f);
+
+	sc_log(ctx, "read cached file %s", fname);
+	*buf = data;
+	*buflen = (size_t)stbuf.st_size;
+	return SC_SUCCESS;
+}
+
+int _sc_write_cache_file(sc_context_t *ctx, const char *name, const u8 *buf, size_t buflen)
+{
+	char fname[PATH_MAX];
+	FILE *f;
+	size_t c;
+	int r;
+
+	if (name == NULL || buf == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	r = generate_driver_cache_filename(ctx, name, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
+		return r;
+
+	f = fopen(fname, "wb");
+	/* If the open failed because the cache directory does
+	 * not exist, create it and a re-try the fopen() call.
+	 */
+	if (f == NULL && errno == ENOENT) {
+		if ((r = sc_make_cache_dir(ctx)) < 0)
+			return r;
+		f = fopen(fname, "wb");
+	}
+	if (f == NULL)
+		return SC_SUCCESS;
+
+	c = fwrite(buf, 1, buflen, f);
+	fclose(f);
+	if (c != buflen) {
+		sc_log(ctx, "fwrite() wrote only %"SC_FORMAT_LEN_SIZE_T"u bytes", c);
+		unlink(fname);
+		return SC_ERROR_INTERNAL;
+	}
+	return SC_SUCCESS;
+}
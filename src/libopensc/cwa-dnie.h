@@ -50,6 +50,11 @@ struct cwa_provider_st;
      u8 *cache;      /**< Cache buffer for read_binary() operation */
      size_t cachelen;    /**< length of cache buffer */
      struct cwa_provider_st *cwa_provider;
+     int sm_reuse;       /**< share the secure channel with other processes */
+     int sm_lifetime;    /**< seconds a stored session stays valid unused */
+     int sm_checked;     /**< stored session already looked up */
+     int sm_dirty;       /**< SSC moved on since the session was stored */
+     char sm_session[64];    /**< file name of the stored session */
 #ifdef ENABLE_DNIE_UI
 	 struct ui_context ui_ctx;
 #endif
@@ -29,9 +29,20 @@
 
 #if defined(ENABLE_OPENSSL) && defined(ENABLE_SM)	/* empty file without openssl or sm */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#endif
 
 #include "opensc.h"
 #include "cardctl.h"
@@ -1354,6 +1365,161 @@ int cwa_create_secure_channel(sc_card_t * card,
 	LOG_FUNC_RETURN(ctx, res);
 }
 
+/******************* SM session persistence ******************************/
+
+#define CWA_SESSION_MAGIC "CWA1"
+#define CWA_SESSION_SIZE  (4 + 16 + 16 + 8)
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+static int cwa_session_filename(sc_card_t * card, const char *name,
+				char *buf, size_t bufsize)
+{
+	int res = sc_get_cache_dir(card->ctx, buf, bufsize);
+	if (res != SC_SUCCESS)
+		return res;
+	if (strlen(buf) + strlen(name) + 2 > bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	strcat(buf, "/");
+	strcat(buf, name);
+	return SC_SUCCESS;
+}
+
+int cwa_store_session(sc_card_t * card, const char *name)
+{
+#ifdef _WIN32
+	return SC_ERROR_NOT_SUPPORTED;
+#else
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 8];
+	u8 data[CWA_SESSION_SIZE];
+	struct sm_cwa_session *sm;
+	ssize_t written;
+	int fd;
+	int res;
+
+	if (!card || !card->ctx || !name)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(card->ctx);
+	if (card->sm_ctx.sm_mode != SM_MODE_TRANSMIT)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_SM_NOT_INITIALIZED);
+	res = cwa_session_filename(card, name, path, sizeof(path));
+	LOG_TEST_RET(card->ctx, res, "Cannot compose session file name");
+
+	sm = &card->sm_ctx.info.session.cwa;
+	memcpy(data, CWA_SESSION_MAGIC, 4);
+	memcpy(data + 4, sm->session_enc, 16);
+	memcpy(data + 20, sm->session_mac, 16);
+	memcpy(data + 36, sm->ssc, 8);
+
+	/* session keys: readable by the owner only (mkstemp() uses mode
+	 * 0600). The file is written aside and renamed over the old one, so
+	 * that other processes never see it empty or half-written */
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0 && errno == ENOENT) {
+		res = sc_make_cache_dir(card->ctx);
+		if (res == SC_SUCCESS) {
+			snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+			fd = mkstemp(tmp);
+		}
+	}
+	if (fd < 0) {
+		sc_mem_clear(data, sizeof(data));
+		LOG_TEST_RET(card->ctx, SC_ERROR_INTERNAL, "Cannot create session file");
+	}
+	res = SC_SUCCESS;
+	if (fchmod(fd, S_IRUSR | S_IWUSR) != 0)
+		res = SC_ERROR_INTERNAL;
+	if (res == SC_SUCCESS) {
+		written = write(fd, data, sizeof(data));
+		if (written != (ssize_t) sizeof(data))
+			res = SC_ERROR_INTERNAL;
+	}
+	if (close(fd) != 0)
+		res = SC_ERROR_INTERNAL;
+	sc_mem_clear(data, sizeof(data));
+	if (res == SC_SUCCESS && rename(tmp, path) != 0)
+		res = SC_ERROR_INTERNAL;
+	if (res != SC_SUCCESS)
+		unlink(tmp);
+	LOG_FUNC_RETURN(card->ctx, res);
+#endif
+}
+
+int cwa_load_session(sc_card_t * card, const char *name, int max_age)
+{
+#ifdef _WIN32
+	return SC_ERROR_NOT_SUPPORTED;
+#else
+	char path[PATH_MAX];
+	u8 data[CWA_SESSION_SIZE];
+	struct sm_cwa_session *sm;
+	struct stat st;
+	ssize_t got;
+	int fd;
+	int res;
+
+	if (!card || !card->ctx || !name)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(card->ctx);
+	res = cwa_session_filename(card, name, path, sizeof(path));
+	LOG_TEST_RET(card->ctx, res, "Cannot compose session file name");
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_FILE_NOT_FOUND);
+	/* refuse session files that someone else could have read or planted */
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+	    || st.st_uid != geteuid() || (st.st_mode & (S_IRWXG | S_IRWXO))) {
+		close(fd);
+		sc_log(card->ctx, "Ignoring session file with wrong owner or mode");
+		unlink(path);
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_FILE_NOT_FOUND);
+	}
+	if (max_age > 0 && time(NULL) - st.st_mtime > max_age) {
+		close(fd);
+		sc_log(card->ctx, "Stored SM session expired");
+		unlink(path);
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_FILE_NOT_FOUND);
+	}
+	got = read(fd, data, sizeof(data));
+	close(fd);
+	if (got != (ssize_t) sizeof(data) || memcmp(data, CWA_SESSION_MAGIC, 4)) {
+		/* not ours to remove: the next store replaces it */
+		sc_mem_clear(data, sizeof(data));
+		sc_log(card->ctx, "Ignoring malformed session file");
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_FILE_NOT_FOUND);
+	}
+
+	sm = &card->sm_ctx.info.session.cwa;
+	memcpy(sm->session_enc, data + 4, 16);
+	memcpy(sm->session_mac, data + 20, 16);
+	memcpy(sm->ssc, data + 36, 8);
+	sc_mem_clear(data, sizeof(data));
+	card->sm_ctx.sm_mode = SM_MODE_TRANSMIT;
+	sc_log(card->ctx, "Loaded SM session; SSC: %s", sc_dump_hex(sm->ssc, 8));
+	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+#endif
+}
+
+int cwa_remove_session(sc_card_t * card, const char *name)
+{
+	char path[PATH_MAX];
+	int res;
+
+	if (!card || !card->ctx || !name)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	res = cwa_session_filename(card, name, path, sizeof(path));
+	if (res != SC_SUCCESS)
+		return res;
+	if (unlink(path) != 0 && errno != ENOENT)
+		return SC_ERROR_INTERNAL;
+	return SC_SUCCESS;
+}
+
 /******************* SM internal APDU encoding / decoding functions ******/
 
 /**
@@ -260,6 +260,46 @@ typedef struct cwa_provider_st {
 extern int cwa_create_secure_channel(sc_card_t * card,
 				     cwa_provider_t * provider, int flag);
 
+/**
+ * Store the current SM session (keys and SSC) in the file cache.
+ *
+ * The file is created readable by the owner only, so another process
+ * of the same user can resume the channel with cwa_load_session()
+ * instead of negotiating a new one. The SSC changes with every SM
+ * APDU, so callers have to store the session again before another
+ * process may use the card, i.e. before releasing the reader lock.
+ * The file is replaced atomically, readers never see a partial one.
+ *
+ * @param card card info structure
+ * @param name file name inside the cache directory
+ * @return SC_SUCCESS if ok; else error code
+ */
+extern int cwa_store_session(sc_card_t * card, const char *name);
+
+/**
+ * Resume a SM session stored by cwa_store_session().
+ *
+ * On success SM mode is set to transmit. Nothing is sent to the card:
+ * whether the card still knows the session shows with the next APDU.
+ * A session not stored again within \a max_age seconds is removed.
+ *
+ * @param card card info structure
+ * @param name file name inside the cache directory
+ * @param max_age lifetime of an unused session in seconds, 0 for no limit
+ * @return SC_SUCCESS if ok; SC_ERROR_FILE_NOT_FOUND if there is no
+ * usable session; else error code
+ */
+extern int cwa_load_session(sc_card_t * card, const char *name, int max_age);
+
+/**
+ * Forget a stored SM session.
+ *
+ * @param card card info structure
+ * @param name file name inside the cache directory
+ * @return SC_SUCCESS if ok; else error code
+ */
+extern int cwa_remove_session(sc_card_t * card, const char *name);
+
 /**
  * Decode an APDU response.
  *
@@ -333,7 +333,7 @@ static int update_transparent(sc_card_t *card, sc_file_t *file)
 		memset(buf + buf_size, 0, file->size - buf_size);
 		buf_size = file->size;
 	}
-	r = sc_update_binary(card, 0, buf, buf_size, 0);
+	r = sc_update_binary_diff(card, 0, buf, buf_size, NULL, 0);
 	free(buf);
 	LOG_TEST_RET(card->ctx, r, "Unable to update EF(DIR)");
 
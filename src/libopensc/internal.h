@@ -118,6 +118,14 @@ unsigned short bebytes2ushort(const u8 *buf);
  */
 unsigned short lebytes2ushort(const u8 *buf);
 
+/* Driver level file cache, kept in the same directory as the PKCS#15
+ * file cache and enabled by the same "use_file_caching" option.
+ * Names are plain file names inside the cache directory; it's up to
+ * the driver to make them unique per card (e.g. by including a serial). */
+int _sc_use_file_cache(sc_context_t *ctx);
+int _sc_read_cache_file(sc_context_t *ctx, const char *name, u8 **buf, size_t *buflen);
+int _sc_write_cache_file(sc_context_t *ctx, const char *name, const u8 *buf, size_t buflen);
+
 /* Returns an scconf_block entry with matching ATR/ATRmask to the ATR specified,
  * NULL otherwise. Additionally, if card driver is not specified, search through
  * all card drivers user configured ATRs. */
@@ -244,6 +252,12 @@ int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
  */
 int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 		size_t len);
+/**
+ * Sets the short or extended APDU case if a generic SC_APDU_CASE_? is used
+ * @param  card    sc_card_t object
+ * @param  apdu    the apdu to update
+ */
+void sc_detect_apdu_cse(const sc_card_t *card, sc_apdu_t *apdu);
 /**
  * Logs APDU
  * @param  ctx          sc_context_t object
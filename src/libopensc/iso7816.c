@@ -1253,7 +1253,8 @@ static struct sc_card_operations iso_ops = {
 	NULL,			/* put_data */
 	NULL,			/* delete_record */
 	NULL,			/* read_public_key */
-	NULL			/* card_reader_lock_obtained */
+	NULL,			/* card_reader_lock_obtained */
+	NULL			/* card_reader_lock_released */
 };
 
 static struct sc_card_driver iso_driver = {
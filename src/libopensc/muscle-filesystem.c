@@ -42,27 +42,64 @@ static const u8* ignoredFiles[] = {
 	NULL
 };
 
+static unsigned int mscfs_id_hash(const u8 *id)
+{
+	return ((id[0] << 24 | id[1] << 16 | id[2] << 8 | id[3]) * 2654435761U) >> 26;
+}
+
+static unsigned int mscfs_dir_hash(const u8 *dir)
+{
+	return ((dir[0] << 8 | dir[1]) * 2654435761U) >> 26;
+}
+
+static void mscfs_index_file(mscfs_cache_t *cache, int x)
+{
+	mscfs_file_t *file = &cache->array[x];
+	unsigned int h;
+
+	h = mscfs_id_hash(file->objectId.id);
+	file->idNext = cache->idHash[h];
+	cache->idHash[h] = x;
+	h = mscfs_dir_hash(file->objectId.id);
+	file->dirNext = cache->dirHash[h];
+	cache->dirHash[h] = x;
+}
+
+static void mscfs_rebuild_index(mscfs_cache_t *cache)
+{
+	int x;
+	for(x = 0; x < MSCFS_HASH_SIZE; x++) {
+		cache->idHash[x] = -1;
+		cache->dirHash[x] = -1;
+	}
+	for(x = 0; x < cache->size; x++)
+		mscfs_index_file(cache, x);
+}
+
 mscfs_t *mscfs_new(void) {
 	mscfs_t *fs = malloc(sizeof(mscfs_t));
 	if (!fs)
 		return NULL;
 	memset(fs, 0, sizeof(mscfs_t));
 	memcpy(fs->currentPath, "\x3F\x00", 2);
+	mscfs_clear_cache(fs);
 	return fs;
 }
 
 void mscfs_free(mscfs_t *fs) {
+	if(!fs)
+		return;
 	mscfs_clear_cache(fs);
+	free(fs);
 }
 
 void mscfs_clear_cache(mscfs_t* fs) {
-	if(!fs->cache.array) {
-		return;
-	}
 	free(fs->cache.array);
 	fs->cache.array = NULL;
 	fs->cache.totalSize = 0;
 	fs->cache.size = 0;
+	fs->cache.valid = 0;
+	mscfs_rebuild_index(&fs->cache);
 }
 
 static int mscfs_is_ignored(mscfs_t* fs, msc_id objectId)
@@ -77,23 +114,36 @@ static int mscfs_is_ignored(mscfs_t* fs, msc_id objectId)
 	return ignored;
 }
 
+/* Map an object as listed by the card to its cache entry */
+static void mscfs_map_object(mscfs_file_t *file)
+{
+	u8* oid = file->objectId.id;
+	/* Check if its a directory in the root */
+	if(oid[2] == 0 && oid[3] == 0) {
+		oid[2] = oid[0];
+		oid[3] = oid[1];
+		oid[0] = 0x3F;
+		oid[1] = 0x00;
+		file->ef = 0;
+	} else  {
+		file->ef = 1; /* File is a working elementary file */
+	}
+}
+
 int mscfs_push_file(mscfs_t* fs, mscfs_file_t *file)
 {
 	mscfs_cache_t *cache = &fs->cache;
 	if(!cache->array || cache->size == cache->totalSize) {
 		int length = cache->totalSize + MSCFS_CACHE_INCREMENT;
-		mscfs_file_t *oldArray;
-		cache->totalSize = length;
-		oldArray = cache->array;
-		cache->array = malloc(sizeof(mscfs_file_t) * length);
-		if(!cache->array)
+		mscfs_file_t *newArray;
+		newArray = realloc(cache->array, sizeof(mscfs_file_t) * length);
+		if(!newArray)
 			return MSCFS_NO_MEMORY;
-		if(oldArray) {
-			memcpy(cache->array, oldArray, sizeof(mscfs_file_t) * cache->size);
-			free(oldArray);
-		}
+		cache->array = newArray;
+		cache->totalSize = length;
 	}
 	cache->array[cache->size] = *file;
+	mscfs_index_file(cache, cache->size);
 	cache->size++;
 	return 0;
 }
@@ -103,42 +153,94 @@ int mscfs_update_cache(mscfs_t* fs) {
 	int r;
 	mscfs_clear_cache(fs);
 	r = fs->listFile(&file, 1, fs->udata);
-	if(r == 0)
-		return 0;
-	else if(r < 0)
+	if(r < 0)
 		return r;
-	while(1) {
+	while(r > 0) {
 		if(!mscfs_is_ignored(fs, file.objectId)) {
-			/* Check if its a directory in the root */
-			u8* oid = file.objectId.id;
-			if(oid[2] == 0 && oid[3] == 0) {
-				oid[2] = oid[0];
-				oid[3] = oid[1];
-				oid[0] = 0x3F;
-				oid[1] = 0x00;
-				file.ef = 0;
-			} else  {
-				file.ef = 1; /* File is a working elementary file */
+			mscfs_map_object(&file);
+			r = mscfs_push_file(fs, &file);
+			if(r < 0) {
+				mscfs_clear_cache(fs);
+				return r;
 			}
-			
-			mscfs_push_file(fs, &file);
 		}
 		r = fs->listFile(&file, 0, fs->udata);
-		if(r == 0)
-			break;
-		else if(r < 0)
+		if(r < 0) {
+			mscfs_clear_cache(fs);
 			return r;
+		}
 	}
+	/* An empty list is a valid result too, don't list again */
+	fs->cache.valid = 1;
 	return fs->cache.size;
 }
 
 void mscfs_check_cache(mscfs_t* fs)
 {
-	if(!fs->cache.array) {
+	if(!fs->cache.valid) {
 		mscfs_update_cache(fs);
 	}
 }
 
+int mscfs_cache_add_object(mscfs_t* fs, const mscfs_file_t *file)
+{
+	mscfs_file_t entry = *file;
+	int x;
+
+	/* Nothing listed yet, the object shows up with the first listing */
+	if(!fs->cache.valid)
+		return 0;
+	if(mscfs_is_ignored(fs, entry.objectId))
+		return 0;
+	mscfs_map_object(&entry);
+	x = mscfs_find_file(fs, &entry.objectId);
+	if(x >= 0) {
+		entry.idNext = fs->cache.array[x].idNext;
+		entry.dirNext = fs->cache.array[x].dirNext;
+		fs->cache.array[x] = entry;
+		return 0;
+	}
+	return mscfs_push_file(fs, &entry);
+}
+
+/* Takes the id of a cache entry, directories are removed with their children */
+void mscfs_cache_remove_object(mscfs_t* fs, msc_id objectId)
+{
+	mscfs_cache_t *cache = &fs->cache;
+	msc_id current;
+	int isDirectory;
+	int x, y, found;
+
+	if(!cache->valid)
+		return;
+	found = mscfs_find_file(fs, &objectId);
+	if(found < 0) {
+		/* Not something we know about (e.g. the virtual root) */
+		mscfs_clear_cache(fs);
+		return;
+	}
+	isDirectory = !cache->array[found].ef;
+	if(fs->currentFileIndex >= 0 && fs->currentFileIndex < cache->size)
+		current = cache->array[fs->currentFileIndex].objectId;
+	else
+		memset(&current, 0, sizeof(current));
+
+	for(x = 0, y = 0; x < cache->size; x++) {
+		const u8 *oid = cache->array[x].objectId.id;
+		if(0 == memcmp(oid, objectId.id, 4))
+			continue;
+		if(isDirectory && 0 == memcmp(oid, objectId.id + 2, 2))
+			continue;
+		if(x != y)
+			cache->array[y] = cache->array[x];
+		y++;
+	}
+	cache->size = y;
+	mscfs_rebuild_index(cache);
+	if(fs->currentFileIndex >= 0)
+		fs->currentFileIndex = mscfs_find_file(fs, &current);
+}
+
 int mscfs_lookup_path(mscfs_t* fs, const u8 *path, int pathlen, msc_id* objectId, int isDirectory)
 {
 	u8* oid = objectId->id;
@@ -194,6 +296,37 @@ int mscfs_lookup_local(mscfs_t* fs, const int id, msc_id* objectId)
 	return 0;
 }
 
+int mscfs_find_file(mscfs_t* fs, const msc_id *objectId)
+{
+	int x;
+	for(x = fs->cache.idHash[mscfs_id_hash(objectId->id)]; x >= 0;
+			x = fs->cache.array[x].idNext) {
+		if(0 == memcmp(fs->cache.array[x].objectId.id, objectId->id, 4))
+			return x;
+	}
+	return -1;
+}
+
+static int mscfs_match_in_dir(mscfs_t* fs, int x, const u8 *dir)
+{
+	for(; x >= 0; x = fs->cache.array[x].dirNext) {
+		if(0 == memcmp(fs->cache.array[x].objectId.id, dir, 2))
+			return x;
+	}
+	return -1;
+}
+
+int mscfs_first_in_dir(mscfs_t* fs, const u8 *dir)
+{
+	return mscfs_match_in_dir(fs, fs->cache.dirHash[mscfs_dir_hash(dir)], dir);
+}
+
+int mscfs_next_in_dir(mscfs_t* fs, int idx)
+{
+	const mscfs_file_t *file = &fs->cache.array[idx];
+	return mscfs_match_in_dir(fs, file->dirNext, file->objectId.id);
+}
+
 /* -1 any, 0 DF, 1 EF */
 int mscfs_check_selection(mscfs_t *fs, int requiredItem)
 {
@@ -213,17 +346,9 @@ int mscfs_loadFileInfo(mscfs_t* fs, const u8 *path, int pathlen, mscfs_file_t **
 	
 	/* Obtain file information while checking if it exists */
 	mscfs_check_cache(fs);
-	if(idx) *idx = -1;
-	for(x = 0; x < fs->cache.size; x++) {
-		msc_id objectId;
-		*file_data = &fs->cache.array[x];
-		objectId = (*file_data)->objectId;
-		if(0 == memcmp(objectId.id, fullPath.id, 4)) {
-			if(idx) *idx = x;
-			break;
-		}
-		*file_data = NULL;
-	}
+	x = mscfs_find_file(fs, &fullPath);
+	if(idx) *idx = x;
+	*file_data = x >= 0 ? &fs->cache.array[x] : NULL;
 	if(*file_data == NULL && (0 == memcmp("\x3F\x00\x00\x00", fullPath.id, 4) || 0 == memcmp("\x3F\x00\x3F\x00", fullPath.id, 4 ))) {
 		static mscfs_file_t ROOT_FILE;
 		ROOT_FILE.ef = 0;
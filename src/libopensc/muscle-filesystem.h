@@ -34,12 +34,22 @@ typedef struct mscfs_file {
 	size_t size;
 	unsigned short read, write, delete;
 	int ef;
+	/* Hash chains, indexes into the cache array or -1 */
+	int idNext;
+	int dirNext;
 } mscfs_file_t;
 
+#define MSCFS_HASH_SIZE 64
+
 typedef struct mscfs_cache {
 	int size;
 	int totalSize;
 	mscfs_file_t *array;
+	/* Set once the object list was read from the card */
+	int valid;
+	/* Heads of the chains by full object id and by directory */
+	int idHash[MSCFS_HASH_SIZE];
+	int dirHash[MSCFS_HASH_SIZE];
 } mscfs_cache_t;
 
 typedef struct mscsfs {
@@ -56,12 +66,19 @@ void mscfs_free(mscfs_t *fs);
 void mscfs_clear_cache(mscfs_t* fs);
 int mscfs_push_file(mscfs_t* fs, mscfs_file_t *file);
 int mscfs_update_cache(mscfs_t* fs);
+/* Keep a loaded cache in sync with objects created or deleted on the card */
+int mscfs_cache_add_object(mscfs_t* fs, const mscfs_file_t *file);
+void mscfs_cache_remove_object(mscfs_t* fs, msc_id objectId);
 
 void mscfs_check_cache(mscfs_t* fs);
 
 int mscfs_lookup_path(mscfs_t* fs, const u8 *path, int pathlen, msc_id* objectId, int isDirectory);
 
 int mscfs_lookup_local(mscfs_t* fs, const int id, msc_id* objectId);
+int mscfs_find_file(mscfs_t* fs, const msc_id *objectId);
+/* Iterate over the cached objects in directory dir (first two id bytes) */
+int mscfs_first_in_dir(mscfs_t* fs, const u8 *dir);
+int mscfs_next_in_dir(mscfs_t* fs, int idx);
 /* -1 any, 0 DF, 1 EF */
 int mscfs_check_selection(mscfs_t *fs, int requiredItem);
 int mscfs_loadFileInfo(mscfs_t* fs, const u8 *path, int pathlen, mscfs_file_t **file_data, int* index);
@@ -274,6 +274,12 @@ struct sc_card_cache {
         struct sc_file *current_ef;
         struct sc_file *current_df;
 
+	/* Security environment set for the last PKCS#15 key operation
+	 * and the key file selected for it */
+	struct sc_security_env senv;
+	struct sc_path senv_path;
+	int senv_valid;
+
 	int valid;
 };
 
@@ -648,6 +654,8 @@ struct sc_card_operations {
 			unsigned char **, size_t *);
 
 	int (*card_reader_lock_obtained)(struct sc_card *, int was_reset);
+	/* called before the reader lock is released; must not talk to the card */
+	int (*card_reader_lock_released)(struct sc_card *);
 };
 
 typedef struct sc_card_driver {
@@ -709,9 +717,13 @@ typedef struct sc_context {
 
 	struct sc_reader_driver *reader_driver;
 	void *reader_drv_data;
+	/* 0: not initialised yet, 1: ready, < 0: error from init() */
+	int reader_driver_state;
 
+	/* filled in by sc_ctx_load_card_drivers() */
 	struct sc_card_driver *card_drivers[SC_MAX_CARD_DRIVERS];
 	struct sc_card_driver *forced_driver;
+	int card_drivers_loaded;
 
 	sc_thread_context_t	*thread_ctx;
 	void *mutex;
@@ -812,6 +824,15 @@ int sc_release_context(sc_context_t *ctx);
  */
 int sc_ctx_detect_readers(sc_context_t *ctx);
 
+/**
+ * Instantiates the configured card drivers and their ATR tables.
+ * sc_context_create() defers this until a card is connected; callers
+ * that look at ctx->card_drivers directly have to call this first.
+ * @param  ctx  OpenSC context
+ * @return SC_SUCCESS on success and an error code otherwise.
+ */
+int sc_ctx_load_card_drivers(sc_context_t *ctx);
+
 /**
  * In windows: get configuration option from environment or from registers.
  * @param env name of environment variable
@@ -1042,6 +1063,22 @@ int sc_write_binary(struct sc_card *card, unsigned int idx, const u8 * buf,
  */
 int sc_update_binary(struct sc_card *card, unsigned int idx, const u8 * buf,
 		     size_t count, unsigned long flags);
+/**
+ * Updates the content of a binary EF, sending UPDATE BINARY only for the
+ * byte ranges that differ from the current content. Nearby ranges are
+ * merged into a single command.
+ * @param  card   struct sc_card object on which to issue the command
+ * @param  idx    index within the file for the data to be updated
+ * @param  buf    buffer with the new data
+ * @param  count  number of bytes to update
+ * @param  old    current content of the @count bytes at @idx as read
+ *                from the card while holding the card lock, or NULL to
+ *                read it first; a stale copy leaves the file corrupted
+ * @param  flags  flags for the UPDATE BINARY command (currently not used)
+ * @return @count or an error code
+ */
+int sc_update_binary_diff(struct sc_card *card, unsigned int idx, const u8 * buf,
+		     size_t count, const u8 *old, unsigned long flags);
 
 /**
  * Sets (part of) the content fo an EF to its logical erased state
@@ -32,17 +32,19 @@
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "internal.h"
 #include "pkcs15.h"
 
 #define RANDOM_UID_INDICATOR 0x08
-static int generate_cache_filename(struct sc_pkcs15_card *p15card,
-				   const sc_path_t *path,
+static int generate_cache_filename_key(struct sc_pkcs15_card *p15card,
+				   const sc_path_t *path, const char *last_update,
 				   char *buf, size_t bufsize)
 {
 	char dir[PATH_MAX];
-	char *last_update = NULL;
 	int  r;
 	unsigned u;
 
@@ -57,10 +59,6 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 		return r;
 	snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "/");
 
-	last_update = sc_pkcs15_get_lastupdate(p15card);
-	if (!last_update)
-		last_update = "NODATE";
-
 	if (p15card->tokeninfo->serial_number) {
 		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
 				"%s_%s", p15card->tokeninfo->serial_number,
@@ -101,6 +99,17 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 	return SC_SUCCESS;
 }
 
+static int generate_cache_filename(struct sc_pkcs15_card *p15card,
+				   const sc_path_t *path,
+				   char *buf, size_t bufsize)
+{
+	char *last_update = sc_pkcs15_get_lastupdate(p15card);
+
+	if (!last_update)
+		last_update = "NODATE";
+	return generate_cache_filename_key(p15card, path, last_update, buf, bufsize);
+}
+
 int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 				const sc_path_t *path,
 				u8 **buf, size_t *bufsize)
@@ -193,6 +202,8 @@ int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 	FILE *f;
 	size_t c;
 
+	sc_pkcs15_forget_shared_der(p15card, path);
+
 	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
 	if (r != 0)
 		return r;
@@ -220,3 +231,210 @@ int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 	}
 	return 0;
 }
+
+/*
+ * Process-wide store of immutable DER blobs (certificates), shared by
+ * reference between all cards, sc_pkcs15_cert objects and PKCS#11 objects
+ * of a process. Identical contents are stored once. With the file cache
+ * enabled, a blob also remembers the cached file it was read from, so
+ * that binding the same token again finds it without reading the file.
+ * That name is dropped whenever the file is written or cached again, see
+ * sc_pkcs15_forget_shared_der(). A blob is freed when its last reference
+ * is dropped.
+ */
+#define SHARED_DER_HASH_SIZE	64
+
+struct shared_der {
+	struct shared_der *next_data;	/* chain by contents */
+	struct shared_der *next_name;	/* chain by cache file name */
+	unsigned int data_hash;
+	unsigned int name_hash;
+	unsigned int refs;
+	char *name;
+	size_t len;
+	/* the DER blob follows */
+};
+
+static struct shared_der *shared_der_by_data[SHARED_DER_HASH_SIZE];
+static struct shared_der *shared_der_by_name[SHARED_DER_HASH_SIZE];
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t shared_der_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define shared_der_lock()	pthread_mutex_lock(&shared_der_mutex)
+#define shared_der_unlock()	pthread_mutex_unlock(&shared_der_mutex)
+#else
+#define shared_der_lock()
+#define shared_der_unlock()
+#endif
+
+#define shared_der_value(sd)	((u8 *)((sd) + 1))
+
+static unsigned int shared_der_hash(const u8 *buf, size_t len)
+{
+	unsigned int h = 2166136261U;
+
+	while (len--)
+		h = (h ^ *buf++) * 16777619U;
+	return h;
+}
+
+/*
+ * Name of a shared blob: the cache file name without the lastUpdate key,
+ * the part of the file and then the key, so that all names of a file share
+ * a prefix whatever the key. Tokens without lastUpdate have no usable key:
+ * nothing tells a file rewritten by another process from the one cached.
+ */
+static int shared_der_filename(struct sc_pkcs15_card *p15card,
+		const sc_path_t *path, char *buf, size_t bufsize)
+{
+	char *last_update;
+	int r;
+
+	if (!p15card->opts.use_file_cache || path == NULL || path->len < 2)
+		return SC_ERROR_NOT_SUPPORTED;
+	last_update = sc_pkcs15_get_lastupdate(p15card);
+	if (last_update == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+	r = generate_cache_filename_key(p15card, path, "", buf, bufsize);
+	if (r != SC_SUCCESS)
+		return r;
+	/* a blob may be a part of the cached file */
+	if (path->count >= 0)
+		snprintf(buf + strlen(buf), bufsize - strlen(buf), "#%u+%d",
+				path->index, path->count);
+	snprintf(buf + strlen(buf), bufsize - strlen(buf), "@%s", last_update);
+	return SC_SUCCESS;
+}
+
+void sc_pkcs15_forget_shared_der(struct sc_pkcs15_card *p15card,
+		const sc_path_t *path)
+{
+	char fname[PATH_MAX + 32];
+	struct shared_der *sd, **p;
+	size_t len;
+	unsigned int i;
+
+	if (p15card == NULL || !p15card->opts.use_file_cache || path == NULL || path->len < 2)
+		return;
+	if (generate_cache_filename_key(p15card, path, "", fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	len = strlen(fname);
+
+	shared_der_lock();
+	for (i = 0; i < SHARED_DER_HASH_SIZE; i++) {
+		p = &shared_der_by_name[i];
+		while ((sd = *p) != NULL) {
+			if (!strncmp(sd->name, fname, len)
+					&& (sd->name[len] == '#' || sd->name[len] == '@')) {
+				/* references still alive keep the blob, but it
+				 * is not found by name any more */
+				*p = sd->next_name;
+				free(sd->name);
+				sd->name = NULL;
+				continue;
+			}
+			p = &sd->next_name;
+		}
+	}
+	shared_der_unlock();
+}
+
+const u8 *sc_pkcs15_get_shared_der(struct sc_pkcs15_card *p15card,
+		const sc_path_t *path, size_t *len)
+{
+	char fname[PATH_MAX + 32];
+	struct shared_der *sd;
+	unsigned int h;
+
+	if (shared_der_filename(p15card, path, fname, sizeof(fname)) != SC_SUCCESS)
+		return NULL;
+	h = shared_der_hash((const u8 *)fname, strlen(fname));
+
+	shared_der_lock();
+	for (sd = shared_der_by_name[h % SHARED_DER_HASH_SIZE]; sd; sd = sd->next_name)
+		if (sd->name_hash == h && !strcmp(sd->name, fname))
+			break;
+	if (sd)
+		sd->refs++;
+	shared_der_unlock();
+
+	if (sd == NULL)
+		return NULL;
+	sc_log(p15card->card->ctx, "using shared copy of %s", fname);
+	*len = sd->len;
+	return shared_der_value(sd);
+}
+
+const u8 *sc_pkcs15_share_der(struct sc_pkcs15_card *p15card,
+		const sc_path_t *path, const u8 *buf, size_t len)
+{
+	char fname[PATH_MAX + 32];
+	struct shared_der *sd;
+	unsigned int h, nh = 0;
+	int named = 0;
+
+	if (p15card != NULL
+			&& shared_der_filename(p15card, path, fname, sizeof(fname)) == SC_SUCCESS) {
+		named = 1;
+		nh = shared_der_hash((const u8 *)fname, strlen(fname));
+	}
+	h = shared_der_hash(buf, len);
+
+	shared_der_lock();
+	for (sd = shared_der_by_data[h % SHARED_DER_HASH_SIZE]; sd; sd = sd->next_data)
+		if (sd->data_hash == h && sd->len == len
+				&& !memcmp(shared_der_value(sd), buf, len))
+			break;
+	if (sd == NULL) {
+		sd = malloc(sizeof(*sd) + len);
+		if (sd == NULL) {
+			shared_der_unlock();
+			return NULL;
+		}
+		memset(sd, 0, sizeof(*sd));
+		memcpy(shared_der_value(sd), buf, len);
+		sd->len = len;
+		sd->data_hash = h;
+		sd->next_data = shared_der_by_data[h % SHARED_DER_HASH_SIZE];
+		shared_der_by_data[h % SHARED_DER_HASH_SIZE] = sd;
+	}
+	if (named && sd->name == NULL) {
+		sd->name = strdup(fname);
+		if (sd->name != NULL) {
+			sd->name_hash = nh;
+			sd->next_name = shared_der_by_name[nh % SHARED_DER_HASH_SIZE];
+			shared_der_by_name[nh % SHARED_DER_HASH_SIZE] = sd;
+		}
+	}
+	sd->refs++;
+	shared_der_unlock();
+
+	return shared_der_value(sd);
+}
+
+void sc_pkcs15_free_shared_der(const u8 *der)
+{
+	struct shared_der *sd, **p;
+
+	if (der == NULL)
+		return;
+	sd = (struct shared_der *)der - 1;
+
+	shared_der_lock();
+	if (--sd->refs > 0) {
+		shared_der_unlock();
+		return;
+	}
+	for (p = &shared_der_by_data[sd->data_hash % SHARED_DER_HASH_SIZE]; *p != sd; p = &(*p)->next_data)
+		;
+	*p = sd->next_data;
+	if (sd->name != NULL) {
+		for (p = &shared_der_by_name[sd->name_hash % SHARED_DER_HASH_SIZE]; *p != sd; p = &(*p)->next_name)
+			;
+		*p = sd->next_name;
+	}
+	shared_der_unlock();
+
+	free(sd->name);
+	free(sd);
+}
@@ -90,11 +90,8 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 	if (obj == NULL)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "X.509 certificate not found");
 
+	/* The caller attaches the DER blob, see sc_pkcs15_read_certificate() */
 	data_len = objlen + (obj - buf);
-	cert->data.value = malloc(data_len);
-	if (!cert->data.value)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-	memcpy(cert->data.value, buf, data_len);
 	cert->data.len = data_len;
 
 	r = sc_asn1_decode(ctx, asn1_cert, obj, objlen, NULL, NULL);
@@ -359,6 +356,9 @@ sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs1
 	struct sc_context *ctx = NULL;
 	struct sc_pkcs15_cert *cert = NULL;
 	struct sc_pkcs15_der der;
+	const u8 *shared = NULL;
+	size_t shared_len = 0;
+	u8 *data = NULL;
 	int r;
 
 	if (p15card == NULL || info == NULL || cert_out == NULL) {
@@ -368,28 +368,51 @@ sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs1
 	LOG_FUNC_CALLED(ctx);
 
 	if (info->value.len && info->value.value)   {
-		sc_der_copy(&der, &info->value);
+		der = info->value;
 	}
 	else if (info->path.len) {
-		r = sc_pkcs15_read_file(p15card, &info->path, &der.value, &der.len);
-		LOG_TEST_RET(ctx, r, "Unable to read certificate file.");
+		/* Another card object of this process may have read it already */
+		shared = sc_pkcs15_get_shared_der(p15card, &info->path, &shared_len);
+		if (shared) {
+			der.value = (u8 *)shared;
+			der.len = shared_len;
+		}
+		else {
+			r = sc_pkcs15_read_file(p15card, &info->path, &data, &der.len);
+			LOG_TEST_RET(ctx, r, "Unable to read certificate file.");
+			der.value = data;
+		}
 	}
 	else   {
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OBJECT_NOT_FOUND);
 	}
 
-	cert = malloc(sizeof(struct sc_pkcs15_cert));
+	cert = calloc(1, sizeof(struct sc_pkcs15_cert));
 	if (cert == NULL) {
-		free(der.value);
+		free(data);
+		sc_pkcs15_free_shared_der(shared);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 	}
-	memset(cert, 0, sizeof(struct sc_pkcs15_cert));
 	if (parse_x509_cert(ctx, &der, cert)) {
-		free(der.value);
+		free(data);
+		sc_pkcs15_free_shared_der(shared);
 		sc_pkcs15_free_certificate(cert);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ASN1_OBJECT);
 	}
-	free(der.value);
+
+	if (shared && cert->data.len == shared_len) {
+		cert->data.value = (u8 *)shared;
+	}
+	else {
+		cert->data.value = (u8 *)sc_pkcs15_share_der(p15card,
+				data ? &info->path : NULL, der.value, cert->data.len);
+		sc_pkcs15_free_shared_der(shared);
+	}
+	free(data);
+	if (cert->data.value == NULL) {
+		sc_pkcs15_free_certificate(cert);
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	}
 
 	*cert_out = cert;
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
@@ -544,7 +567,7 @@ sc_pkcs15_free_certificate(struct sc_pkcs15_cert *cert)
 	free(cert->subject);
 	free(cert->issuer);
 	free(cert->serial);
-	free(cert->data.value);
+	sc_pkcs15_free_shared_der(cert->data.value);
 	free(cert->extensions);
 	free(cert);
 }
@@ -33,17 +33,16 @@
 #include "internal.h"
 #include "pkcs15.h"
 
-static int select_key_file(struct sc_pkcs15_card *p15card,
+static int get_key_file_path(struct sc_pkcs15_card *p15card,
 		const struct sc_pkcs15_prkey_info *prkey,
-		sc_security_env_t *senv)
+		sc_security_env_t *senv, sc_path_t *path)
 {
 	sc_context_t *ctx = p15card->card->ctx;
-	sc_path_t path, file_id;
-	int r;
+	sc_path_t file_id;
 
 	LOG_FUNC_CALLED(ctx);
 
-	memset(&path, 0, sizeof(sc_path_t));
+	memset(path, 0, sizeof(sc_path_t));
 	memset(&file_id, 0, sizeof(sc_path_t));
 
 	/* TODO: Why file_app may be NULL -- at least 3F00 has to be present?
@@ -52,18 +51,18 @@ static int select_key_file(struct sc_pkcs15_card *p15card,
 	 * in that case we allways assume an absolute path */
 	if (!prkey->path.len && prkey->path.aid.len) {
 		/* Private key is a SDO allocated in application DF */
-		path = prkey->path;
+		*path = prkey->path;
 	}
 	else if (prkey->path.len == 2 && p15card->file_app != NULL) {
 		/* Path is relative to app. DF */
-		path = p15card->file_app->path;
+		*path = p15card->file_app->path;
 		file_id = prkey->path;
-		sc_append_path(&path, &file_id);
+		sc_append_path(path, &file_id);
 		senv->file_ref = file_id;
 		senv->flags |= SC_SEC_ENV_FILE_REF_PRESENT;
 	}
 	else if (prkey->path.len > 2) {
-		path = prkey->path;
+		*path = prkey->path;
 		memcpy(file_id.value, prkey->path.value + prkey->path.len - 2, 2);
 		file_id.len = 2;
 		file_id.type = SC_PATH_TYPE_FILE_ID;
@@ -74,12 +73,43 @@ static int select_key_file(struct sc_pkcs15_card *p15card,
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "invalid private key path");
 	}
 
-	r = sc_select_file(p15card->card, &path, NULL);
-	LOG_TEST_RET(ctx, r, "sc_select_file() failed");
-
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
+static int senv_path_equal(const sc_path_t *a, const sc_path_t *b)
+{
+	return a->type == b->type && a->index == b->index && a->count == b->count
+		&& sc_compare_path(a, b)
+		&& a->aid.len == b->aid.len
+		&& memcmp(a->aid.value, b->aid.value, a->aid.len) == 0;
+}
+
+/* supported_algos is not compared, it comes from the TokenInfo of the card */
+static int senv_is_current(sc_card_t *card, const sc_security_env_t *senv,
+		const sc_path_t *path)
+{
+	const sc_security_env_t *cur = &card->cache.senv;
+
+	return card->cache.valid && card->cache.senv_valid
+		&& cur->flags == senv->flags
+		&& cur->operation == senv->operation
+		&& cur->algorithm == senv->algorithm
+		&& cur->algorithm_flags == senv->algorithm_flags
+		&& cur->algorithm_ref == senv->algorithm_ref
+		&& cur->key_ref_len == senv->key_ref_len
+		&& memcmp(cur->key_ref, senv->key_ref, senv->key_ref_len) == 0
+		&& senv_path_equal(&cur->file_ref, &senv->file_ref)
+		&& senv_path_equal(&card->cache.senv_path, path);
+}
+
+static void senv_set_current(sc_card_t *card, const sc_security_env_t *senv,
+		const sc_path_t *path)
+{
+	card->cache.senv = *senv;
+	card->cache.senv_path = *path;
+	card->cache.senv_valid = 1;
+}
+
 static int use_key(struct sc_pkcs15_card *p15card,
 		const struct sc_pkcs15_object *obj,
 		sc_security_env_t *senv,
@@ -96,18 +126,41 @@ static int use_key(struct sc_pkcs15_card *p15card,
 	LOG_TEST_RET(p15card->card->ctx, r, "sc_lock() failed");
 
 	do {
-		if (prkey->path.len != 0 || prkey->path.aid.len != 0) {
-			r = select_key_file(p15card, prkey, senv);
+		sc_path_t path;
+		int has_path = prkey->path.len != 0 || prkey->path.aid.len != 0;
+
+		memset(&path, 0, sizeof(path));
+		if (has_path) {
+			r = get_key_file_path(p15card, prkey, senv, &path);
 			if (r < 0) {
 				sc_log(p15card->card->ctx,
 						"Unable to select private key file");
 			}
 		}
-		if (r == SC_SUCCESS)
-			r = sc_set_security_env(p15card->card, senv, 0);
+		if (r == SC_SUCCESS && p15card->opts.use_senv_cache
+				&& senv_is_current(p15card->card, senv, &path)) {
+			sc_log(p15card->card->ctx,
+					"Security environment unchanged, skipping SELECT and MSE");
+		}
+		else {
+			if (r == SC_SUCCESS && has_path) {
+				r = sc_select_file(p15card->card, &path, NULL);
+				if (r < 0) {
+					sc_log(p15card->card->ctx,
+							"Unable to select private key file");
+				}
+			}
+			if (r == SC_SUCCESS)
+				r = sc_set_security_env(p15card->card, senv, 0);
+			if (r == SC_SUCCESS && p15card->opts.use_senv_cache)
+				senv_set_current(p15card->card, senv, &path);
+		}
 
 		if (r == SC_SUCCESS)
 			r = card_command(p15card->card, in, inlen, out, outlen);
+		/* the card may have lost the environment */
+		if (r < 0)
+			p15card->card->cache.senv_valid = 0;
 
 		if (revalidated_cached_pin)
 			/* only re-validate once */
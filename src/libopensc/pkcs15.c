@@ -984,12 +984,13 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 	struct sc_path tmppath;
 	struct sc_card    *card = p15card->card;
 	struct sc_context *ctx  = card->ctx;
+	struct sc_path odf_path;
 	struct sc_pkcs15_tokeninfo tokeninfo;
 	struct sc_pkcs15_df *df;
 	const struct sc_app_info *info = NULL;
-	unsigned char *buf = NULL;
-	size_t len;
-	int    err, ok = 0;
+	unsigned char *buf = NULL, *odf_buf = NULL;
+	size_t len, odf_len;
+	int    err, odf_read, ok = 0;
 
 	LOG_FUNC_CALLED(ctx);
 	/* Enumerate apps now */
@@ -1068,52 +1069,26 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		goto end;
 	}
 
-	len = p15card->file_odf->size;
-	if (!len) {
+	odf_path = tmppath;
+	odf_len = p15card->file_odf->size;
+	if (!odf_len) {
 		sc_log(ctx, "EF(ODF) is empty");
 		goto end;
 	}
-	buf = malloc(len);
-	if(buf == NULL)
+	odf_buf = malloc(odf_len);
+	if (odf_buf == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 
-	err = -1; /* file state: not in cache */
-	if (p15card->opts.use_file_cache) {
-		err = sc_pkcs15_read_cached_file(p15card, &tmppath, &buf, &len);
-		if (err == SC_SUCCESS)
-			err = len;
-	}
-	if (err < 0) {
-		err = sc_read_binary(card, 0, buf, len, 0);
-		if (err < 2) {
-			if (err < 0) {
-				sc_log(ctx, "read EF(ODF) file error: %s", sc_strerror(err));
-			} else {
-				err = SC_ERROR_PKCS15_APP_NOT_FOUND;
-				sc_log(ctx, "Invalid content of EF(ODF): %s", sc_strerror(err));
-			}
-			goto end;
-		}
-		/* sc_read_binary may return less than requested */
-		len = err;
-
-		if (p15card->opts.use_file_cache) {
-			sc_pkcs15_cache_file(p15card, &tmppath, buf, len);
-		}
+	/* With the file cache, EF(ODF) is read after EF(TokenInfo): serial
+	 * number and lastUpdate are the key of the cache, so TokenInfo always
+	 * comes from the card and the rest of the structure from the cache. */
+	err = -1; /* file state: not read */
+	if (!p15card->opts.use_file_cache) {
+		err = sc_read_binary(card, 0, odf_buf, odf_len, 0);
+		if (err < 2)
+			goto odf_err;
 	}
-
-	if (parse_odf(buf, len, p15card)) {
-		err = SC_ERROR_PKCS15_APP_NOT_FOUND;
-		sc_log(ctx, "Unable to parse ODF");
-		goto end;
-	}
-	free(buf);
-	buf = NULL;
-
-	sc_log(ctx, "The following DFs were found:");
-	for (df = p15card->df_list; df; df = df->next)
-		sc_log(ctx, "  DF type %u, path %s, index %u, count %d", df->type,
-				sc_print_path(&df->path), df->path.index, df->path.count);
+	odf_read = err;
 
 	if (p15card->file_tokeninfo == NULL) {
 		sc_format_path("5032", &tmppath);
@@ -1145,29 +1120,15 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 	if(buf == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 
-	err = -1; /* file state: not in cache */
-	if (p15card->opts.use_file_cache) {
-		err = sc_pkcs15_read_cached_file(p15card, &tmppath, &buf, &len);
-		if (err == SC_SUCCESS)
-			err = len;
-	}
-	if (err < 0) {
-		err = sc_read_binary(card, 0, buf, len, 0);
-		if (err <= 2) {
-			if (err < 0)   {
-				sc_log(ctx, "read EF(TokenInfo) file error: %s", sc_strerror(err));
-			} else {
-				err = SC_ERROR_PKCS15_APP_NOT_FOUND;
-				sc_log(ctx, "Invalid content of EF(TokenInfo): %s", sc_strerror(err));
-			}
-			goto end;
-		}
-		/* sc_read_binary may return less than requested */
-		len = err;
-
-		if (p15card->opts.use_file_cache) {
-			sc_pkcs15_cache_file(p15card, &tmppath, buf, len);
+	err = sc_read_binary(card, 0, buf, len, 0);
+	if (err <= 2) {
+		if (err < 0)   {
+			sc_log(ctx, "read EF(TokenInfo) file error: %s", sc_strerror(err));
+		} else {
+			err = SC_ERROR_PKCS15_APP_NOT_FOUND;
+			sc_log(ctx, "Invalid content of EF(TokenInfo): %s", sc_strerror(err));
 		}
+		goto end;
 	}
 
 	memset(&tokeninfo, 0, sizeof(tokeninfo));
@@ -1176,6 +1137,8 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		sc_log(ctx, "cannot parse TokenInfo content: %s", sc_strerror(err));
 		goto end;
 	}
+	free(buf);
+	buf = NULL;
 
 	*(p15card->tokeninfo) = tokeninfo;
 
@@ -1194,10 +1157,51 @@ sc_pkcs15_bind_internal(struct sc_pkcs15_card *p15card, struct sc_aid *aid)
 		sc_log(ctx, "p15card->tokeninfo->serial_number %s", p15card->tokeninfo->serial_number);
 	}
 
+	err = odf_read;
+	if (err < 0 && p15card->opts.use_file_cache) {
+		err = sc_pkcs15_read_cached_file(p15card, &odf_path, &odf_buf, &odf_len);
+		if (err == SC_SUCCESS)
+			err = odf_len;
+	}
+	if (err < 0) {
+		err = sc_select_file(card, &odf_path, NULL);
+		if (err == SC_SUCCESS)
+			err = sc_read_binary(card, 0, odf_buf, odf_len, 0);
+		if (err < 2)
+			goto odf_err;
+
+		if (p15card->opts.use_file_cache) {
+			sc_pkcs15_cache_file(p15card, &odf_path, odf_buf, err);
+		}
+	}
+	/* sc_read_binary may return less than requested */
+	odf_len = err;
+
+	if (parse_odf(odf_buf, odf_len, p15card)) {
+		err = SC_ERROR_PKCS15_APP_NOT_FOUND;
+		sc_log(ctx, "Unable to parse ODF");
+		goto end;
+	}
+
+	sc_log(ctx, "The following DFs were found:");
+	for (df = p15card->df_list; df; df = df->next)
+		sc_log(ctx, "  DF type %u, path %s, index %u, count %d", df->type,
+				sc_print_path(&df->path), df->path.index, df->path.count);
+
 	ok = 1;
+	goto end;
+
+odf_err:
+	if (err < 0) {
+		sc_log(ctx, "read EF(ODF) file error: %s", sc_strerror(err));
+	} else {
+		err = SC_ERROR_PKCS15_APP_NOT_FOUND;
+		sc_log(ctx, "Invalid content of EF(ODF): %s", sc_strerror(err));
+	}
 end:
 	if(buf != NULL)
 		free(buf);
+	free(odf_buf);
 	if (!ok) {
 		sc_pkcs15_card_clear(p15card);
 		if (err == SC_ERROR_FILE_NOT_FOUND)
@@ -1233,6 +1237,7 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 	p15card->opts.use_pin_cache = 1;
 	p15card->opts.pin_cache_counter = 10;
 	p15card->opts.pin_cache_ignore_user_consent = 0;
+	p15card->opts.use_senv_cache = 0;
 
 	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
 
@@ -1242,10 +1247,12 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 		p15card->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", p15card->opts.pin_cache_counter);
 		p15card->opts.pin_cache_ignore_user_consent =  scconf_get_bool(conf_block, "pin_cache_ignore_user_consent",
 				p15card->opts.pin_cache_ignore_user_consent);
+		p15card->opts.use_senv_cache = scconf_get_bool(conf_block, "use_security_env_caching",
+				p15card->opts.use_senv_cache);
 	}
-	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d",
+	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d use_senv_cache=%d",
 			p15card->opts.use_file_cache, p15card->opts.use_pin_cache,p15card->opts.pin_cache_counter,
-			p15card->opts.pin_cache_ignore_user_consent);
+			p15card->opts.pin_cache_ignore_user_consent, p15card->opts.use_senv_cache);
 
 	r = sc_lock(card);
 	if (r) {
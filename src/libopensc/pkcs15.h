@@ -291,7 +291,7 @@ struct sc_pkcs15_cert {
 
 	struct sc_pkcs15_pubkey * key;
 
-	/* DER encoded raw cert */
+	/* DER encoded raw cert, shared and read-only (sc_pkcs15_share_der()) */
 	struct sc_pkcs15_der data;
 };
 typedef struct sc_pkcs15_cert sc_pkcs15_cert_t;
@@ -591,6 +591,7 @@ typedef struct sc_pkcs15_card {
 		int use_pin_cache;
 		int pin_cache_counter;
 		int pin_cache_ignore_user_consent;
+		int use_senv_cache;
 	} opts;
 
 	unsigned int magic;
@@ -907,6 +908,20 @@ int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
 
+/* Process-wide, reference counted and read-only DER blobs.
+ * sc_pkcs15_share_der() returns a shared copy of buf (path may be NULL),
+ * sc_pkcs15_get_shared_der() the blob shared before for the cached file at
+ * path, if any. Both references are dropped with sc_pkcs15_free_shared_der().
+ * Whoever writes the file at path calls sc_pkcs15_forget_shared_der(), so
+ * that the old blob is not returned for it any more. */
+const u8 *sc_pkcs15_share_der(struct sc_pkcs15_card *p15card,
+			const struct sc_path *path, const u8 *buf, size_t len);
+const u8 *sc_pkcs15_get_shared_der(struct sc_pkcs15_card *p15card,
+			const struct sc_path *path, size_t *len);
+void sc_pkcs15_free_shared_der(const u8 *der);
+void sc_pkcs15_forget_shared_der(struct sc_pkcs15_card *p15card,
+			const struct sc_path *path);
+
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
 			 const struct sc_pkcs15_id *id2);
@@ -74,6 +74,7 @@ int sc_set_security_env(sc_card_t *card,
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->set_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	card->cache.senv_valid = 0;
 	r = card->ops->set_security_env(card, env, se_num);
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
@@ -88,6 +89,7 @@ int sc_restore_security_env(sc_card_t *card, int se_num)
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->restore_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	card->cache.senv_valid = 0;
 	r = card->ops->restore_security_env(card, se_num);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
@@ -111,6 +113,7 @@ int sc_logout(sc_card_t *card)
 {
 	if (card->ops->logout == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
+	card->cache.senv_valid = 0;
 	return card->ops->logout(card);
 }
 
@@ -167,6 +170,8 @@ int sc_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data,
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
+	/* drivers may select files or set up the card for PIN commands */
+	card->cache.senv_valid = 0;
 	if (card->ops->pin_cmd) {
 		r = card->ops->pin_cmd(card, data, tries_left);
 	} else if (!(data->flags & SC_PIN_CMD_USE_PINPAD)) {
@@ -173,6 +173,75 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 	LOG_FUNC_RETURN(ctx, rv);
 }
 
+int
+sc_sm_pipeline_transmit(struct sc_card *card, struct sc_apdu *apdus, size_t count)
+{
+	struct sc_context *ctx;
+	struct sc_apdu *sm_apdu = NULL;
+	size_t i, completed = 0;
+	int rv = SC_SUCCESS;
+
+	if (!card || !apdus)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	ctx = card->ctx;
+
+	LOG_FUNC_CALLED(ctx);
+	if (card->sm_ctx.sm_mode != SM_MODE_TRANSMIT
+			|| !(card->sm_ctx.sm_flags & SM_FLAGS_PIPELINE)
+			|| !card->sm_ctx.ops.get_sm_apdu || !card->sm_ctx.ops.free_sm_apdu)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
+	if (!count)
+		LOG_FUNC_RETURN(ctx, 0);
+
+	rv = sc_lock(card);
+	LOG_TEST_RET(ctx, rv, "sc_lock() failed");
+
+	/* Each APDU is wrapped only once the previous answer has been
+	 * unwrapped, on this thread. The SM counters never run ahead of the
+	 * card, so stopping early leaves the session usable. */
+	for (i = 0; i < count; i++) {
+		struct sc_apdu *apdu = &apdus[i];
+		int r;
+
+		sc_detect_apdu_cse(card, apdu);
+		rv = sc_check_apdu(card, apdu);
+		if (rv != SC_SUCCESS)
+			break;
+		rv = card->sm_ctx.ops.get_sm_apdu(card, apdu, &sm_apdu);
+		if (rv == SC_ERROR_SM_NOT_APPLIED) {
+			/* leave the plain APDU to the caller */
+			rv = SC_SUCCESS;
+			break;
+		}
+		if (rv != SC_SUCCESS)
+			break;
+		rv = sc_check_apdu(card, sm_apdu);
+		if (rv != SC_SUCCESS) {
+			card->sm_ctx.ops.free_sm_apdu(card, NULL, &sm_apdu);
+			break;
+		}
+		sm_apdu->flags |= SC_APDU_FLAGS_NO_SM;
+
+		rv = sc_transmit_apdu(card, sm_apdu);
+		r = card->sm_ctx.ops.free_sm_apdu(card, rv < 0 ? NULL : apdu, &sm_apdu);
+		if (rv == SC_SUCCESS)
+			rv = r;
+		if (rv < 0)
+			break;
+		if (apdu->sw1 != 0x90 || apdu->sw2 != 0x00 || apdu->resplen < apdu->le)
+			/* short read or error status, the caller takes over */
+			break;
+		completed = i + 1;
+	}
+
+	if (rv < 0)
+		sc_sm_stop(card);
+
+	sc_unlock(card);
+	LOG_TEST_RET(ctx, rv, "SM pipeline failed");
+	LOG_FUNC_RETURN(ctx, (int)completed);
+}
+
 int
 sc_sm_stop(struct sc_card *card)
 {
@@ -210,6 +279,12 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 	return SC_ERROR_NOT_SUPPORTED;
 }
 
+int
+sc_sm_pipeline_transmit(struct sc_card *card, struct sc_apdu *apdus, size_t count)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
 int
 sc_sm_stop(struct sc_card *card)
 {
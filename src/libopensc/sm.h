@@ -49,6 +49,12 @@ extern "C" {
 #define SM_MODE_ACL		0x100
 #define SM_MODE_TRANSMIT	0x200
 
+/* sm_context.sm_flags */
+/* Consecutive READ BINARY or UPDATE BINARY commands may be sent as one
+ * batch with sc_sm_pipeline_transmit(). 'free_sm_apdu' must accept a NULL
+ * plain APDU to release a wrapped APDU whose exchange failed. */
+#define SM_FLAGS_PIPELINE	0x01
+
 #define SM_CMD_INITIALIZE		0x10
 #define SM_CMD_MUTUAL_AUTHENTICATION	0x20
 #define SM_CMD_RSA			0x100
@@ -353,6 +359,22 @@ int sc_sm_parse_answer(struct sc_card *, unsigned char *, size_t, struct sm_card
 int sc_sm_update_apdu_response(struct sc_card *, unsigned char *, size_t, int, struct sc_apdu *);
 int sc_sm_single_transmit(struct sc_card *, struct sc_apdu *);
 
+/**
+ * @brief Transmits a sequence of independent APDUs in SM 'APDU TRANSMIT' mode.
+ *
+ * Requires \c SM_FLAGS_PIPELINE. The APDUs are wrapped, sent and unwrapped
+ * one after the other under a single card lock, reusing the driver's SM
+ * buffers. Stops at the first APDU which does not complete with SW 9000 and
+ * a full response, without touching the SM session.
+ *
+ * @param[in] card
+ * @param[in,out] apdus plain APDUs, answers are stored in place
+ * @param[in] count number of APDUs
+ *
+ * @return number of leading APDUs that completed or error code
+ */
+int sc_sm_pipeline_transmit(struct sc_card *card, struct sc_apdu *apdus, size_t count);
+
 /**
  * @brief Stops SM and frees allocated ressources.
  *
@@ -21,6 +21,7 @@
 #include "config.h"
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "libopensc/log.h"
 #include "libopensc/internal.h"
 #include "libopensc/asn1.h"
@@ -92,6 +93,12 @@ struct pkcs15_prkey_object {
 
 	struct sc_pkcs15_prkey_info *	prv_info;
 	struct sc_pkcs15_pubkey *	pub_data;
+
+	/* Key pool state, see pkcs15_prkey_pool_pick() */
+	u8 *				pool_key;	/* encoded public key */
+	size_t				pool_key_len;
+	unsigned long			pool_last_use;
+	time_t				pool_retry_after;
 };
 #define prv_flags		base.base.flags
 #define prv_p15obj		base.p15_object
@@ -317,6 +324,14 @@ pkcs15_bind(struct sc_pkcs11_card *p11card, struct sc_app_info *app_info)
 		return sc_to_cryptoki_error(rc, NULL);
 	}
 
+	/* The cached security environment is dropped whenever the card lock
+	 * is acquired anew, i.e. with every operation unless the card stays
+	 * locked for the whole login session */
+	if (fw_data->p15_card->opts.use_senv_cache && !sc_pkcs11_conf.lock_login) {
+		sc_log(context, "use_security_env_caching needs lock_login, disabled");
+		fw_data->p15_card->opts.use_senv_cache = 0;
+	}
+
 	/* Mechanisms are registered globally per card. Checking
 	 * p11card->nmechanisms avoids registering the same mechanisms twice for a
 	 * card with multiple slots. */
@@ -933,6 +948,7 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 
 	if (cert->cert_data)
 		return 0;
+	sc_pkcs11_card_access(fw_data->p15_card->card);
 	rv = sc_pkcs15_read_certificate(fw_data->p15_card, cert->cert_info, &cert->cert_data);
 	if (rv < 0)
 		return rv;
@@ -3436,10 +3452,13 @@ static void pkcs15_prkey_release(void *object)
 {
 	struct pkcs15_prkey_object *prkey = (struct pkcs15_prkey_object*) object;
 	struct sc_pkcs15_pubkey *key_data = prkey->pub_data;
+	u8 *pool_key = prkey->pool_key;
 
-	if (__pkcs15_release_object((struct pkcs15_any_object *) object) == 0)
+	if (__pkcs15_release_object((struct pkcs15_any_object *) object) == 0) {
 		if (key_data)
 			sc_pkcs15_free_pubkey(key_data);
+		free(pool_key);
+	}
 }
 
 static CK_RV pkcs15_prkey_set_attribute(struct sc_pkcs11_session *session,
@@ -3646,6 +3665,206 @@ pkcs15_prkey_get_attribute(struct sc_pkcs11_session *session,
 }
 
 
+/* ECDSA with hash is registered with a software digest when the card can
+ * sign raw hashes (see register_ec_mechanisms()). The data to sign is then
+ * the digest already, otherwise the card has to hash it. */
+static unsigned long
+pkcs15_ecdsa_hash_flags(struct sc_pkcs11_card *p11card, CK_MECHANISM_TYPE mech,
+		unsigned long hash_flag)
+{
+	sc_pkcs11_mechanism_type_t *mt = sc_pkcs11_find_mechanism(p11card, mech, CKF_SIGN);
+
+	if (mt && mt->mech_data)
+		return SC_ALGORITHM_ECDSA_HASH_NONE;
+	return hash_flag;
+}
+
+/*
+ * Private key operation (signature or decipher) on one card.
+ */
+struct pkcs15_prkey_op {
+	int		decipher;
+	int		flags;
+	const u8 *	in;
+	size_t		in_len;
+	u8 *		out;
+	size_t		out_len;
+};
+
+static int
+pkcs15_prkey_card_op(struct sc_pkcs11_card *p11card, struct pkcs15_fw_data *fw_data,
+		struct pkcs15_prkey_object *prkey, struct pkcs15_prkey_op *op)
+{
+	int rv, prkey_has_path = 0;
+
+	if (prkey->prv_info->path.len || prkey->prv_info->path.aid.len)
+		prkey_has_path = 1;
+
+	rv = sc_lock(p11card->card);
+	if (rv < 0)
+		return rv;
+
+	if (op->decipher)
+		rv = sc_pkcs15_decipher(fw_data->p15_card, prkey->prv_p15obj, op->flags,
+				op->in, op->in_len, op->out, op->out_len);
+	else
+		rv = sc_pkcs15_compute_signature(fw_data->p15_card, prkey->prv_p15obj, op->flags,
+				op->in, op->in_len, op->out, op->out_len);
+	if (rv < 0 && !sc_pkcs11_conf.lock_login && !prkey_has_path) {
+		/* If private key PKCS#15 object do not have 'path' attribute,
+		 * and if PKCS#11 login session is not locked,
+		 * the operation could fail because of concurent access to the card
+		 * by other application that could change the current DF.
+		 * In this particular case try to 'reselect' application DF.
+		 */
+		if (reselect_app_df(fw_data->p15_card) == SC_SUCCESS) {
+			if (op->decipher)
+				rv = sc_pkcs15_decipher(fw_data->p15_card, prkey->prv_p15obj, op->flags,
+						op->in, op->in_len, op->out, op->out_len);
+			else
+				rv = sc_pkcs15_compute_signature(fw_data->p15_card, prkey->prv_p15obj, op->flags,
+						op->in, op->in_len, op->out, op->out_len);
+		}
+	}
+
+	sc_unlock(p11card->card);
+	return rv;
+}
+
+
+/*
+ * Key pool: with 'pool_keys' several identical tokens holding the same key
+ * (e.g. cloned with the SC-HSM DKEK) are used interchangeably. Members are
+ * the private keys of all logged in slots with the same ID and public key;
+ * each operation goes to the least recently used healthy member, and a member
+ * failing with a card or reader error is skipped for POOL_RETRY_DELAY seconds.
+ */
+#define POOL_RETRY_DELAY	30
+
+static unsigned long pool_clock;
+
+static int
+pkcs15_prkey_pool_key(struct pkcs15_prkey_object *prkey)
+{
+	struct sc_pkcs15_pubkey *key = prkey->pub_data;
+
+	if (prkey->pool_key)
+		return SC_SUCCESS;
+	if (!key && prkey->prv_pubkey)
+		key = ((struct pkcs15_pubkey_object *) prkey->prv_pubkey)->pub_data;
+	if (!key)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+
+	return sc_pkcs15_encode_pubkey(context, key, &prkey->pool_key, &prkey->pool_key_len);
+}
+
+static int
+pkcs15_prkey_pool_member(struct pkcs15_prkey_object *prkey,
+		struct pkcs15_prkey_object *member, unsigned usage)
+{
+	if (member == prkey)
+		return 1;
+	if (member->prv_p15obj->type != prkey->prv_p15obj->type
+			|| !(member->prv_info->usage & usage)
+			|| member->prv_p15obj->user_consent
+			|| !sc_pkcs15_compare_id(&member->prv_info->id, &prkey->prv_info->id))
+		return 0;
+	if (pkcs15_prkey_pool_key(member) != SC_SUCCESS)
+		return 0;
+
+	return member->pool_key_len == prkey->pool_key_len
+		&& !memcmp(member->pool_key, prkey->pool_key, prkey->pool_key_len);
+}
+
+static struct pkcs15_prkey_object *
+pkcs15_prkey_pool_pick(struct sc_pkcs11_slot *own_slot, struct pkcs15_prkey_object *prkey,
+		unsigned usage, struct sc_pkcs11_slot **member_slot)
+{
+	struct pkcs15_prkey_object *best = NULL;
+	time_t now = time(NULL);
+	unsigned int i, j;
+
+	for (i = 0; i < list_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *) list_get_at(&virtual_slots, i);
+
+		if (!slot->p11card || slot->p11card->framework != &framework_pkcs15
+				|| !slot->p11card->fws_data[slot->fw_data_idx])
+			continue;
+		if (slot != own_slot && slot->login_user != CKU_USER)
+			continue;
+
+		for (j = 0; j < list_size(&slot->objects); j++) {
+			struct pkcs15_prkey_object *member = (struct pkcs15_prkey_object *) list_get_at(&slot->objects, j);
+
+			if (member->base.base.ops != &pkcs15_prkey_ops
+					|| member->pool_retry_after > now
+					|| !pkcs15_prkey_pool_member(prkey, member, usage))
+				continue;
+			if (best && best->pool_last_use <= member->pool_last_use)
+				continue;
+			best = member;
+			*member_slot = slot;
+		}
+	}
+
+	return best;
+}
+
+static int
+pkcs15_prkey_pool_op(struct sc_pkcs11_slot *slot, struct pkcs15_prkey_object *prkey,
+		unsigned usage, struct pkcs15_prkey_op *op)
+{
+	struct sc_pkcs11_slot *member_slot = slot;
+	struct pkcs15_prkey_object *member = NULL;
+	int rv, pooled = 0;
+
+	if (sc_pkcs11_conf.pool_keys && !sc_pkcs11_conf.atomic && !prkey->prv_p15obj->user_consent
+			&& pkcs15_prkey_pool_key(prkey) == SC_SUCCESS) {
+		pooled = 1;
+		member = pkcs15_prkey_pool_pick(slot, prkey, usage, &member_slot);
+	}
+	if (!member) {
+		member = prkey;
+		member_slot = slot;
+	}
+
+	for (;;) {
+		struct sc_pkcs11_card *p11card = member_slot->p11card;
+
+		if (member != prkey)
+			sc_log(context, "Using pooled key in slot 0x%lx", member_slot->id);
+		rv = pkcs15_prkey_card_op(p11card,
+				(struct pkcs15_fw_data *) p11card->fws_data[member_slot->fw_data_idx],
+				member, op);
+		member->pool_last_use = ++pool_clock;
+		if (!pooled)
+			return rv;
+
+		switch (rv) {
+		case SC_ERROR_CARD_NOT_PRESENT:
+		case SC_ERROR_CARD_REMOVED:
+		case SC_ERROR_CARD_RESET:
+		case SC_ERROR_TRANSMIT_FAILED:
+		case SC_ERROR_CARD_UNRESPONSIVE:
+		case SC_ERROR_READER_DETACHED:
+		case SC_ERROR_READER_REATTACHED:
+		case SC_ERROR_SECURITY_STATUS_NOT_SATISFIED:
+			sc_log(context, "Pooled key in slot 0x%lx failed (%d), trying next",
+					member_slot->id, rv);
+			member->pool_retry_after = time(NULL) + POOL_RETRY_DELAY;
+			break;
+		default:
+			member->pool_retry_after = 0;
+			return rv;
+		}
+
+		member = pkcs15_prkey_pool_pick(slot, prkey, usage, &member_slot);
+		if (!member)
+			return rv;
+	}
+}
+
+
 static CK_RV
 pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 			CK_MECHANISM_PTR pMechanism, CK_BYTE_PTR pData,
@@ -3655,7 +3874,8 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 	struct pkcs15_prkey_object *prkey = (struct pkcs15_prkey_object *) obj;
 	struct sc_pkcs11_card *p11card = session->slot->p11card;
 	struct pkcs15_fw_data *fw_data = NULL;
-	int rv, flags = 0, prkey_has_path = 0;
+	struct pkcs15_prkey_op op = { 0 };
+	int rv, flags = 0;
 	unsigned sign_flags = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_SIGNRECOVER
 			| SC_PKCS15_PRKEY_USAGE_NONREPUDIATION;
 
@@ -3672,9 +3892,6 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 	if (prkey == NULL)
 		return CKR_KEY_FUNCTION_NOT_PERMITTED;
 
-	if (prkey->prv_info->path.len || prkey->prv_info->path.aid.len)
-		prkey_has_path = 1;
-
 	switch (pMechanism->mechanism) {
 	case CKM_RSA_PKCS:
 		flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE;
@@ -3710,35 +3927,34 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 		flags = SC_ALGORITHM_ECDSA_HASH_NONE;
 		break;
 	case CKM_ECDSA_SHA1:
-		flags = SC_ALGORITHM_ECDSA_HASH_SHA1;
+		flags = pkcs15_ecdsa_hash_flags(p11card, CKM_ECDSA_SHA1, SC_ALGORITHM_ECDSA_HASH_SHA1);
+		break;
+	case CKM_ECDSA_SHA224:
+		flags = pkcs15_ecdsa_hash_flags(p11card, CKM_ECDSA_SHA224, SC_ALGORITHM_ECDSA_HASH_SHA224);
+		break;
+	case CKM_ECDSA_SHA256:
+		flags = pkcs15_ecdsa_hash_flags(p11card, CKM_ECDSA_SHA256, SC_ALGORITHM_ECDSA_HASH_SHA256);
+		break;
+	case CKM_ECDSA_SHA384:
+		flags = pkcs15_ecdsa_hash_flags(p11card, CKM_ECDSA_SHA384, SC_ALGORITHM_ECDSA_HASH_SHA384);
+		break;
+	case CKM_ECDSA_SHA512:
+		flags = pkcs15_ecdsa_hash_flags(p11card, CKM_ECDSA_SHA512, SC_ALGORITHM_ECDSA_HASH_SHA512);
 		break;
 	default:
 		sc_log(context, "DEE - need EC for %lu", pMechanism->mechanism);
 		return CKR_MECHANISM_INVALID;
 	}
 
-	rv = sc_lock(p11card->card);
-	if (rv < 0)
-		return sc_to_cryptoki_error(rv, "C_Sign");
-
 	sc_log(context,
 	       "Selected flags %X. Now computing signature for %lu bytes. %lu bytes reserved.",
 	       flags, ulDataLen, *pulDataLen);
-	rv = sc_pkcs15_compute_signature(fw_data->p15_card, prkey->prv_p15obj, flags,
-			pData, ulDataLen, pSignature, *pulDataLen);
-	if (rv < 0 && !sc_pkcs11_conf.lock_login && !prkey_has_path) {
-		/* If private key PKCS#15 object do not have 'path' attribute,
-		 * and if PKCS#11 login session is not locked,
-		 * the compute signature could fail because of concurent access to the card
-		 * by other application that could change the current DF.
-		 * In this particular case try to 'reselect' application DF.
-		 */
-		if (reselect_app_df(fw_data->p15_card) == SC_SUCCESS)
-			rv = sc_pkcs15_compute_signature(fw_data->p15_card, prkey->prv_p15obj, flags,
-					pData, ulDataLen, pSignature, *pulDataLen);
-	}
-
-	sc_unlock(p11card->card);
+	op.flags = flags;
+	op.in = pData;
+	op.in_len = ulDataLen;
+	op.out = pSignature;
+	op.out_len = *pulDataLen;
+	rv = pkcs15_prkey_pool_op(session->slot, prkey, sign_flags, &op);
 
 	sc_log(context, "Sign complete. Result %d.", rv);
 
@@ -3761,7 +3977,9 @@ pkcs15_prkey_decrypt(struct sc_pkcs11_session *session, void *obj,
 	struct pkcs15_fw_data *fw_data = NULL;
 	struct pkcs15_prkey_object *prkey;
 	unsigned char decrypted[512]; /* FIXME: Will not work for keys above 4096 bits */
-	int	buff_too_small, rv, flags = 0, prkey_has_path = 0;
+	struct pkcs15_prkey_op op = { 0 };
+	unsigned decrypt_flags = SC_PKCS15_PRKEY_USAGE_DECRYPT | SC_PKCS15_PRKEY_USAGE_UNWRAP;
+	int	buff_too_small, rv, flags = 0;
 
 	sc_log(context, "Initiating decryption.");
 
@@ -3771,14 +3989,11 @@ pkcs15_prkey_decrypt(struct sc_pkcs11_session *session, void *obj,
 
 	/* See which of the alternative keys supports decrypt */
 	prkey = (struct pkcs15_prkey_object *) obj;
-	while (prkey  && !(prkey->prv_info->usage & (SC_PKCS15_PRKEY_USAGE_DECRYPT|SC_PKCS15_PRKEY_USAGE_UNWRAP)))
+	while (prkey  && !(prkey->prv_info->usage & decrypt_flags))
 		prkey = prkey->prv_next;
 	if (prkey == NULL)
 		return CKR_KEY_FUNCTION_NOT_PERMITTED;
 
-	if (prkey->prv_info->path.len || prkey->prv_info->path.aid.len)
-		prkey_has_path = 1;
-
 	/* Select the proper padding mechanism */
 	switch (pMechanism->mechanism) {
 	case CKM_RSA_PKCS:
@@ -3791,19 +4006,13 @@ pkcs15_prkey_decrypt(struct sc_pkcs11_session *session, void *obj,
 		return CKR_MECHANISM_INVALID;
 	}
 
-	rv = sc_lock(p11card->card);
-	if (rv < 0)
-		return sc_to_cryptoki_error(rv, "C_Decrypt");
-
-	rv = sc_pkcs15_decipher(fw_data->p15_card, prkey->prv_p15obj, flags,
-			pEncryptedData, ulEncryptedDataLen, decrypted, sizeof(decrypted));
-
-	if (rv < 0 && !sc_pkcs11_conf.lock_login && !prkey_has_path)
-		if (reselect_app_df(fw_data->p15_card) == SC_SUCCESS)
-			rv = sc_pkcs15_decipher(fw_data->p15_card, prkey->prv_p15obj, flags,
-					pEncryptedData, ulEncryptedDataLen, decrypted, sizeof(decrypted));
-
-	sc_unlock(p11card->card);
+	op.decipher = 1;
+	op.flags = flags;
+	op.in = pEncryptedData;
+	op.in_len = ulEncryptedDataLen;
+	op.out = decrypted;
+	op.out_len = sizeof(decrypted);
+	rv = pkcs15_prkey_pool_op(session->slot, prkey, decrypt_flags, &op);
 
 	sc_log(context, "Decryption complete. Result %d.", rv);
 
@@ -4232,6 +4441,7 @@ pkcs15_dobj_get_value(struct sc_pkcs11_session *session,
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GetAttributeValue");
 
+	sc_pkcs11_card_access(card);
 	rv = sc_lock(card);
 	if (rv < 0)
 		return sc_to_cryptoki_error(rv, "C_GetAttributeValue");
@@ -4722,8 +4932,21 @@ register_gost_mechanisms(struct sc_pkcs11_card *p11card, int flags)
 static int register_ec_mechanisms(struct sc_pkcs11_card *p11card, int flags,
 		unsigned long ext_flags, CK_ULONG min_key_size, CK_ULONG max_key_size)
 {
+#ifdef ENABLE_OPENSSL
+	static const struct {
+		CK_MECHANISM_TYPE mech, hash_mech;
+		int flag;
+	} ecdsa_hashes[] = {
+		{ CKM_ECDSA_SHA1, CKM_SHA_1, SC_ALGORITHM_ECDSA_HASH_SHA1 },
+		{ CKM_ECDSA_SHA224, CKM_SHA224, SC_ALGORITHM_ECDSA_HASH_SHA224 },
+		{ CKM_ECDSA_SHA256, CKM_SHA256, SC_ALGORITHM_ECDSA_HASH_SHA256 },
+		{ CKM_ECDSA_SHA384, CKM_SHA384, SC_ALGORITHM_ECDSA_HASH_SHA384 },
+		{ CKM_ECDSA_SHA512, CKM_SHA512, SC_ALGORITHM_ECDSA_HASH_SHA512 },
+	};
+	size_t i;
+#endif
 	CK_MECHANISM_INFO mech_info;
-	sc_pkcs11_mechanism_type_t *mt;
+	sc_pkcs11_mechanism_type_t *mt, *ecdsa_mt = NULL;
 	CK_FLAGS ec_flags = 0;
 	int rc;
 
@@ -4752,14 +4975,30 @@ static int register_ec_mechanisms(struct sc_pkcs11_card *p11card, int flags,
 		rc = sc_pkcs11_register_mechanism(p11card, mt);
 		if (rc != CKR_OK)
 			return rc;
+		ecdsa_mt = mt;
 	}
 
 #ifdef ENABLE_OPENSSL
-	if(flags & SC_ALGORITHM_ECDSA_HASH_SHA1) {
-		mt = sc_pkcs11_new_fw_mechanism(CKM_ECDSA_SHA1, &mech_info, CKK_EC, NULL, NULL);
-		if (!mt)
-			return CKR_HOST_MEMORY;
-		rc = sc_pkcs11_register_mechanism(p11card, mt);
+	for (i = 0; i < sizeof(ecdsa_hashes) / sizeof(ecdsa_hashes[0]); i++) {
+		if (ecdsa_mt) {
+			/* Hash in software and sign the digest, so that
+			 * C_SignUpdate() streams through the digest */
+			rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card,
+					ecdsa_hashes[i].mech, ecdsa_hashes[i].hash_mech, ecdsa_mt);
+			/* digest not available in this OpenSSL */
+			if (rc == CKR_MECHANISM_INVALID)
+				continue;
+		}
+		else if (flags & ecdsa_hashes[i].flag) {
+			/* the card hashes the data itself */
+			mt = sc_pkcs11_new_fw_mechanism(ecdsa_hashes[i].mech, &mech_info, CKK_EC, NULL, NULL);
+			if (!mt)
+				return CKR_HOST_MEMORY;
+			rc = sc_pkcs11_register_mechanism(p11card, mt);
+		}
+		else {
+			continue;
+		}
 		if (rc != CKR_OK)
 			return rc;
 	}
@@ -4823,7 +5062,7 @@ register_mechanisms(struct sc_pkcs11_card *p11card)
 	mech_info.flags = CKF_HW | CKF_SIGN | CKF_DECRYPT;
 #ifdef ENABLE_OPENSSL
 	/* That practise definitely conflicts with CKF_HW -- andre 2010-11-28 */
-	mech_info.flags |= CKF_VERIFY;
+	mech_info.flags |= CKF_VERIFY | CKF_ENCRYPT;
 #endif
 	mech_info.ulMinKeySize = ~0;
 	mech_info.ulMaxKeySize = 0;
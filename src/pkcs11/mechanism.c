@@ -39,6 +39,7 @@ struct signature_data {
 	struct sc_pkcs11_object *key;
 	struct hash_signature_info *info;
 	sc_pkcs11_operation_t *	md;
+	int			md_detached;	/* md is being fed without the global lock */
 	CK_BYTE			buffer[4096/8];
 	unsigned int		buffer_len;
 };
@@ -420,6 +421,8 @@ sc_pkcs11_signature_update(sc_pkcs11_operation_t *operation,
 	LOG_FUNC_CALLED(context);
 	sc_log(context, "data part length %li", ulPartLen);
 	data = (struct signature_data *) operation->priv_data;
+	if (data->md_detached)
+		LOG_FUNC_RETURN(context, CKR_OPERATION_ACTIVE);
 	if (data->md) {
 		CK_RV rv = data->md->type->md_update(data->md, pPart, ulPartLen);
 		LOG_FUNC_RETURN(context, rv);
@@ -444,6 +447,8 @@ sc_pkcs11_signature_final(sc_pkcs11_operation_t *operation,
 	LOG_FUNC_CALLED(context);
 	data = (struct signature_data *) operation->priv_data;
 	sc_log(context, "data length %u", data->buffer_len);
+	if (data->md_detached)
+		LOG_FUNC_RETURN(context, CKR_OPERATION_ACTIVE);
 	if (data->md) {
 		sc_pkcs11_operation_t	*md = data->md;
 		CK_ULONG len = sizeof(data->buffer);
@@ -462,6 +467,65 @@ sc_pkcs11_signature_final(sc_pkcs11_operation_t *operation,
 	LOG_FUNC_RETURN(context, rv);
 }
 
+/*
+ * Take the software digest out of a signature operation, so that the caller
+ * can feed it without holding the global lock while other sessions use the
+ * card. The operation can't proceed until sc_pkcs11_sign_attach_md().
+ */
+CK_RV
+sc_pkcs11_sign_detach_md(struct sc_pkcs11_session *session,
+		sc_pkcs11_operation_t **md)
+{
+	sc_pkcs11_operation_t *op;
+	struct signature_data *data;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_SIGN, &op);
+	if (rv != CKR_OK)
+		return rv;
+	if (op->type->sign_update != sc_pkcs11_signature_update)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	data = (struct signature_data *) op->priv_data;
+	if (!data || !data->md || data->md_detached)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	*md = data->md;
+	data->md = NULL;
+	data->md_detached = 1;
+	return CKR_OK;
+}
+
+/*
+ * Give back the digest taken by sc_pkcs11_sign_detach_md(). 'rv' is the
+ * result of feeding it; on error the signature operation is terminated.
+ * The session has to be looked up again by the caller, as it may have
+ * been closed meanwhile.
+ */
+CK_RV
+sc_pkcs11_sign_attach_md(struct sc_pkcs11_session *session,
+		sc_pkcs11_operation_t *md, CK_RV rv)
+{
+	sc_pkcs11_operation_t *op;
+	struct signature_data *data = NULL;
+
+	if (session && session_get_operation(session, SC_PKCS11_OPERATION_SIGN, &op) == CKR_OK
+			&& op->type->sign_update == sc_pkcs11_signature_update)
+		data = (struct signature_data *) op->priv_data;
+
+	if (!data || !data->md_detached) {
+		/* the operation was terminated meanwhile */
+		sc_pkcs11_release_operation(&md);
+		return CKR_OPERATION_NOT_INITIALIZED;
+	}
+
+	data->md = md;
+	data->md_detached = 0;
+	if (rv != CKR_OK)
+		session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
+	return rv;
+}
+
 static CK_RV
 sc_pkcs11_signature_size(sc_pkcs11_operation_t *operation, CK_ULONG_PTR pLength)
 {
@@ -737,6 +801,87 @@ done:
 
 	return rv;
 }
+
+/*
+ * Initialize an encryption context. Encryption with the public key is
+ * done in software, see sc_pkcs11_encrypt_data().
+ */
+CK_RV
+sc_pkcs11_encr_init(struct sc_pkcs11_session *session, CK_MECHANISM_PTR pMechanism,
+		struct sc_pkcs11_object *key, CK_MECHANISM_TYPE key_type)
+{
+	struct sc_pkcs11_card *p11card;
+	sc_pkcs11_operation_t *operation;
+	sc_pkcs11_mechanism_type_t *mt;
+	struct signature_data *data;
+	CK_RV rv;
+
+	if (!session || !session->slot
+	 || !(p11card = session->slot->p11card))
+		return CKR_ARGUMENTS_BAD;
+
+	/* See if we support this mechanism type */
+	mt = sc_pkcs11_find_mechanism(p11card, pMechanism->mechanism, CKF_ENCRYPT);
+	if (mt == NULL)
+		return CKR_MECHANISM_INVALID;
+
+	/* See if compatible with key type */
+	if (mt->key_type != key_type)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	rv = session_start_operation(session, SC_PKCS11_OPERATION_ENCRYPT, mt, &operation);
+	if (rv != CKR_OK)
+		return rv;
+
+	memcpy(&operation->mechanism, pMechanism, sizeof(CK_MECHANISM));
+
+	if (!(data = calloc(1, sizeof(*data)))) {
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+		return CKR_HOST_MEMORY;
+	}
+	data->key = key;
+	operation->priv_data = data;
+
+	return CKR_OK;
+}
+
+CK_RV
+sc_pkcs11_encr(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	sc_pkcs11_operation_t *op;
+	struct signature_data *data;
+	struct sc_pkcs11_object *key;
+	CK_ATTRIBUTE attr = {CKA_SPKI, NULL, 0};
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_ENCRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	data = (struct signature_data *) op->priv_data;
+	key = data->key;
+
+	rv = key->ops->get_attribute(session, key, &attr);
+	if (rv == CKR_OK) {
+		attr.pValue = calloc(1, attr.ulValueLen);
+		if (!attr.pValue)
+			rv = CKR_HOST_MEMORY;
+	}
+	if (rv == CKR_OK)
+		rv = key->ops->get_attribute(session, key, &attr);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_encrypt_data(attr.pValue, attr.ulValueLen,
+				op->mechanism.mechanism, pData, ulDataLen,
+				pEncryptedData, pulEncryptedDataLen);
+	free(attr.pValue);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && pEncryptedData != NULL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
 #endif
 
 /*
@@ -68,6 +68,23 @@ static sc_pkcs11_mechanism_type_t openssl_sha1_mech = {
 };
 
 #if OPENSSL_VERSION_NUMBER >= 0x00908000L
+static sc_pkcs11_mechanism_type_t openssl_sha224_mech = {
+	CKM_SHA224,
+	{ 0, 0, CKF_DIGEST },
+	0,
+	sizeof(struct sc_pkcs11_operation),
+	sc_pkcs11_openssl_md_release,
+	sc_pkcs11_openssl_md_init,
+	sc_pkcs11_openssl_md_update,
+	sc_pkcs11_openssl_md_final,
+	NULL, NULL, NULL, NULL,	/* sign_* */
+	NULL, NULL, NULL,	/* verif_* */
+	NULL, NULL,		/* decrypt_* */
+	NULL,			/* derive */
+	NULL,			/* mech_data */
+	NULL,			/* free_mech_data */
+};
+
 static sc_pkcs11_mechanism_type_t openssl_sha256_mech = {
 	CKM_SHA256,
 	{ 0, 0, CKF_DIGEST },
@@ -233,6 +250,8 @@ sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *p11card)
 	openssl_sha1_mech.mech_data = EVP_sha1();
 	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_sha1_mech, sizeof openssl_sha1_mech));
 #if OPENSSL_VERSION_NUMBER >= 0x00908000L
+	openssl_sha224_mech.mech_data = EVP_sha224();
+	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_sha224_mech, sizeof openssl_sha224_mech));
 	openssl_sha256_mech.mech_data = EVP_sha256();
 	sc_pkcs11_register_mechanism(p11card, dup_mem(&openssl_sha256_mech, sizeof openssl_sha256_mech));
 	openssl_sha384_mech.mech_data = EVP_sha384();
@@ -393,6 +412,79 @@ static CK_RV gostr3410_verify_data(const unsigned char *pubkey, int pubkey_len,
 }
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC) */
 
+/*
+ * Public keys parsed for verification and encryption are kept, so that
+ * repeated operations with the same key don't decode it again and reuse
+ * the Montgomery context cached in the RSA key.
+ */
+#define PUBKEY_CACHE_SIZE	8
+
+static struct pubkey_cache_entry {
+	unsigned char *der;
+	int der_len;
+	EVP_PKEY *pkey;
+	unsigned long last_use;
+} pubkey_cache[PUBKEY_CACHE_SIZE];
+static unsigned long pubkey_cache_clock;
+
+/* The returned key belongs to the cache and must not be freed */
+static EVP_PKEY *
+sc_pkcs11_get_pubkey(const unsigned char *pubkey, int pubkey_len)
+{
+	struct pubkey_cache_entry *entry = &pubkey_cache[0];
+	const unsigned char *pubkey_tmp = pubkey;
+	EVP_PKEY *pkey;
+	unsigned char *der;
+	int i;
+
+	for (i = 0; i < PUBKEY_CACHE_SIZE; i++) {
+		if (pubkey_cache[i].pkey && pubkey_cache[i].der_len == pubkey_len
+				&& !memcmp(pubkey_cache[i].der, pubkey, pubkey_len)) {
+			pubkey_cache[i].last_use = ++pubkey_cache_clock;
+			return pubkey_cache[i].pkey;
+		}
+		if (pubkey_cache[i].last_use < entry->last_use)
+			entry = &pubkey_cache[i];
+	}
+
+	/*
+	 * PKCS#11 does not define CKA_VALUE for public keys, and different cards
+	 * return either the raw or spki versions as defined in PKCS#15
+	 * And we need to support more then just RSA.
+	 * We can use d2i_PUBKEY which works for SPKI and any key type.
+	 */
+	pkey = d2i_PUBKEY(NULL, &pubkey_tmp, pubkey_len);
+	if (pkey == NULL)
+		return NULL;
+	der = malloc(pubkey_len);
+	if (der == NULL) {
+		EVP_PKEY_free(pkey);
+		return NULL;
+	}
+	memcpy(der, pubkey, pubkey_len);
+
+	/* replace the least recently used entry */
+	EVP_PKEY_free(entry->pkey);
+	free(entry->der);
+	entry->der = der;
+	entry->der_len = pubkey_len;
+	entry->pkey = pkey;
+	entry->last_use = ++pubkey_cache_clock;
+	return pkey;
+}
+
+void
+sc_pkcs11_openssl_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < PUBKEY_CACHE_SIZE; i++) {
+		EVP_PKEY_free(pubkey_cache[i].pkey);
+		free(pubkey_cache[i].der);
+	}
+	memset(pubkey_cache, 0, sizeof(pubkey_cache));
+}
+
 /* If no hash function was used, finish with RSA_public_decrypt().
  * If a hash function was used, we can make a big shortcut by
  *   finishing with EVP_VerifyFinal().
@@ -406,7 +498,6 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 	int res;
 	CK_RV rv = CKR_GENERAL_ERROR;
 	EVP_PKEY *pkey = NULL;
-	const unsigned char *pubkey_tmp = NULL;
 
 	if (mech == CKM_GOSTR3410)
 	{
@@ -420,15 +511,7 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 #endif
 	}
 
-	/*
-	 * PKCS#11 does not define CKA_VALUE for public keys, and different cards
-	 * return either the raw or spki versions as defined in PKCS#15
-	 * And we need to support more then just RSA.
-	 * We can use d2i_PUBKEY which works for SPKI and any key type. 
-	 */
-	pubkey_tmp = pubkey; /* pass in so pubkey pointer is not modified */
-
-	pkey = d2i_PUBKEY(NULL, &pubkey_tmp, pubkey_len);
+	pkey = sc_pkcs11_get_pubkey(pubkey, pubkey_len);
 	if (pkey == NULL)
 		return CKR_GENERAL_ERROR;
 
@@ -436,7 +519,6 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 		EVP_MD_CTX *md_ctx = DIGEST_CTX(md);
 
 		res = EVP_VerifyFinal(md_ctx, signat, signat_len, pkey);
-		EVP_PKEY_free(pkey);
 		if (res == 1)
 			return CKR_OK;
 		else if (res == 0)
@@ -460,12 +542,10 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 		 	break;
 		/* TODO support more then RSA */
 		 default:
-			EVP_PKEY_free(pkey);
 		 	return CKR_ARGUMENTS_BAD;
 		 }
 
 		rsa = EVP_PKEY_get1_RSA(pkey);
-		EVP_PKEY_free(pkey);
 		if (rsa == NULL)
 			return CKR_DEVICE_MEMORY;
 
@@ -493,4 +573,52 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 
 	return rv;
 }
+
+/*
+ * Public key encryption is done on the host, there is no reason to bother
+ * the card with it.
+ */
+CK_RV sc_pkcs11_encrypt_data(const unsigned char *pubkey, int pubkey_len,
+			CK_MECHANISM_TYPE mech,
+			unsigned char *data, int data_len,
+			unsigned char *out, CK_ULONG_PTR out_len)
+{
+	EVP_PKEY *pkey;
+	RSA *rsa;
+	int pad, r;
+
+	switch (mech) {
+	case CKM_RSA_PKCS:
+		pad = RSA_PKCS1_PADDING;
+		break;
+	case CKM_RSA_X_509:
+		pad = RSA_NO_PADDING;
+		break;
+	default:
+		return CKR_MECHANISM_INVALID;
+	}
+
+	pkey = sc_pkcs11_get_pubkey(pubkey, pubkey_len);
+	if (pkey == NULL)
+		return CKR_GENERAL_ERROR;
+	rsa = EVP_PKEY_get1_RSA(pkey);
+	if (rsa == NULL)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	if (out == NULL || *out_len < (CK_ULONG)RSA_size(rsa)) {
+		r = RSA_size(rsa);
+		RSA_free(rsa);
+		*out_len = r;
+		return out ? CKR_BUFFER_TOO_SMALL : CKR_OK;
+	}
+
+	r = RSA_public_encrypt(data_len, data, out, rsa, pad);
+	RSA_free(rsa);
+	if (r <= 0) {
+		sc_log(context, "RSA_public_encrypt() returned %d\n", r);
+		return CKR_DATA_LEN_RANGE;
+	}
+	*out_len = r;
+	return CKR_OK;
+}
 #endif
@@ -361,6 +361,7 @@ static enum_specs ck_mec_s[] = {
   { CKM_SHA_1                    , "CKM_SHA_1                    " },
   { CKM_SHA_1_HMAC               , "CKM_SHA_1_HMAC               " },
   { CKM_SHA_1_HMAC_GENERAL       , "CKM_SHA_1_HMAC_GENERAL       " },
+  { CKM_SHA224                   , "CKM_SHA224                   " },
   { CKM_SHA256                   , "CKM_SHA256                   " },
   { CKM_SHA256_HMAC              , "CKM_SHA256_HMAC              " },
   { CKM_SHA256_HMAC_GENERAL      , "CKM_SHA256_HMAC_GENERAL      " },
@@ -479,6 +480,10 @@ static enum_specs ck_mec_s[] = {
   { CKM_EC_KEY_PAIR_GEN          , "CKM_EC_KEY_PAIR_GEN          " },
   { CKM_ECDSA                    , "CKM_ECDSA                    " },
   { CKM_ECDSA_SHA1               , "CKM_ECDSA_SHA1               " },
+  { CKM_ECDSA_SHA224             , "CKM_ECDSA_SHA224             " },
+  { CKM_ECDSA_SHA256             , "CKM_ECDSA_SHA256             " },
+  { CKM_ECDSA_SHA384             , "CKM_ECDSA_SHA384             " },
+  { CKM_ECDSA_SHA512             , "CKM_ECDSA_SHA512             " },
   { CKM_ECDH1_DERIVE             , "CKM_ECDH1_DERIVE             " },
   { CKM_ECDH1_COFACTOR_DERIVE    , "CKM_ECDH1_COFACTOR_DERIVE    " },
   { CKM_ECMQV_DERIVE             , "CKM_ECMQV_DERIVE             " },
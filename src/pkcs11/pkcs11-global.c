@@ -208,6 +208,18 @@ static int slot_list_seeker(const void *el, const void *key) {
 		return 1;
 	return 0;
 }
+static list_hash_t session_list_hasher(const void *el) {
+	return (list_hash_t)((const struct sc_pkcs11_session *)el)->handle;
+}
+static list_hash_t session_handle_hasher(const void *key) {
+	return (list_hash_t)*(const CK_SESSION_HANDLE *)key;
+}
+static list_hash_t slot_list_hasher(const void *el) {
+	return (list_hash_t)((const struct sc_pkcs11_slot *)el)->id;
+}
+static list_hash_t slot_id_hasher(const void *key) {
+	return (list_hash_t)*(const CK_SLOT_ID *)key;
+}
 
 
 
@@ -261,14 +273,18 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 		rv = CKR_HOST_MEMORY;
 		goto out;
 	}
+	list_attributes_vector(&sessions, 1);
 	list_attributes_seeker(&sessions, session_list_seeker);
+	list_attributes_seeker_hash(&sessions, session_list_hasher, session_handle_hasher);
 
 	/* List of slots */
 	if (0 != list_init(&virtual_slots)) {
 		rv = CKR_HOST_MEMORY;
 		goto out;
 	}
+	list_attributes_vector(&virtual_slots, 1);
 	list_attributes_seeker(&virtual_slots, slot_list_seeker);
+	list_attributes_seeker_hash(&virtual_slots, slot_list_hasher, slot_id_hasher);
 
 	/* Create slots for readers found on initialization, only if in 2.11 mode */
 	for (i=0; i<sc_ctx_get_reader_count(context); i++)
@@ -329,6 +345,9 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 
 	sc_release_context(context);
 	context = NULL;
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_openssl_cleanup();
+#endif
 
 	/* Release and destroy the mutex */
 	sc_pkcs11_free_lock();
@@ -798,6 +817,35 @@ void sc_pkcs11_unlock(void)
 	__sc_pkcs11_unlock(global_lock);
 }
 
+/* Card whose lock is taken on first access, and whether it was taken */
+static struct sc_card *deferred_card = NULL;
+static int deferred_card_locked = 0;
+
+void sc_pkcs11_defer_card_lock(struct sc_card *card)
+{
+	sc_pkcs11_release_card_lock();
+	deferred_card = card;
+}
+
+/*
+ * Called before reading from the card: if the current call deferred
+ * the lock of this card, take it now and keep it until the call is done.
+ */
+void sc_pkcs11_card_access(struct sc_card *card)
+{
+	if (card && card == deferred_card && !deferred_card_locked
+			&& sc_lock(card) == SC_SUCCESS)
+		deferred_card_locked = 1;
+}
+
+void sc_pkcs11_release_card_lock(void)
+{
+	if (deferred_card_locked)
+		sc_unlock(deferred_card);
+	deferred_card = NULL;
+	deferred_card_locked = 0;
+}
+
 /*
  * Free the lock - note the lock must be held when
  * you come here
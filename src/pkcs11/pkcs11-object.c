@@ -27,6 +27,9 @@
 
 static void sc_find_release(sc_pkcs11_operation_t *operation);
 
+/* Data parts from this size on are hashed without the global lock */
+#define SIGN_UNLOCKED_DIGEST_MIN	4096
+
 /* Pseudo mechanism for the Find operation */
 static sc_pkcs11_mechanism_type_t find_mechanism = {
 	0,		/* mech */
@@ -228,6 +231,12 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	/* Debug printf */
 	snprintf(object_name, sizeof(object_name), "Object %lu", (unsigned long)hObject);
 
+	/* Attributes may need the object's data to be read from the card
+	 * (certificate, data object); for a whole template do that within
+	 * one card transaction, taken only if an attribute reads at all. */
+	if (ulCount > 1 && session->slot->p11card)
+		sc_pkcs11_defer_card_lock(session->slot->p11card->card);
+
 	res_type = 0;
 	for (i = 0; i < ulCount; i++) {
 		res = object->ops->get_attribute(session, object, &pTemplate[i]);
@@ -255,6 +264,8 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		}
 	}
 
+	sc_pkcs11_release_card_lock();
+
 out:	sc_log(context, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = %s",
 			hSession, hObject, lookup_enum ( RV_T, rv ));
 	sc_pkcs11_unlock();
@@ -604,6 +615,41 @@ C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 }
 
 
+/*
+ * Feed data to be signed. If it is hashed in software, do that without the
+ * global lock, so that other sessions (threads) can meanwhile run their card
+ * operations. Called and returns with the lock held; *session is updated as
+ * it may be gone when the lock is taken again.
+ */
+static CK_RV
+sign_update(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session,
+		CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+{
+	sc_pkcs11_operation_t *md = NULL;
+	CK_RV rv;
+
+	if (ulPartLen < SIGN_UNLOCKED_DIGEST_MIN
+			|| sc_pkcs11_sign_detach_md(*session, &md) != CKR_OK)
+		return sc_pkcs11_sign_update(*session, pPart, ulPartLen);
+
+	sc_pkcs11_unlock();
+	rv = md->type->md_update(md, pPart, ulPartLen);
+	if (sc_pkcs11_lock() != CKR_OK) {
+		/* finalized meanwhile */
+		*session = NULL;
+		sc_pkcs11_release_operation(&md);
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+
+	if (get_session(hSession, session) != CKR_OK)
+		*session = NULL;
+	rv = sc_pkcs11_sign_attach_md(*session, md, rv);
+	if (rv != CKR_OK)
+		*session = NULL;
+	return rv;
+}
+
+
 CK_RV
 C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		CK_MECHANISM_PTR pMechanism,	/* the signature mechanism */
@@ -689,7 +735,7 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		goto out;
 	}
 
-	rv = sc_pkcs11_sign_update(session, pData, ulDataLen);
+	rv = sign_update(hSession, &session, pData, ulDataLen);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK)
@@ -718,7 +764,7 @@ C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	rv = get_session(hSession, &session);
 	if (rv == CKR_OK)
-		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
+		rv = sign_update(hSession, &session, pPart, ulPartLen);
 
 	sc_log(context, "C_SignUpdate() = %s", lookup_enum ( RV_T, rv ));
 	sc_pkcs11_unlock();
@@ -793,7 +839,49 @@ C_EncryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_MECHANISM_PTR pMechanism,	/* the encryption mechanism */
 		CK_OBJECT_HANDLE hKey)		/* handle of encryption key */
 {
+#ifndef ENABLE_OPENSSL
 	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	CK_BBOOL can_encrypt;
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE encrypt_attribute = { CKA_ENCRYPT,	&can_encrypt,	sizeof(can_encrypt) };
+	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE,	&key_type,	sizeof(key_type) };
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *object;
+
+	if (pMechanism == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_object_from_session(hSession, hKey, &session, &object);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+
+	rv = object->ops->get_attribute(session, object, &encrypt_attribute);
+	if (rv != CKR_OK || !can_encrypt) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+	rv = object->ops->get_attribute(session, object, &key_type_attr);
+	if (rv != CKR_OK) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	rv = sc_pkcs11_encr_init(session, pMechanism, object, key_type);
+
+out:
+	sc_log(context, "C_EncryptInit() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock();
+	return rv;
+#endif
 }
 
 
@@ -803,7 +891,28 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_BYTE_PTR pEncryptedData,	/* receives encrypted data */
 		CK_ULONG_PTR pulEncryptedDataLen)
 {				/* receives encrypted byte count */
+#ifndef ENABLE_OPENSSL
 	return CKR_FUNCTION_NOT_SUPPORTED;
+#else
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	if (pData == NULL_PTR || pulEncryptedDataLen == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_encr(session, pData, ulDataLen,
+				pEncryptedData, pulEncryptedDataLen);
+
+	sc_log(context, "C_Encrypt() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock();
+	return rv;
+#endif
 }
 
 CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
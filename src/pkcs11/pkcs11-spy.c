@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -29,6 +30,11 @@
 #else
 #include <sys/time.h>
 #include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+#if !defined(_WIN32) && defined(HAVE_PTHREAD)
+#include <pthread.h>
 #endif
 
 #define CRYPTOKI_EXPORTS
@@ -49,6 +55,78 @@ static CK_FUNCTION_LIST_PTR po = NULL;
 static void *modhandle = NULL;
 /* Spy module output */
 static FILE *spy_output = NULL;
+/* Trace calls to spy_output; off in profiling mode unless PKCS11SPY_OUTPUT is set */
+static int spy_trace = 1;
+
+/*
+ * Profiling mode (PKCS11SPY_PROFILE=<file>): per function and mechanism
+ * call and error counts and a log-linear latency histogram. The statistics
+ * are appended to the file as one JSON object per line at C_Finalize and,
+ * on Unix, at the first call after SIGUSR1.
+ */
+#define SPY_HIST_SUB		8	/* buckets per power of two */
+#define SPY_HIST_SIZE		(SPY_HIST_SUB * 40)
+#define SPY_STATS_BUCKETS	64
+#define SPY_SESSIONS		64
+#define SPY_NO_MECHANISM	((CK_MECHANISM_TYPE) CK_UNAVAILABLE_INFORMATION)
+
+enum { SPY_OP_ENCRYPT, SPY_OP_DECRYPT, SPY_OP_DIGEST, SPY_OP_SIGN, SPY_OP_VERIFY,
+	SPY_OP_NONE };
+
+struct spy_stat {
+	const char *function;
+	CK_MECHANISM_TYPE mechanism;
+	unsigned long count, errors;
+	unsigned long long total_us, min_us, max_us;
+	unsigned long hist[SPY_HIST_SIZE];
+	struct spy_stat *next;
+};
+
+/* State of one call, between enter() and retne() */
+struct spy_call {
+	const char *function;
+	CK_MECHANISM_TYPE mechanism;
+#ifdef _WIN32
+	LARGE_INTEGER start;
+#else
+	struct timespec start;
+#endif
+};
+
+static FILE *spy_profile = NULL;
+static struct spy_stat *spy_stats[SPY_STATS_BUCKETS];
+/* Mechanism of the active operations, to attribute C_Sign etc. */
+static struct {
+	CK_SESSION_HANDLE session;
+	CK_MECHANISM_TYPE mechanism[SPY_OP_NONE];
+} spy_sessions[SPY_SESSIONS];
+
+#ifdef _WIN32
+static CRITICAL_SECTION spy_profile_lock;
+static LARGE_INTEGER spy_counter_freq;
+#define spy_profile_lock()	EnterCriticalSection(&spy_profile_lock)
+#define spy_profile_unlock()	LeaveCriticalSection(&spy_profile_lock)
+#elif defined(HAVE_PTHREAD)
+static pthread_mutex_t spy_profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define spy_profile_lock()	pthread_mutex_lock(&spy_profile_mutex)
+#define spy_profile_unlock()	pthread_mutex_unlock(&spy_profile_mutex)
+#else
+#define spy_profile_lock()
+#define spy_profile_unlock()
+#endif
+
+#ifndef _WIN32
+static volatile sig_atomic_t spy_dump_requested = 0;
+
+static void
+spy_sigusr1(int sig)
+{
+	(void)sig;
+	spy_dump_requested = 1;
+}
+#endif
+
+static void spy_profile_init(const char *output);
 
 /* Inits the spy. If successfull, po != NULL */
 static CK_RV
@@ -147,6 +225,10 @@ init_spy(void)
 	 * as we want to be able to override configuration file via
 	 * environment variables
 	 */
+	output = getenv("PKCS11SPY_PROFILE");
+	if (output)
+		spy_profile_init(output);
+
 	output = getenv("PKCS11SPY_OUTPUT");
 	if (output)
 		spy_output = fopen(output, "a");
@@ -180,6 +262,17 @@ init_spy(void)
 		spy_output = fopen(output, "a");
 	}
 #endif
+	if (!spy_output && spy_profile) {
+		/* profiling only: the wrappers still write, but to nowhere */
+		spy_trace = 0;
+#ifdef _WIN32
+		spy_output = fopen("NUL", "w");
+#else
+		spy_output = fopen("/dev/null", "w");
+#endif
+		if (spy_output)
+			setvbuf(spy_output, NULL, _IOFBF, BUFSIZ);
+	}
 	if (!spy_output)
 		spy_output = stderr;
 
@@ -236,7 +329,204 @@ init_spy(void)
 
 
 static void
-enter(const char *function)
+spy_profile_init(const char *output)
+{
+	spy_profile = fopen(output, "a");
+	if (!spy_profile)
+		return;
+#ifdef _WIN32
+	InitializeCriticalSection(&spy_profile_lock);
+	QueryPerformanceFrequency(&spy_counter_freq);
+#else
+	{
+		struct sigaction sa, old;
+
+		/* don't take SIGUSR1 away from the application */
+		if (sigaction(SIGUSR1, NULL, &old) == 0 && old.sa_handler == SIG_DFL) {
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = spy_sigusr1;
+			sa.sa_flags = SA_RESTART;
+			sigemptyset(&sa.sa_mask);
+			sigaction(SIGUSR1, &sa, NULL);
+		}
+	}
+#endif
+}
+
+static unsigned int
+spy_hist_index(unsigned long long us)
+{
+	unsigned int e = 0;
+
+	if (us < SPY_HIST_SUB)
+		return (unsigned int)us;
+	while ((us >> e) >= 2 * SPY_HIST_SUB)
+		e++;
+	if ((e + 2) * SPY_HIST_SUB > SPY_HIST_SIZE)
+		return SPY_HIST_SIZE - 1;
+	return (e + 1) * SPY_HIST_SUB + (unsigned int)((us >> e) - SPY_HIST_SUB);
+}
+
+/* Lowest value counted in a histogram bucket */
+static unsigned long long
+spy_hist_value(unsigned int i)
+{
+	if (i < SPY_HIST_SUB)
+		return i;
+	return (unsigned long long)(SPY_HIST_SUB + i % SPY_HIST_SUB) << (i / SPY_HIST_SUB - 1);
+}
+
+static unsigned long long
+spy_hist_percentile(const struct spy_stat *stat, unsigned int percent)
+{
+	unsigned long long want = (stat->count * (unsigned long long)percent + 99) / 100, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < SPY_HIST_SIZE; i++) {
+		seen += stat->hist[i];
+		if (seen >= want)
+			return spy_hist_value(i);
+	}
+	return stat->max_us;
+}
+
+/* Called with the profile lock held */
+static void
+spy_profile_dump(void)
+{
+	const char *sep = "";
+	unsigned int b, i;
+	struct spy_stat *stat;
+
+	if (!spy_profile)
+		return;
+
+#ifdef _WIN32
+	fprintf(spy_profile, "{\"pid\":%lu,\"time\":%lu,\"stats\":[",
+			(unsigned long)GetCurrentProcessId(), (unsigned long)time(NULL));
+#else
+	fprintf(spy_profile, "{\"pid\":%lu,\"time\":%lu,\"stats\":[",
+			(unsigned long)getpid(), (unsigned long)time(NULL));
+#endif
+	for (b = 0; b < SPY_STATS_BUCKETS; b++) {
+		for (stat = spy_stats[b]; stat; stat = stat->next) {
+			const char *hsep = "";
+
+			fprintf(spy_profile, "%s\n{\"function\":\"%s\"", sep, stat->function);
+			if (stat->mechanism != SPY_NO_MECHANISM) {
+				const char *name = lookup_enum(MEC_T, stat->mechanism);
+
+				if (name)
+					fprintf(spy_profile, ",\"mechanism\":\"%s\"", name);
+				else
+					fprintf(spy_profile, ",\"mechanism\":\"0x%08lx\"", stat->mechanism);
+			}
+			fprintf(spy_profile, ",\"count\":%lu,\"errors\":%lu,\"total_us\":%llu"
+					",\"min_us\":%llu,\"max_us\":%llu"
+					",\"p50_us\":%llu,\"p90_us\":%llu,\"p99_us\":%llu,\"histogram\":[",
+					stat->count, stat->errors, stat->total_us,
+					stat->min_us, stat->max_us,
+					spy_hist_percentile(stat, 50), spy_hist_percentile(stat, 90),
+					spy_hist_percentile(stat, 99));
+			for (i = 0; i < SPY_HIST_SIZE; i++) {
+				if (!stat->hist[i])
+					continue;
+				fprintf(spy_profile, "%s[%llu,%lu]", hsep, spy_hist_value(i), stat->hist[i]);
+				hsep = ",";
+			}
+			fprintf(spy_profile, "]}");
+			sep = ",";
+		}
+	}
+	fprintf(spy_profile, "]}\n");
+	fflush(spy_profile);
+}
+
+static void
+spy_profile_record(struct spy_call *call, CK_RV rv)
+{
+	unsigned long long us;
+	unsigned int b;
+	struct spy_stat *stat;
+#ifdef _WIN32
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+	us = (unsigned long long)(now.QuadPart - call->start.QuadPart) * 1000000
+		/ (unsigned long long)spy_counter_freq.QuadPart;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (unsigned long long)(now.tv_sec - call->start.tv_sec) * 1000000
+		+ (now.tv_nsec - call->start.tv_nsec) / 1000;
+#endif
+
+	b = (unsigned int)((((size_t)call->function) >> 4) ^ call->mechanism) % SPY_STATS_BUCKETS;
+
+	spy_profile_lock();
+	for (stat = spy_stats[b]; stat; stat = stat->next)
+		if (stat->function == call->function && stat->mechanism == call->mechanism)
+			break;
+	if (!stat) {
+		stat = calloc(1, sizeof(*stat));
+		if (stat) {
+			stat->function = call->function;
+			stat->mechanism = call->mechanism;
+			stat->min_us = us;
+			stat->next = spy_stats[b];
+			spy_stats[b] = stat;
+		}
+	}
+	if (stat) {
+		stat->count++;
+		if (rv != CKR_OK)
+			stat->errors++;
+		stat->total_us += us;
+		if (us < stat->min_us)
+			stat->min_us = us;
+		if (us > stat->max_us)
+			stat->max_us = us;
+		stat->hist[spy_hist_index(us)]++;
+	}
+#ifndef _WIN32
+	if (spy_dump_requested) {
+		spy_dump_requested = 0;
+		spy_profile_dump();
+	}
+#endif
+	spy_profile_unlock();
+}
+
+/* The mechanism of an operation, remembered for the rest of it */
+static void
+spy_set_mechanism(struct spy_call *call, CK_SESSION_HANDLE session, int op,
+		CK_MECHANISM_PTR mechanism)
+{
+	if (!spy_profile || !mechanism)
+		return;
+	call->mechanism = mechanism->mechanism;
+	if (op == SPY_OP_NONE)
+		return;
+	spy_profile_lock();
+	spy_sessions[session % SPY_SESSIONS].session = session;
+	spy_sessions[session % SPY_SESSIONS].mechanism[op] = mechanism->mechanism;
+	spy_profile_unlock();
+}
+
+static void
+spy_get_mechanism(struct spy_call *call, CK_SESSION_HANDLE session, int op)
+{
+	if (!spy_profile)
+		return;
+	spy_profile_lock();
+	if (spy_sessions[session % SPY_SESSIONS].session == session)
+		call->mechanism = spy_sessions[session % SPY_SESSIONS].mechanism[op];
+	spy_profile_unlock();
+}
+
+static void
+spy_enter(struct spy_call *call, const char *function)
 {
 	static int count = 0;
 #ifdef _WIN32
@@ -247,6 +537,18 @@ enter(const char *function)
 	char time_string[40];
 #endif
 
+	call->function = function;
+	call->mechanism = SPY_NO_MECHANISM;
+	if (spy_profile) {
+#ifdef _WIN32
+		QueryPerformanceCounter(&call->start);
+#else
+		clock_gettime(CLOCK_MONOTONIC, &call->start);
+#endif
+	}
+	if (!spy_trace)
+		return;
+
 	fprintf(spy_output, "\n%d: %s\n", count++, function);
 #ifdef _WIN32
         GetLocalTime(&st);
@@ -262,17 +564,33 @@ enter(const char *function)
 }
 
 static CK_RV
-retne(CK_RV rv)
+spy_retne(struct spy_call *call, CK_RV rv)
 {
+	if (spy_profile)
+		spy_profile_record(call, rv);
+	if (!spy_trace)
+		return rv;
 	fprintf(spy_output, "Returned:  %ld %s\n", (unsigned long) rv, lookup_enum ( RV_T, rv ));
 	fflush(spy_output);
 	return rv;
 }
 
+/* Each wrapper brackets the call to the real module with these */
+#define enter(function) \
+	struct spy_call spy_call; \
+	spy_enter(&spy_call, function)
+#define retne(rv)	spy_retne(&spy_call, rv)
+#define profile_mechanism(session, op, mechanism) \
+	spy_set_mechanism(&spy_call, session, op, mechanism)
+#define profile_operation(session, op) \
+	spy_get_mechanism(&spy_call, session, op)
+
 
 static void
 spy_dump_string_in(const char *name, CK_VOID_PTR data, CK_ULONG size)
 {
+	if (!spy_trace)
+		return;
 	fprintf(spy_output, "[in] %s ", name);
 	print_generic(spy_output, 0, data, size, NULL);
 }
@@ -280,6 +598,8 @@ spy_dump_string_in(const char *name, CK_VOID_PTR data, CK_ULONG size)
 static void
 spy_dump_string_out(const char *name, CK_VOID_PTR data, CK_ULONG size)
 {
+	if (!spy_trace)
+		return;
 	fprintf(spy_output, "[out] %s ", name);
 	print_generic(spy_output, 0, data, size, NULL);
 }
@@ -287,24 +607,40 @@ spy_dump_string_out(const char *name, CK_VOID_PTR data, CK_ULONG size)
 static void
 spy_dump_ulong_in(const char *name, CK_ULONG value)
 {
+	if (!spy_trace)
+		return;
 	fprintf(spy_output, "[in] %s = 0x%lx\n", name, value);
 }
 
 static void
 spy_dump_ulong_out(const char *name, CK_ULONG value)
 {
+	if (!spy_trace)
+		return;
 	fprintf(spy_output, "[out] %s = 0x%lx\n", name, value);
 }
 
 static void
 spy_dump_desc_out(const char *name)
 {
-  fprintf(spy_output, "[out] %s: \n", name);
+	if (!spy_trace)
+		return;
+	fprintf(spy_output, "[out] %s: \n", name);
+}
+
+static void
+spy_dump_mechanism_in(CK_MECHANISM_PTR pMechanism)
+{
+	if (!spy_trace)
+		return;
+	spy_dump_mechanism_in(pMechanism);
 }
 
 static void
 spy_dump_array_out(const char *name, CK_ULONG size)
 {
+	if (!spy_trace)
+		return;
 	fprintf(spy_output, "[out] %s[%ld]: \n", name, size);
 }
 
@@ -312,6 +648,8 @@ static void
 spy_attribute_req_in(const char *name, CK_ATTRIBUTE_PTR pTemplate,
 			  CK_ULONG  ulCount)
 {
+	if (!spy_trace)
+		return;
 	fprintf(spy_output, "[in] %s[%ld]: \n", name, ulCount);
 	print_attribute_list_req(spy_output, pTemplate, ulCount);
 }
@@ -320,6 +658,8 @@ static void
 spy_attribute_list_in(const char *name, CK_ATTRIBUTE_PTR pTemplate,
 			  CK_ULONG  ulCount)
 {
+	if (!spy_trace)
+		return;
 	fprintf(spy_output, "[in] %s[%ld]: \n", name, ulCount);
 	print_attribute_list(spy_output, pTemplate, ulCount);
 }
@@ -328,6 +668,8 @@ static void
 spy_attribute_list_out(const char *name, CK_ATTRIBUTE_PTR pTemplate,
 			  CK_ULONG  ulCount)
 {
+	if (!spy_trace)
+		return;
 	fprintf(spy_output, "[out] %s[%ld]: \n", name, ulCount);
 	print_attribute_list(spy_output, pTemplate, ulCount);
 }
@@ -335,19 +677,23 @@ spy_attribute_list_out(const char *name, CK_ATTRIBUTE_PTR pTemplate,
 static void
 print_ptr_in(const char *name, CK_VOID_PTR ptr)
 {
+	if (!spy_trace)
+		return;
  	fprintf(spy_output, "[in] %s = %p\n", name, ptr);
 }
 
 CK_RV C_GetFunctionList
 (CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
 {
+	struct spy_call spy_call;
+
 	if (po == NULL) {
 		CK_RV rv = init_spy();
 		if (rv != CKR_OK)
 			return rv;
 	}
 
-	enter("C_GetFunctionList");
+	spy_enter(&spy_call, "C_GetFunctionList");
 	*ppFunctionList = pkcs11_spy;
 	return retne(CKR_OK);
 }
@@ -355,6 +701,7 @@ CK_RV C_GetFunctionList
 CK_RV
 C_Initialize(CK_VOID_PTR pInitArgs)
 {
+	struct spy_call spy_call;
 	CK_RV rv;
 
 	if (po == NULL) {
@@ -363,10 +710,10 @@ C_Initialize(CK_VOID_PTR pInitArgs)
 			return rv;
 	}
 
-	enter("C_Initialize");
+	spy_enter(&spy_call, "C_Initialize");
 	print_ptr_in("pInitArgs", pInitArgs);
 
-	if (pInitArgs) {
+	if (pInitArgs && spy_trace) {
 		CK_C_INITIALIZE_ARGS *ptr = pInitArgs;
 		fprintf(spy_output, "     flags: %ld\n", ptr->flags);
 		if (ptr->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS)
@@ -386,7 +733,13 @@ C_Finalize(CK_VOID_PTR pReserved)
 
 	enter("C_Finalize");
 	rv = po->C_Finalize(pReserved);
-	return retne(rv);
+	rv = retne(rv);
+	if (spy_profile) {
+		spy_profile_lock();
+		spy_profile_dump();
+		spy_profile_unlock();
+	}
+	return rv;
 }
 
 CK_RV
@@ -398,7 +751,8 @@ C_GetInfo(CK_INFO_PTR pInfo)
 	rv = po->C_GetInfo(pInfo);
 	if(rv == CKR_OK) {
 		spy_dump_desc_out("pInfo");
-		print_ck_info(spy_output, pInfo);
+		if (spy_trace)
+			print_ck_info(spy_output, pInfo);
 	}
 	return retne(rv);
 }
@@ -414,7 +768,8 @@ C_GetSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList,
 	rv = po->C_GetSlotList(tokenPresent, pSlotList, pulCount);
 	if(rv == CKR_OK) {
 		spy_dump_desc_out("pSlotList");
-		print_slot_list(spy_output, pSlotList, *pulCount);
+		if (spy_trace)
+			print_slot_list(spy_output, pSlotList, *pulCount);
 		spy_dump_ulong_out("*pulCount", *pulCount);
 	}
 	return retne(rv);
@@ -430,7 +785,8 @@ C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 	rv = po->C_GetSlotInfo(slotID, pInfo);
 	if(rv == CKR_OK) {
 		spy_dump_desc_out("pInfo");
-		print_slot_info(spy_output, pInfo);
+		if (spy_trace)
+			print_slot_info(spy_output, pInfo);
 	}
 	return retne(rv);
 }
@@ -446,7 +802,8 @@ C_GetTokenInfo(CK_SLOT_ID slotID,
 	rv = po->C_GetTokenInfo(slotID, pInfo);
 	if(rv == CKR_OK) {
 		spy_dump_desc_out("pInfo");
-		print_token_info(spy_output, pInfo);
+		if (spy_trace)
+			print_token_info(spy_output, pInfo);
 	}
 	return retne(rv);
 }
@@ -462,7 +819,8 @@ C_GetMechanismList(CK_SLOT_ID  slotID, CK_MECHANISM_TYPE_PTR pMechanismList,
 	rv = po->C_GetMechanismList(slotID, pMechanismList, pulCount);
 	if(rv == CKR_OK) {
 		spy_dump_array_out("pMechanismList", *pulCount);
-		print_mech_list(spy_output, pMechanismList, *pulCount);
+		if (spy_trace)
+			print_mech_list(spy_output, pMechanismList, *pulCount);
 	}
 	return retne(rv);
 }
@@ -472,19 +830,23 @@ C_GetMechanismInfo(CK_SLOT_ID  slotID, CK_MECHANISM_TYPE type,
 		CK_MECHANISM_INFO_PTR pInfo)
 {
 	CK_RV rv;
-	const char *name = lookup_enum(MEC_T, type);
+	const char *name;
 
 	enter("C_GetMechanismInfo");
 	spy_dump_ulong_in("slotID", slotID);
-	if (name)
-		fprintf(spy_output, "%30s \n", name);
-	else
-		fprintf(spy_output, " Unknown Mechanism (%08lx)  \n", type);
+	if (spy_trace) {
+		name = lookup_enum(MEC_T, type);
+		if (name)
+			fprintf(spy_output, "%30s \n", name);
+		else
+			fprintf(spy_output, " Unknown Mechanism (%08lx)  \n", type);
+	}
 
 	rv = po->C_GetMechanismInfo(slotID, type, pInfo);
 	if(rv == CKR_OK) {
 		spy_dump_desc_out("pInfo");
-		print_mech_info(spy_output, type, pInfo);
+		if (spy_trace)
+			print_mech_info(spy_output, type, pInfo);
 	}
 	return retne(rv);
 }
@@ -538,8 +900,10 @@ C_OpenSession(CK_SLOT_ID  slotID, CK_FLAGS  flags, CK_VOID_PTR  pApplication,
 	enter("C_OpenSession");
 	spy_dump_ulong_in("slotID", slotID);
 	spy_dump_ulong_in("flags", flags);
-	fprintf(spy_output, "pApplication=%p\n", pApplication);
-	fprintf(spy_output, "Notify=%p\n", (void *)Notify);
+	if (spy_trace) {
+		fprintf(spy_output, "pApplication=%p\n", pApplication);
+		fprintf(spy_output, "Notify=%p\n", (void *)Notify);
+	}
 	rv = po->C_OpenSession(slotID, flags, pApplication, Notify, phSession);
 	spy_dump_ulong_out("*phSession", *phSession);
 	return retne(rv);
@@ -576,7 +940,8 @@ C_GetSessionInfo(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo)
 	rv = po->C_GetSessionInfo(hSession, pInfo);
 	if(rv == CKR_OK) {
 		spy_dump_desc_out("pInfo");
-		print_session_info(spy_output, pInfo);
+		if (spy_trace)
+			print_session_info(spy_output, pInfo);
 	}
 	return retne(rv);
 }
@@ -619,8 +984,9 @@ C_Login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType,
 
 	enter("C_Login");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "[in] userType = %s\n",
-			lookup_enum(USR_T, userType));
+	if (spy_trace)
+		fprintf(spy_output, "[in] userType = %s\n",
+				lookup_enum(USR_T, userType));
 	spy_dump_string_in("pPin[ulPinLen]", pPin, ulPinLen);
 	rv = po->C_Login(hSession, userType, pPin, ulPinLen);
 	return retne(rv);
@@ -761,7 +1127,7 @@ C_FindObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject, CK_ULON
 	if (rv == CKR_OK) {
 		CK_ULONG          i;
 		spy_dump_ulong_out("ulObjectCount", *pulObjectCount);
-		for (i = 0; i < *pulObjectCount; i++)
+		for (i = 0; spy_trace && i < *pulObjectCount; i++)
 			fprintf(spy_output, "Object 0x%lx matches\n", phObject[i]);
 	}
 	return retne(rv);
@@ -784,8 +1150,9 @@ C_EncryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT
 	CK_RV rv;
 
 	enter("C_EncryptInit");
+	profile_mechanism(hSession, SPY_OP_ENCRYPT, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_EncryptInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -798,6 +1165,7 @@ C_Encrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG  ulDataLen,
 	CK_RV rv;
 
 	enter("C_Encrypt");
+	profile_operation(hSession, SPY_OP_ENCRYPT);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pData[ulDataLen]", pData, ulDataLen);
 	rv = po->C_Encrypt(hSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
@@ -813,6 +1181,7 @@ C_EncryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG  ulPartL
 	CK_RV rv;
 
 	enter("C_EncryptUpdate");
+	profile_operation(hSession, SPY_OP_ENCRYPT);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pPart[ulPartLen]", pPart, ulPartLen);
 	rv = po->C_EncryptUpdate(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
@@ -827,6 +1196,7 @@ C_EncryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastEncryptedPart, CK_UL
 	CK_RV rv;
 
 	enter("C_EncryptFinal");
+	profile_operation(hSession, SPY_OP_ENCRYPT);
 	spy_dump_ulong_in("hSession", hSession);
 	rv = po->C_EncryptFinal(hSession, pLastEncryptedPart, pulLastEncryptedPartLen);
 	if (rv == CKR_OK)
@@ -842,8 +1212,9 @@ C_DecryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT
 	CK_RV rv;
 
 	enter("C_DecryptInit");
+	profile_mechanism(hSession, SPY_OP_DECRYPT, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_DecryptInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -856,6 +1227,7 @@ C_Decrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData, CK_ULONG  ulEn
 	CK_RV rv;
 
 	enter("C_Decrypt");
+	profile_operation(hSession, SPY_OP_DECRYPT);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pEncryptedData[ulEncryptedDataLen]", pEncryptedData, ulEncryptedDataLen);
 	rv = po->C_Decrypt(hSession, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
@@ -872,6 +1244,7 @@ C_DecryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG
 	CK_RV rv;
 
 	enter("C_DecryptUpdate");
+	profile_operation(hSession, SPY_OP_DECRYPT);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pEncryptedPart[ulEncryptedPartLen]", pEncryptedPart, ulEncryptedPartLen);
 	rv = po->C_DecryptUpdate(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
@@ -887,6 +1260,7 @@ C_DecryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastPart, CK_ULONG_PTR p
 	CK_RV rv;
 
 	enter("C_DecryptFinal");
+	profile_operation(hSession, SPY_OP_DECRYPT);
 	spy_dump_ulong_in("hSession", hSession);
 	rv = po->C_DecryptFinal(hSession, pLastPart, pulLastPartLen);
 	if (rv == CKR_OK)
@@ -901,8 +1275,9 @@ C_DigestInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism)
 	CK_RV rv;
 
 	enter("C_DigestInit");
+	profile_mechanism(hSession, SPY_OP_DIGEST, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	rv = po->C_DigestInit(hSession, pMechanism);
 	return retne(rv);
 }
@@ -914,6 +1289,7 @@ C_Digest(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG  ulDataLen,
 	CK_RV rv;
 
 	enter("C_Digest");
+	profile_operation(hSession, SPY_OP_DIGEST);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pData[ulDataLen]", pData, ulDataLen);
 	rv = po->C_Digest(hSession, pData, ulDataLen, pDigest, pulDigestLen);
@@ -929,6 +1305,7 @@ C_DigestUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG  ulPartLe
 	CK_RV rv;
 
 	enter("C_DigestUpdate");
+	profile_operation(hSession, SPY_OP_DIGEST);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pPart[ulPartLen]", pPart, ulPartLen);
 	rv = po->C_DigestUpdate(hSession, pPart, ulPartLen);
@@ -941,6 +1318,7 @@ C_DigestKey(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey)
 	CK_RV rv;
 
 	enter("C_DigestKey");
+	profile_operation(hSession, SPY_OP_DIGEST);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_DigestKey(hSession, hKey);
@@ -953,6 +1331,7 @@ C_DigestFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulD
 	CK_RV rv;
 
 	enter("C_DigestFinal");
+	profile_operation(hSession, SPY_OP_DIGEST);
 	spy_dump_ulong_in("hSession", hSession);
 	rv = po->C_DigestFinal(hSession, pDigest, pulDigestLen);
 	if (rv == CKR_OK)
@@ -967,15 +1346,16 @@ C_SignInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HA
 	CK_RV rv;
 
 	enter("C_SignInit");
+	profile_mechanism(hSession, SPY_OP_SIGN, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	switch (pMechanism->mechanism) {
 	case CKM_RSA_PKCS_PSS:
 	case CKM_SHA1_RSA_PKCS_PSS:
 	case CKM_SHA256_RSA_PKCS_PSS:
 	case CKM_SHA384_RSA_PKCS_PSS:
 	case CKM_SHA512_RSA_PKCS_PSS:
-		if (pMechanism->pParameter != NULL) {
+		if (pMechanism->pParameter != NULL && spy_trace) {
 			CK_RSA_PKCS_PSS_PARAMS *param =
 				(CK_RSA_PKCS_PSS_PARAMS *) pMechanism->pParameter;
 			fprintf(spy_output, "pMechanism->pParameter->hashAlg=%s\n",
@@ -999,6 +1379,7 @@ C_Sign(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG  ulDataLen,
 	CK_RV rv;
 
 	enter("C_Sign");
+	profile_operation(hSession, SPY_OP_SIGN);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pData[ulDataLen]", pData, ulDataLen);
 	rv = po->C_Sign(hSession, pData, ulDataLen, pSignature, pulSignatureLen);
@@ -1014,6 +1395,7 @@ C_SignUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG  ulPartLen)
 	CK_RV rv;
 
 	enter("C_SignUpdate");
+	profile_operation(hSession, SPY_OP_SIGN);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pPart[ulPartLen]", pPart, ulPartLen);
 	rv = po->C_SignUpdate(hSession, pPart, ulPartLen);
@@ -1026,6 +1408,7 @@ C_SignFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG_PTR pul
 	CK_RV rv;
 
 	enter("C_SignFinal");
+	profile_operation(hSession, SPY_OP_SIGN);
 	spy_dump_ulong_in("hSession", hSession);
 	rv = po->C_SignFinal(hSession, pSignature, pulSignatureLen);
 	if (rv == CKR_OK)
@@ -1040,9 +1423,9 @@ C_SignRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OB
 	CK_RV rv;
 
 	enter("C_SignRecoverInit");
+	profile_mechanism(hSession, SPY_OP_SIGN, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n",
-			lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_SignRecoverInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -1055,6 +1438,7 @@ C_SignRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG  ulDataLen
 	CK_RV rv;
 
 	enter("C_SignRecover");
+	profile_operation(hSession, SPY_OP_SIGN);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pData[ulDataLen]", pData, ulDataLen);
 	rv = po->C_SignRecover(hSession, pData, ulDataLen, pSignature, pulSignatureLen);
@@ -1069,8 +1453,9 @@ C_VerifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_
 	CK_RV rv;
 
 	enter("C_VerifyInit");
+	profile_mechanism(hSession, SPY_OP_VERIFY, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_VerifyInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -1083,6 +1468,7 @@ C_Verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG  ulDataLen,
 	CK_RV rv;
 
 	enter("C_Verify");
+	profile_operation(hSession, SPY_OP_VERIFY);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pData[ulDataLen]", pData, ulDataLen);
 	spy_dump_string_in("pSignature[ulSignatureLen]", pSignature, ulSignatureLen);
@@ -1096,6 +1482,7 @@ C_VerifyUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG  ulPartLe
 	CK_RV rv;
 
 	enter("C_VerifyUpdate");
+	profile_operation(hSession, SPY_OP_VERIFY);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pPart[ulPartLen]", pPart, ulPartLen);
 	rv = po->C_VerifyUpdate(hSession, pPart, ulPartLen);
@@ -1108,6 +1495,7 @@ C_VerifyFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG  ulSi
 	CK_RV rv;
 
 	enter("C_VerifyFinal");
+	profile_operation(hSession, SPY_OP_VERIFY);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pSignature[ulSignatureLen]", pSignature, ulSignatureLen);
 	rv = po->C_VerifyFinal(hSession, pSignature, ulSignatureLen);
@@ -1122,8 +1510,9 @@ C_VerifyRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 	CK_RV rv;
 
 	enter("C_VerifyRecoverInit");
+	profile_mechanism(hSession, SPY_OP_VERIFY, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_VerifyRecoverInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -1136,6 +1525,7 @@ C_VerifyRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG  ul
 	CK_RV rv;
 
 	enter("C_VerifyRecover");
+	profile_operation(hSession, SPY_OP_VERIFY);
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_string_in("pSignature[ulSignatureLen]", pSignature, ulSignatureLen);
 	rv = po->C_VerifyRecover(hSession, pSignature, ulSignatureLen, pData, pulDataLen);
@@ -1215,8 +1605,9 @@ C_GenerateKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 	CK_RV rv;
 
 	enter("C_GenerateKey");
+	profile_mechanism(hSession, SPY_OP_NONE, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_attribute_list_in("pTemplate", pTemplate, ulCount);
 	rv = po->C_GenerateKey(hSession, pMechanism, pTemplate, ulCount, phKey);
 	if (rv == CKR_OK)
@@ -1234,8 +1625,9 @@ C_GenerateKeyPair(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 	CK_RV rv;
 
 	enter("C_GenerateKeyPair");
+	profile_mechanism(hSession, SPY_OP_NONE, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_attribute_list_in("pPublicKeyTemplate", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 	spy_attribute_list_in("pPrivateKeyTemplate", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	rv = po->C_GenerateKeyPair(hSession, pMechanism,
@@ -1257,8 +1649,9 @@ C_WrapKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 	CK_RV rv;
 
 	enter("C_WrapKey");
+	profile_mechanism(hSession, SPY_OP_NONE, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hWrappingKey", hWrappingKey);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_WrapKey(hSession, pMechanism, hWrappingKey, hKey, pWrappedKey, pulWrappedKeyLen);
@@ -1277,8 +1670,9 @@ C_UnwrapKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 	CK_RV rv;
 
 	enter("C_UnwrapKey");
+	profile_mechanism(hSession, SPY_OP_NONE, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hUnwrappingKey", hUnwrappingKey);
 	spy_dump_string_in("pWrappedKey[ulWrappedKeyLen]", pWrappedKey, ulWrappedKeyLen);
 	spy_attribute_list_in("pTemplate", pTemplate, ulAttributeCount);
@@ -1296,8 +1690,9 @@ C_DeriveKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_H
 	CK_RV rv;
 
 	enter("C_DeriveKey");
+	profile_mechanism(hSession, SPY_OP_NONE, pMechanism);
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hBaseKey", hBaseKey);
 	spy_attribute_list_in("pTemplate", pTemplate, ulAttributeCount);
 	rv = po->C_DeriveKey(hSession, pMechanism, hBaseKey, pTemplate, ulAttributeCount, phKey);
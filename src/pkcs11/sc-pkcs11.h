@@ -80,6 +80,7 @@ struct sc_pkcs11_config {
 	unsigned int zero_ckaid_for_ca_certs;
 	unsigned int create_slots_flags;
 	unsigned char ignore_pin_length;
+	unsigned char pool_keys;
 };
 
 /*
@@ -236,6 +237,7 @@ enum {
 	SC_PKCS11_OPERATION_DIGEST,
 	SC_PKCS11_OPERATION_DECRYPT,
 	SC_PKCS11_OPERATION_DERIVE,
+	SC_PKCS11_OPERATION_ENCRYPT,
 	SC_PKCS11_OPERATION_MAX
 };
 
@@ -406,11 +408,16 @@ CK_RV sc_pkcs11_sign_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 CK_RV sc_pkcs11_sign_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_sign_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_sign_size(struct sc_pkcs11_session *, CK_ULONG_PTR);
+CK_RV sc_pkcs11_sign_detach_md(struct sc_pkcs11_session *, sc_pkcs11_operation_t **);
+CK_RV sc_pkcs11_sign_attach_md(struct sc_pkcs11_session *, sc_pkcs11_operation_t *, CK_RV);
 #ifdef ENABLE_OPENSSL
 CK_RV sc_pkcs11_verif_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_verif_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_verif_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
+CK_RV sc_pkcs11_encr_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
+				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
+CK_RV sc_pkcs11_encr(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
 #endif
 CK_RV sc_pkcs11_decr_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR, struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_decr(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
@@ -439,6 +446,11 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 	CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 	unsigned char *inp, int inp_len,
 	unsigned char *signat, int signat_len);
+CK_RV sc_pkcs11_encrypt_data(const unsigned char *pubkey, int pubkey_len,
+	CK_MECHANISM_TYPE mech,
+	unsigned char *data, int data_len,
+	unsigned char *out, CK_ULONG_PTR out_len);
+void sc_pkcs11_openssl_cleanup(void);
 #endif
 
 /* Load configuration defaults */
@@ -450,6 +462,12 @@ CK_RV sc_pkcs11_lock(void);
 void sc_pkcs11_unlock(void);
 void sc_pkcs11_free_lock(void);
 
+/* Card lock taken on the first card access of a call and held until the
+ * call returns; used with the pkcs11 lock held */
+void sc_pkcs11_defer_card_lock(struct sc_card *);
+void sc_pkcs11_card_access(struct sc_card *);
+void sc_pkcs11_release_card_lock(void);
+
 #ifdef __cplusplus
 }
 #endif
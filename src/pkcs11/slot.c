@@ -80,6 +80,16 @@ static int object_list_seeker(const void *el, const void *key)
 	return 0;
 }
 
+static list_hash_t object_list_hasher(const void *el)
+{
+	return (list_hash_t)((const struct sc_pkcs11_object *)el)->handle;
+}
+
+static list_hash_t object_handle_hasher(const void *key)
+{
+	return (list_hash_t)*(const CK_OBJECT_HANDLE *)key;
+}
+
 CK_RV create_slot(sc_reader_t *reader)
 {
 	/* find unused virtual hotplug slots */
@@ -98,7 +108,9 @@ CK_RV create_slot(sc_reader_t *reader)
 		if (0 != list_init(&slot->objects)) {
 			return CKR_HOST_MEMORY;
 		}
+		list_attributes_vector(&slot->objects, 1);
 		list_attributes_seeker(&slot->objects, object_list_seeker);
+		list_attributes_seeker_hash(&slot->objects, object_list_hasher, object_handle_hasher);
 
 		if (0 != list_init(&slot->logins)) {
 			return CKR_HOST_MEMORY;
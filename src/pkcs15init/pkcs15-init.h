@@ -363,6 +363,11 @@ extern int	sc_pkcs15init_add_object(struct sc_pkcs15_card *,
 			struct sc_profile *profile,
 			unsigned int,
 			struct sc_pkcs15_object *);
+/* Write each changed xDF, the ODF and TokenInfo once at commit */
+extern int	sc_pkcs15init_begin(struct sc_pkcs15_card *,
+			struct sc_profile *);
+extern int	sc_pkcs15init_commit(struct sc_pkcs15_card *,
+			struct sc_profile *);
 extern int	sc_pkcs15init_delete_object(struct sc_pkcs15_card *,
 				struct sc_profile *,
 				struct sc_pkcs15_object *);
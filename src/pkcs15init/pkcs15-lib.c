@@ -106,6 +106,9 @@ static int	sc_pkcs15init_update_lastupdate(struct sc_pkcs15_card *,
 			struct sc_profile *profile);
 static int	sc_pkcs15init_update_odf(struct sc_pkcs15_card *,
 			struct sc_profile *profile);
+static int	sc_pkcs15init_update_file_diff(struct sc_profile *,
+			struct sc_pkcs15_card *, struct sc_file *,
+			unsigned char *, size_t);
 static int	sc_pkcs15init_map_usage(unsigned long, int);
 static int	do_select_parent(struct sc_profile *, struct sc_pkcs15_card *,
 			struct sc_file *, struct sc_file **);
@@ -428,6 +431,11 @@ sc_pkcs15init_unbind(struct sc_profile *profile)
 	struct sc_context *ctx = profile->card->ctx;
 
 	LOG_FUNC_CALLED(ctx);
+	if (profile->txn.active && profile->p15_data != NULL) {
+		r = sc_pkcs15init_commit(profile->p15_data, profile);
+		if (r < 0)
+			sc_log(ctx, "Failed to write deferred updates: %s", sc_strerror(r));
+	}
 	sc_log(ctx, "Pksc15init Unbind: %i:%p:%i", profile->dirty, profile->p15_data, profile->pkcs15.do_last_update);
 	if (profile->dirty != 0 && profile->p15_data != NULL && profile->pkcs15.do_last_update) {
 		r = sc_pkcs15init_update_lastupdate(profile->p15_data, profile);
@@ -630,6 +638,7 @@ sc_pkcs15init_delete_by_path(struct sc_profile *profile, struct sc_pkcs15_card *
 */
 
 	sc_log(ctx, "Now really delete file");
+	sc_pkcs15_forget_shared_der(p15card, file_path);
 	rv = sc_delete_file(p15card->card, &path);
 	LOG_FUNC_RETURN(ctx, rv);
 }
@@ -2238,6 +2247,10 @@ sc_pkcs15init_store_data(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 	}
 
 	r = sc_pkcs15init_update_file(profile, p15card, file, data->value, data->len);
+	/* only public objects may end up in the file cache */
+	if (r >= 0 && data->len && p15card->opts.use_file_cache
+			&& !(object->flags & SC_PKCS15_CO_FLAG_PRIVATE))
+		sc_pkcs15_cache_file(p15card, &file->path, data->value, data->len);
 
 	*path = file->path;
 
@@ -2976,6 +2989,10 @@ sc_pkcs15init_update_tokeninfo(struct sc_pkcs15_card *p15card, struct sc_profile
 	int		rv;
 
 	LOG_FUNC_CALLED(ctx);
+	if (profile->txn.active)   {
+		profile->txn.tokeninfo = 1;
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
 
 	/* set lastUpdate field */
 	if (p15card->tokeninfo->last_update.gtime != NULL)   {
@@ -2995,7 +3012,7 @@ sc_pkcs15init_update_tokeninfo(struct sc_pkcs15_card *p15card, struct sc_profile
 
 	rv = sc_pkcs15_encode_tokeninfo(ctx, p15card->tokeninfo, &buf, &size);
 	if (rv >= 0)
-		rv = sc_pkcs15init_update_file(profile, p15card, p15card->file_tokeninfo, buf, size);
+		rv = sc_pkcs15init_update_file_diff(profile, p15card, p15card->file_tokeninfo, buf, size);
 	if (buf)
 		free(buf);
 
@@ -3060,41 +3077,42 @@ sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 	int		r;
 
 	LOG_FUNC_CALLED(ctx);
+	if (profile->txn.active)   {
+		profile->txn.odf = 1;
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
 	r = sc_pkcs15_encode_odf(ctx, p15card, &buf, &size);
 	if (r >= 0)
-		r = sc_pkcs15init_update_file(profile, p15card, p15card->file_odf, buf, size);
+		r = sc_pkcs15init_update_file_diff(profile, p15card, p15card->file_odf, buf, size);
 	if (buf)
 		free(buf);
 	LOG_FUNC_RETURN(ctx, r);
 }
 
 /*
- * Update any PKCS15 DF file (except ODF and DIR)
+ * Encode a DF and write it to the card.
+ * Returns 1 if the ODF has to be rewritten as well.
  */
-int
-sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
-		struct sc_profile *profile,
-		struct sc_pkcs15_df *df,
-		int is_new)
+static int
+sc_pkcs15init_write_df(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct sc_pkcs15_df *df)
 {
 	struct sc_context	*ctx = p15card->card->ctx;
 	struct sc_card	*card = p15card->card;
 	struct sc_file	*file = NULL;
 	unsigned char	*buf = NULL;
 	size_t		bufsize;
-	int		update_odf = is_new, r = 0;
+	int		update_odf = 0, r = 0;
 
 	LOG_FUNC_CALLED(ctx);
-	if (!df)
-		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "DF missing");
-
 	r = sc_profile_get_file_by_path(profile, &df->path, &file);
 	if (r < 0 || file == NULL)
 		sc_select_file(card, &df->path, &file);
 
 	r = sc_pkcs15_encode_df(card->ctx, p15card, df, &buf, &bufsize);
 	if (r >= 0) {
-		r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+		r = sc_pkcs15init_update_file_diff(profile, p15card, file, buf, bufsize);
 
 		/* For better performance and robustness, we want
 		 * to note which portion of the file actually
@@ -3114,16 +3132,103 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 	}
 	sc_file_free(file);
 
+	LOG_TEST_RET(ctx, r, "Failed to encode or update xDF");
+	LOG_FUNC_RETURN(ctx, update_odf);
+}
+
+/*
+ * Update any PKCS15 DF file (except ODF and DIR)
+ */
+int
+sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
+		struct sc_profile *profile,
+		struct sc_pkcs15_df *df,
+		int is_new)
+{
+	struct sc_context	*ctx = p15card->card->ctx;
+	unsigned int	i;
+	int		r = 0;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!df)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "DF missing");
+
+	if (profile->txn.active)   {
+		for (i = 0; i < profile->txn.num_df; i++)
+			if (profile->txn.df[i] == df)
+				break;
+		if (i == profile->txn.num_df && i < SC_PKCS15INIT_MAX_DIRTY_DF)
+			profile->txn.df[profile->txn.num_df++] = df;
+		if (i < profile->txn.num_df)   {
+			if (is_new)
+				profile->txn.odf = 1;
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+		/* no room left to remember it: write it now */
+		sc_log(ctx, "more than %i DFs changed in this transaction, writing %s now",
+				SC_PKCS15INIT_MAX_DIRTY_DF, sc_print_path(&df->path));
+	}
+
+	r = sc_pkcs15init_write_df(p15card, profile, df);
 	LOG_TEST_RET(ctx, r, "Failed to encode or update xDF");
 
 	/* Now update the ODF if we have to */
-	if (update_odf)
+	if (r > 0 || is_new)
 		r = sc_pkcs15init_update_odf(p15card, profile);
 	LOG_TEST_RET(ctx, r, "Failed to encode or update ODF");
 
 	LOG_FUNC_RETURN(ctx, r > 0 ? SC_SUCCESS : r);
 }
 
+/*
+ * Defer the rewrites of the xDFs, ODF and TokenInfo until
+ * sc_pkcs15init_commit(), so that storing several objects writes each
+ * of them only once.
+ */
+int
+sc_pkcs15init_begin(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+
+	LOG_FUNC_CALLED(ctx);
+	if (profile->txn.active)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "pkcs15init transaction already started");
+
+	memset(&profile->txn, 0, sizeof(profile->txn));
+	profile->txn.active = 1;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+int
+sc_pkcs15init_commit(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	unsigned int	i;
+	int		r = 0;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!profile->txn.active)
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
+	sc_log(ctx, "commit %u DF(s), ODF %i, TokenInfo %i",
+			profile->txn.num_df, profile->txn.odf, profile->txn.tokeninfo);
+	profile->txn.active = 0;
+
+	for (i = 0; r >= 0 && i < profile->txn.num_df; i++)   {
+		r = sc_pkcs15init_write_df(p15card, profile, profile->txn.df[i]);
+		if (r > 0)
+			profile->txn.odf = 1;
+	}
+	if (r >= 0 && profile->txn.odf)
+		r = sc_pkcs15init_update_odf(p15card, profile);
+	if (r >= 0 && profile->txn.tokeninfo)
+		r = sc_pkcs15init_update_tokeninfo(p15card, profile);
+
+	memset(&profile->txn, 0, sizeof(profile->txn));
+	LOG_TEST_RET(ctx, r, "Failed to write deferred updates");
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
 /*
  * Add an object to one of the pkcs15 directory files.
  */
@@ -3470,6 +3575,7 @@ sc_pkcs15init_update_certificate(struct sc_pkcs15_card *p15card,
 	if (r < 0)
 		goto done;
 
+	sc_pkcs15_forget_shared_der(p15card, path);
 	r = sc_update_binary(p15card->card, 0, rawcert, certlen, 0);
 	if (r < 0)
 		goto done;
@@ -3958,8 +4064,11 @@ sc_pkcs15init_update_file(struct sc_profile *profile,
 
 	/* Present authentication info needed */
 	r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
-	if (r >= 0 && datalen)
+	if (r >= 0 && datalen) {
+		/* shared copies of the old contents must not be found any more */
+		sc_pkcs15_forget_shared_der(p15card, &file->path);
 		r = sc_update_binary(p15card->card, 0, (const unsigned char *) data, datalen, 0);
+	}
 
 	if (copy)
 		free(copy);
@@ -3967,6 +4076,68 @@ sc_pkcs15init_update_file(struct sc_profile *profile,
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+/*
+ * Like sc_pkcs15init_update_file(), but write only the byte ranges
+ * that differ from the current contents. These are read from the
+ * card, never taken from the file cache: the cache may be stale if
+ * another application changed the card, and writing only the ranges
+ * that differ from a stale copy would corrupt the file.
+ * Only used for the public meta files (xDFs, ODF, TokenInfo), so the
+ * written contents are refreshed in the file cache. The plain
+ * sc_pkcs15init_update_file() also writes keys and PINs and never
+ * touches the cache.
+ */
+static int
+sc_pkcs15init_update_file_diff(struct sc_profile *profile,
+		struct sc_pkcs15_card *p15card, struct sc_file *file,
+		unsigned char *data, size_t datalen)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_file	*selected_file = NULL;
+	struct sc_path	path;
+	unsigned char	*new = NULL;
+	size_t		size = 0;
+	int		r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!file)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+
+	r = sc_select_file(p15card->card, &file->path, &selected_file);
+	if (r == 0 && selected_file->size >= datalen
+			&& selected_file->ef_structure == SC_FILE_EF_TRANSPARENT)
+		size = selected_file->size;
+	sc_file_free(selected_file);
+
+	if (size == 0)   {
+		/* Let the plain update create, zero or refuse the file */
+		r = sc_pkcs15init_update_file(profile, p15card, file, data, datalen);
+		if (r >= 0 && datalen && p15card->opts.use_file_cache)
+			sc_pkcs15_cache_file(p15card, &file->path, data, datalen);
+		LOG_FUNC_RETURN(ctx, r);
+	}
+
+	new = calloc(1, size);
+	if (new == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	memcpy(new, data, datalen);
+
+	path = file->path;
+	path.index = 0;
+	path.count = -1;
+
+	r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
+	if (r >= 0) {
+		sc_pkcs15_forget_shared_der(p15card, &path);
+		r = sc_update_binary_diff(p15card->card, 0, new, size, NULL, 0);
+	}
+	if (r >= 0 && p15card->opts.use_file_cache)
+		sc_pkcs15_cache_file(p15card, &path, new, size);
+
+	free(new);
+	LOG_FUNC_RETURN(ctx, r < 0 ? r : SC_SUCCESS);
+}
+
 /*
  * Fix up a file's ACLs by replacing all occurrences of a symbolic
  * PIN name with the real reference.
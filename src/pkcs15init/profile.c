@@ -36,6 +36,7 @@
 #endif
 #include <assert.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -45,6 +46,7 @@
 #include "common/compat_strlcpy.h"
 #include "scconf/scconf.h"
 #include "libopensc/log.h"
+#include "libopensc/internal.h"
 #include "libopensc/pkcs15.h"
 #include "pkcs15-init.h"
 #include "profile.h"
@@ -256,12 +258,17 @@ static struct file_info *	add_file(sc_profile_t *, const char *,
 				sc_file_t *, struct file_info *);
 static void		free_file_list(struct file_info **);
 static void		append_file(sc_profile_t *, struct file_info *);
+static unsigned int	profile_name_hash(const char *);
 static struct auth_info *	new_key(struct sc_profile *,
 				unsigned int, unsigned int);
 static void		set_pin_defaults(struct sc_profile *,
 				struct pin_info *);
 static void		new_macro(sc_profile_t *, const char *, scconf_list *);
 static sc_macro_t *	find_macro(sc_profile_t *, const char *);
+static scconf_context *	load_compiled_profile(struct sc_context *,
+				const char *, const char *);
+static void		save_compiled_profile(struct sc_context *,
+				const char *, const char *, scconf_context *);
 
 static sc_file_t *
 init_file(unsigned int type)
@@ -326,8 +333,8 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 	struct sc_context *ctx = profile->card->ctx;
 	scconf_context	*conf;
 	const char *profile_dir = NULL;
-	char path[PATH_MAX];
-	int res = 0, i;
+	char path[PATH_MAX], cache_name[PATH_MAX];
+	int res = 0, i, use_cache = 0;
 #ifdef _WIN32
 	char temp_path[PATH_MAX];
 	size_t temp_len;
@@ -339,6 +346,9 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 		if (profile_dir)
 			break;
 	}
+	for (i = 0; ctx->conf_blocks[i]; i++) {
+		use_cache = scconf_get_bool(ctx->conf_blocks[i], "use_profile_cache", use_cache);
+	}
 
 	if (!profile_dir) {
 #ifdef _WIN32
@@ -362,26 +372,302 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 
 	sc_log(ctx, "Trying profile file %s", path);
 
-	conf = scconf_new(path);
-	res = scconf_parse(conf);
+	snprintf(cache_name, sizeof(cache_name), "profile-%s.bin", filename);
+	for (i = 0; cache_name[i]; i++)
+		if (cache_name[i] == '/' || cache_name[i] == '\\')
+			cache_name[i] = '_';
 
-	sc_log(ctx, "profile %s loaded ok", path);
+	conf = use_cache ? load_compiled_profile(ctx, path, cache_name) : NULL;
+	if (conf == NULL)   {
+		conf = scconf_new(path);
+		res = scconf_parse(conf);
 
-	if (res < 0) {
-		scconf_free(conf);
-		LOG_FUNC_RETURN(ctx, SC_ERROR_FILE_NOT_FOUND);
-	}
+		sc_log(ctx, "profile %s loaded ok", path);
 
-	if (res == 0) {
-		scconf_free(conf);
-		LOG_FUNC_RETURN(ctx, SC_ERROR_SYNTAX_ERROR);
+		if (res < 0) {
+			scconf_free(conf);
+			LOG_FUNC_RETURN(ctx, SC_ERROR_FILE_NOT_FOUND);
+		}
+
+		if (res == 0) {
+			scconf_free(conf);
+			LOG_FUNC_RETURN(ctx, SC_ERROR_SYNTAX_ERROR);
+		}
+
+		if (use_cache)
+			save_compiled_profile(ctx, path, cache_name, conf);
 	}
 
+	/* File paths may change while the profile is processed */
+	profile->path_index_valid = 0;
 	res = process_conf(profile, conf);
 	scconf_free(conf);
 	LOG_FUNC_RETURN(ctx, res);
 }
 
+/*
+ * Precompiled profiles.
+ *
+ * When 'use_profile_cache' is set, the parse tree of each profile file is
+ * kept in the file cache directory in a binary form, tagged with the path,
+ * size and modification time of its source. Loading it back saves lexing
+ * and parsing the text; a changed source file is parsed and saved again.
+ */
+#define PROFILE_CACHE_MAGIC	"OSCPRF01"
+#define PROFILE_CACHE_DEPTH	32
+
+struct profile_buf {
+	u8 *			data;
+	size_t			len, size;
+	int			error;
+};
+
+static void
+profile_buf_put(struct profile_buf *b, const void *data, size_t len)
+{
+	if (b->error)
+		return;
+	if (b->len + len > b->size)   {
+		size_t	size = b->size ? 2 * b->size : 1024;
+		u8	*p;
+
+		while (size < b->len + len)
+			size *= 2;
+		if ((p = realloc(b->data, size)) == NULL)   {
+			b->error = 1;
+			return;
+		}
+		b->data = p;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void
+profile_buf_put_uint(struct profile_buf *b, unsigned long value)
+{
+	u8	v[4];
+
+	v[0] = (value >> 24) & 0xFF;
+	v[1] = (value >> 16) & 0xFF;
+	v[2] = (value >> 8) & 0xFF;
+	v[3] = value & 0xFF;
+	profile_buf_put(b, v, sizeof(v));
+}
+
+static void
+profile_buf_put_str(struct profile_buf *b, const char *str)
+{
+	/* 0 is a NULL string, otherwise the length plus one */
+	size_t	len = str ? strlen(str) : 0;
+
+	profile_buf_put_uint(b, str ? len + 1 : 0);
+	if (len)
+		profile_buf_put(b, str, len);
+}
+
+static void
+compile_list(struct profile_buf *b, const scconf_list *list)
+{
+	const scconf_list *l;
+	unsigned long	n = 0;
+
+	for (l = list; l; l = l->next)
+		n++;
+	profile_buf_put_uint(b, n);
+	for (l = list; l; l = l->next)
+		profile_buf_put_str(b, l->data);
+}
+
+static void
+compile_block(struct profile_buf *b, const scconf_block *blk)
+{
+	const scconf_item *item;
+	unsigned long	n = 0;
+
+	compile_list(b, blk->name);
+	for (item = blk->items; item; item = item->next)
+		if (item->type != SCCONF_ITEM_TYPE_COMMENT)
+			n++;
+	profile_buf_put_uint(b, n);
+	for (item = blk->items; item; item = item->next) {
+		if (item->type == SCCONF_ITEM_TYPE_COMMENT)
+			continue;
+		profile_buf_put_uint(b, item->type);
+		profile_buf_put_str(b, item->key);
+		if (item->type == SCCONF_ITEM_TYPE_BLOCK)
+			compile_block(b, item->value.block);
+		else
+			compile_list(b, item->value.list);
+	}
+}
+
+struct profile_reader {
+	const u8 *		p;
+	const u8 *		end;
+	int			error;
+};
+
+static unsigned long
+profile_get_uint(struct profile_reader *r)
+{
+	unsigned long	value;
+
+	if (r->error || r->end - r->p < 4)   {
+		r->error = 1;
+		return 0;
+	}
+	value = ((unsigned long)r->p[0] << 24) | ((unsigned long)r->p[1] << 16)
+		| ((unsigned long)r->p[2] << 8) | r->p[3];
+	r->p += 4;
+	return value;
+}
+
+static char *
+profile_get_str(struct profile_reader *r)
+{
+	unsigned long	len = profile_get_uint(r);
+	char		*str;
+
+	if (r->error || len-- == 0)
+		return NULL;
+	if ((unsigned long)(r->end - r->p) < len || (str = malloc(len + 1)) == NULL)   {
+		r->error = 1;
+		return NULL;
+	}
+	memcpy(str, r->p, len);
+	str[len] = '\0';
+	r->p += len;
+	return str;
+}
+
+static scconf_list *
+load_list(struct profile_reader *r)
+{
+	scconf_list	*list = NULL, **tail = &list;
+	unsigned long	n = profile_get_uint(r);
+
+	while (!r->error && n--) {
+		if ((*tail = calloc(1, sizeof(scconf_list))) == NULL)   {
+			r->error = 1;
+			break;
+		}
+		(*tail)->data = profile_get_str(r);
+		tail = &(*tail)->next;
+	}
+	return list;
+}
+
+static void
+load_block(struct profile_reader *r, scconf_block *blk, int depth)
+{
+	scconf_item	*item, **tail = &blk->items;
+	unsigned long	n;
+
+	blk->name = load_list(r);
+	n = profile_get_uint(r);
+	while (!r->error && n--) {
+		if ((item = calloc(1, sizeof(scconf_item))) == NULL)   {
+			r->error = 1;
+			break;
+		}
+		*tail = item;
+		tail = &item->next;
+
+		item->type = (int)profile_get_uint(r);
+		item->key = profile_get_str(r);
+		if (item->type == SCCONF_ITEM_TYPE_BLOCK && depth < PROFILE_CACHE_DEPTH)   {
+			item->value.block = calloc(1, sizeof(scconf_block));
+			if (item->value.block == NULL)   {
+				r->error = 1;
+				break;
+			}
+			item->value.block->parent = blk;
+			load_block(r, item->value.block, depth + 1);
+		}
+		else if (item->type == SCCONF_ITEM_TYPE_VALUE)   {
+			item->value.list = load_list(r);
+		}
+		else   {
+			/* Keep scconf_item_destroy() away from the union */
+			item->type = SCCONF_ITEM_TYPE_COMMENT;
+			r->error = 1;
+		}
+	}
+}
+
+static void
+compile_header(struct profile_buf *b, const char *path, const struct stat *st)
+{
+	profile_buf_put(b, PROFILE_CACHE_MAGIC, strlen(PROFILE_CACHE_MAGIC));
+	profile_buf_put_str(b, path);
+	profile_buf_put_uint(b, (unsigned long)st->st_size);
+	profile_buf_put_uint(b, (unsigned long)st->st_mtime);
+}
+
+static scconf_context *
+load_compiled_profile(struct sc_context *ctx, const char *path, const char *cache_name)
+{
+	struct profile_buf	header;
+	struct profile_reader	reader;
+	struct stat		st;
+	scconf_context		*conf;
+	u8			*data = NULL;
+	size_t			len;
+
+	if (stat(path, &st) != 0)
+		return NULL;
+	if (_sc_read_cache_file(ctx, cache_name, &data, &len) != SC_SUCCESS)
+		return NULL;
+
+	memset(&header, 0, sizeof(header));
+	compile_header(&header, path, &st);
+	if (header.error || len < header.len || memcmp(data, header.data, header.len))   {
+		sc_log(ctx, "precompiled profile %s is out of date", cache_name);
+		free(header.data);
+		free(data);
+		return NULL;
+	}
+
+	reader.p = data + header.len;
+	reader.end = data + len;
+	reader.error = 0;
+	free(header.data);
+
+	conf = scconf_new(path);
+	if (conf != NULL)   {
+		load_block(&reader, conf->root, 0);
+		if (reader.error || reader.p != reader.end)   {
+			sc_log(ctx, "precompiled profile %s is corrupted", cache_name);
+			scconf_free(conf);
+			conf = NULL;
+		}
+	}
+	free(data);
+	return conf;
+}
+
+static void
+save_compiled_profile(struct sc_context *ctx, const char *path, const char *cache_name,
+		scconf_context *conf)
+{
+	struct profile_buf	b;
+	struct stat		st;
+
+	if (stat(path, &st) != 0)
+		return;
+
+	memset(&b, 0, sizeof(b));
+	compile_header(&b, path, &st);
+	compile_block(&b, conf->root);
+	if (!b.error)
+		_sc_write_cache_file(ctx, cache_name, b.data, b.len);
+	else
+		sc_log(ctx, "cannot compile profile %s", path);
+	free(b.data);
+}
+
 
 int
 sc_profile_finish(struct sc_profile *profile, const struct sc_app_info *app_info)
@@ -686,7 +972,8 @@ sc_profile_instantiate_template(sc_profile_t *profile,
 
 	tmpl = info->data;
 	idx = id->value[id->len-1];
-	for (fi = profile->ef_list; fi; fi = fi->next) {
+	fi = profile->name_index[profile_name_hash(file_name)];
+	for (; fi; fi = fi->name_next) {
 		if (fi->base_template == tmpl
 		 && fi->inst_index == idx
 		 && sc_compare_path(&fi->inst_path, base_path)
@@ -1136,6 +1423,60 @@ process_tmpl(struct state *cur, struct block *info,
 	return r;
 }
 
+/*
+ * Hash of a file name (case insensitive) or of a path value,
+ * used to index the ef_list
+ */
+static unsigned int
+profile_hash(const u8 *data, size_t len, int fold)
+{
+	unsigned int	h = 2166136261U;
+	size_t		i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (fold ? tolower(data[i]) : data[i])) * 16777619U;
+	return h % SC_PROFILE_HASH_SIZE;
+}
+
+static unsigned int
+profile_name_hash(const char *name)
+{
+	return profile_hash((const u8 *) name, strlen(name), 1);
+}
+
+static unsigned int
+profile_path_hash(const sc_path_t *path)
+{
+	return profile_hash(path->value, path->len, 0);
+}
+
+/*
+ * Hash chains keep the order of the ef_list, so that lookups
+ * return the same entry a scan of the list would.
+ */
+static void
+index_path(sc_profile_t *profile, struct file_info *nfile)
+{
+	struct file_info	**list;
+
+	list = &profile->path_index[profile_path_hash(&nfile->file->path)];
+	while (*list != NULL)
+		list = &(*list)->path_next;
+	*list = nfile;
+	nfile->path_next = NULL;
+}
+
+static void
+build_path_index(sc_profile_t *profile)
+{
+	struct file_info	*fi;
+
+	memset(profile->path_index, 0, sizeof(profile->path_index));
+	for (fi = profile->ef_list; fi; fi = fi->next)
+		index_path(profile, fi);
+	profile->path_index_valid = 1;
+}
+
 /*
  * Append new file at the end of the ef_list.
  * This is crucial; the profile instantiation code relies on it
@@ -1148,6 +1489,14 @@ static void append_file(sc_profile_t *profile, struct file_info *nfile)
 	while ((fi = *list) != NULL)
 		list = &fi->next;
 	*list = nfile;
+
+	list = &profile->name_index[profile_name_hash(nfile->ident)];
+	while (*list != NULL)
+		list = &(*list)->name_next;
+	*list = nfile;
+
+	if (profile->path_index_valid)
+		index_path(profile, nfile);
 }
 
 /*
@@ -2026,7 +2375,8 @@ sc_profile_find_file(struct sc_profile *pro,
 	unsigned int		len;
 
 	len = path? path->len : 0;
-	for (fi = pro->ef_list; fi; fi = fi->next) {
+	fi = pro->name_index[profile_name_hash(name)];
+	for (; fi; fi = fi->name_next) {
 		sc_path_t *fpath = &fi->file->path;
 
 		if (!strcasecmp(fi->ident, name) && fpath->len >= len && !memcmp(fpath->value, path->value, len))
@@ -2036,11 +2386,44 @@ sc_profile_find_file(struct sc_profile *pro,
 }
 
 
+static int
+sc_profile_match_path(struct file_info *fi, const sc_path_t *path)
+{
+	struct sc_path *fp_path, *fpp_path;
+
+	fp_path = &fi->file->path;
+	fpp_path = fi->parent ? &fi->parent->file->path : NULL;
+
+	if (fp_path->len != path->len)
+		return 0;
+	if (fp_path->len && memcmp(fp_path->value, path->value, path->len))
+		return 0;
+
+	if (path->aid.len && fp_path->aid.len)   {
+		if (memcmp(fp_path->aid.value, path->aid.value, path->aid.len))
+			return 0;
+	}
+	else if (path->aid.len && !fp_path->aid.len && fpp_path)   {
+		if (fpp_path->type == SC_PATH_TYPE_DF_NAME && fpp_path->len)   {
+			if (fpp_path->len != path->aid.len)
+				return 0;
+			if (memcmp(fpp_path->value, path->aid.value, path->aid.len))
+				return 0;
+		}
+		else if (fpp_path->aid.len)   {
+			if (fpp_path->aid.len != path->aid.len)
+				return 0;
+			if (memcmp(fpp_path->aid.value, path->aid.value, path->aid.len))
+				return 0;
+		}
+	}
+	return 1;
+}
+
 static struct file_info *
 sc_profile_find_file_by_path(struct sc_profile *pro, const sc_path_t *path)
 {
 	struct file_info *fi, *out = NULL;
-	struct sc_path *fp_path, *fpp_path;
 
 #ifdef DEBUG_PROFILE
 	struct sc_context *ctx = pro->card->ctx;
@@ -2058,36 +2441,16 @@ sc_profile_find_file_by_path(struct sc_profile *pro, const sc_path_t *path)
 	if (!path || (!path->len && !path->aid.len))
 		return NULL;
 
-	for (fi = pro->ef_list; fi; fi = fi->next) {
-		fp_path = &fi->file->path;
-		fpp_path = fi->parent ? &fi->parent->file->path : NULL;
+	if (!pro->path_index_valid)
+		build_path_index(pro);
+	for (fi = pro->path_index[profile_path_hash(path)]; fi; fi = fi->path_next)
+		if (sc_profile_match_path(fi, path))
+			out = fi;
 
-		if (fp_path->len != path->len)
-			continue;
-		if (fp_path->len && memcmp(fp_path->value, path->value, path->len))
-			continue;
-
-		if (path->aid.len && fp_path->aid.len)   {
-			if (memcmp(fp_path->aid.value, path->aid.value, path->aid.len))
-				continue;
-		}
-		else if (path->aid.len && !fp_path->aid.len && fpp_path)   {
-			if (fpp_path->type == SC_PATH_TYPE_DF_NAME && fpp_path->len)   {
-				if (fpp_path->len != path->aid.len)
-					continue;
-				if (memcmp(fpp_path->value, path->aid.value, path->aid.len))
-					continue;
-			}
-			else if (fpp_path->aid.len)   {
-				if (fpp_path->aid.len != path->aid.len)
-					continue;
-				if (memcmp(fpp_path->aid.value, path->aid.value, path->aid.len))
-					continue;
-			}
-		}
-
-		out = fi;
-	}
+	/* Paths changed behind the index' back are still found */
+	for (fi = out ? NULL : pro->ef_list; fi; fi = fi->next)
+		if (sc_profile_match_path(fi, path))
+			out = fi;
 
 #ifdef DEBUG_PROFILE
 	sc_log(ctx, "returns (%s)", out ? out->ident: "<null>");
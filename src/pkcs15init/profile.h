@@ -43,6 +43,8 @@ struct auth_info {
 struct file_info {
 	char *			ident;
 	struct file_info *	next;
+	struct file_info *	name_next;	/* hash chain of name_index */
+	struct file_info *	path_next;	/* hash chain of path_index */
 	struct sc_file *	file;
 	unsigned int		dont_free;
 	struct file_info *	parent;
@@ -92,6 +94,8 @@ typedef struct sc_template {
 	struct file_info *	file;
 } sc_template_t;
 
+#define SC_PKCS15INIT_MAX_DIRTY_DF	16
+#define SC_PROFILE_HASH_SIZE	64
 #define SC_PKCS15INIT_MAX_OPTIONS 16
 struct sc_profile {
 	char *			name;
@@ -105,6 +109,11 @@ struct sc_profile {
 	struct file_info *	mf_info;
 	struct file_info *	df_info;
 	struct file_info *	ef_list;
+	/* Hashed views of ef_list; the path index is rebuilt
+	 * on demand once the profile files have been parsed */
+	struct file_info *	name_index[SC_PROFILE_HASH_SIZE];
+	struct file_info *	path_index[SC_PROFILE_HASH_SIZE];
+	int			path_index_valid;
 	struct sc_file *	df[SC_PKCS15_DF_TYPE_COUNT];
 
 	struct pin_info *	pin_list;
@@ -136,6 +145,16 @@ struct sc_profile {
 	 * has been changed) */
 	int			dirty;
 
+	/* Updates of the PKCS#15 meta files deferred between
+	 * sc_pkcs15init_begin() and sc_pkcs15init_commit() */
+	struct {
+		int			active;
+		struct sc_pkcs15_df *	df[SC_PKCS15INIT_MAX_DIRTY_DF];
+		unsigned int		num_df;
+		int			odf;
+		int			tokeninfo;
+	} txn;
+
 	/* PKCS15 object ID style */
 	unsigned int id_style;
 
@@ -49,6 +49,11 @@ typedef struct _scconf_parser {
 	char emesg[256];
 } scconf_parser;
 
+/* Index the items of the block and its sub-blocks by key,
+ * for blocks large enough to make it worth it */
+extern void scconf_index_build(scconf_block * block);
+extern void scconf_index_free(scconf_block * block);
+
 extern int scconf_lex_parse(scconf_parser * parser, const char *filename);
 extern int scconf_lex_parse_string(scconf_parser * parser,
 				   const char *config_string);
@@ -112,6 +112,8 @@ static scconf_item *scconf_item_add_internal(scconf_parser * parser, int type)
 		return NULL;
 	}
 	item->type = type;
+	/* The index would miss the new item */
+	scconf_index_free(parser->block);
 
 	item->key = parser->key;
 	parser->key = NULL;
@@ -392,6 +394,7 @@ int scconf_parse(scconf_context * config)
 		strlcpy(buffer, p.emesg, sizeof(buffer));
 		r = 0;
 	} else {
+		scconf_index_build(config->root);
 		r = 1;
 	}
 
@@ -419,6 +422,7 @@ int scconf_parse_string(scconf_context * config, const char *string)
 		strlcpy(buffer, p.emesg, sizeof(buffer));
 		r = 0;
 	} else {
+		scconf_index_build(config->root);
 		r = 1;
 	}
 
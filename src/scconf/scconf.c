@@ -30,6 +30,7 @@
 #include <ctype.h>
 
 #include "scconf.h"
+#include "internal.h"
 
 scconf_context *scconf_new(const char *filename)
 {
@@ -62,6 +63,144 @@ void scconf_free(scconf_context * config)
 	}
 }
 
+/*
+ * Item index of a block: all items with the same key (compared
+ * case insensitively) are listed in one entry, in block order
+ */
+#define SCCONF_INDEX_MIN_ITEMS	8
+
+typedef struct _scconf_index_entry {
+	struct _scconf_index_entry *next;
+	unsigned int hash;
+	const char *key;		/* owned by the first item */
+	scconf_item *value;		/* first value item */
+	scconf_item **blocks;		/* block items */
+	int nblocks;
+} scconf_index_entry;
+
+struct _scconf_index {
+	unsigned int size;
+	scconf_index_entry **table;
+	scconf_index_entry *entries;
+	scconf_item **blocks;
+};
+
+static unsigned int scconf_hash(const char *key)
+{
+	unsigned int h = 2166136261U;
+
+	while (*key) {
+		h = (h ^ (unsigned char) tolower((unsigned char) *key++)) * 16777619U;
+	}
+	return h;
+}
+
+static scconf_index_entry *scconf_index_find(const scconf_index * index, const char *key)
+{
+	scconf_index_entry *entry;
+	unsigned int h = scconf_hash(key);
+
+	for (entry = index->table[h & (index->size - 1)]; entry; entry = entry->next) {
+		if (entry->hash == h && strcasecmp(entry->key, key) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+void scconf_index_free(scconf_block * block)
+{
+	if (block && block->index) {
+		free(block->index->table);
+		free(block->index->entries);
+		free(block->index->blocks);
+		free(block->index);
+		block->index = NULL;
+	}
+}
+
+static int scconf_index_block(scconf_block * block)
+{
+	scconf_index *index;
+	scconf_index_entry *entry;
+	scconf_item *item;
+	unsigned int n = 0, nentries = 0, nblocks = 0;
+
+	for (item = block->items; item; item = item->next) {
+		if (item->type != SCCONF_ITEM_TYPE_COMMENT && item->key) {
+			n++;
+		}
+	}
+	if (n < SCCONF_INDEX_MIN_ITEMS) {
+		return 0;
+	}
+
+	index = calloc(1, sizeof(scconf_index));
+	if (!index) {
+		return -1;
+	}
+	for (index->size = 16; index->size < 2 * n; index->size *= 2);
+	index->table = calloc(index->size, sizeof(scconf_index_entry *));
+	index->entries = calloc(n, sizeof(scconf_index_entry));
+	index->blocks = calloc(n, sizeof(scconf_item *));
+	block->index = index;
+	if (!index->table || !index->entries || !index->blocks) {
+		scconf_index_free(block);
+		return -1;
+	}
+
+	/* First count the block items of each key, then hand out
+	 * consecutive slices of index->blocks */
+	for (item = block->items; item; item = item->next) {
+		if (item->type == SCCONF_ITEM_TYPE_COMMENT || !item->key) {
+			continue;
+		}
+		entry = scconf_index_find(index, item->key);
+		if (!entry) {
+			entry = &index->entries[nentries++];
+			entry->hash = scconf_hash(item->key);
+			entry->key = item->key;
+			entry->next = index->table[entry->hash & (index->size - 1)];
+			index->table[entry->hash & (index->size - 1)] = entry;
+		}
+		if (item->type == SCCONF_ITEM_TYPE_VALUE) {
+			if (!entry->value) {
+				entry->value = item;
+			}
+		} else {
+			entry->nblocks++;
+		}
+	}
+	for (entry = index->entries; entry < index->entries + nentries; entry++) {
+		entry->blocks = index->blocks + nblocks;
+		nblocks += entry->nblocks;
+		entry->nblocks = 0;
+	}
+	for (item = block->items; item; item = item->next) {
+		if (item->type == SCCONF_ITEM_TYPE_BLOCK && item->key) {
+			entry = scconf_index_find(index, item->key);
+			entry->blocks[entry->nblocks++] = item;
+		}
+	}
+	return 0;
+}
+
+void scconf_index_build(scconf_block * block)
+{
+	scconf_item *item;
+
+	if (!block) {
+		return;
+	}
+	scconf_index_free(block);
+	scconf_index_block(block);
+	for (item = block->items; item; item = item->next) {
+		if (item->type == SCCONF_ITEM_TYPE_BLOCK) {
+			scconf_index_build(item->value.block);
+		}
+	}
+}
+
 const scconf_block *scconf_find_block(const scconf_context * config, const scconf_block * block, const char *item_name)
 {
 	scconf_item *item;
@@ -72,6 +211,11 @@ const scconf_block *scconf_find_block(const scconf_context * config, const sccon
 	if (!item_name) {
 		return NULL;
 	}
+	if (block->index) {
+		scconf_index_entry *entry = scconf_index_find(block->index, item_name);
+
+		return entry && entry->nblocks ? entry->blocks[0]->value.block : NULL;
+	}
 	for (item = block->items; item; item = item->next) {
 		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
 		    strcasecmp(item_name, item->key) == 0) {
@@ -102,6 +246,32 @@ scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_bl
 	}
 	blocks = tmp;
 
+	if (block->index) {
+		scconf_index_entry *entry = scconf_index_find(block->index, item_name);
+		int i;
+
+		for (i = 0; entry && i < entry->nblocks; i++) {
+			item = entry->blocks[i];
+			if (!item->value.block)
+				continue;
+			if (key && strcasecmp(key, item->value.block->name->data)) {
+				continue;
+			}
+			if (size + 1 >= alloc_size) {
+				alloc_size *= 2;
+				tmp = (scconf_block **) realloc(blocks, sizeof(scconf_block *) * alloc_size);
+				if (!tmp) {
+					free(blocks);
+					return NULL;
+				}
+				blocks = tmp;
+			}
+			blocks[size++] = item->value.block;
+		}
+		blocks[size] = NULL;
+		return blocks;
+	}
+
 	for (item = block->items; item; item = item->next) {
 		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
 		    strcasecmp(item_name, item->key) == 0) {
@@ -133,6 +303,11 @@ const scconf_list *scconf_find_list(const scconf_block * block, const char *opti
 	if (!block)
 		return NULL;
 
+	if (block->index) {
+		scconf_index_entry *entry = scconf_index_find(block->index, option);
+
+		return entry && entry->value ? entry->value->value.list : NULL;
+	}
 	for (item = block->items; item; item = item->next)
 		if (item->type == SCCONF_ITEM_TYPE_VALUE && strcasecmp(option, item->key) == 0)
 			return item->value.list;
@@ -299,6 +474,7 @@ scconf_block *scconf_block_copy(const scconf_block * src, scconf_block ** dst)
 void scconf_block_destroy(scconf_block * block)
 {
 	if (block) {
+		scconf_index_free(block);
 		scconf_list_destroy(block->name);
 		scconf_item_destroy(block->items);
 		free(block);
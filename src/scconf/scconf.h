@@ -33,6 +33,7 @@ extern "C" {
 #define SCCONF_STRING		13
 
 typedef struct _scconf_block scconf_block;
+typedef struct _scconf_index scconf_index;
 
 typedef struct _scconf_list {
 	struct _scconf_list *next;
@@ -58,6 +59,7 @@ struct _scconf_block {
 	scconf_block *parent;
 	scconf_list *name;
 	scconf_item *items;
+	scconf_index *index;	/* hashed items, built by scconf_parse() */
 };
 
 typedef struct {
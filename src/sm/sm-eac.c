@@ -261,6 +261,8 @@ struct npa_sm_ctx {
 	BUF_MEM *eph_pub_key;
 	/** @brief Auxiliary Data */
 	BUF_MEM *auxiliary_data;
+	/** @brief Input buffer reused for the SM crypto operations */
+	BUF_MEM *input;
 	char flags;
 };
 
@@ -300,6 +302,7 @@ npa_sm_ctx_create(EAC_CTX *ctx, const unsigned char *certificate_description,
 		goto err;
 
 	out->ctx = ctx;
+	out->input = NULL;
 
 	if (certificate_description && certificate_description_length) {
 		out->certificate_description =
@@ -1902,6 +1905,25 @@ increment_ssc(struct npa_sm_ctx *eacsmctx)
 	return SC_SUCCESS;
 }
 
+/* Copies data into the persistent input buffer of the SM context, which only
+ * grows and hence doesn't need to be allocated for every APDU. */
+static BUF_MEM *
+npa_sm_input(struct npa_sm_ctx *eacsmctx, const u8 *data, size_t datalen)
+{
+	if (!eacsmctx->input) {
+		eacsmctx->input = BUF_MEM_new();
+		if (!eacsmctx->input)
+			return NULL;
+	}
+
+	if (!BUF_MEM_grow_clean(eacsmctx->input, datalen))
+		return NULL;
+	/* Flawfinder: ignore */
+	memcpy(eacsmctx->input->data, data, datalen);
+
+	return eacsmctx->input;
+}
+
 static int
 npa_sm_encrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 		const u8 *data, size_t datalen, u8 **enc)
@@ -1917,8 +1939,9 @@ npa_sm_encrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	}
 	eacsmctx = ctx->priv_data;
 
-	databuf = BUF_MEM_create_init(data, datalen);
-	encbuf = EAC_encrypt(eacsmctx->ctx, databuf);
+	databuf = npa_sm_input(eacsmctx, data, datalen);
+	if (databuf)
+		encbuf = EAC_encrypt(eacsmctx->ctx, databuf);
 	if (!databuf || !encbuf) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not encrypt data.");
 		ssl_error(card->ctx);
@@ -1937,7 +1960,8 @@ npa_sm_encrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	r = encbuf->length;
 
 err:
-	BUF_MEM_clear_free(databuf);
+	if (databuf)
+		OPENSSL_cleanse(databuf->data, databuf->length);
 	if (encbuf)
 		BUF_MEM_free(encbuf);
 
@@ -1959,8 +1983,9 @@ npa_sm_decrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	}
 	eacsmctx = ctx->priv_data;
 
-	encbuf = BUF_MEM_create_init(enc, enclen);
-	databuf = EAC_decrypt(eacsmctx->ctx, encbuf);
+	encbuf = npa_sm_input(eacsmctx, enc, enclen);
+	if (encbuf)
+		databuf = EAC_decrypt(eacsmctx->ctx, encbuf);
 	if (!encbuf || !databuf) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not decrypt data.");
 		ssl_error(card->ctx);
@@ -1980,8 +2005,6 @@ npa_sm_decrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 
 err:
 	BUF_MEM_clear_free(databuf);
-	if (encbuf)
-		BUF_MEM_free(encbuf);
 
 	return r;
 }
@@ -2001,7 +2024,7 @@ npa_sm_authenticate(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	}
 	eacsmctx = ctx->priv_data;
 
-	inbuf = BUF_MEM_create_init(data, datalen);
+	inbuf = npa_sm_input(eacsmctx, data, datalen);
 	if (!inbuf) {
 		r = SC_ERROR_OUT_OF_MEMORY;
 		goto err;
@@ -2027,8 +2050,6 @@ npa_sm_authenticate(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	r = macbuf->length;
 
 err:
-	if (inbuf)
-		BUF_MEM_free(inbuf);
 	if (macbuf)
 		BUF_MEM_free(macbuf);
 
@@ -2050,7 +2071,7 @@ npa_sm_verify_authentication(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	}
 	eacsmctx = ctx->priv_data;
 
-	inbuf = BUF_MEM_create_init(macdata, macdatalen);
+	inbuf = npa_sm_input(eacsmctx, macdata, macdatalen);
 	if (!inbuf) {
 		r = SC_ERROR_OUT_OF_MEMORY;
 		goto err;
@@ -2078,8 +2099,6 @@ npa_sm_verify_authentication(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	r = SC_SUCCESS;
 
 err:
-	if (inbuf)
-		BUF_MEM_free(inbuf);
 	if (my_mac)
 		BUF_MEM_free(my_mac);
 
@@ -2368,6 +2387,8 @@ npa_sm_clear_free(const struct iso_sm_ctx *ctx)
 			BUF_MEM_free(eacsmctx->eph_pub_key);
 		if (eacsmctx->auxiliary_data)
 			BUF_MEM_free(eacsmctx->auxiliary_data);
+		if (eacsmctx->input)
+			BUF_MEM_clear_free(eacsmctx->input);
 		free(eacsmctx);
 	}
 }
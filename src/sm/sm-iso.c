@@ -30,18 +30,6 @@
 
 #ifdef ENABLE_SM
 
-static const struct sc_asn1_entry c_sm_capdu[] = {
-	{ "Cryptogram",
-		SC_ASN1_OCTET_STRING, SC_ASN1_CTX|0x05, SC_ASN1_OPTIONAL, NULL, NULL },
-	{ "Padding-content indicator followed by cryptogram",
-		SC_ASN1_OCTET_STRING, SC_ASN1_CTX|0x07, SC_ASN1_OPTIONAL, NULL, NULL },
-	{ "Protected Le",
-		SC_ASN1_OCTET_STRING, SC_ASN1_CTX|0x17, SC_ASN1_OPTIONAL, NULL, NULL },
-	{ "Cryptographic Checksum",
-		SC_ASN1_OCTET_STRING, SC_ASN1_CTX|0x0E, SC_ASN1_OPTIONAL, NULL, NULL },
-	{ NULL , 0 , 0 , 0 , NULL , NULL }
-};
-
 static const struct sc_asn1_entry c_sm_rapdu[] = {
 	{ "Cryptogram",
 		SC_ASN1_OCTET_STRING, SC_ASN1_CTX|0x05, SC_ASN1_OPTIONAL, NULL, NULL },
@@ -54,28 +42,132 @@ static const struct sc_asn1_entry c_sm_rapdu[] = {
 	{ NULL, 0, 0, 0, NULL, NULL }
 };
 
+/* SM data objects (ISO 7816-4 Table 31) */
+#define SM_TAG_CRYPTOGRAM	0x85
+#define SM_TAG_PI_CRYPTOGRAM	0x87
+#define SM_TAG_LE		0x97
+#define SM_TAG_SW		0x99
+#define SM_TAG_MAC		0x8E
+
+/* Buffers kept for the lifetime of the SM session. Once they have grown to
+ * the size of the largest APDU, wrapping and unwrapping doesn't allocate
+ * anymore. Each set belongs to one outstanding SM APDU, which is embedded as
+ * well. A command may be wrapped while another one is outstanding (e.g. GET
+ * RESPONSE from within sc_transmit()); it gets the nested set. */
+struct iso_sm_scratch {
+	/* padded command data */
+	u8 *pad;
+	size_t pad_size;
+	/* padded data to authenticate */
+	u8 *mac_data;
+	size_t mac_data_size;
+	/* data field of the SM APDU */
+	u8 *sm_data;
+	size_t sm_data_size;
+	/* response buffer of the SM APDU */
+	u8 *resp;
+	size_t resp_size;
+
+	sc_apdu_t sm_apdu;
+	int sm_apdu_in_use;
+
+	/* buffers for a command wrapped while sm_apdu is outstanding */
+	struct iso_sm_scratch *nested;
+};
+
+static int
+scratch_reserve(u8 **buf, size_t *size, size_t len)
+{
+	u8 *p;
+
+	if (len <= *size)
+		return SC_SUCCESS;
+
+	p = realloc(*buf, len);
+	if (!p)
+		return SC_ERROR_OUT_OF_MEMORY;
+	*buf = p;
+	*size = len;
+
+	return SC_SUCCESS;
+}
+
+static void
+scratch_free(struct iso_sm_scratch *s)
+{
+	if (!s)
+		return;
+
+	if (s->pad) {
+		sc_mem_clear(s->pad, s->pad_size);
+		free(s->pad);
+	}
+	free(s->mac_data);
+	free(s->sm_data);
+	free(s->resp);
+	scratch_free(s->nested);
+	free(s);
+}
+
+/* Buffers for wrapping the next command: the first set, or the nested one
+ * if the first set's APDU is still outstanding */
+static struct iso_sm_scratch *
+scratch_get(struct iso_sm_ctx *sctx)
+{
+	struct iso_sm_scratch **s = &sctx->scratch;
+	int depth;
+
+	for (depth = 0; depth < 2; depth++) {
+		if (!*s) {
+			*s = calloc(1, sizeof **s);
+			if (!*s)
+				return NULL;
+		}
+		if (!(*s)->sm_apdu_in_use)
+			return *s;
+		s = &(*s)->nested;
+	}
+
+	return NULL;
+}
+
+/* Buffers the SM APDU was wrapped into */
+static struct iso_sm_scratch *
+scratch_of(const struct iso_sm_ctx *sctx, const sc_apdu_t *sm_apdu)
+{
+	struct iso_sm_scratch *s;
+
+	for (s = sctx ? sctx->scratch : NULL; s; s = s->nested)
+		if (sm_apdu == &s->sm_apdu)
+			return s;
+
+	return NULL;
+}
+
 static int
-add_iso_pad(const u8 *data, size_t datalen, int block_size, u8 **padded)
+add_iso_pad(const u8 *data, size_t datalen, int block_size, u8 **padded,
+		size_t *padded_size)
 {
 	u8 *p;
 	size_t p_len;
+	int in_place, r;
 
-	if (!padded)
+	if (!padded || !padded_size)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	/* calculate length of padded message */
 	p_len = (datalen / block_size) * block_size + block_size;
 
-	p = realloc(*padded, p_len);
-	if (!p)
-		return SC_ERROR_OUT_OF_MEMORY;
+	in_place = *padded == data;
+	r = scratch_reserve(padded, padded_size, p_len);
+	if (r < 0)
+		return r;
+	p = *padded;
 
-	if (*padded != data)
+	if (!in_place)
 		/* Flawfinder: ignore */
 		memcpy(p, data, datalen);
 
-	*padded = p;
-
 	/* now add iso padding */
 	memset(p + datalen, 0x80, 1);
 	memset(p + datalen + 1, 0, p_len - datalen - 1);
@@ -85,23 +177,23 @@ add_iso_pad(const u8 *data, size_t datalen, int block_size, u8 **padded)
 
 static int
 add_padding(const struct iso_sm_ctx *ctx, const u8 *data, size_t datalen,
-		u8 **padded)
+		u8 **padded, size_t *padded_size)
 {
-	u8 *p;
+	int r;
 
 	switch (ctx->padding_indicator) {
 		case SM_NO_PADDING:
 			if (*padded != data) {
-				p = realloc(*padded, datalen);
-				if (!p)
-					return SC_ERROR_OUT_OF_MEMORY;
-				*padded = p;
+				r = scratch_reserve(padded, padded_size, datalen);
+				if (r < 0)
+					return r;
 				/* Flawfinder: ignore */
 				memcpy(*padded, data, datalen);
 			}
 			return datalen;
 		case SM_ISO_PADDING:
-			return add_iso_pad(data, datalen, ctx->block_length, padded);
+			return add_iso_pad(data, datalen, ctx->block_length, padded,
+					padded_size);
 		default:
 			return SC_ERROR_INVALID_ARGUMENTS;
 	}
@@ -141,148 +233,51 @@ rm_padding(u8 padding_indicator, const u8 *data, size_t datalen)
 	return len;
 }
 
-static int format_le(size_t le, struct sc_asn1_entry *le_entry,
-		u8 **lebuf, size_t *le_len)
+/* size of a data object with a BER encoded length as sc_asn1_encode() would
+ * write it */
+static size_t tlv_size(size_t len)
 {
-	u8 *p;
-
-	if (!lebuf || !le_len)
-		return SC_ERROR_INVALID_ARGUMENTS;
-
-	p = realloc(*lebuf, *le_len);
-	if (!p)
-		return SC_ERROR_OUT_OF_MEMORY;
-	*lebuf = p;
+	size_t c = 0;
 
-	switch (*le_len) {
-		case 1:
-			p[0] = le;
-			break;
-		case 2:
-			p[0] = le >> 8;
-			p[1] = le & 0xff;
-			break;
-		case 3:
-			p[0] = 0x00;
-			p[1] = le >> 8;
-			p[2] = le & 0xff;
-			break;
-		default:
-			return SC_ERROR_INVALID_ARGUMENTS;
+	if (len > 127) {
+		c = 1;
+		while (len >> (c << 3))
+			c++;
 	}
 
-	sc_format_asn1_entry(le_entry, *lebuf, le_len, SC_ASN1_PRESENT);
-
-	return SC_SUCCESS;
+	return 2 + c + len;
 }
 
-static int prefix_buf(u8 prefix, u8 *buf, size_t buflen, u8 **cat)
+static u8 *put_tag_len(u8 *p, u8 tag, size_t len)
 {
-	u8 *p;
-
-	p = realloc(*cat, buflen + 1);
-	if (!p)
-		return SC_ERROR_OUT_OF_MEMORY;
-
-	if (*cat == buf) {
-		memmove(p + 1, p, buflen);
+	size_t c = 0;
+
+	*p++ = tag;
+	if (len > 127) {
+		c = 1;
+		while (len >> (c << 3))
+			c++;
+		*p++ = 0x80 | c;
+		while (c--)
+			*p++ = (len >> (c << 3)) & 0xFF;
 	} else {
-		/* Flawfinder: ignore */
-		memcpy(p + 1, buf, buflen);
-	}
-	p[0] = prefix;
-
-	*cat = p;
-
-	return buflen + 1;
-}
-
-static int format_data(sc_card_t *card, const struct iso_sm_ctx *ctx,
-		int prepend_padding_indicator, const u8 *data, size_t datalen,
-		struct sc_asn1_entry *formatted_encrypted_data_entry,
-		u8 **formatted_data, size_t *formatted_data_len)
-{
-	int r;
-	u8 *pad_data = NULL;
-	size_t pad_data_len = 0;
-
-	if (!ctx || !formatted_data || !formatted_data_len) {
-		r = SC_ERROR_INVALID_ARGUMENTS;
-		goto err;
-	}
-
-	r = add_padding(ctx, data, datalen, &pad_data);
-	if (r < 0) {
-		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not add padding to data: %s",
-				sc_strerror(r));
-		goto err;
-	}
-	pad_data_len = r;
-
-	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Data to encrypt", pad_data, pad_data_len);
-	r = ctx->encrypt(card, ctx, pad_data, pad_data_len, formatted_data);
-	if (r < 0) {
-		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not encrypt the data");
-		goto err;
-	}
-	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Cryptogram", *formatted_data, r);
-
-	if (prepend_padding_indicator) {
-		r = prefix_buf(ctx->padding_indicator, *formatted_data, r, formatted_data);
-		if (r < 0) {
-			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not prepend padding indicator to formatted "
-					"data: %s", sc_strerror(r));
-			goto err;
-		}
-	}
-
-	*formatted_data_len = r;
-	sc_format_asn1_entry(formatted_encrypted_data_entry,
-			*formatted_data, formatted_data_len, SC_ASN1_PRESENT);
-
-	r = SC_SUCCESS;
-
-err:
-	if (pad_data) {
-		sc_mem_clear(pad_data, pad_data_len);
-		free(pad_data);
+		*p++ = len & 0x7F;
 	}
 
-	return r;
-}
-
-static int format_head(const struct iso_sm_ctx *ctx, const sc_apdu_t *apdu,
-		u8 **formatted_head)
-{
-	u8 *p;
-
-	if (!apdu || !formatted_head)
-		return SC_ERROR_INVALID_ARGUMENTS;
-
-	p = realloc(*formatted_head, 4);
-	if (!p)
-		return SC_ERROR_OUT_OF_MEMORY;
-
-	p[0] = apdu->cla;
-	p[1] = apdu->ins;
-	p[2] = apdu->p1;
-	p[3] = apdu->p2;
-	*formatted_head = p;
-
-	return add_padding(ctx, *formatted_head, 4, formatted_head);
+	return p;
 }
 
-static int sm_encrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
-		const sc_apdu_t *apdu, sc_apdu_t **psm_apdu)
+static int sm_encrypt(const struct iso_sm_ctx *ctx, struct iso_sm_scratch *s,
+		sc_card_t *card, const sc_apdu_t *apdu, sc_apdu_t **psm_apdu)
 {
-	struct sc_asn1_entry sm_capdu[5];
-	u8 *p, *le = NULL, *sm_data = NULL, *fdata = NULL, *mac_data = NULL,
-	   *asn1 = NULL, *mac = NULL, *resp_data = NULL;
-	size_t sm_data_len, fdata_len, mac_data_len, asn1_len, mac_len, le_len;
-	int r, cse;
+	u8 le[2], *p, *crypt = NULL, *mac = NULL;
+	size_t le_len = 0, pad_len, crypt_len = 0, mac_data_len, mac_len,
+		   sm_data_len = 0, resplen;
+	int r, cse, encrypt = 0, prepend_padding_indicator = 0;
 	sc_apdu_t *sm_apdu = NULL;
 
-	if (!apdu || !ctx || !card || !card->reader || !psm_apdu) {
+	if (!apdu || !ctx || !s || s->sm_apdu_in_use || !card || !card->reader
+			|| !psm_apdu) {
 		r = SC_ERROR_INVALID_ARGUMENTS;
 		goto err;
 	}
@@ -293,26 +288,6 @@ static int sm_encrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 		goto err;
 	}
 
-	sc_copy_asn1_entry(c_sm_capdu, sm_capdu);
-
-	sm_apdu = malloc(sizeof(sc_apdu_t));
-	if (!sm_apdu) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto err;
-	}
-	sm_apdu->control = apdu->control;
-	sm_apdu->flags = apdu->flags;
-	sm_apdu->cla = apdu->cla|0x0C;
-	sm_apdu->ins = apdu->ins;
-	sm_apdu->p1 = apdu->p1;
-	sm_apdu->p2 = apdu->p2;
-	r = format_head(ctx, sm_apdu, &mac_data);
-	if (r < 0) {
-		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format header of SM apdu");
-		goto err;
-	}
-	mac_data_len = r;
-
 	/* get le and data depending on the case of the insecure command */
 	cse = apdu->cse;
 	if ((apdu->le/ctx->block_length + 1)*ctx->block_length + 18 > 0xff+1)
@@ -326,107 +301,36 @@ static int sm_encrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 	switch (cse) {
 		case SC_APDU_CASE_1:
 			break;
-	case SC_APDU_CASE_2_SHORT:
+		case SC_APDU_CASE_2_SHORT:
 			le_len = 1;
-			r = format_le(apdu->le, sm_capdu + 2, &le, &le_len);
-			if (r < 0) {
-				sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format Le of SM apdu");
-				goto err;
-			}
-			sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Protected Le (plain)", le, le_len);
 			break;
-	case SC_APDU_CASE_2_EXT:
+		case SC_APDU_CASE_2_EXT:
 			if (card->reader->active_protocol == SC_PROTO_T0) {
 				/* T0 extended APDUs look just like short APDUs */
 				le_len = 1;
-				r = format_le(apdu->le, sm_capdu + 2, &le, &le_len);
-				if (r < 0) {
-					sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format Le of SM apdu");
-					goto err;
-				}
 			} else {
 				/* in case of T1 always use 2 bytes for length */
 				le_len = 2;
-				r = format_le(apdu->le, sm_capdu + 2, &le, &le_len);
-				if (r < 0) {
-					sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format Le of SM apdu");
-					goto err;
-				}
 			}
-			sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Protected Le (plain)", le, le_len);
 			break;
 		case SC_APDU_CASE_3_SHORT:
 		case SC_APDU_CASE_3_EXT:
-			if (apdu->ins & 1) {
-				r = format_data(card, ctx, 0, apdu->data, apdu->datalen,
-						sm_capdu + 0, &fdata, &fdata_len);
-			} else {
-				r = format_data(card, ctx, 1, apdu->data, apdu->datalen,
-						sm_capdu + 1, &fdata, &fdata_len);
-			}
-			if (r < 0) {
-				sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format data of SM apdu");
-				goto err;
-			}
-			sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Padding-content indicator followed by cryptogram (plain)",
-					fdata, fdata_len);
+			encrypt = 1;
 			break;
 		case SC_APDU_CASE_4_SHORT:
 			/* in case of T0 no Le byte is added */
-			if (card->reader->active_protocol != SC_PROTO_T0) {
+			if (card->reader->active_protocol != SC_PROTO_T0)
 				le_len = 1;
-				r = format_le(apdu->le, sm_capdu + 2, &le, &le_len);
-				if (r < 0) {
-					sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format Le of SM apdu");
-					goto err;
-				}
-				sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Protected Le (plain)", le, le_len);
-			}
-
-			if (apdu->ins & 1) {
-				r = format_data(card, ctx, 0, apdu->data, apdu->datalen,
-						sm_capdu + 0, &fdata, &fdata_len);
-			} else {
-				r = format_data(card, ctx, 1, apdu->data, apdu->datalen,
-						sm_capdu + 1, &fdata, &fdata_len);
-			}
-			if (r < 0) {
-				sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format data of SM apdu");
-				goto err;
-			}
-			sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Padding-content indicator followed by cryptogram (plain)",
-					fdata, fdata_len);
+			encrypt = 1;
 			break;
 		case SC_APDU_CASE_4_EXT:
-			if (card->reader->active_protocol == SC_PROTO_T0) {
-				/* again a T0 extended case 4 APDU looks just
-				 * like a short APDU, the additional data is
-				 * transferred using ENVELOPE and GET RESPONSE */
-			} else {
-				/* only 2 bytes are use to specify the length of the
-				 * expected data */
+			/* again a T0 extended case 4 APDU looks just like a short
+			 * APDU, the additional data is transferred using ENVELOPE and
+			 * GET RESPONSE. Otherwise only 2 bytes are use to specify the
+			 * length of the expected data */
+			if (card->reader->active_protocol != SC_PROTO_T0)
 				le_len = 2;
-				r = format_le(apdu->le, sm_capdu + 2, &le, &le_len);
-				if (r < 0) {
-					sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format Le of SM apdu");
-					goto err;
-				}
-				sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Protected Le (plain)", le, le_len);
-			}
-
-			if (apdu->ins & 1) {
-				r = format_data(card, ctx, 0, apdu->data, apdu->datalen,
-						sm_capdu + 0, &fdata, &fdata_len);
-			} else {
-				r = format_data(card, ctx, 1, apdu->data, apdu->datalen,
-						sm_capdu + 1, &fdata, &fdata_len);
-			}
-			if (r < 0) {
-				sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format data of SM apdu");
-				goto err;
-			}
-			sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Padding-content indicator followed by cryptogram (plain)",
-					fdata, fdata_len);
+			encrypt = 1;
 			break;
 		default:
 			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Unhandled apdu case");
@@ -434,31 +338,95 @@ static int sm_encrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 			goto err;
 	}
 
+	if (le_len == 1) {
+		le[0] = apdu->le & 0xff;
+	} else if (le_len == 2) {
+		le[0] = (apdu->le >> 8) & 0xff;
+		le[1] = apdu->le & 0xff;
+	}
+	if (le_len)
+		sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Protected Le (plain)", le, le_len);
+
+	if (encrypt) {
+		prepend_padding_indicator = !(apdu->ins & 1);
+
+		r = add_padding(ctx, apdu->data, apdu->datalen, &s->pad, &s->pad_size);
+		if (r < 0) {
+			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not add padding to data: %s",
+					sc_strerror(r));
+			goto err;
+		}
+		pad_len = r;
+
+		sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Data to encrypt", s->pad, pad_len);
+		r = ctx->encrypt(card, ctx, s->pad, pad_len, &crypt);
+		sc_mem_clear(s->pad, pad_len);
+		if (r < 0) {
+			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not encrypt the data");
+			goto err;
+		}
+		crypt_len = r;
+		sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Cryptogram", crypt, crypt_len);
+	}
+
+	/* data objects that are covered by the MAC */
+	r = scratch_reserve(&s->sm_data, &s->sm_data_size,
+			(encrypt ? tlv_size(prepend_padding_indicator + crypt_len) : 0)
+			+ (le_len ? tlv_size(le_len) : 0));
+	if (r < 0)
+		goto err;
+	p = s->sm_data;
+	if (encrypt) {
+		if (prepend_padding_indicator) {
+			p = put_tag_len(p, SM_TAG_PI_CRYPTOGRAM, 1 + crypt_len);
+			*p++ = ctx->padding_indicator;
+		} else {
+			p = put_tag_len(p, SM_TAG_CRYPTOGRAM, crypt_len);
+		}
+		/* Flawfinder: ignore */
+		memcpy(p, crypt, crypt_len);
+		p += crypt_len;
+	}
+	if (le_len) {
+		p = put_tag_len(p, SM_TAG_LE, le_len);
+		/* Flawfinder: ignore */
+		memcpy(p, le, le_len);
+		p += le_len;
+	}
+	sm_data_len = p - s->sm_data;
 
-	r = sc_asn1_encode(card->ctx, sm_capdu, (u8 **) &asn1, &asn1_len);
+	/* padded header followed by the padded data objects */
+	r = scratch_reserve(&s->mac_data, &s->mac_data_size, 4);
+	if (r < 0)
+		goto err;
+	s->mac_data[0] = apdu->cla|0x0C;
+	s->mac_data[1] = apdu->ins;
+	s->mac_data[2] = apdu->p1;
+	s->mac_data[3] = apdu->p2;
+	r = add_padding(ctx, s->mac_data, 4, &s->mac_data, &s->mac_data_size);
 	if (r < 0) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not format header of SM apdu");
 		goto err;
 	}
-	if (asn1_len) {
-		p = realloc(mac_data, mac_data_len + asn1_len);
-		if (!p) {
-			r = SC_ERROR_OUT_OF_MEMORY;
+	mac_data_len = r;
+	if (sm_data_len) {
+		r = scratch_reserve(&s->mac_data, &s->mac_data_size,
+				mac_data_len + sm_data_len);
+		if (r < 0)
 			goto err;
-		}
-		mac_data = p;
 		/* Flawfinder: ignore */
-		memcpy(mac_data + mac_data_len, asn1, asn1_len);
-		mac_data_len += asn1_len;
-		r = add_padding(ctx, mac_data, mac_data_len, &mac_data);
+		memcpy(s->mac_data + mac_data_len, s->sm_data, sm_data_len);
+		mac_data_len += sm_data_len;
+		r = add_padding(ctx, s->mac_data, mac_data_len, &s->mac_data,
+				&s->mac_data_size);
 		if (r < 0) {
 			goto err;
 		}
 		mac_data_len = r;
 	}
-	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Data to authenticate", mac_data, mac_data_len);
+	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "Data to authenticate", s->mac_data, mac_data_len);
 
-	r = ctx->authenticate(card, ctx, mac_data, mac_data_len,
-			&mac);
+	r = ctx->authenticate(card, ctx, s->mac_data, mac_data_len, &mac);
 	if (r < 0) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not get authentication code");
 		goto err;
@@ -468,50 +436,56 @@ static int sm_encrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 
 
 	/* format SM apdu */
-	sc_format_asn1_entry(sm_capdu + 3, mac, &mac_len, SC_ASN1_PRESENT);
-	r = sc_asn1_encode(card->ctx, sm_capdu, (u8 **) &sm_data, &sm_data_len);
+	r = scratch_reserve(&s->sm_data, &s->sm_data_size,
+			sm_data_len + tlv_size(mac_len));
 	if (r < 0)
 		goto err;
-	sm_apdu->data = sm_data;
-	sm_apdu->datalen = sm_data_len;
-	sm_apdu->lc = sm_data_len;
-	sm_apdu->le = 0;
+	p = put_tag_len(s->sm_data + sm_data_len, SM_TAG_MAC, mac_len);
+	/* Flawfinder: ignore */
+	memcpy(p, mac, mac_len);
+	sm_data_len += tlv_size(mac_len);
+
 	if (cse & SC_APDU_EXT) {
-		sm_apdu->cse = SC_APDU_CASE_4_EXT;
 #if OPENSC_NOT_BOGUS_ANYMORE
-		sm_apdu->resplen = 0xffff+1;
+		resplen = 0xffff+1;
 #else
-		sm_apdu->resplen = SC_MAX_EXT_APDU_BUFFER_SIZE;
+		resplen = SC_MAX_EXT_APDU_BUFFER_SIZE;
 #endif
 	} else {
-		sm_apdu->cse = SC_APDU_CASE_4_SHORT;
 #if OPENSC_NOT_BOGUS_ANYMORE
-		sm_apdu->resplen = 0xff+1;
+		resplen = 0xff+1;
 #else
-		sm_apdu->resplen = SC_MAX_APDU_BUFFER_SIZE;
+		resplen = SC_MAX_APDU_BUFFER_SIZE;
 #endif
 	}
-	resp_data = malloc(sm_apdu->resplen);
-	if (!resp_data) {
-		r = SC_ERROR_OUT_OF_MEMORY;
+
+	r = scratch_reserve(&s->resp, &s->resp_size, resplen);
+	if (r < 0)
 		goto err;
-	}
-	sm_apdu->resp = resp_data;
+	sm_apdu = &s->sm_apdu;
+	memset(sm_apdu, 0, sizeof *sm_apdu);
+	sm_apdu->data = s->sm_data;
+	sm_apdu->resp = s->resp;
+	sm_apdu->control = apdu->control;
+	sm_apdu->flags = apdu->flags;
+	sm_apdu->cla = apdu->cla|0x0C;
+	sm_apdu->ins = apdu->ins;
+	sm_apdu->p1 = apdu->p1;
+	sm_apdu->p2 = apdu->p2;
+	sm_apdu->datalen = sm_data_len;
+	sm_apdu->lc = sm_data_len;
+	sm_apdu->le = 0;
+	sm_apdu->cse = cse & SC_APDU_EXT ? SC_APDU_CASE_4_EXT : SC_APDU_CASE_4_SHORT;
+	sm_apdu->resplen = resplen;
+	s->sm_apdu_in_use = 1;
 	sc_debug_hex(card->ctx, SC_LOG_DEBUG_NORMAL, "ASN.1 encoded encrypted APDU data", sm_apdu->data, sm_apdu->datalen);
 
 	*psm_apdu = sm_apdu;
+	r = SC_SUCCESS;
 
 err:
-	free(fdata);
-	free(asn1);
-	free(mac_data);
+	free(crypt);
 	free(mac);
-	free(le);
-	if (r < 0) {
-		free(resp_data);
-		free(sm_apdu);
-		free(sm_data);
-	}
 
 	return r;
 }
@@ -520,13 +494,15 @@ static int sm_decrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 		const sc_apdu_t *sm_apdu, sc_apdu_t *apdu)
 {
 	int r;
+	struct iso_sm_scratch *s = scratch_of(ctx, sm_apdu);
 	struct sc_asn1_entry sm_rapdu[5];
-	struct sc_asn1_entry my_sm_rapdu[5];
-	u8 sw[2], mac[8], fdata[SC_MAX_EXT_APDU_BUFFER_SIZE];
+	u8 sw[2], mac[8], fdata[SC_MAX_EXT_APDU_BUFFER_SIZE], *p, *plain = NULL;
 	size_t sw_len = sizeof sw, mac_len = sizeof mac, fdata_len = sizeof fdata,
-		   buf_len, asn1_len, fdata_offset = 0;
+		   buf_len, plain_len = 0, mac_data_len, fdata_offset = 0;
 	const u8 *buf;
-	u8 *data = NULL, *mac_data = NULL, *asn1 = NULL;
+
+	if (!s)
+		return SC_ERROR_INVALID_ARGUMENTS;
 
 	sc_copy_asn1_entry(c_sm_rapdu, sm_rapdu);
 	sc_format_asn1_entry(sm_rapdu + 0, fdata, &fdata_len, 0);
@@ -545,20 +521,38 @@ static int sm_decrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 
 
 	if (sm_rapdu[3].flags & SC_ASN1_PRESENT) {
-		/* copy from sm_apdu to my_sm_apdu, but leave mac at default */
-		sc_copy_asn1_entry(sm_rapdu, my_sm_rapdu);
-		sc_copy_asn1_entry(&c_sm_rapdu[3], &my_sm_rapdu[3]);
-
-		r = sc_asn1_encode(card->ctx, my_sm_rapdu, &asn1, &asn1_len);
+		/* re-encode all data objects but the MAC */
+		mac_data_len = 0;
+		if (sm_rapdu[0].flags & SC_ASN1_PRESENT
+				|| sm_rapdu[1].flags & SC_ASN1_PRESENT)
+			mac_data_len += tlv_size(fdata_len);
+		if (sm_rapdu[2].flags & SC_ASN1_PRESENT)
+			mac_data_len += tlv_size(sw_len);
+		r = scratch_reserve(&s->mac_data, &s->mac_data_size, mac_data_len);
 		if (r < 0)
 			goto err;
-		r = add_padding(ctx, asn1, asn1_len, &mac_data);
+		p = s->mac_data;
+		if (sm_rapdu[0].flags & SC_ASN1_PRESENT
+				|| sm_rapdu[1].flags & SC_ASN1_PRESENT) {
+			p = put_tag_len(p, sm_rapdu[0].flags & SC_ASN1_PRESENT ?
+					SM_TAG_CRYPTOGRAM : SM_TAG_PI_CRYPTOGRAM, fdata_len);
+			/* Flawfinder: ignore */
+			memcpy(p, fdata, fdata_len);
+			p += fdata_len;
+		}
+		if (sm_rapdu[2].flags & SC_ASN1_PRESENT) {
+			p = put_tag_len(p, SM_TAG_SW, sw_len);
+			/* Flawfinder: ignore */
+			memcpy(p, sw, sw_len);
+		}
+		r = add_padding(ctx, s->mac_data, mac_data_len, &s->mac_data,
+				&s->mac_data_size);
 		if (r < 0) {
 			goto err;
 		}
-		
+
 		r = ctx->verify_authentication(card, ctx, mac, mac_len,
-				mac_data, r);
+				s->mac_data, r);
 		if (r < 0)
 			goto err;
 	} else {
@@ -578,12 +572,12 @@ static int sm_decrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 	if (sm_rapdu[0].flags & SC_ASN1_PRESENT
 			|| sm_rapdu[1].flags & SC_ASN1_PRESENT) {
 		r = ctx->decrypt(card, ctx, fdata + fdata_offset,
-				fdata_len - fdata_offset, &data);
+				fdata_len - fdata_offset, &plain);
 		if (r < 0)
 			goto err;
-		buf_len = r;
+		plain_len = r;
 
-		r = rm_padding(ctx->padding_indicator, data, buf_len);
+		r = rm_padding(ctx->padding_indicator, plain, plain_len);
 		if (r < 0) {
 			sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not remove padding");
 			goto err;
@@ -598,7 +592,7 @@ static int sm_decrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 			goto err;
 		}
 		/* Flawfinder: ignore */
-		memcpy(apdu->resp, data, r);
+		memcpy(apdu->resp, plain, r);
 		apdu->resplen = r;
 	} else {
 		apdu->resplen = 0;
@@ -626,11 +620,9 @@ static int sm_decrypt(const struct iso_sm_ctx *ctx, sc_card_t *card,
 	r = SC_SUCCESS;
 
 err:
-	free(asn1);
-	free(mac_data);
-	if (data) {
-		sc_mem_clear(data, buf_len);
-		free(data);
+	if (plain) {
+		sc_mem_clear(plain, plain_len);
+		free(plain);
 	}
 
 	return r;
@@ -639,6 +631,8 @@ err:
 static int iso_add_sm(struct iso_sm_ctx *sctx, sc_card_t *card,
 		sc_apdu_t *apdu, sc_apdu_t **sm_apdu)
 {
+	struct iso_sm_scratch *s;
+
 	if (!card || !sctx)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
@@ -649,10 +643,16 @@ static int iso_add_sm(struct iso_sm_ctx *sctx, sc_card_t *card,
 		return SC_ERROR_SM_NOT_APPLIED;
 	}
 
+	s = scratch_get(sctx);
+	if (!s) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "No buffers left for wrapping another APDU");
+		return SC_ERROR_NOT_ALLOWED;
+	}
+
 	if (sctx->pre_transmit)
 		SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, sctx->pre_transmit(card, sctx, apdu),
 				"Could not complete SM specific pre transmit routine");
-	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, sm_encrypt(sctx, card, apdu, sm_apdu),
+	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, sm_encrypt(sctx, s, card, apdu, sm_apdu),
 			"Could not encrypt APDU");
 
 	return SC_SUCCESS;
@@ -690,6 +690,8 @@ int iso_get_sm_apdu(struct sc_card *card, struct sc_apdu *apdu, struct sc_apdu *
 
 int iso_free_sm_apdu(struct sc_card *card, struct sc_apdu *apdu, struct sc_apdu **sm_apdu)
 {
+	struct iso_sm_ctx *sctx;
+	struct iso_sm_scratch *s;
 	struct sc_apdu *p;
 	int r;
 
@@ -698,13 +700,20 @@ int iso_free_sm_apdu(struct sc_card *card, struct sc_apdu *apdu, struct sc_apdu
 
 	p = *sm_apdu;
 
-	r = iso_rm_sm(card->sm_ctx.info.cmd_data, card, p, apdu);
+	sctx = card->sm_ctx.info.cmd_data;
+	r = iso_rm_sm(sctx, card, p, apdu);
 
-	if (p) {
-		free((unsigned char *) p->data);
-		free((unsigned char *) p->resp);
+	s = scratch_of(sctx, p);
+	if (s) {
+		/* data and response are owned by the scratch buffers */
+		s->sm_apdu_in_use = 0;
+	} else {
+		if (p) {
+			free((unsigned char *) p->data);
+			free((unsigned char *) p->resp);
+		}
+		free(p);
 	}
-	free(*sm_apdu);
 	*sm_apdu = NULL;
 
 	return r;
@@ -727,14 +736,18 @@ struct iso_sm_ctx *iso_sm_ctx_create(void)
 	sctx->post_transmit = NULL;
 	sctx->finish = NULL;
 	sctx->clear_free = NULL;
+	sctx->scratch = NULL;
 
 	return sctx;
 }
 
 void iso_sm_ctx_clear_free(struct iso_sm_ctx *sctx)
 {
-	if (sctx && sctx->clear_free)
-		sctx->clear_free(sctx);
+	if (sctx) {
+		if (sctx->clear_free)
+			sctx->clear_free(sctx);
+		scratch_free(sctx->scratch);
+	}
 	free(sctx);
 }
 
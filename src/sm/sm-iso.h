@@ -50,6 +50,8 @@ extern "C" {
 /** @brief Padding indicator: use no padding */
 #define SM_NO_PADDING  0x02
 
+struct iso_sm_scratch;
+
 /** @brief Secure messaging context */
 struct iso_sm_ctx {
 	/** @brief data of the specific crypto implementation */
@@ -87,6 +89,9 @@ struct iso_sm_ctx {
 
 	/** @brief Clears and frees private data */
 	void (*clear_free)(const struct iso_sm_ctx *ctx);
+
+	/** @brief Buffers reused for wrapping and unwrapping APDUs (internal) */
+	struct iso_sm_scratch *scratch;
 };
 
 /** 
@@ -0,0 +1,94 @@
+/*
+ * ctx-bench.c: Start-up time of an OpenSC context
+ *
+ * Creates and releases contexts in a loop, the way short-lived tools and
+ * PKCS#11 modules loaded per request do. Card drivers and the reader driver
+ * are initialised on first use, so the cost of touching them is measured
+ * separately. Set OPENSC_CONF to benchmark a specific configuration file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "libopensc/opensc.h"
+
+#define TOUCH_NOTHING		0
+#define TOUCH_CARD_DRIVERS	1
+#define TOUCH_READERS		2
+
+static const char *touch_names[] = {
+	"context only",
+	"card drivers",
+	"card drivers and readers"
+};
+
+static int run(unsigned long count, int touch)
+{
+	struct sc_context *ctx;
+	struct timeval tv1, tv2;
+	unsigned long i;
+	double elapsed;
+	int r;
+
+	if (0 != gettimeofday(&tv1, NULL)) {
+		fprintf(stderr, "gettimeofday() failed: %s\n", strerror(errno));
+		return 1;
+	}
+	for (i = 0; i < count; i++) {
+		r = sc_establish_context(&ctx, "ctx-bench");
+		if (r) {
+			fprintf(stderr, "Failed to create context: %s\n", sc_strerror(r));
+			return 1;
+		}
+		if (touch >= TOUCH_CARD_DRIVERS)
+			sc_ctx_load_card_drivers(ctx);
+		if (touch >= TOUCH_READERS)
+			sc_ctx_get_reader_count(ctx);
+		sc_release_context(ctx);
+	}
+	gettimeofday(&tv2, NULL);
+
+	elapsed = (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) / 1000000.0;
+	printf("%-26s %lu contexts in %.3f s, %.1f us per context\n",
+			touch_names[touch], count, elapsed, elapsed * 1000000.0 / count);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long count = 10000;
+	int touch;
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 0);
+	if (!count) {
+		fprintf(stderr, "Usage: %s [count]\n", argv[0]);
+		return 1;
+	}
+
+	for (touch = TOUCH_NOTHING; touch <= TOUCH_READERS; touch++)
+		if (run(count, touch))
+			return 1;
+	return 0;
+}
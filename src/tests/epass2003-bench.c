@@ -0,0 +1,421 @@
+/*
+ * epass2003-bench.c: Throughput of the ePass2003 secure messaging
+ *
+ * Connects the epass2003 driver to an emulated token behind a virtual reader
+ * and measures READ BINARY and UPDATE BINARY commands per second. All of
+ * them are SCP01 wrapped. The emulator checks the MAC and the cryptogram of
+ * every command, so this also verifies the wrapping.
+ *
+ * Whole file transfers span several commands. They are measured one command
+ * at a time and as one batch (sm_pipeline). An optional latency emulates the
+ * reader round trip.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <openssl/evp.h>
+
+#include "libopensc/opensc.h"
+
+#define DATA_LEN 128
+#define FILE_LEN 4096
+
+/* ATR and default key of an ePass2003 in FIPS (AES) mode */
+static const u8 epass2003_atr[] = {
+	0x3B, 0x9F, 0x95, 0x81, 0x31, 0xFE, 0x9F, 0x00, 0x66, 0x46, 0x53, 0x05,
+	0x10, 0x00, 0x11, 0x71, 0xdf, 0x00, 0x00, 0x00, 0x6a, 0x82, 0x5e
+};
+static const u8 init_key[16] = {
+	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C,
+	0x0D, 0x0E, 0x0F, 0x10
+};
+static const u8 card_random[8] = {
+	0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88
+};
+static const u8 zero_iv[16];
+
+static struct {
+	EVP_CIPHER_CTX *enc;		/* AES-128-CBC with the session key */
+	EVP_CIPHER_CTX *dec;
+	u8 icv[16];
+	u8 data[FILE_LEN];
+	unsigned long latency;		/* microseconds per SM command */
+	unsigned long errors;
+} emu;
+
+static int aes_cbc(EVP_CIPHER_CTX *ctx, const u8 *key, const u8 *iv,
+		const u8 *in, size_t len, u8 *out)
+{
+	int outl;
+
+	return EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, -1)
+		&& EVP_CipherUpdate(ctx, out, &outl, in, len) ? 0 : -1;
+}
+
+static size_t iso_pad(u8 *buf, size_t len)
+{
+	buf[len++] = 0x80;
+	while (len % 16)
+		buf[len++] = 0x00;
+	return len;
+}
+
+static void set_resp(sc_apdu_t *apdu, const u8 *resp, size_t len,
+		unsigned int sw)
+{
+	if (len > apdu->resplen)
+		len = apdu->resplen;
+	memcpy(apdu->resp, resp, len);
+	apdu->resplen = len;
+	apdu->sw1 = sw >> 8;
+	apdu->sw2 = sw & 0xFF;
+}
+
+static void emu_initialize_update(sc_apdu_t *apdu)
+{
+	u8 resp[28], derivation[16], sk[16], buf[32], cryptogram[32];
+	const u8 *host_random = apdu->data;
+
+	memset(resp, 0, sizeof resp);
+	memcpy(resp + 12, card_random, 8);
+
+	/* session key */
+	memcpy(derivation, resp + 16, 4);
+	memcpy(derivation + 4, host_random, 4);
+	memcpy(derivation + 8, resp + 12, 4);
+	memcpy(derivation + 12, host_random + 4, 4);
+	aes_cbc(emu.enc, init_key, zero_iv, derivation, 16, sk);
+	EVP_CipherInit_ex(emu.enc, NULL, NULL, sk, NULL, -1);
+	EVP_CipherInit_ex(emu.dec, NULL, NULL, sk, NULL, -1);
+
+	/* card cryptogram */
+	memcpy(buf, host_random, 8);
+	memcpy(buf + 8, card_random, 8);
+	iso_pad(buf, 16);
+	aes_cbc(emu.enc, NULL, zero_iv, buf, 32, cryptogram);
+	memcpy(resp + 20, cryptogram + 16, 8);
+
+	set_resp(apdu, resp, sizeof resp, 0x9000);
+}
+
+/* READ BINARY answer: cryptogram, status and a MAC the host ignores */
+static void emu_read(sc_apdu_t *apdu, size_t offs, size_t le)
+{
+	u8 pad[SC_MAX_APDU_BUFFER_SIZE + 16], resp[SC_MAX_APDU_BUFFER_SIZE + 32];
+	size_t len = 0, pad_len;
+
+	if (offs >= FILE_LEN || le > SC_MAX_APDU_BUFFER_SIZE) {
+		set_resp(apdu, (const u8 *) "\x99\x02\x6B\x00\x8E\x08\0\0\0\0\0\0\0\0",
+				14, 0x9000);
+		return;
+	}
+	if (le > FILE_LEN - offs)
+		le = FILE_LEN - offs;
+
+	memcpy(pad, emu.data + offs, le);
+	pad_len = iso_pad(pad, le);
+	resp[len++] = 0x87;
+	if (pad_len + 1 > 0x7F)
+		resp[len++] = 0x81;
+	resp[len++] = pad_len + 1;
+	resp[len++] = 0x01;
+	aes_cbc(emu.enc, NULL, zero_iv, pad, pad_len, resp + len);
+	len += pad_len;
+	memcpy(resp + len, "\x99\x02\x90\x00\x8E\x08\0\0\0\0\0\0\0\0", 14);
+	len += 14;
+
+	set_resp(apdu, resp, len, 0x9000);
+}
+
+static void emu_sm_command(sc_apdu_t *apdu)
+{
+	u8 mac_data[SC_MAX_APDU_BUFFER_SIZE + 32], mac[SC_MAX_APDU_BUFFER_SIZE + 32];
+	u8 plain[SC_MAX_APDU_BUFFER_SIZE];
+	size_t len, objs_len, offs, hdr;
+	int i;
+
+	if (apdu->datalen < 10 || apdu->datalen > SC_MAX_APDU_BUFFER_SIZE
+			|| apdu->data[apdu->datalen - 10] != 0x8E) {
+		emu.errors++;
+		set_resp(apdu, NULL, 0, 0x6987);
+		return;
+	}
+	objs_len = apdu->datalen - 10;
+
+	for (i = 15; i >= 0; i--)
+		if (++emu.icv[i])
+			break;
+
+	memset(mac_data, 0, 16);
+	mac_data[0] = apdu->cla;
+	mac_data[1] = apdu->ins;
+	mac_data[2] = apdu->p1;
+	mac_data[3] = apdu->p2;
+	mac_data[4] = 0x80;
+	len = 16;
+	if (objs_len) {
+		memcpy(mac_data + len, apdu->data, objs_len);
+		len = iso_pad(mac_data, len + objs_len);
+	}
+	aes_cbc(emu.enc, NULL, emu.icv, mac_data, len, mac);
+	if (memcmp(mac + len - 16, apdu->data + objs_len + 2, 8) != 0) {
+		emu.errors++;
+		set_resp(apdu, NULL, 0, 0x6988);
+		return;
+	}
+
+	offs = (apdu->p1 << 8) | apdu->p2;
+	switch (apdu->ins) {
+	case 0xB0:
+		/* 97 01 Le or 97 02 Le Le */
+		if (apdu->data[0] != 0x97 || objs_len != 2 + (size_t)apdu->data[1]) {
+			emu.errors++;
+			set_resp(apdu, NULL, 0, 0x6700);
+			break;
+		}
+		len = apdu->data[1] == 1 ? apdu->data[2] : (apdu->data[2] << 8) | apdu->data[3];
+		emu_read(apdu, offs, len);
+		break;
+	case 0xD6:
+		/* 87 L 01 or 87 82 L L 01, then the cryptogram */
+		if (apdu->data[0] != 0x87) {
+			emu.errors++;
+			set_resp(apdu, NULL, 0, 0x6700);
+			break;
+		}
+		if (apdu->data[1] == 0x82) {
+			len = ((apdu->data[2] << 8) | apdu->data[3]) - 1;
+			hdr = 5;
+		} else {
+			len = apdu->data[1] - 1;
+			hdr = 3;
+		}
+		if (hdr + len > objs_len || len > sizeof plain
+				|| aes_cbc(emu.dec, NULL, zero_iv, apdu->data + hdr, len, plain)) {
+			emu.errors++;
+			set_resp(apdu, NULL, 0, 0x6700);
+			break;
+		}
+		while (len && plain[len - 1] == 0x00)
+			len--;
+		/* the written data is expected to match the file */
+		if (!len || plain[--len] != 0x80 || offs + len > FILE_LEN
+				|| memcmp(plain, emu.data + offs, len) != 0)
+			emu.errors++;
+		set_resp(apdu, (const u8 *) "\x99\x02\x90\x00\x8E\x08\0\0\0\0\0\0\0\0",
+				14, 0x9000);
+		break;
+	default:
+		set_resp(apdu, NULL, 0, 0x6D00);
+		break;
+	}
+}
+
+static int emu_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	static const u8 get_data_86[32] = { 0x00, 0x00, 0x01 };
+
+	if ((apdu->cla & 0x0C) == 0x0C) {
+		if (emu.latency)
+			usleep(emu.latency);
+		emu_sm_command(apdu);
+	} else if (apdu->ins == 0xCA && apdu->p2 == 0x86) {
+		set_resp(apdu, get_data_86, sizeof get_data_86, 0x9000);
+	} else if (apdu->cla == 0x80 && apdu->ins == 0x50 && apdu->datalen == 8) {
+		emu_initialize_update(apdu);
+	} else if (apdu->cla == 0x84 && apdu->ins == 0x82 && apdu->datalen == 16) {
+		/* EXTERNAL AUTHENTICATE: the host MAC is the initial ICV */
+		memset(emu.icv, 0, sizeof emu.icv);
+		memcpy(emu.icv, apdu->data + 8, 8);
+		set_resp(apdu, NULL, 0, 0x9000);
+	} else {
+		set_resp(apdu, NULL, 0, 0x6D00);
+	}
+
+	return SC_SUCCESS;
+}
+
+static int emu_connect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int emu_disconnect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static struct sc_reader_operations emu_ops;
+static struct sc_reader_driver emu_drv = {
+	"Emulated ePass2003",
+	"emulated",
+	&emu_ops,
+	NULL
+};
+
+static int run(const char *name, sc_card_t *card, int update, size_t len,
+		unsigned long count)
+{
+	struct timeval tv1, tv2;
+	unsigned long i;
+	double elapsed;
+	u8 buf[FILE_LEN];
+	int r;
+
+	gettimeofday(&tv1, NULL);
+	for (i = 0; i < count; i++) {
+		if (update)
+			r = sc_update_binary(card, 0, emu.data, len, 0);
+		else
+			r = sc_read_binary(card, 0, buf, len, 0);
+		if (r != (int)len || (!update && memcmp(buf, emu.data, len) != 0)) {
+			fprintf(stderr, "%s failed: %s\n", name, r < 0 ? sc_strerror(r) : "wrong data");
+			return 1;
+		}
+	}
+	gettimeofday(&tv2, NULL);
+
+	elapsed = (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) / 1000000.0;
+	printf("%s, %"SC_FORMAT_LEN_SIZE_T"u bytes: %lu calls in %.3f s", name, len, count, elapsed);
+	if (elapsed > 0)
+		printf(", %.0f calls per second", count / elapsed);
+	printf("\n");
+
+	return 0;
+}
+
+/* A short read in the middle of a batched transfer ends the batch; the
+ * session must be usable afterwards. */
+static int check_resync(sc_card_t *card)
+{
+	u8 buf[FILE_LEN + 1024];
+	int r;
+
+	r = sc_read_binary(card, 0, buf, sizeof buf, 0);
+	if (r >= 0 && r != FILE_LEN) {
+		fprintf(stderr, "Reading past the end of the file returned %d bytes\n", r);
+		return 1;
+	}
+	r = sc_read_binary(card, 0, buf, FILE_LEN, 0);
+	if (r != FILE_LEN || memcmp(buf, emu.data, FILE_LEN) != 0) {
+		fprintf(stderr, "SM session lost after a failed read: %s\n",
+				r < 0 ? sc_strerror(r) : "wrong data");
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sc_context *ctx = NULL;
+	struct sc_reader reader;
+	struct sc_card *card = NULL;
+	unsigned long count = 100000;
+	size_t i;
+	int r;
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		emu.latency = strtoul(argv[2], NULL, 0);
+	if (!count) {
+		fprintf(stderr, "Usage: %s [count [latency in microseconds]]\n", argv[0]);
+		return 1;
+	}
+
+	emu.enc = EVP_CIPHER_CTX_new();
+	emu.dec = EVP_CIPHER_CTX_new();
+	if (!emu.enc || !emu.dec
+			|| !EVP_EncryptInit_ex(emu.enc, EVP_aes_128_cbc(), NULL, NULL, NULL)
+			|| !EVP_DecryptInit_ex(emu.dec, EVP_aes_128_cbc(), NULL, NULL, NULL)) {
+		fprintf(stderr, "Failed to initialize emulator\n");
+		return 1;
+	}
+	EVP_CIPHER_CTX_set_padding(emu.enc, 0);
+	EVP_CIPHER_CTX_set_padding(emu.dec, 0);
+	for (i = 0; i < FILE_LEN; i++)
+		emu.data[i] = i & 0xff;
+
+	r = sc_establish_context(&ctx, "epass2003-bench");
+	if (r) {
+		fprintf(stderr, "Failed to create initial context: %s\n", sc_strerror(r));
+		return 1;
+	}
+
+	emu_ops.connect = emu_connect;
+	emu_ops.disconnect = emu_disconnect;
+	emu_ops.transmit = emu_transmit;
+	memset(&reader, 0, sizeof reader);
+	reader.ctx = ctx;
+	reader.driver = &emu_drv;
+	reader.ops = &emu_ops;
+	reader.name = "Emulated ePass2003 reader";
+	reader.flags = SC_READER_CARD_PRESENT;
+	reader.active_protocol = SC_PROTO_T1;
+	memcpy(reader.atr.value, epass2003_atr, sizeof epass2003_atr);
+	reader.atr.len = sizeof epass2003_atr;
+
+	r = sc_set_card_driver(ctx, "epass2003");
+	if (r == SC_SUCCESS)
+		r = sc_connect_card(&reader, &card);
+	if (r) {
+		fprintf(stderr, "Failed to connect to the emulated card: %s\n", sc_strerror(r));
+		goto end;
+	}
+
+	r = run("READ BINARY", card, 0, DATA_LEN, count);
+	if (!r)
+		r = run("UPDATE BINARY", card, 1, DATA_LEN, count);
+	/* each of these takes some twenty commands */
+	if (!r)
+		r = run("READ BINARY", card, 0, FILE_LEN, count / 20 + 1);
+	if (!r)
+		r = run("UPDATE BINARY", card, 1, FILE_LEN, count / 20 + 1);
+	if (!r)
+		r = check_resync(card);
+	card->sm_ctx.sm_flags |= SM_FLAGS_PIPELINE;
+	if (!r)
+		r = run("READ BINARY batched", card, 0, FILE_LEN, count / 20 + 1);
+	if (!r)
+		r = run("UPDATE BINARY batched", card, 1, FILE_LEN, count / 20 + 1);
+	if (!r)
+		r = check_resync(card);
+	if (emu.errors) {
+		fprintf(stderr, "%lu commands were not wrapped correctly\n", emu.errors);
+		r = 1;
+	}
+
+end:
+	if (card)
+		sc_disconnect_card(card);
+	sc_release_context(ctx);
+	EVP_CIPHER_CTX_free(emu.enc);
+	EVP_CIPHER_CTX_free(emu.dec);
+	return r ? 1 : 0;
+}
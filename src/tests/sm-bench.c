@@ -0,0 +1,361 @@
+/*
+ * sm-bench.c: Throughput of ISO 7816 secure messaging wrapping
+ *
+ * Wraps and unwraps APDUs with the ISO SM layer using AES-128 encryption and
+ * an AES CBC-MAC, without talking to a card. The response of the "card" is
+ * computed once in advance, so only the host side of SM is measured.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <openssl/evp.h>
+
+#include "libopensc/opensc.h"
+#include "sm/sm-iso.h"
+
+#define BLOCK_SIZE 16
+#define MAC_SIZE 8
+
+struct bench_keys {
+	EVP_CIPHER_CTX *enc;
+	EVP_CIPHER_CTX *dec;
+	EVP_CIPHER_CTX *mac;
+};
+
+static const u8 iv[BLOCK_SIZE];
+
+static int bench_encrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
+		const u8 *data, size_t datalen, u8 **enc)
+{
+	struct bench_keys *keys = ctx->priv_data;
+	u8 *p;
+	int len;
+
+	p = realloc(*enc, datalen);
+	if (!p)
+		return SC_ERROR_OUT_OF_MEMORY;
+	*enc = p;
+
+	if (!EVP_EncryptInit_ex(keys->enc, NULL, NULL, NULL, iv)
+			|| !EVP_EncryptUpdate(keys->enc, p, &len, data, datalen))
+		return SC_ERROR_INTERNAL;
+
+	return len;
+}
+
+static int bench_decrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
+		const u8 *enc, size_t enclen, u8 **data)
+{
+	struct bench_keys *keys = ctx->priv_data;
+	u8 *p;
+	int len;
+
+	p = realloc(*data, enclen);
+	if (!p)
+		return SC_ERROR_OUT_OF_MEMORY;
+	*data = p;
+
+	if (!EVP_DecryptInit_ex(keys->dec, NULL, NULL, NULL, iv)
+			|| !EVP_DecryptUpdate(keys->dec, p, &len, enc, enclen))
+		return SC_ERROR_INTERNAL;
+
+	return len;
+}
+
+static int cbc_mac(struct bench_keys *keys, const u8 *data, size_t datalen,
+		u8 mac[BLOCK_SIZE])
+{
+	size_t i;
+	int len;
+
+	if (datalen % BLOCK_SIZE
+			|| !EVP_EncryptInit_ex(keys->mac, NULL, NULL, NULL, iv))
+		return SC_ERROR_INTERNAL;
+
+	/* keep only the last block of the CBC encryption */
+	for (i = 0; i < datalen; i += BLOCK_SIZE)
+		if (!EVP_EncryptUpdate(keys->mac, mac, &len, data + i, BLOCK_SIZE))
+			return SC_ERROR_INTERNAL;
+
+	return SC_SUCCESS;
+}
+
+static int bench_authenticate(sc_card_t *card, const struct iso_sm_ctx *ctx,
+		const u8 *data, size_t datalen, u8 **outdata)
+{
+	u8 mac[BLOCK_SIZE], *p;
+	int r;
+
+	r = cbc_mac(ctx->priv_data, data, datalen, mac);
+	if (r < 0)
+		return r;
+
+	p = realloc(*outdata, MAC_SIZE);
+	if (!p)
+		return SC_ERROR_OUT_OF_MEMORY;
+	*outdata = p;
+	memcpy(p, mac, MAC_SIZE);
+
+	return MAC_SIZE;
+}
+
+static int bench_verify_authentication(sc_card_t *card, const struct iso_sm_ctx *ctx,
+		const u8 *mac, size_t maclen,
+		const u8 *macdata, size_t macdatalen)
+{
+	u8 my_mac[BLOCK_SIZE];
+	int r;
+
+	r = cbc_mac(ctx->priv_data, macdata, macdatalen, my_mac);
+	if (r < 0)
+		return r;
+
+	if (maclen != MAC_SIZE || memcmp(my_mac, mac, MAC_SIZE) != 0)
+		return SC_ERROR_OBJECT_NOT_VALID;
+
+	return SC_SUCCESS;
+}
+
+static void bench_clear_free(const struct iso_sm_ctx *ctx)
+{
+	struct bench_keys *keys = ctx->priv_data;
+
+	if (keys) {
+		EVP_CIPHER_CTX_free(keys->enc);
+		EVP_CIPHER_CTX_free(keys->dec);
+		EVP_CIPHER_CTX_free(keys->mac);
+		free(keys);
+	}
+}
+
+static struct iso_sm_ctx *bench_sm_ctx_create(void)
+{
+	static const u8 key[BLOCK_SIZE] = {
+		0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+	};
+	struct iso_sm_ctx *sctx;
+	struct bench_keys *keys;
+
+	sctx = iso_sm_ctx_create();
+	keys = calloc(1, sizeof *keys);
+	if (!sctx || !keys) {
+		free(keys);
+		iso_sm_ctx_clear_free(sctx);
+		return NULL;
+	}
+	sctx->priv_data = keys;
+	sctx->clear_free = bench_clear_free;
+
+	keys->enc = EVP_CIPHER_CTX_new();
+	keys->dec = EVP_CIPHER_CTX_new();
+	keys->mac = EVP_CIPHER_CTX_new();
+	if (!keys->enc || !keys->dec || !keys->mac
+			|| !EVP_EncryptInit_ex(keys->enc, EVP_aes_128_cbc(), NULL, key, iv)
+			|| !EVP_DecryptInit_ex(keys->dec, EVP_aes_128_cbc(), NULL, key, iv)
+			|| !EVP_EncryptInit_ex(keys->mac, EVP_aes_128_cbc(), NULL, key, iv)) {
+		iso_sm_ctx_clear_free(sctx);
+		return NULL;
+	}
+	EVP_CIPHER_CTX_set_padding(keys->enc, 0);
+	EVP_CIPHER_CTX_set_padding(keys->dec, 0);
+	EVP_CIPHER_CTX_set_padding(keys->mac, 0);
+
+	sctx->authenticate = bench_authenticate;
+	sctx->verify_authentication = bench_verify_authentication;
+	sctx->encrypt = bench_encrypt;
+	sctx->decrypt = bench_decrypt;
+	sctx->padding_indicator = SM_ISO_PADDING;
+	sctx->block_length = BLOCK_SIZE;
+
+	return sctx;
+}
+
+/* Builds the protected response a card would send for the given data with
+ * status word 9000. */
+static int format_response(struct iso_sm_ctx *sctx, sc_card_t *card,
+		const u8 *data, size_t datalen, u8 *resp, size_t *resplen)
+{
+	u8 padded[SC_MAX_APDU_BUFFER_SIZE], *enc = NULL, *mac = NULL;
+	size_t padded_len, len = 0;
+	int r;
+
+	padded_len = (datalen / BLOCK_SIZE + 1) * BLOCK_SIZE;
+	if (padded_len + 1 > 0xff || padded_len + 20 > *resplen)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	memcpy(padded, data, datalen);
+	padded[datalen] = 0x80;
+	memset(padded + datalen + 1, 0, padded_len - datalen - 1);
+
+	r = sctx->encrypt(card, sctx, padded, padded_len, &enc);
+	if (r < 0)
+		goto err;
+
+	resp[len++] = 0x87;
+	if (padded_len + 1 > 0x7f)
+		resp[len++] = 0x81;
+	resp[len++] = padded_len + 1;
+	resp[len++] = SM_ISO_PADDING;
+	memcpy(resp + len, enc, padded_len);
+	len += padded_len;
+	resp[len++] = 0x99;
+	resp[len++] = 0x02;
+	resp[len++] = 0x90;
+	resp[len++] = 0x00;
+
+	/* MAC data is padded as well */
+	memcpy(padded, resp, len);
+	padded[len] = 0x80;
+	padded_len = (len / BLOCK_SIZE + 1) * BLOCK_SIZE;
+	memset(padded + len + 1, 0, padded_len - len - 1);
+	r = sctx->authenticate(card, sctx, padded, padded_len, &mac);
+	if (r < 0)
+		goto err;
+
+	resp[len++] = 0x8E;
+	resp[len++] = r;
+	memcpy(resp + len, mac, r);
+	len += r;
+
+	*resplen = len;
+	r = SC_SUCCESS;
+
+err:
+	free(enc);
+	free(mac);
+	return r;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sc_context *ctx = NULL;
+	struct sc_reader reader;
+	struct sc_card card;
+	struct iso_sm_ctx *sctx;
+	struct sc_apdu apdu, *sm_apdu;
+	struct timeval tv1, tv2;
+	u8 data[MAX_SM_APDU_DATA_SIZE], rbuf[SC_MAX_APDU_BUFFER_SIZE];
+	u8 card_resp[SC_MAX_APDU_BUFFER_SIZE];
+	size_t card_resp_len = sizeof card_resp, datalen = 128;
+	unsigned long i, count = 100000;
+	double elapsed;
+	int r;
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		datalen = strtoul(argv[2], NULL, 0);
+	if (!count || datalen > MAX_SM_APDU_RESP_SIZE) {
+		fprintf(stderr, "Usage: %s [count] [data length (max %d)]\n",
+				argv[0], MAX_SM_APDU_RESP_SIZE);
+		return 1;
+	}
+
+	r = sc_establish_context(&ctx, "sm-bench");
+	if (r) {
+		fprintf(stderr, "Failed to create initial context: %s\n", sc_strerror(r));
+		return 1;
+	}
+
+	memset(&reader, 0, sizeof reader);
+	reader.active_protocol = SC_PROTO_T1;
+	memset(&card, 0, sizeof card);
+	card.ctx = ctx;
+	card.reader = &reader;
+
+	sctx = bench_sm_ctx_create();
+	if (!sctx) {
+		fprintf(stderr, "Failed to create SM context\n");
+		r = 1;
+		goto end;
+	}
+	r = iso_sm_start(&card, sctx);
+	if (r < 0) {
+		iso_sm_ctx_clear_free(sctx);
+		fprintf(stderr, "Failed to start SM: %s\n", sc_strerror(r));
+		goto end;
+	}
+
+	for (i = 0; i < sizeof data; i++)
+		data[i] = i & 0xff;
+	r = format_response(sctx, &card, data, datalen, card_resp, &card_resp_len);
+	if (r < 0) {
+		fprintf(stderr, "Failed to prepare response: %s\n", sc_strerror(r));
+		goto end;
+	}
+
+	if (0 != gettimeofday(&tv1, NULL)) {
+		fprintf(stderr, "gettimeofday() failed: %s\n", strerror(errno));
+		r = 1;
+		goto end;
+	}
+	for (i = 0; i < count; i++) {
+		/* UPDATE BINARY sending datalen bytes, answered with datalen bytes */
+		memset(&apdu, 0, sizeof apdu);
+		apdu.cse = SC_APDU_CASE_4_SHORT;
+		apdu.cla = 0x00;
+		apdu.ins = 0xD6;
+		apdu.data = data;
+		apdu.datalen = datalen;
+		apdu.lc = datalen;
+		apdu.le = datalen;
+		apdu.resp = rbuf;
+		apdu.resplen = sizeof rbuf;
+
+		r = card.sm_ctx.ops.get_sm_apdu(&card, &apdu, &sm_apdu);
+		if (r < 0) {
+			fprintf(stderr, "Failed to wrap APDU: %s\n", sc_strerror(r));
+			goto end;
+		}
+
+		memcpy(sm_apdu->resp, card_resp, card_resp_len);
+		sm_apdu->resplen = card_resp_len;
+		sm_apdu->sw1 = 0x90;
+		sm_apdu->sw2 = 0x00;
+
+		r = card.sm_ctx.ops.free_sm_apdu(&card, &apdu, &sm_apdu);
+		if (r < 0 || apdu.resplen != datalen
+				|| memcmp(rbuf, data, datalen) != 0) {
+			fprintf(stderr, "Failed to unwrap APDU: %s\n", sc_strerror(r));
+			r = 1;
+			goto end;
+		}
+	}
+	gettimeofday(&tv2, NULL);
+
+	elapsed = (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) / 1000000.0;
+	printf("%lu APDUs with %lu bytes data in %.3f s\n",
+			count, (unsigned long) datalen, elapsed);
+	if (elapsed > 0)
+		printf("%.0f wrapped/unwrapped APDUs per second\n", count / elapsed);
+	r = 0;
+
+end:
+	if (card.sm_ctx.ops.close)
+		card.sm_ctx.ops.close(&card);
+	if (ctx)
+		sc_release_context(ctx);
+	return r ? 1 : 0;
+}
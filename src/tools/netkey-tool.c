@@ -540,6 +540,7 @@ int main(
 	if(ctx->debug>0)
 		printf("Context for application \"%s\" created, Debug=%d\n", ctx->app_name, ctx->debug);
 
+	sc_ctx_load_card_drivers(ctx);
 	for(i=0;ctx->card_drivers[i];++i)
 		if(!strcmp("tcos", ctx->card_drivers[i]->short_name)) break;
 	if(!ctx->card_drivers[i]){
@@ -304,6 +304,7 @@ static int list_drivers(void)
 {
 	int i;
 
+	sc_ctx_load_card_drivers(ctx);
 	if (ctx->card_drivers[0] == NULL) {
 		printf("No card drivers installed!\n");
 		return 0;
@@ -27,8 +27,12 @@
 
 #ifndef _WIN32
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #else
 #include <windows.h>
 #include <io.h>
@@ -77,6 +81,14 @@ extern CK_RV C_UnloadModule(void *module);
 #define NEED_SESSION_RO	0x01
 #define NEED_SESSION_RW	0x02
 
+/* --bench-ops */
+#define BENCH_SIGN	0x01
+#define BENCH_DECRYPT	0x02
+#define BENCH_DIGEST	0x04
+#define BENCH_FIND	0x08
+#define BENCH_ATTR	0x10
+#define BENCH_ALL	0x1f
+
 static struct ec_curve_info {
 	const char *name;
 	const char *oid;
@@ -150,6 +162,12 @@ enum {
 	OPT_HASH_ALGORITHM,
 	OPT_MGF,
 	OPT_SALT,
+	OPT_BENCHMARK,
+	OPT_BENCH_THREADS,
+	OPT_BENCH_SESSIONS,
+	OPT_BENCH_DURATION,
+	OPT_BENCH_OPS,
+	OPT_BENCH_ALL_SLOTS,
 };
 
 static const struct option options[] = {
@@ -217,6 +235,12 @@ static const struct option options[] = {
 	{ "test-fork",		0, NULL,		OPT_TEST_FORK },
 #endif
 	{ "generate-random",	1, NULL,		OPT_GENERATE_RANDOM },
+	{ "benchmark",		0, NULL,		OPT_BENCHMARK },
+	{ "bench-threads",	1, NULL,		OPT_BENCH_THREADS },
+	{ "bench-sessions",	1, NULL,		OPT_BENCH_SESSIONS },
+	{ "bench-duration",	1, NULL,		OPT_BENCH_DURATION },
+	{ "bench-ops",		1, NULL,		OPT_BENCH_OPS },
+	{ "bench-all-slots",	0, NULL,		OPT_BENCH_ALL_SLOTS },
 
 	{ NULL, 0, NULL, 0 }
 };
@@ -286,6 +310,12 @@ static const char *option_help[] = {
 	"Test forking and calling C_Initialize() in the child",
 #endif
 	"Generate given amount of random data",
+	"Measure throughput and latency (best used with the --login or --pin option)",
+	"Number of benchmark threads (default 1)",
+	"Number of sessions per benchmark thread (default 1)",
+	"Seconds to run each benchmark case (default 10)",
+	"Operations to benchmark: sign,decrypt,digest,find,attr (default all)",
+	"Spread the benchmark threads over all slots with a token",
 };
 
 static const char *	app_name = "pkcs11-tool"; /* for utils.c */
@@ -333,6 +363,11 @@ static CK_MECHANISM_TYPE opt_hash_alg = 0;
 static unsigned long	opt_mgf = 0;
 static long	        salt_len = 0;
 static int		salt_len_given = 0; /* 0 - not given, 1 - given with input parameters */
+static unsigned long	opt_bench_threads = 1;
+static unsigned long	opt_bench_sessions = 1;
+static unsigned long	opt_bench_duration = 10;
+static unsigned int	opt_bench_ops = BENCH_ALL;
+static int		opt_bench_all_slots = 0;
 
 static void *module = NULL;
 static CK_FUNCTION_LIST_PTR p11 = NULL;
@@ -437,6 +472,8 @@ static void		test_ec(CK_SLOT_ID slot, CK_SESSION_HANDLE session);
 static void		test_fork(void);
 #endif
 static void		generate_random(CK_SESSION_HANDLE session);
+static unsigned int	parse_bench_ops(const char *list);
+static void		benchmark(CK_SESSION_HANDLE session, int do_login);
 static CK_RV		find_object_with_attributes(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE *out,
 				CK_ATTRIBUTE *attrs, CK_ULONG attrsLen, CK_ULONG obj_index);
 static CK_ULONG		get_private_key_length(CK_SESSION_HANDLE sess, CK_OBJECT_HANDLE prkey);
@@ -554,6 +591,8 @@ int main(int argc, char * argv[])
 	int do_unlock_pin = 0;
 	int action_count = 0;
 	int do_generate_random = 0;
+	int do_benchmark = 0;
+	CK_C_INITIALIZE_ARGS init_args = { NULL, NULL, NULL, NULL, CKF_OS_LOCKING_OK, NULL };
 	CK_RV rv;
 
 #ifdef _WIN32
@@ -868,6 +907,26 @@ int main(int argc, char * argv[])
 			do_generate_random = 1;
 			action_count++;
 			break;
+		case OPT_BENCHMARK:
+			need_session |= NEED_SESSION_RO;
+			do_benchmark = 1;
+			action_count++;
+			break;
+		case OPT_BENCH_THREADS:
+			opt_bench_threads = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_BENCH_SESSIONS:
+			opt_bench_sessions = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_BENCH_DURATION:
+			opt_bench_duration = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_BENCH_OPS:
+			opt_bench_ops = parse_bench_ops(optarg);
+			break;
+		case OPT_BENCH_ALL_SLOTS:
+			opt_bench_all_slots = 1;
+			break;
 
 		default:
 			util_print_usage_and_die(app_name, options, option_help, NULL);
@@ -880,6 +939,9 @@ int main(int argc, char * argv[])
 	if (action_count == 0)
 		util_print_usage_and_die(app_name, options, option_help, NULL);
 
+	if (!opt_bench_threads || !opt_bench_sessions || !opt_bench_duration)
+		util_fatal("Benchmark threads, sessions and duration must be positive");
+
 #ifdef _WIN32
 	expanded_len = PATH_MAX;
 	expanded_len = ExpandEnvironmentStringsA(opt_module, expanded_val, expanded_len);
@@ -891,7 +953,8 @@ int main(int argc, char * argv[])
 	if (module == NULL)
 		util_fatal("Failed to load pkcs11 module");
 
-	rv = p11->C_Initialize(NULL);
+	/* the benchmark calls the module from several threads */
+	rv = p11->C_Initialize(do_benchmark ? &init_args : NULL);
 	if (rv == CKR_CRYPTOKI_ALREADY_INITIALIZED)
 		fprintf(stderr, "\n*** Cryptoki library has already been initialized ***\n");
 	else if (rv != CKR_OK)
@@ -1118,6 +1181,9 @@ int main(int argc, char * argv[])
 		generate_random(session);
 	}
 
+	if (do_benchmark)
+		benchmark(session, opt_login);
+
 end:
 	if (session != CK_INVALID_HANDLE) {
 		rv = p11->C_CloseSession(session);
@@ -5613,6 +5679,546 @@ static void generate_random(CK_SESSION_HANDLE session)
 	free(buf);
 }
 
+/*
+ * Throughput benchmark: every case (operation, mechanism, key) is run for
+ * opt_bench_duration seconds by opt_bench_threads threads, each one
+ * cycling through opt_bench_sessions sessions of its own.
+ */
+#define BENCH_MAX_CASES	64
+#define BENCH_MAX_KEYS	16
+#define BENCH_MAX_SLOTS	16
+
+static const struct bench_op_name {
+	const char *name;
+	unsigned int op;
+} bench_op_names[] = {
+	{ "sign",	BENCH_SIGN },
+	{ "decrypt",	BENCH_DECRYPT },
+	{ "digest",	BENCH_DIGEST },
+	{ "find",	BENCH_FIND },
+	{ "attr",	BENCH_ATTR },
+	{ NULL, 0 }
+};
+
+/* Mechanisms swept when no --mechanism is given */
+static const struct bench_mech {
+	CK_MECHANISM_TYPE mech;
+	CK_KEY_TYPE key_type;
+	unsigned int ops;
+	CK_ULONG data_len;
+} bench_mechs[] = {
+	{ CKM_RSA_PKCS,		CKK_RSA,	BENCH_SIGN | BENCH_DECRYPT,	32 },
+	{ CKM_SHA1_RSA_PKCS,	CKK_RSA,	BENCH_SIGN,	1024 },
+	{ CKM_SHA256_RSA_PKCS,	CKK_RSA,	BENCH_SIGN,	1024 },
+	{ CKM_SHA384_RSA_PKCS,	CKK_RSA,	BENCH_SIGN,	1024 },
+	{ CKM_SHA512_RSA_PKCS,	CKK_RSA,	BENCH_SIGN,	1024 },
+	{ CKM_ECDSA,		CKK_EC,		BENCH_SIGN,	32 },
+	{ CKM_ECDSA_SHA1,	CKK_EC,		BENCH_SIGN,	1024 },
+	{ CKM_ECDSA_SHA256,	CKK_EC,		BENCH_SIGN,	1024 },
+	{ CKM_SHA_1,		0,		BENCH_DIGEST,	1024 },
+	{ CKM_SHA256,		0,		BENCH_DIGEST,	1024 },
+	{ CKM_SHA384,		0,		BENCH_DIGEST,	1024 },
+	{ CKM_SHA512,		0,		BENCH_DIGEST,	1024 },
+	{ 0, 0, 0, 0 }
+};
+
+struct bench_case {
+	unsigned int op;
+	CK_MECHANISM_TYPE mech;
+	CK_ULONG data_len;
+	unsigned char id[100];
+	CK_ULONG id_len;
+	char key[32];
+	unsigned char cipher[1024];
+	CK_ULONG cipher_len;
+};
+
+struct bench_thread {
+	const struct bench_case *bcase;
+	CK_SLOT_ID slot;
+	unsigned long count, errors;
+	unsigned long long *latency;
+	size_t latency_len, latency_size;
+};
+
+static unsigned long long bench_now(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER now, freq;
+
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&freq);
+	return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000
+		+ (unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static CK_RV bench_run(const struct bench_case *bcase, CK_SESSION_HANDLE sess,
+		CK_OBJECT_HANDLE key, unsigned char *data)
+{
+	CK_MECHANISM mech = { bcase->mech, NULL, 0 };
+	unsigned char out[1024], id[100], label[256];
+	CK_ULONG out_len = sizeof(out), count;
+	CK_OBJECT_CLASS cls;
+	CK_KEY_TYPE type;
+	CK_OBJECT_HANDLE found[32];
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, &cls, sizeof(cls) },
+		{ CKA_KEY_TYPE, &type, sizeof(type) },
+		{ CKA_ID, id, sizeof(id) },
+		{ CKA_LABEL, label, sizeof(label) }
+	};
+	CK_RV rv;
+
+	switch (bcase->op) {
+	case BENCH_SIGN:
+		rv = p11->C_SignInit(sess, &mech, key);
+		if (rv == CKR_OK)
+			rv = p11->C_Sign(sess, data, bcase->data_len, out, &out_len);
+		break;
+	case BENCH_DECRYPT:
+		rv = p11->C_DecryptInit(sess, &mech, key);
+		if (rv == CKR_OK)
+			rv = p11->C_Decrypt(sess, (CK_BYTE_PTR)bcase->cipher, bcase->cipher_len,
+					out, &out_len);
+		break;
+	case BENCH_DIGEST:
+		rv = p11->C_DigestInit(sess, &mech);
+		if (rv == CKR_OK)
+			rv = p11->C_Digest(sess, data, bcase->data_len, out, &out_len);
+		break;
+	case BENCH_FIND:
+		rv = p11->C_FindObjectsInit(sess, NULL, 0);
+		if (rv != CKR_OK)
+			break;
+		do {
+			rv = p11->C_FindObjects(sess, found, sizeof(found)/sizeof(found[0]), &count);
+		} while (rv == CKR_OK && count);
+		p11->C_FindObjectsFinal(sess);
+		break;
+	case BENCH_ATTR:
+		rv = p11->C_GetAttributeValue(sess, key, attrs, sizeof(attrs)/sizeof(attrs[0]));
+		/* a key without CKA_LABEL is fine */
+		if (rv == CKR_ATTRIBUTE_TYPE_INVALID)
+			rv = CKR_OK;
+		break;
+	default:
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+	}
+	return rv;
+}
+
+static void bench_thread_run(struct bench_thread *bt)
+{
+	const struct bench_case *bcase = bt->bcase;
+	CK_SESSION_HANDLE *sessions;
+	CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+	unsigned char data[1024];
+	unsigned long long end, t, t0;
+	unsigned long i;
+	CK_RV rv;
+
+	sessions = calloc(opt_bench_sessions, sizeof(*sessions));
+	if (!sessions)
+		util_fatal("out of memory");
+	for (i = 0; i < opt_bench_sessions; i++) {
+		rv = p11->C_OpenSession(bt->slot, CKF_SERIAL_SESSION, NULL, NULL, &sessions[i]);
+		if (rv != CKR_OK)
+			p11_fatal("C_OpenSession", rv);
+	}
+	if (bcase->id_len && !find_object(sessions[0], CKO_PRIVATE_KEY, &key,
+				bcase->id, bcase->id_len, 0)) {
+		fprintf(stderr, "Key %s not found in slot 0x%lx\n", bcase->key, bt->slot);
+		goto out;
+	}
+	pseudo_randomize(data, sizeof(data));
+
+	t = bench_now();
+	end = t + (unsigned long long)opt_bench_duration * 1000000;
+	for (i = 0; t < end; i++) {
+		t0 = t;
+		rv = bench_run(bcase, sessions[i % opt_bench_sessions], key, data);
+		t = bench_now();
+		if (rv != CKR_OK) {
+			bt->errors++;
+			continue;
+		}
+		if (bt->latency_len == bt->latency_size) {
+			unsigned long long *p;
+
+			bt->latency_size = bt->latency_size ? 2 * bt->latency_size : 1024;
+			p = realloc(bt->latency, bt->latency_size * sizeof(*p));
+			if (!p)
+				util_fatal("out of memory");
+			bt->latency = p;
+		}
+		bt->latency[bt->latency_len++] = t - t0;
+		bt->count++;
+	}
+
+out:
+	for (i = 0; i < opt_bench_sessions; i++)
+		p11->C_CloseSession(sessions[i]);
+	free(sessions);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI bench_thread_main(LPVOID arg)
+{
+	bench_thread_run(arg);
+	return 0;
+}
+#elif defined(HAVE_PTHREAD)
+static void *bench_thread_main(void *arg)
+{
+	bench_thread_run(arg);
+	return NULL;
+}
+#endif
+
+static int bench_cmp_latency(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned int parse_bench_ops(const char *list)
+{
+	const struct bench_op_name *n;
+	unsigned int ops = 0;
+	size_t len;
+
+	while (*list) {
+		len = strcspn(list, ",");
+		for (n = bench_op_names; n->name; n++)
+			if (strlen(n->name) == len && !strncmp(n->name, list, len))
+				break;
+		if (!n->name)
+			util_fatal("Unknown benchmark operation \"%.*s\"", (int)len, list);
+		ops |= n->op;
+		list += len;
+		if (*list == ',')
+			list++;
+	}
+	return ops;
+}
+
+static const char *bench_op_name(unsigned int op)
+{
+	const struct bench_op_name *n;
+
+	for (n = bench_op_names; n->name; n++)
+		if (n->op == op)
+			return n->name;
+	return "?";
+}
+
+static void bench_case_run(const struct bench_case *bcase,
+		const CK_SLOT_ID *slots, unsigned int nslots)
+{
+	struct bench_thread *threads;
+	unsigned long long *all;
+	unsigned long count = 0, errors = 0;
+	size_t len = 0, n;
+	unsigned long i;
+	double p50 = 0, p99 = 0, p999 = 0;
+
+	threads = calloc(opt_bench_threads, sizeof(*threads));
+	if (!threads)
+		util_fatal("out of memory");
+	for (i = 0; i < opt_bench_threads; i++) {
+		threads[i].bcase = bcase;
+		threads[i].slot = slots[i % nslots];
+	}
+
+#ifdef _WIN32
+	{
+		HANDLE *handles = calloc(opt_bench_threads, sizeof(*handles));
+
+		if (!handles)
+			util_fatal("out of memory");
+		for (i = 0; i < opt_bench_threads; i++) {
+			handles[i] = CreateThread(NULL, 0, bench_thread_main, &threads[i], 0, NULL);
+			if (!handles[i])
+				util_fatal("Cannot create benchmark thread");
+		}
+		for (i = 0; i < opt_bench_threads; i++) {
+			WaitForSingleObject(handles[i], INFINITE);
+			CloseHandle(handles[i]);
+		}
+		free(handles);
+	}
+#elif defined(HAVE_PTHREAD)
+	{
+		pthread_t *tids = calloc(opt_bench_threads, sizeof(*tids));
+
+		if (!tids)
+			util_fatal("out of memory");
+		for (i = 0; i < opt_bench_threads; i++)
+			if (pthread_create(&tids[i], NULL, bench_thread_main, &threads[i]))
+				util_fatal("Cannot create benchmark thread");
+		for (i = 0; i < opt_bench_threads; i++)
+			pthread_join(tids[i], NULL);
+		free(tids);
+	}
+#else
+	for (i = 0; i < opt_bench_threads; i++)
+		bench_thread_run(&threads[i]);
+#endif
+
+	for (i = 0; i < opt_bench_threads; i++)
+		len += threads[i].latency_len;
+	all = malloc((len ? len : 1) * sizeof(*all));
+	if (!all)
+		util_fatal("out of memory");
+	for (i = 0, n = 0; i < opt_bench_threads; i++) {
+		if (threads[i].latency_len)
+			memcpy(all + n, threads[i].latency, threads[i].latency_len * sizeof(*all));
+		n += threads[i].latency_len;
+		count += threads[i].count;
+		errors += threads[i].errors;
+		free(threads[i].latency);
+	}
+	if (len) {
+		qsort(all, len, sizeof(*all), bench_cmp_latency);
+		p50 = all[len * 50 / 100] / 1000.0;
+		p99 = all[len * 99 / 100] / 1000.0;
+		p999 = all[len * 999 / 1000] / 1000.0;
+	}
+
+	printf("%-8s %-24s %-10s %9lu %7lu %10.1f %10.3f %10.3f %10.3f\n",
+			bench_op_name(bcase->op),
+			bcase->op & (BENCH_SIGN | BENCH_DECRYPT | BENCH_DIGEST)
+				? p11_mechanism_to_name(bcase->mech) : "-",
+			bcase->key[0] ? bcase->key : "-",
+			count, errors, (double)count / opt_bench_duration, p50, p99, p999);
+	fflush(stdout);
+
+	free(all);
+	free(threads);
+}
+
+static int bench_mech_supported(CK_SLOT_ID slot, CK_MECHANISM_TYPE mech, CK_FLAGS flags)
+{
+	CK_MECHANISM_INFO info;
+
+	if (p11->C_GetMechanismInfo(slot, mech, &info) != CKR_OK)
+		return 0;
+	return (info.flags & flags) == flags;
+}
+
+/* Encrypt a sample with the public key, as input for the decrypt case */
+static int bench_encrypt_sample(CK_SESSION_HANDLE session, struct bench_case *bcase)
+{
+	CK_MECHANISM mech = { bcase->mech, NULL, 0 };
+	CK_OBJECT_HANDLE pubkey;
+	unsigned char data[32];
+	CK_RV rv;
+
+	if (!find_object(session, CKO_PUBLIC_KEY, &pubkey, bcase->id, bcase->id_len, 0))
+		return 0;
+	pseudo_randomize(data, sizeof(data));
+	rv = p11->C_EncryptInit(session, &mech, pubkey);
+	if (rv != CKR_OK)
+		return 0;
+	bcase->cipher_len = sizeof(bcase->cipher);
+	rv = p11->C_Encrypt(session, data, sizeof(data), bcase->cipher, &bcase->cipher_len);
+	return rv == CKR_OK;
+}
+
+static unsigned int bench_add_mech_cases(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key,
+		struct bench_case *bcase, const struct bench_mech *bm,
+		struct bench_case *cases, unsigned int ncases)
+{
+	unsigned int op;
+
+	for (op = BENCH_SIGN; op <= BENCH_DECRYPT; op <<= 1) {
+		if (!(bm->ops & op & opt_bench_ops) || ncases == BENCH_MAX_CASES)
+			continue;
+		if (op == BENCH_SIGN && (!getSIGN(session, key)
+				|| !bench_mech_supported(opt_slot, bm->mech, CKF_SIGN)))
+			continue;
+		if (op == BENCH_DECRYPT && (!getDECRYPT(session, key)
+				|| !bench_mech_supported(opt_slot, bm->mech, CKF_DECRYPT)))
+			continue;
+		bcase->op = op;
+		bcase->mech = bm->mech;
+		bcase->data_len = bm->data_len;
+		if (op == BENCH_DECRYPT && !bench_encrypt_sample(session, bcase)) {
+			fprintf(stderr, "Cannot encrypt for %s with %s, skipping decrypt\n",
+					bcase->key, p11_mechanism_to_name(bm->mech));
+			continue;
+		}
+		cases[ncases++] = *bcase;
+	}
+	return ncases;
+}
+
+static unsigned int bench_add_key_cases(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key,
+		struct bench_case *cases, unsigned int ncases)
+{
+	CK_KEY_TYPE key_type = getKEY_TYPE(session, key);
+	unsigned char *id;
+	CK_ULONG id_len, bits = 0;
+	struct bench_case bcase;
+	const struct bench_mech *bm;
+	struct bench_mech custom;
+
+	if (getALWAYS_AUTHENTICATE(session, key)) {
+		fprintf(stderr, "Skipping a key that needs a PIN for every use\n");
+		return ncases;
+	}
+	id = getID(session, key, &id_len);
+	if (!id || !id_len || id_len > sizeof(bcase.id)) {
+		free(id);
+		return ncases;
+	}
+
+	memset(&bcase, 0, sizeof(bcase));
+	memcpy(bcase.id, id, id_len);
+	bcase.id_len = id_len;
+	free(id);
+	if (key_type == CKK_RSA) {
+		bits = get_private_key_length(session, key);
+		snprintf(bcase.key, sizeof(bcase.key), "RSA %lu", bits);
+	} else if (key_type == CKK_EC) {
+		CK_OBJECT_HANDLE pubkey;
+		unsigned char *point = NULL;
+		CK_ULONG point_len = 0;
+
+		if (find_object(session, CKO_PUBLIC_KEY, &pubkey, bcase.id, bcase.id_len, 0))
+			point = getEC_POINT(session, pubkey, &point_len);
+		/* DER OCTET STRING holding 04 || X || Y */
+		if (point_len > 3)
+			bits = (point_len - 3) / 2 * 8;
+		free(point);
+		snprintf(bcase.key, sizeof(bcase.key), "EC %lu", bits);
+	} else {
+		snprintf(bcase.key, sizeof(bcase.key), "type 0x%lx", key_type);
+	}
+
+	if (opt_mechanism_used) {
+		custom.mech = opt_mechanism;
+		custom.key_type = key_type;
+		custom.ops = BENCH_SIGN | BENCH_DECRYPT;
+		custom.data_len = 32;
+		return bench_add_mech_cases(session, key, &bcase, &custom, cases, ncases);
+	}
+	for (bm = bench_mechs; bm->mech || bm->ops; bm++)
+		if (bm->key_type == key_type)
+			ncases = bench_add_mech_cases(session, key, &bcase, bm, cases, ncases);
+	return ncases;
+}
+
+static void benchmark(CK_SESSION_HANDLE session, int do_login)
+{
+	struct bench_case *cases;
+	unsigned int ncases = 0, nslots = 0, i;
+	CK_SLOT_ID slots[BENCH_MAX_SLOTS];
+	CK_SESSION_HANDLE slot_sessions[BENCH_MAX_SLOTS];
+	CK_OBJECT_HANDLE key = CK_INVALID_HANDLE, keys[BENCH_MAX_KEYS];
+	CK_OBJECT_CLASS cls = CKO_PRIVATE_KEY;
+	CK_ATTRIBUTE attrs[2] = {
+		{ CKA_CLASS, &cls, sizeof(cls) },
+		{ CKA_ID, opt_object_id, opt_object_id_len }
+	};
+	CK_ULONG nkeys = 0;
+	const struct bench_mech *bm;
+	CK_RV rv;
+
+	/* The sessions stay open so that the tokens stay logged in */
+	slots[nslots] = opt_slot;
+	slot_sessions[nslots++] = CK_INVALID_HANDLE;
+	for (i = 0; opt_bench_all_slots && i < p11_num_slots && nslots < BENCH_MAX_SLOTS; i++) {
+		CK_SLOT_INFO info;
+
+		if (p11_slots[i] == opt_slot)
+			continue;
+		rv = p11->C_GetSlotInfo(p11_slots[i], &info);
+		if (rv != CKR_OK || !(info.flags & CKF_TOKEN_PRESENT))
+			continue;
+		rv = p11->C_OpenSession(p11_slots[i], CKF_SERIAL_SESSION, NULL, NULL,
+				&slot_sessions[nslots]);
+		if (rv != CKR_OK)
+			p11_fatal("C_OpenSession", rv);
+		if (do_login && login(slot_sessions[nslots], CKU_USER))
+			util_fatal("Login to slot 0x%lx failed", p11_slots[i]);
+		slots[nslots++] = p11_slots[i];
+	}
+
+	cases = calloc(BENCH_MAX_CASES, sizeof(*cases));
+	if (!cases)
+		util_fatal("out of memory");
+
+	if (opt_bench_ops & (BENCH_SIGN | BENCH_DECRYPT | BENCH_ATTR)) {
+		rv = p11->C_FindObjectsInit(session, attrs, opt_object_id_len ? 2 : 1);
+		if (rv != CKR_OK)
+			p11_fatal("C_FindObjectsInit", rv);
+		rv = p11->C_FindObjects(session, keys, BENCH_MAX_KEYS, &nkeys);
+		if (rv != CKR_OK)
+			p11_fatal("C_FindObjects", rv);
+		p11->C_FindObjectsFinal(session);
+		if (nkeys)
+			key = keys[0];
+	}
+
+	if (opt_bench_ops & (BENCH_SIGN | BENCH_DECRYPT))
+		for (i = 0; i < nkeys; i++)
+			ncases = bench_add_key_cases(session, keys[i], cases, ncases);
+
+	for (bm = bench_mechs; (opt_bench_ops & BENCH_DIGEST) && bm->mech; bm++) {
+		if (!(bm->ops & BENCH_DIGEST) || ncases == BENCH_MAX_CASES)
+			continue;
+		if (opt_mechanism_used && bm->mech != opt_mechanism)
+			continue;
+		if (!bench_mech_supported(opt_slot, bm->mech, CKF_DIGEST))
+			continue;
+		cases[ncases].op = BENCH_DIGEST;
+		cases[ncases].mech = bm->mech;
+		cases[ncases++].data_len = bm->data_len;
+	}
+
+	if ((opt_bench_ops & BENCH_FIND) && ncases < BENCH_MAX_CASES)
+		cases[ncases++].op = BENCH_FIND;
+
+	if ((opt_bench_ops & BENCH_ATTR) && key != CK_INVALID_HANDLE && ncases < BENCH_MAX_CASES) {
+		unsigned char *id;
+		CK_ULONG id_len;
+
+		id = getID(session, key, &id_len);
+		if (id && id_len && id_len <= sizeof(cases[ncases].id)) {
+			cases[ncases].op = BENCH_ATTR;
+			memcpy(cases[ncases].id, id, id_len);
+			cases[ncases].id_len = id_len;
+			strlcpy(cases[ncases].key, "privkey", sizeof(cases[ncases].key));
+			ncases++;
+		}
+		free(id);
+	}
+
+	if (!ncases)
+		util_fatal("Nothing to benchmark on this token");
+
+	printf("Benchmark: %lu thread(s) x %lu session(s) on %u slot(s), %lu s per case\n",
+			opt_bench_threads, opt_bench_sessions, nslots, opt_bench_duration);
+	printf("%-8s %-24s %-10s %9s %7s %10s %10s %10s %10s\n",
+			"op", "mechanism", "key", "ops", "errors", "ops/s",
+			"p50 ms", "p99 ms", "p999 ms");
+	for (i = 0; i < ncases; i++)
+		bench_case_run(&cases[i], slots, nslots);
+
+	for (i = 1; i < nslots; i++)
+		p11->C_CloseSession(slot_sessions[i]);
+	free(cases);
+}
+
 static const char *p11_flag_names(struct flag_info *list, CK_FLAGS value)
 {
 	static char	buffer[1024];
@@ -38,6 +38,13 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 #include <openssl/opensslv.h>
 #include "libopensc/sc-ossl-compat.h"
 #if OPENSSL_VERSION_NUMBER >= 0x00907000L
@@ -97,6 +104,7 @@ static int	do_update_certificate(struct sc_profile *);
 static int	do_convert_cert(sc_pkcs15_der_t *, X509 *);
 static int	is_cacert_already_present(struct sc_pkcs15init_certargs *);
 static int	do_finalize_card(sc_card_t *, struct sc_profile *);
+static int	commit_updates(struct sc_profile *);
 
 static int	do_read_data_object(const char *name, u8 **out, size_t *outlen, size_t expected);
 static int	do_store_data_object(struct sc_profile *profile);
@@ -121,6 +129,10 @@ static void	parse_commandline(int argc, char **argv);
 static void	read_options_file(const char *);
 static void	ossl_print_errors(void);
 static int	verify_pin(struct sc_pkcs15_card *, char *);
+#ifndef _WIN32
+static int	do_batch(int *);
+static void	batch_report(int);
+#endif
 
 enum {
 	OPT_OPTIONS = 0x100,
@@ -148,6 +160,7 @@ enum {
 	OPT_UPDATE_EXISTING,
 	OPT_MD_CONTAINER_GUID,
 	OPT_VERSION,
+	OPT_BATCH,
 
 	OPT_PIN1      = 0x10000,	/* don't touch these values */
 	OPT_PUK1      = 0x10001,
@@ -217,6 +230,9 @@ const struct option	options[] = {
 	{ "options-file",	required_argument, NULL,	OPT_OPTIONS },
 	{ "md-container-guid",	required_argument, NULL,	OPT_MD_CONTAINER_GUID},
 	{ "wait",		no_argument, NULL,		'w' },
+#ifndef _WIN32
+	{ "batch",		no_argument, NULL,		OPT_BATCH },
+#endif
 	{ "help",		no_argument, NULL,		'h' },
 	{ "verbose",		no_argument, NULL,		'v' },
 
@@ -282,6 +298,9 @@ static const char *		option_help[] = {
 	"Read additional command line options from file",
 	"For a new key specify GUID for a MD container",
 	"Wait for card insertion",
+#ifndef _WIN32
+	"Process the cards in all readers in parallel (give PINs on the command line)",
+#endif
 	"Display this message",
 	"Verbose operation. Use several times to enable debug output.",
 
@@ -394,8 +413,21 @@ static struct secret		opt_secrets[MAX_SECRETS];
 static unsigned int		opt_secret_count;
 static int			opt_ignore_ca_certs = 0;
 static int			opt_update_existing = 0;
+static int			opt_batch = 0;
 static int			verbose = 0;
 
+/* Inputs read once before the cards are processed in batch mode */
+static struct {
+	int			prkey_read;
+	EVP_PKEY		*prkey;
+	X509			*certs[MAX_CERTS];
+	int			ncerts;
+	EVP_PKEY		*pubkey;
+	X509			*cert;
+	u8			*data;
+	size_t			data_len;
+} staged;
+
 static struct sc_pkcs15init_callbacks callbacks = {
 	get_pin_callback,	/* get_pin() */
 	get_key_callback,	/* get_key() */
@@ -486,6 +518,12 @@ main(int argc, char **argv)
 		util_print_usage_and_die(app_name, options, option_help, NULL);
 	}
 
+#ifndef _WIN32
+	/* the parent returns here, the child for each card continues */
+	if (opt_batch && do_batch(&r))
+		return r;
+#endif
+
 	/* Connect to the card */
 	if (!open_reader_and_card(opt_reader))
 		return 1;
@@ -547,6 +585,11 @@ main(int argc, char **argv)
 
 			sc_pkcs15init_set_p15card(profile, p15card);
 
+			/* write the DFs and TokenInfo once, after all actions */
+			r = sc_pkcs15init_begin(p15card, profile);
+			if (r < 0)
+				break;
+
 			if (opt_verify_pin)   {
 				r = verify_pin(p15card, opt_authid);
 				if (r)   {
@@ -608,6 +651,8 @@ main(int argc, char **argv)
 				r = do_generate_skey(profile, opt_newkey);
 			break;
 		case ACTION_FINALIZE_CARD:
+			if (p15card && (r = commit_updates(profile)) < 0)
+				break;
 			r = do_finalize_card(card, profile);
 			break;
 		case ACTION_SANITY_CHECK:
@@ -617,6 +662,8 @@ main(int argc, char **argv)
 			profile->dirty = 1;
 			break;
 		case ACTION_ERASE_APPLICATION:
+			if (p15card && (r = commit_updates(profile)) < 0)
+				break;
 			r = do_erase_application(card, profile);
 			break;
 		default:
@@ -630,11 +677,22 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (p15card) {
+		int rv = commit_updates(profile);
+
+		if (rv < 0 && r >= 0)
+			r = rv;
+	}
+
 	for (n = 0; n < sizeof(pins)/sizeof(pins[0]); n++) {
 		free(pins[n]);
 	}
 
 out:
+#ifndef _WIN32
+	if (opt_batch)
+		batch_report(r);
+#endif
 	if (profile) {
 		sc_pkcs15init_unbind(profile);
 	}
@@ -675,6 +733,25 @@ open_reader_and_card(char *reader)
 	return 1;
 }
 
+/*
+ * Write the PKCS#15 directory files changed since sc_pkcs15init_begin()
+ */
+static int
+commit_updates(struct sc_profile *profile)
+{
+	int	r;
+
+	r = sc_lock(card);
+	if (r < 0)
+		return r;
+	r = sc_pkcs15init_commit(p15card, profile);
+	sc_unlock(card);
+	if (r < 0)
+		fprintf(stderr, "Failed to update the PKCS#15 directory files: %s\n",
+				sc_strerror(r));
+	return r;
+}
+
 /*
  * Make sure there's no pkcs15 structure on the card
  */
@@ -2289,6 +2366,13 @@ do_read_private_key(const char *filename, const char *format,
 	char	*passphrase = NULL;
 	int	r;
 
+	if (staged.prkey_read) {
+		*pk = staged.prkey;
+		for (r = 0; r < staged.ncerts && r < (int)max_certs; r++)
+			certs[r] = staged.certs[r];
+		return r;
+	}
+
 	if (opt_passphrase)
 		passphrase = (char *) opt_passphrase;
 
@@ -2366,6 +2450,11 @@ do_read_der_public_key(const char *filename)
 static int
 do_read_public_key(const char *name, const char *format, EVP_PKEY **out)
 {
+	if (staged.pubkey) {
+		*out = staged.pubkey;
+		return 0;
+	}
+
 	if (!format || !strcasecmp(format, "pem")) {
 		*out = do_read_pem_public_key(name);
 	} else if (!strcasecmp(format, "der")) {
@@ -2419,6 +2508,11 @@ do_read_der_certificate(const char *filename)
 static int
 do_read_certificate(const char *name, const char *format, X509 **out)
 {
+	if (staged.cert) {
+		*out = staged.cert;
+		return 0;
+	}
+
 	if (!format || !strcasecmp(format, "pem")) {
 		*out = do_read_pem_certificate(name);
 	} else if (!strcasecmp(format, "der")) {
@@ -2455,9 +2549,20 @@ static int
 do_read_data_object(const char *name, u8 **out, size_t *outlen, size_t expected)
 {
 	FILE *inf;
-	size_t filesize = expected ? expected : determine_filesize(name);
+	size_t filesize;
 	int c;
 
+	if (staged.data && !expected) {
+		/* the caller frees the buffer */
+		*out = malloc(staged.data_len);
+		if (*out == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		memcpy(*out, staged.data, staged.data_len);
+		*outlen = staged.data_len;
+		return 0;
+	}
+
+	filesize = expected ? expected : determine_filesize(name);
 	*out = malloc(filesize);
 	if (*out == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
@@ -2740,6 +2845,9 @@ handle_option(const struct option *opt)
 	case 'w':
 		opt_wait = 1;
 		break;
+	case OPT_BATCH:
+		opt_batch = 1;
+		break;
 	case OPT_OPTIONS:
 		read_options_file(optarg);
 		break;
@@ -3165,3 +3273,148 @@ static int verify_pin(struct sc_pkcs15_card *p15card, char *auth_id_str)
 
 	return r;
 }
+
+#ifndef _WIN32
+/*
+ * Batch issuance: the input files are read (and their passphrases asked
+ * for) once, then one process per reader with a card runs the requested
+ * actions, all cards in parallel.
+ */
+static struct timeval batch_start;
+
+static double
+batch_elapsed(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - batch_start.tv_sec) + (now.tv_usec - batch_start.tv_usec) / 1e6;
+}
+
+static void
+batch_stage_inputs(void)
+{
+	int r;
+
+	if (opt_actions & (1 << ACTION_STORE_PRIVKEY)) {
+		r = do_read_private_key(opt_infile, opt_format,
+				&staged.prkey, staged.certs, MAX_CERTS);
+		if (r < 0)
+			util_fatal("Unable to read private key from %s: %s\n",
+					opt_infile, sc_strerror(r));
+		staged.ncerts = r;
+		staged.prkey_read = 1;
+	}
+	if (opt_actions & (1 << ACTION_STORE_PUBKEY)) {
+		r = do_read_public_key(opt_infile, opt_format, &staged.pubkey);
+		if (r < 0)
+			util_fatal("Unable to read public key from %s: %s\n",
+					opt_infile, sc_strerror(r));
+	}
+	if (opt_actions & ((1 << ACTION_STORE_CERT) | (1 << ACTION_UPDATE_CERT))) {
+		r = do_read_certificate(opt_infile, opt_format, &staged.cert);
+		if (r < 0)
+			util_fatal("Unable to read certificate from %s: %s\n",
+					opt_infile, sc_strerror(r));
+	}
+	if (opt_actions & (1 << ACTION_STORE_DATA)) {
+		if (do_read_data_object(opt_infile, &staged.data, &staged.data_len, 0) < 0)
+			util_fatal("Unable to read data object from %s\n", opt_infile);
+	}
+}
+
+/*
+ * Returns 0 in the child processes, which go on with their card, and 1 in
+ * the parent once all children have finished.
+ */
+static int
+do_batch(int *exit_code)
+{
+	sc_context_param_t ctx_param;
+	sc_context_t	*bctx = NULL;
+	pid_t		*pids;
+	char		**names;
+	unsigned int	i, n, count = 0, failed = 0;
+	int		r;
+
+	if (opt_reader || opt_wait)
+		util_fatal("--batch uses all readers; it cannot be combined with --reader or --wait");
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.app_name = app_name;
+	r = sc_context_create(&bctx, &ctx_param);
+	if (r)
+		util_fatal("Failed to establish context: %s\n", sc_strerror(r));
+
+	n = sc_ctx_get_reader_count(bctx);
+	pids = calloc(n ? n : 1, sizeof(*pids));
+	names = calloc(n ? n : 1, sizeof(*names));
+	if (!pids || !names)
+		util_fatal("out of memory");
+
+	batch_stage_inputs();
+
+	gettimeofday(&batch_start, NULL);
+	for (i = 0; i < n; i++) {
+		struct sc_reader *reader = sc_ctx_get_reader(bctx, i);
+		char	num[16];
+
+		if (!(sc_detect_card_presence(reader) & SC_READER_CARD_PRESENT))
+			continue;
+		names[i] = strdup(reader->name);
+
+		fflush(stdout);
+		fflush(stderr);
+		pids[i] = fork();
+		if (pids[i] < 0)
+			util_fatal("Failed to fork: %s", strerror(errno));
+		if (pids[i] == 0) {
+			/* the child uses a context of its own */
+			snprintf(num, sizeof(num), "%u", i);
+			opt_reader = strdup(num);
+			return 0;
+		}
+		count++;
+	}
+	sc_release_context(bctx);
+
+	if (!count) {
+		fprintf(stderr, "No card present in any reader.\n");
+		*exit_code = 1;
+		return 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		int	status;
+
+		if (!pids[i])
+			continue;
+		if (waitpid(pids[i], &status, 0) < 0
+				|| !WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "Failed: card in reader %s\n", names[i]);
+			failed++;
+		}
+		free(names[i]);
+	}
+	printf("Batch: %u card(s) processed, %u failed, %.3f s\n",
+			count, failed, batch_elapsed());
+
+	free(names);
+	free(pids);
+	*exit_code = failed ? 1 : 0;
+	return 1;
+}
+
+static void
+batch_report(int r)
+{
+	const char *serial = NULL;
+
+	if (p15card && p15card->tokeninfo)
+		serial = p15card->tokeninfo->serial_number;
+	printf("%s: card %s in reader %s, %.3f s\n",
+			r < 0 ? "Failed" : "Done", serial ? serial : "(no serial)",
+			card ? card->reader->name : opt_reader, batch_elapsed());
+	fflush(stdout);
+}
+#endif